@@ -0,0 +1,65 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _ADAPTIVE_H
+#define _ADAPTIVE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/*
+ * Adaptive rates for the light sensor and the publish cycle.
+ *
+ * TIM2 keeps ticking every 0.5 s, the sampler decides on which ticks the
+ * BH1750 is read: every tick while the lux moves or is near the auto mode
+ * threshold, twice as far apart after each stable sample up to
+ * ADAPTIVE_SAMPLE_MAX. The conversion is started the tick before the read,
+ * so the value read is never older than a tick.
+ *
+ * The publish cycle does the same per topic: a value is published as soon
+ * as it changes by more than its deadband, else again after an interval
+ * doubling from ADAPTIVE_PUB_MIN_MS to ADAPTIVE_PUB_MAX_MS, which stays
+ * below the keepalive as the firmware sends no PINGREQ.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Define --------------------------------------------------------------------*/
+#define ADAPTIVE_LUX_THRESHOLD 50	///< Auto mode switch point, see updateDeviceInfo().
+#define ADAPTIVE_LUX_NEAR      (ADAPTIVE_LUX_THRESHOLD / 4)	///< Sampled every tick this close to it.
+#define ADAPTIVE_LUX_DEADBAND(lux) ((lux) / 16 + 1)	///< Change of the light topic published at once.
+
+#define ADAPTIVE_SAMPLE_MIN 1	///< TIM2 ticks between samples, 0.5 s.
+#define ADAPTIVE_SAMPLE_MAX 16	///< 8 s.
+
+#define ADAPTIVE_PUB_MIN_MS 500UL
+#define ADAPTIVE_PUB_MAX_MS 32000UL	///< Below the 120 s keepalive, with room for lost packets.
+
+/* Private typedef -----------------------------------------------------------*/
+struct adaptive_sampler {
+	int last;		///< Last lux read, -1 for none or a failed read.
+	unsigned int interval;	///< Ticks from the last sample to the next.
+	unsigned int countdown;	///< Ticks to the next sample.
+};
+
+struct adaptive_pub {
+	int value;		///< Last value published.
+	int fresh;		///< Nothing published since adaptive_pub_reset().
+	uint32_t last_ms;	///< When it was published.
+	uint32_t interval_ms;	///< Republished after that long unchanged.
+};
+
+/* Function prototypes -------------------------------------------------------*/
+extern void adaptive_sampler_init(struct adaptive_sampler *s);
+extern int  adaptive_sampler_tick(struct adaptive_sampler *s);
+extern int  adaptive_sampler_starting(const struct adaptive_sampler *s);
+extern void adaptive_sampler_update(struct adaptive_sampler *s, int lux);
+
+extern void adaptive_pub_reset(struct adaptive_pub *p);
+extern int  adaptive_pub_due(const struct adaptive_pub *p, int value, int deadband, uint32_t now);
+extern void adaptive_pub_done(struct adaptive_pub *p, int value, int deadband, uint32_t now);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -16,5 +16,6 @@ typedef enum
 } BH1750_MODE;
 
 uint8_t	BH1750_Send_Cmd(BH1750_MODE cmd);
+uint8_t	BH1750_Read_Dat(uint8_t* dat);
 uint16_t BH1750_Dat_To_Lux(uint8_t* dat);
 
@@ -0,0 +1,34 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _CMD_QUEUE_H
+#define _CMD_QUEUE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/*
+ * Queue of the commands received on the subscribed topics.
+ *
+ * MqttHandlerTask() reads every complete PUBLISH there is in one go and
+ * queues its handler with a copy of the payload, the packet buffer being
+ * reused for the next one; cmd_queue_apply() then runs them in the order
+ * they came. Nothing is dropped: when the queue is full the oldest command
+ * is applied to make room.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "topic_name_helper.h"
+
+/* Define --------------------------------------------------------------------*/
+#define CMD_QUEUE_SIZE  8	///< Commands, a power of 2.
+#define CMD_PAYLOAD_MAX 4	///< Payload bytes kept, the handlers read the first only.
+
+/* Function prototypes -------------------------------------------------------*/
+extern void         cmd_queue_put(topic_handler_t handler, const unsigned char *payload, int payloadlen);
+extern int          cmd_queue_apply(void);
+extern unsigned int cmd_queue_used(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -22,15 +22,21 @@ struct fifo {
 	unsigned int	out;
 	unsigned int	mask;
 	unsigned char *data;
+	unsigned int	overflow;	/* bytes dropped by fifo_in, never reset */
+	unsigned int	watermark;	/* fill level that triggers on_watermark, 0 disables */
+	void		(*on_watermark)(struct fifo *fifo);
 };
 
 /* Function prototypes -------------------------------------------------------*/
 extern unsigned int fifo_used(struct fifo *fifo);
+#ifndef STATIC_MEMORY
 extern signed int fifo_alloc(struct fifo *fifo, unsigned int size);
 extern void         fifo_free(struct fifo *fifo);
+#endif
 extern int          fifo_init(struct fifo *fifo, unsigned char *buffer,	unsigned int size);
 extern unsigned int fifo_in(struct fifo *fifo, unsigned char *buf, unsigned int len);
 extern unsigned int fifo_out(struct fifo *fifo,	unsigned char *buf, unsigned int len);
+extern void         fifo_set_watermark(struct fifo *fifo, unsigned int level, void (*on_watermark)(struct fifo *fifo));
 
 #ifdef __cplusplus
 }
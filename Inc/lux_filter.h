@@ -0,0 +1,65 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _LUX_FILTER_H
+#define _LUX_FILTER_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/*
+ * Filtered lux and the auto mode switch.
+ *
+ * Each sample goes through a median of the last 3, which drops single
+ * spikes such as headlights, then an exponential moving average, which
+ * smooths the noise left; integers only, the same few operations for every
+ * sample. The switch turns the lamp on below the threshold less
+ * LUX_HYSTERESIS and off at the threshold plus LUX_HYSTERESIS, and not
+ * before it has been on or off for the minimum dwell, so the lamp does not
+ * chatter at dusk.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+#include "adaptive.h"
+
+/* Define --------------------------------------------------------------------*/
+#ifndef LUX_HYSTERESIS
+#define LUX_HYSTERESIS 5	///< Half width of the band around ADAPTIVE_LUX_THRESHOLD, lx.
+#endif
+#ifndef LUX_MIN_ON_TICKS
+#define LUX_MIN_ON_TICKS 60	///< TIM2 ticks the lamp stays on at least, 30 s.
+#endif
+#ifndef LUX_MIN_OFF_TICKS
+#define LUX_MIN_OFF_TICKS 60	///< And off.
+#endif
+#define LUX_EMA_SHIFT 2		///< Weight of a new sample in the average, 1 / 2^shift.
+#define LUX_FRAC_BITS 4		///< Fraction bits of the average.
+
+/* Private typedef -----------------------------------------------------------*/
+struct lux_filter {
+	int window[3];		///< Last samples, for the median.
+	unsigned char next;	///< Where the next sample goes.
+	unsigned char primed;	///< A sample came in.
+	int ema;		///< Average of the medians, LUX_FRAC_BITS fraction bits.
+};
+
+struct lux_switch {
+	int low;		///< Lamp on below.
+	int high;		///< Lamp off at or above.
+	unsigned int min_on;	///< Ticks.
+	unsigned int min_off;
+	unsigned int dwell;	///< Ticks in the current state, up to the larger minimum.
+	int on;
+};
+
+/* Function prototypes -------------------------------------------------------*/
+extern void lux_filter_init(struct lux_filter *f);
+extern int  lux_filter_put(struct lux_filter *f, int lux);
+
+extern void lux_switch_init(struct lux_switch *s, int low, int high,
+		unsigned int min_on, unsigned int min_off);
+extern int  lux_switch_update(struct lux_switch *s, int lux);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
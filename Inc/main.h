@@ -32,6 +32,7 @@ extern "C" {
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "mem_config.h"
 
 /* USER CODE END Includes */
 
@@ -67,8 +68,9 @@ void Error_Handler(void);
 #define LED1_Pin GPIO_PIN_2
 #define LED1_GPIO_Port GPIOD
 /* USER CODE BEGIN Private defines */
-#define RX_BUFFER_SIZE 256
-#define FIFO_BUFFER_SIZE 1024
+#define RX_BUFFER_SIZE MEM_UART_DMA_SIZE
+#define FIFO_BUFFER_SIZE MEM_FIFO_SIZE
+#define FIFO_WATERMARK (FIFO_BUFFER_SIZE / 2)
 /* USER CODE END Private defines */
 
 #ifdef __cplusplus
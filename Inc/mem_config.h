@@ -0,0 +1,48 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _MEM_CONFIG_H
+#define _MEM_CONFIG_H
+
+/*
+ * Compile time sizes of all data path buffers and the RAM budget of the
+ * STM32F103RC (48 KB).
+ *
+ * With STATIC_MEMORY defined the buffers are placed in per-subsystem
+ * .bss.ram_<name> sections (still zeroed by the startup code, but visible in
+ * the map file for tools/ram_budget.py), fifo_alloc() is not available and
+ * the heap is capped at MEM_HEAP_RESERVE so it can never reach the stack.
+ */
+
+/* Define --------------------------------------------------------------------*/
+#define MEM_UART_DMA_SIZE     256	///< USART2 DMA receive buffer.
+#define MEM_FIFO_SIZE         1024	///< rxFifo, must be a power of 2.
+#define MEM_AT_RESPONSE_SIZE  1024	///< ESP8266 response buffer.
+#define MEM_AT_CMD_SIZE       128	///< ESP8266 command buffer.
+#define MEM_MQTT_TX_SIZE      128	///< MQTT serialization buffer.
+#define MEM_MQTT_RX_SIZE      128	///< MQTT receive buffer.
+#define MEM_NET_RX_SIZE       128	///< networkwrapper receive buffer.
+#define MEM_LOG_SIZE          256	///< Debug uart log buffer.
+#ifdef UART_CAPTURE_ENABLE
+#define MEM_CAPTURE_SIZE      2048	///< USART2 capture ring, see Inc/uart_capture.h; a power of 2.
+#else
+#define MEM_CAPTURE_SIZE      0
+#endif
+
+#define MEM_RAM_SIZE          (48UL * 1024)
+#define MEM_STACK_RESERVE     0x1000UL	///< Main stack, interrupts included.
+#define MEM_HEAP_RESERVE      0x800UL	///< newlib stdio buffers and printf.
+#define MEM_SYSTEM_RESERVE    0x1000UL	///< HAL handles, libc and other statics.
+
+#define MEM_BUFFERS_TOTAL (MEM_UART_DMA_SIZE + MEM_FIFO_SIZE + MEM_AT_RESPONSE_SIZE + MEM_AT_CMD_SIZE \
+		+ MEM_MQTT_TX_SIZE + MEM_MQTT_RX_SIZE + MEM_NET_RX_SIZE + MEM_LOG_SIZE + MEM_CAPTURE_SIZE)
+
+#ifdef STATIC_MEMORY
+#define MEM_SECTION(name) __attribute__((section(".bss.ram_" name)))
+#else
+#define MEM_SECTION(name)
+#endif
+
+_Static_assert((MEM_FIFO_SIZE & (MEM_FIFO_SIZE - 1)) == 0, "MEM_FIFO_SIZE must be a power of 2");
+_Static_assert(MEM_BUFFERS_TOTAL + MEM_STACK_RESERVE + MEM_HEAP_RESERVE + MEM_SYSTEM_RESERVE <= MEM_RAM_SIZE,
+		"data path buffers do not fit the RAM budget");
+
+#endif
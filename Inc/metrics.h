@@ -0,0 +1,80 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Define --------------------------------------------------------------------*/
+#ifndef METRICS_PERIOD_MS
+#define METRICS_PERIOD_MS 60000UL ///< Publish period of the metrics records, 0 disables.
+#endif
+#define METRICS_TOPIC_CORE "sys/LightSensor/metrics"
+#define METRICS_TOPIC_AT   "sys/LightSensor/at"
+
+#define METRICS_LAT_BUCKETS 12 ///< Bucket n counts publish latencies in [2^n, 2^(n+1)) ms.
+
+/*
+ * AT command classes errors and timeouts are accounted to.
+ */
+#define METRICS_AT_COMMANDS(X) \
+	X(METRICS_AT_RESTORE,    "AT+RESTORE",    "rst") \
+	X(METRICS_AT_CWMODE,     "AT+CWMODE",     "mode") \
+	X(METRICS_AT_CWJAP,      "AT+CWJAP",      "jap") \
+	X(METRICS_AT_CIPSTATUS,  "AT+CIPSTATUS",  "stat") \
+	X(METRICS_AT_CIPSSLSIZE, "AT+CIPSSLSIZE", "ssl") \
+	X(METRICS_AT_CIPSTART,   "AT+CIPSTART",   "start") \
+	X(METRICS_AT_CIPSEND,    "AT+CIPSEND",    "send") \
+	X(METRICS_AT_CIPCLOSE,   "AT+CIPCLOSE",   "close")
+
+/* Private typedef -----------------------------------------------------------*/
+#define METRICS_AT_ENUM(id, prefix, name) id,
+typedef enum {
+	METRICS_AT_COMMANDS(METRICS_AT_ENUM)
+	METRICS_AT_DATA,	///< Payload following AT+CIPSEND.
+	METRICS_AT_MAX
+} metrics_at_t;
+#undef METRICS_AT_ENUM
+
+typedef enum {
+	METRICS_RECORD_CORE = 0,
+	METRICS_RECORD_AT,
+	METRICS_RECORD_MAX
+} metrics_record_t;
+
+struct metrics {
+	uint32_t connects;	///< MQTT (re)connect attempts.
+	uint32_t at_error[METRICS_AT_MAX];
+	uint32_t at_timeout[METRICS_AT_MAX];
+	uint32_t fifo_high_water;
+	uint32_t fifo_overflow;	///< Bytes dropped at fifo_in.
+	uint32_t rx_resync;	///< Bytes skipped to find the next +IPD header.
+	uint32_t sensor_errors;	///< Failed BH1750 reads.
+	uint32_t pub_latency[METRICS_LAT_BUCKETS];
+};
+
+extern struct metrics metrics;
+
+/*
+ * Hot path counters: a single increment on a static struct.
+ */
+#define METRICS_INC(field)      (metrics.field++)
+#define METRICS_ADD(field, n)   (metrics.field += (n))
+#define METRICS_MAX(field, v)   do { if ((v) > metrics.field) metrics.field = (v); } while (0)
+
+/* Function prototypes -------------------------------------------------------*/
+extern void         metrics_init(void);
+extern metrics_at_t metrics_at_classify(const char *command);
+extern void         metrics_publish_latency(uint32_t ms);
+extern int          metrics_due(uint32_t now_ms);
+extern int          metrics_format(metrics_record_t record, char *buf, unsigned int len);
+extern const char  *metrics_topic(metrics_record_t record);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
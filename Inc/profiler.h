@@ -0,0 +1,69 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Define --------------------------------------------------------------------*/
+/*
+ * Named hot-path regions. Add new regions here, the name is what shows up
+ * in the dumps.
+ */
+#define PROF_REGIONS(X) \
+	X(PROF_AT_RESPONSE,    "at_resp") /* ESP82_checkResponse */ \
+	X(PROF_MQTT_READNB,    "mqtt_rd") /* MQTTPacket_readnb */ \
+	X(PROF_PAYLOAD_FMT,    "pay_fmt") /* sprintf of the publish payload */ \
+	X(PROF_MQTT_SERIALIZE, "mqtt_ser") /* PUBLISH serialization */ \
+	X(PROF_I2C_READ,       "i2c_rd")  /* BH1750 command + read */
+
+#define PROF_HIST_BUCKETS 16 ///< Bucket n counts samples in [2^n, 2^(n+1)) ticks.
+
+/* Private typedef -----------------------------------------------------------*/
+#define PROF_ENUM(id, name) id,
+typedef enum {
+	PROF_REGIONS(PROF_ENUM)
+	PROF_REGION_MAX
+} prof_region_t;
+#undef PROF_ENUM
+
+struct prof_stats {
+	uint32_t start;	///< Tick at the last begin marker.
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t hist[PROF_HIST_BUCKETS];
+};
+
+/*
+ * Markers compile to nothing unless PROFILER_ENABLE is defined, so they can
+ * stay in the hot paths of release builds.
+ */
+#ifdef PROFILER_ENABLE
+#define PROF_BEGIN(region) prof_begin(region)
+#define PROF_END(region)   prof_end(region)
+#else
+#define PROF_BEGIN(region) ((void)0)
+#define PROF_END(region)   ((void)0)
+#endif
+
+/* Function prototypes -------------------------------------------------------*/
+extern void         prof_init(void);
+extern void         prof_reset(void);
+extern uint32_t     prof_now(void);
+extern void         prof_begin(prof_region_t region);
+extern void         prof_end(prof_region_t region);
+extern const struct prof_stats *prof_get(prof_region_t region);
+extern const char  *prof_name(prof_region_t region);
+extern int          prof_format(prof_region_t region, char *buf, unsigned int len);
+extern void         prof_print(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -1,27 +1,35 @@
-#include<string.h>
-
-#define LEDS_TOPIC 1
-#define LEDH_TOPIC 2
-#define LIGHT_TOPIC 3
-#define MODE_TOPIC 4
-
-const char* leds_topic_name = "leds";
-const char* ledh_topic_name = "ledh";
-const char* light_topic_name = "light";
-const char* mode_topic_name = "mode";
-
-int getTopicCode(const char* topic_name){
-    if(!strcmp(topic_name,leds_topic_name))
-        return LEDS_TOPIC;
-    if(!strcmp(topic_name,ledh_topic_name))
-        return LEDH_TOPIC;
-    if(!strcmp(topic_name,light_topic_name))
-        return LIGHT_TOPIC;
-    if(!strcmp(topic_name,mode_topic_name))
-        return MODE_TOPIC;    
-}
+#ifndef _TOPIC_NAME_HELPER_H
+#define _TOPIC_NAME_HELPER_H
+
+#include "MQTTPacket.h"
+
+typedef void (*topic_handler_t)(const unsigned char *payload, int payloadlen);
+
+#define TOPIC(code, name, handler) code,
+enum {
+    TOPIC_UNKNOWN = 0,
+#include "topic_table.def"
+    TOPIC_MAX
+};
+#undef TOPIC
+
+// Handlers of the command topics, implemented by the application.
+#define TOPIC(code, name, handler) void handler(const unsigned char *payload, int payloadlen);
+#include "topic_table.def"
+#undef TOPIC
+
+// Topic code of a received topic, TOPIC_UNKNOWN if it is not in the table.
+int getTopicCode(const MQTTString *topic);
+
+// Handler of a received topic, NULL if it is not in the table.
+topic_handler_t getTopicHandler(const MQTTString *topic);
+
+// Calls the handler of the received topic, returns its code or TOPIC_UNKNOWN.
+int topic_dispatch(const MQTTString *topic, const unsigned char *payload, int payloadlen);
 
 // Only parse the first one char to unsigned int.
-int getPayLoadValue(const char* payload){
+static inline int getPayLoadValue(const unsigned char *payload){
     return payload[0]-48;
 }
+
+#endif
@@ -0,0 +1,58 @@
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef _UART_CAPTURE_H
+#define _UART_CAPTURE_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include <stdint.h>
+
+/* Define --------------------------------------------------------------------*/
+/*
+ * Capture of the USART2 traffic with the ESP8266, for replay on the host by
+ * tools/replay. Every receive chunk is recorded as the idle-line interrupt
+ * delivers it, every command and data segment as it is handed to the DMA,
+ * and the records are streamed out of USART1 in place of the debug log.
+ *
+ * Stream format, all integers little endian:
+ *
+ *   header  "UARTCAP1"                       once, at uart_capture_init()
+ *   record  uint8_t  type                    UART_CAPTURE_RX, _TX or _LOST
+ *           uint32_t time                    us since boot
+ *           uint16_t length                  bytes that follow
+ *           uint8_t  bytes[length]           RX/TX: the data
+ *                                            LOST: uint16_t records dropped
+ *                                            before this one
+ *
+ * Records that do not fit the ring while USART1 is busy are dropped whole
+ * and counted; a LOST record goes out ahead of the next one that fits.
+ */
+#define UART_CAPTURE_MAGIC      "UARTCAP1"
+#define UART_CAPTURE_MAGIC_SIZE 8
+#define UART_CAPTURE_HEADER     7	///< Bytes of a record before its data.
+
+#define UART_CAPTURE_RX   'R'	///< Chunk received from the module.
+#define UART_CAPTURE_TX   'T'	///< Bytes sent to the module.
+#define UART_CAPTURE_LOST 'L'	///< Records dropped for want of room.
+
+/*
+ * Hooks compile to nothing unless UART_CAPTURE_ENABLE is defined.
+ */
+#ifdef UART_CAPTURE_ENABLE
+#define UART_CAPTURE_RX_CHUNK(buf, len) uart_capture_record(UART_CAPTURE_RX, (buf), (len))
+#define UART_CAPTURE_TX_DATA(buf, len)  uart_capture_record(UART_CAPTURE_TX, (buf), (len))
+#else
+#define UART_CAPTURE_RX_CHUNK(buf, len) ((void)0)
+#define UART_CAPTURE_TX_DATA(buf, len)  ((void)0)
+#endif
+
+/* Function prototypes -------------------------------------------------------*/
+extern void         uart_capture_init(void);
+extern void         uart_capture_record(uint8_t type, const void *data, uint16_t len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
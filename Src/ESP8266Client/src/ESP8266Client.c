@@ -32,6 +32,9 @@
 #include <assert.h>
 #include "usart.h"
 #include "fifo.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "uart_capture.h"
 
 // Timing settings.
 #define ESP82_TIMEOUT_MS_CMD           2500UL///< Command sending and processing timeout.
@@ -42,10 +45,9 @@
 #define ESP82_TIMEOUT_MS_HOST_CONNECT 10000UL///< Host connecting timeout.
 
 // Buffer settings.
-#define ESP82_BUFFERSIZE_UART_2N 11UL///< Buffer size of 2^7=128byte
-#define ESP82_BUFFERSIZE_UART (1UL << ESP82_BUFFERSIZE_UART_2N)
-#define ESP82_BUFFERSIZE_RESPONSE 1024UL
-#define ESP82_BUFFERSIZE_CMD 128UL
+#define ESP82_BUFFERSIZE_RESPONSE MEM_AT_RESPONSE_SIZE
+#define ESP82_BUFFERSIZE_CMD MEM_AT_CMD_SIZE
+#define ESP82_FRAME_MAX (9 + MEM_NET_RX_SIZE)///< "+IPD,128:" and the data.
 
 // ESP82 Events.
 #define ESP82_RES_OK               (1UL<<0)
@@ -76,26 +78,29 @@ static const char * ESP82_RES_CLOSED_str = "CLOSED";
 static const char * ESP82_RES_SEND_BEGIN_str = "\r\n> ";
 
 // Variables.
-static unsigned long int (* ESP82_getTime_ms)(void);///< Used to hold handler for time provider.
-static char ESP82_uartTxBuf[ESP82_BUFFERSIZE_UART];///< Buffer for circular uart tx.
-static char ESP82_uartRxBuf[ESP82_BUFFERSIZE_UART];///< Buffer for circular uart rx.
-static char ESP82_resBuffer[ESP82_BUFFERSIZE_RESPONSE]; ///< Buffer to store the response.
-static uint8_t ESP82_resBufferFront;///< Buffer front pointer.
-static uint8_t ESP82_resBufferBack;///< Buffer back pointer.
-static char ESP82_cmdBuffer[ESP82_BUFFERSIZE_CMD];
+static uint32_t (* ESP82_getTime_ms)(void);///< Used to hold handler for time provider.
+static char ESP82_resBuffer[ESP82_BUFFERSIZE_RESPONSE] MEM_SECTION("at"); ///< Buffer to store the response.
+static uint16_t ESP82_resBufferFront;///< Buffer front pointer.
+static uint16_t ESP82_resBufferBack;///< Buffer back pointer.
+static uint16_t ESP82_resBufferKept;///< +IPD frames received during a command, at the buffer start.
+static char ESP82_cmdBuffer[ESP82_BUFFERSIZE_CMD] MEM_SECTION("at");
 static uint32_t ESP82_receivedFlags;///< Used for debug purposes.
 static bool ESP82_inProgress = false;///< State flag for non-blocking functions.
 static void * ESP82_SR_State = NULL;///< State flag for non-blocking functions.
 static const char * ESP82_SSLSIZE_str = "AT+CIPSSLSIZE=4096\r\n";///< ESP8266 module memory (2048 to 4096) reserved for SSL.
-static unsigned long int ESP82_t0;///< Keeps entry time for timeout detection.
+static uint32_t ESP82_t0;///< Keeps entry time for timeout detection.
+static unsigned int ESP82_rxOverflowSeen;///< rxFifo.overflow when the receive path last checked for loss.
+static metrics_at_t ESP82_cmdClass = METRICS_AT_DATA;///< Command errors and timeouts are accounted to.
+static ESP82_Segment_t ESP82_sendSegments[ESP82_SEGMENTS_MAX];///< Data of the send in progress.
+static uint8_t ESP82_sendCount;///< Number of segments in ESP82_sendSegments.
 
 extern UART_HandleTypeDef huart2;
 extern UART_HandleTypeDef huart1;
 extern uint8_t rxBuffer[RX_BUFFER_SIZE];
-extern uint8_t debugSentBuffer[RX_BUFFER_SIZE];
+extern uint8_t debugSentBuffer[MEM_LOG_SIZE];
 extern int recv_end_flag;
 extern int rx_len;
-struct fifo rxFifo;
+extern struct fifo rxFifo;
 
 // Internal states.
 typedef enum {
@@ -136,54 +141,71 @@ static bool ESP82_timeoutIsExpired(const uint16_t interval_ms) {
  * @param commandLength Length of the command.
  * @param clearBuffers UART and response buffers are cleared if this is true.
  */
-static void ESP82_sendCmd(const char * command, const uint8_t commandLength, const bool clearBuffers){
+static void ESP82_sendCmd(const char * command, const uint16_t commandLength, const bool clearBuffers){
+	uint16_t debugLength = (commandLength < MEM_LOG_SIZE - 5) ? commandLength : (MEM_LOG_SIZE - 5);
+
 	// Check if restart requested.
 	if(clearBuffers){
 		// Reset RX+TX buffers and start TX.
 		// CircularUART_ClearRx();
 		// CircularUART_ClearTx();
-		ESP82_resBufferFront = 0;
-		ESP82_resBufferBack = 0;
+		ESP82_resBufferFront = ESP82_resBufferKept;
+		ESP82_resBufferBack = ESP82_resBufferKept;
 		ESP82_receivedFlags = 0;
 	}
 
 	// Write to uart.
 	// CircularUART_Send(command, commandLength);
+	UART_CAPTURE_TX_DATA(command, commandLength);
+	HAL_UART_Transmit_DMA(&huart2,(uint8_t *)command,commandLength);
+#ifndef UART_CAPTURE_ENABLE
+	// Debug log, USART1 carries the capture instead when enabled.
+	// Skipped while the last echo is still going out of the buffer, as between the segments of a send.
+	if(huart1.gState != HAL_UART_STATE_READY){
+		return;
+	}
 	debugSentBuffer[0] = '\n';
 	debugSentBuffer[1] = 'U';
 	debugSentBuffer[2] = 'T';
 	debugSentBuffer[3] = ':';
 	debugSentBuffer[4] = ' ';
-	memcpy(debugSentBuffer+5,command,commandLength);
-	HAL_UART_Transmit_DMA(&huart2,command,commandLength);
-	HAL_UART_Transmit_DMA(&huart1, debugSentBuffer, commandLength+5);
+	memcpy(debugSentBuffer+5,command,debugLength);
+	HAL_UART_Transmit_DMA(&huart1, debugSentBuffer, debugLength+5);
+#endif
 }
 
 /*
  * @brief INTERNAL Gets a CR-LF terminated line from the module response.
+ * The search stops at the end of the data, not at a NUL: +IPD payloads are binary.
  * @param data Module response.
  * @param searchPosition The position to start search. Modified after call.
+ * @param dataLength Length of the data.
  * @return Pointer to the line string (terminated).
  */
-static char * ESP82_readLine(char * const data, uint8_t * const searchPosition){
+static char * ESP82_readLine(char * const data, uint16_t * const searchPosition, const uint16_t dataLength){
 	char * posFound;
-	uint8_t iterator;
+	uint16_t iterator;
 
 	// Get search starting position.
 	iterator = (searchPosition == NULL) ? 0 : *searchPosition;
 
 	// Get "\r\n" position if exists.
-	if (NULL != (posFound = strstr(&data[iterator], "\r\n"))) {
-		// Terminate the string.
-		posFound[0] = 0;
-
-		// Export the new search starting position.
-		if (searchPosition) {
-			*searchPosition = (posFound - data) + 2;
+	for (posFound = &data[iterator]; posFound < &data[dataLength]; posFound++) {
+		if (NULL == (posFound = memchr(posFound, '\r', &data[dataLength] - posFound))) {
+			break;
 		}
+		if ((posFound + 1 < &data[dataLength]) && (posFound[1] == '\n')) {
+			// Terminate the string.
+			posFound[0] = 0;
+
+			// Export the new search starting position.
+			if (searchPosition) {
+				*searchPosition = (posFound - data) + 2;
+			}
 
-		// Found.
-		return &data[iterator];
+			// Found.
+			return &data[iterator];
+		}
 	}
 
 	// Not found.
@@ -192,6 +214,128 @@ static char * ESP82_readLine(char * const data, uint8_t * const searchPosition){
 
 
 
+/*
+ * @brief INTERNAL Finds a string in the unread part of the response buffer.
+ * @param str The string to search for.
+ * @param strLength Length of the string.
+ * @return Position in the buffer or -1 if not found.
+ */
+static int ESP82_findResponse(const char * str, const uint16_t strLength){
+	uint16_t i;
+
+	for(i = ESP82_resBufferFront; i + strLength <= ESP82_resBufferBack; i++){
+		if((ESP82_resBuffer[i] == str[0]) && !memcmp(&ESP82_resBuffer[i], str, strLength)){
+			return i;
+		}
+	}
+
+	// Not found.
+	return -1;
+}
+
+/*
+ * @brief INTERNAL Moves the unread response bytes to the start of the buffer, after the kept frames.
+ */
+static void ESP82_compactResponse(void){
+	uint16_t unread = ESP82_resBufferBack - ESP82_resBufferFront;
+
+	if(ESP82_resBufferFront > ESP82_resBufferKept){
+		memmove(&ESP82_resBuffer[ESP82_resBufferKept], &ESP82_resBuffer[ESP82_resBufferFront], unread);
+		ESP82_resBufferFront = ESP82_resBufferKept;
+		ESP82_resBufferBack = ESP82_resBufferKept + unread;
+	}
+}
+
+/*
+ * @brief INTERNAL Moves the +IPD frames in the unread response to the kept part of the buffer.
+ * The module sends them whenever data comes in, also between the lines of a command response.
+ * @return End of the response to parse: the start of a frame not complete yet, else the buffer back.
+ */
+static uint16_t ESP82_keepFrames(void){
+	char frame[ESP82_FRAME_MAX];
+	uint16_t i, end, length;
+
+	for(i = ESP82_resBufferFront; i + 5 <= ESP82_resBufferBack; i++){
+		if((ESP82_resBuffer[i] != '+') || memcmp(&ESP82_resBuffer[i], "+IPD,", 5)){
+			continue;
+		}
+
+		// Length: up to 3 decimal digits, then ':'.
+		for(end = i + 5, length = 0; (end < ESP82_resBufferBack) && (end < i + 8) && (ESP82_resBuffer[end] >= '0') && (ESP82_resBuffer[end] <= '9'); end++){
+			length = length * 10 + (ESP82_resBuffer[end] - '0');
+		}
+		if(end == ESP82_resBufferBack){
+			// Header not complete.
+			return i;
+		}
+		if((ESP82_resBuffer[end] != ':') || !length || (length > MEM_NET_RX_SIZE)){
+			// Not a frame.
+			continue;
+		}
+		end += 1 + length;
+		if(end > ESP82_resBufferBack){
+			// Data not complete.
+			return i;
+		}
+
+		// Out of room: the frame is lost.
+		if(ESP82_resBufferKept + (end - i) > ESP82_BUFFERSIZE_RESPONSE / 2){
+			METRICS_ADD(rx_resync, end - i);
+			continue;
+		}
+
+		// Frame to the kept part, the unread response before it moved up to it.
+		memcpy(frame, &ESP82_resBuffer[i], end - i);
+		memmove(&ESP82_resBuffer[ESP82_resBufferFront + (end - i)], &ESP82_resBuffer[ESP82_resBufferFront], i - ESP82_resBufferFront);
+		memcpy(&ESP82_resBuffer[ESP82_resBufferKept], frame, end - i);
+		ESP82_resBufferKept += end - i;
+		ESP82_resBufferFront += end - i;
+		i = end - 1;
+	}
+
+	// All complete.
+	return ESP82_resBufferBack;
+}
+
+/*
+ * @brief INTERNAL Drops unread bytes up to the next "+IPD," header, used after data loss or garbage.
+ * @return True if a header was found, the front pointer is then on it.
+ */
+static bool ESP82_resync(void){
+	int headerPosition = ESP82_findResponse("+IPD,", 5);
+	uint16_t newFront;
+
+	if(headerPosition >= 0){
+		newFront = headerPosition;
+	}else{
+		// Keep what may be the start of a header.
+		newFront = (ESP82_resBufferBack - ESP82_resBufferFront > 4) ? ESP82_resBufferBack - 4 : ESP82_resBufferFront;
+	}
+	METRICS_ADD(rx_resync, newFront - ESP82_resBufferFront);
+	ESP82_resBufferFront = newFront;
+	return headerPosition >= 0;
+}
+
+/*
+ * @brief INTERNAL Checks for a CLOSED line between the front pointer and the next "+IPD," header.
+ * Only whole lines count, the data of the frames after the header is not looked at.
+ * @return True if the connection was closed.
+ */
+static bool ESP82_closedLine(void){
+	int headerPosition = ESP82_findResponse("+IPD,", 5);
+	uint16_t end = (headerPosition >= 0) ? headerPosition : ESP82_resBufferBack;
+	uint16_t i;
+
+	for(i = ESP82_resBufferFront; i + 8 <= end; i++){
+		if(((i == ESP82_resBufferFront) || ((i >= ESP82_resBufferFront + 2) && !memcmp(&ESP82_resBuffer[i - 2], "\r\n", 2))) && !memcmp(&ESP82_resBuffer[i], "CLOSED\r\n", 8)){
+			return true;
+		}
+	}
+
+	// Not found.
+	return false;
+}
+
 /*
  * @brief INTERNAL Reads command response from the module and checks for the expected events.
  * @param expectedFlags The flag(s) to check.
@@ -201,16 +345,31 @@ static char * ESP82_readLine(char * const data, uint8_t * const searchPosition){
  * @return SUCCESS, INPROGRESS or ERROR.
  */
 static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const uint16_t timeout_ms, char * const responseOut, const uint8_t responseLengthMax){
+	uint16_t responseEnd;
+
+	PROF_BEGIN(PROF_AT_RESPONSE);
+
 	// Switch waiting state.
 	if(!ESP82_inProgress) {
 		// Start timeout.
 		ESP82_timeoutBegin();
 	}
 
+	// Buffer full: drop the lines already read, or a line too long to ever end.
+	if(ESP82_resBufferBack >= ESP82_BUFFERSIZE_RESPONSE - 1){
+		if(ESP82_resBufferFront > ESP82_resBufferKept){
+			ESP82_compactResponse();
+		}else{
+			METRICS_ADD(rx_resync, ESP82_resBufferBack - ESP82_resBufferKept);
+			ESP82_resBufferFront = ESP82_resBufferBack = ESP82_resBufferKept;
+		}
+	}
+
 	// Get response data and terminate as a string.
 	ESP82_resBufferBack += fifo_out(&rxFifo, &ESP82_resBuffer[ESP82_resBufferBack], ESP82_BUFFERSIZE_RESPONSE - 1 - ESP82_resBufferBack);
 	ESP82_resBuffer[ESP82_resBufferBack] = 0;
 	recv_end_flag == 0;
+	responseEnd = ESP82_keepFrames();
 	// Search for Begin Cursor '>'.
 	if((expectedFlags & ESP82_RES_SEND_BEGIN) && (ESP82_resBufferBack >= 4)){
 		// Check for the cursor string.
@@ -222,7 +381,7 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 	// Parse line-by-line and search for known state messages.
 	else{
 		static char * lineString;
-		while((lineString = ESP82_readLine(ESP82_resBuffer, &ESP82_resBufferFront))){
+		while((lineString = ESP82_readLine(ESP82_resBuffer, &ESP82_resBufferFront, responseEnd))){
 			// Check for error.
 			if(!strcmp(lineString, ESP82_RES_OK_str)){
 				ESP82_receivedFlags |= ESP82_RES_OK;
@@ -276,7 +435,9 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 	// Error, fail or busy.
 	if(ESP82_receivedFlags & (ESP82_RES_ERROR | ESP82_RES_FAIL | ESP82_RES_BUSY)){
 		// Error.
+		METRICS_INC(at_error[ESP82_cmdClass]);
 		ESP82_inProgress = false;
+		PROF_END(PROF_AT_RESPONSE);
 		return ESP82_ERROR;
 	}else
 
@@ -285,7 +446,7 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 		// Provide the response if requested.
 		if(responseOut != NULL){
 			// Set the length to copy to the output.
-			uint8_t copyLength = ESP82_resBufferFront;
+			uint16_t copyLength = ESP82_resBufferFront - ESP82_resBufferKept;
 
 			// Limit length of output.
 			if(copyLength > responseLengthMax){
@@ -294,7 +455,7 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 
 			// Export the response: restore CRs back.
 			for(uint8_t i = 0; i < copyLength; i++){
-				char c = ESP82_resBuffer[i];
+				char c = ESP82_resBuffer[ESP82_resBufferKept + i];
 				responseOut[i] = c ? c : '\r';
 			}
 
@@ -306,6 +467,7 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 
 		// Success.
 		ESP82_inProgress = false;
+		PROF_END(PROF_AT_RESPONSE);
 		return ESP82_SUCCESS;
 	}else
 
@@ -313,23 +475,27 @@ static ESP82_Result_t ESP82_checkResponse(const uint32_t expectedFlags, const ui
 	if(ESP82_timeoutIsExpired(timeout_ms)){
 		// Fail.
 		ESP82_receivedFlags = ESP82_RES_TIMEOUT | expectedFlags;
+		METRICS_INC(at_timeout[ESP82_cmdClass]);
 		ESP82_inProgress = false;
+		PROF_END(PROF_AT_RESPONSE);
 		return ESP82_ERROR;
 	}
 
 	// Waiting.
 	ESP82_inProgress = true;
+	PROF_END(PROF_AT_RESPONSE);
 	return ESP82_INPROGRESS;
 }
 
 /*
- * @brief INTERNAL Sends data after the cursor '>' detection and gets module confirmation message.
- * @param data The data to send.
- * @param dataLength Length of the data.
+ * @brief INTERNAL Sends the segments of ESP82_sendSegments after CIPSEND.
+ * Each segment is one DMA transfer straight from its buffer (RAM or flash),
+ * the next one starts when the uart is ready again.
  * @return SUCCESS, INPROGRESS or ERROR.
  */
-static ESP82_Result_t ESP82_sendData(const char * data, const uint8_t dataLength){
+static ESP82_Result_t ESP82_sendData(void){
 	static uint8_t internalState;
+	static uint8_t segment;
 	ESP82_Result_t result;
 
 	// State machine.
@@ -337,10 +503,8 @@ static ESP82_Result_t ESP82_sendData(const char * data, const uint8_t dataLength
 	case ESP82_State0:
 		// Check for send-begin cursor '>'.
 		if (ESP82_SUCCESS == (result = ESP82_checkResponse(ESP82_RES_SEND_BEGIN, ESP82_TIMEOUT_MS_CMD, NULL, 0))) {
-			// Send the data.
-			ESP82_sendCmd(data, dataLength, true);
-
-			// Switch to waiting for SEND OK.
+			// Start with the first segment.
+			segment = 0;
 			internalState = ESP82_State1;
 		} else {
 			// In progress or failure.
@@ -349,6 +513,23 @@ static ESP82_Result_t ESP82_sendData(const char * data, const uint8_t dataLength
 
 		//nobreak;
 	case ESP82_State1:
+		// Send the segments back to back, the module counts the bytes.
+		while (segment < ESP82_sendCount) {
+			if (huart2.gState != HAL_UART_STATE_READY) {
+				// Previous transfer still running.
+				ESP82_inProgress = true;
+				return ESP82_INPROGRESS;
+			}
+			ESP82_cmdClass = METRICS_AT_DATA;
+			ESP82_sendCmd(ESP82_sendSegments[segment].data, ESP82_sendSegments[segment].length, segment == 0);
+			segment++;
+		}
+
+		// Switch to waiting for SEND OK.
+		internalState = ESP82_State2;
+
+		//nobreak;
+	case ESP82_State2:
 		// Wait for SEND OK.
 		return ESP82_checkResponse(ESP82_RES_SEND_OK, ESP82_TIMEOUT_MS_DATA_SEND, NULL, 0);
 	}
@@ -370,6 +551,7 @@ static ESP82_Result_t ESP82_execute(const char * command, const uint32_t expecte
 	switch (internalState = (ESP82_inProgress ? internalState : ESP82_State0)) {
 	case ESP82_State0:
 		// Send.
+		ESP82_cmdClass = metrics_at_classify(command);
 		ESP82_sendCmd(command, strlen(command), true);
 
 		// To the next state.
@@ -572,18 +754,45 @@ ESP82_Result_t ESP82_CloseTCP(void) {
  * @return SUCCESS, INPROGRESS or ERROR.
  */
 ESP82_Result_t ESP82_Send(const char * const data, const uint8_t dataLength) {
+	ESP82_Segment_t segment = { data, dataLength };
+
+	return ESP82_SendV(&segment, 1);
+}
+
+/*
+ * @brief Send data gathered from several buffers to server, as one CIPSEND.
+ * @param segments The buffers, only read on entry.
+ * @param count Number of segments, at most ESP82_SEGMENTS_MAX.
+ * @return SUCCESS, INPROGRESS or ERROR.
+ */
+ESP82_Result_t ESP82_SendV(const ESP82_Segment_t * const segments, const uint8_t count) {
 	// Construct the command on entry.
-	if(!ESP82_inProgress || (ESP82_SR_State != ESP82_Send)){
+	if(!ESP82_inProgress || (ESP82_SR_State != ESP82_SendV)){
+		uint16_t dataLength = 0;
+
+		// Take the segments.
+		if((count == 0) || (count > ESP82_SEGMENTS_MAX)){
+			return ESP82_ERROR;
+		}
+		for(ESP82_sendCount = 0; ESP82_sendCount < count; ESP82_sendCount++){
+			ESP82_sendSegments[ESP82_sendCount] = segments[ESP82_sendCount];
+			dataLength += segments[ESP82_sendCount].length;
+		}
+		if(dataLength > ESP82_SEND_MAX){
+			return ESP82_ERROR;
+		}
+
 		// Set SR_State as Send.
-		ESP82_SR_State = ESP82_Send;
+		ESP82_SR_State = ESP82_SendV;
 
 		// Create the command.
-		sprintf(ESP82_cmdBuffer, "AT+CIPSEND=%i\r\n", dataLength);
+		ESP82_cmdClass = METRICS_AT_CIPSEND;
+		sprintf(ESP82_cmdBuffer, "AT+CIPSEND=%u\r\n", dataLength);
 		ESP82_sendCmd(ESP82_cmdBuffer, strlen(ESP82_cmdBuffer), true);
 	}
 
 	// Send the data.
-	return ESP82_sendData(data, dataLength);
+	return ESP82_sendData();
 }
 
 /*
@@ -595,7 +804,6 @@ ESP82_Result_t ESP82_Send(const char * const data, const uint8_t dataLength) {
 ESP82_Result_t ESP82_Receive(char * const data, const uint8_t dataLengthMax) {
 	static uint8_t internalState;
 	static unsigned int expectedLength;
-	char * terminatorPosition;
 
 	// Set SR_State as Reveive.
 	if(ESP82_SR_State != ESP82_Receive){
@@ -603,13 +811,34 @@ ESP82_Result_t ESP82_Receive(char * const data, const uint8_t dataLengthMax) {
 		ESP82_inProgress = false;
 	}
 
+	// The frames kept during the commands come first, then the unread rest.
+	if(ESP82_resBufferKept){
+		ESP82_compactResponse();
+		ESP82_resBufferFront = 0;
+		ESP82_resBufferKept = 0;
+		ESP82_inProgress = false;
+	}
+
+	// Between frames, make room for the next one.
+	if(!ESP82_inProgress){
+		ESP82_compactResponse();
+	}
+
 	// Receive the available data.
 	// __HAL_LOCK(&hdma);
 	int popLength = fifo_out(&rxFifo, &ESP82_resBuffer[ESP82_resBufferBack], ESP82_BUFFERSIZE_RESPONSE - 1 - ESP82_resBufferBack);
 	ESP82_resBufferBack += popLength;
-	uint8_t availableLength = (ESP82_resBufferBack - ESP82_resBufferFront);
+	uint16_t availableLength = (ESP82_resBufferBack - ESP82_resBufferFront);
 	recv_end_flag == 0;
 
+	// Bytes were dropped on the way in: the frame in progress is incomplete, look for the next header.
+	if(rxFifo.overflow != ESP82_rxOverflowSeen){
+		ESP82_rxOverflowSeen = rxFifo.overflow;
+		if(ESP82_inProgress && (internalState > ESP82_State1)){
+			internalState = ESP82_State1;
+		}
+	}
+
 	// State machine.
 	switch (internalState = (ESP82_inProgress ? internalState : ESP82_State0)) {
 	case ESP82_State0:
@@ -630,52 +859,63 @@ ESP82_Result_t ESP82_Receive(char * const data, const uint8_t dataLengthMax) {
 			if(0 == memcmp(&ESP82_resBuffer[ESP82_resBufferFront], "\r\n+IPD,", 7)){
 				// Update the front pointer.
 				ESP82_resBufferFront += 7;
-
-				// Switch to next state and wait for length.
-				internalState = ESP82_State2;
-			}else{
-				// Error occured, no +IPD header received.
+			}else if(ESP82_closedLine()){
+				// Error occured, connection closed.
 				ESP82_inProgress = false;
 				return ESP82_ERROR;
+			}else if(ESP82_resync()){
+				// Garbage or a truncated frame skipped, continue with the found header at the buffer start.
+				ESP82_resBufferFront += 5;
+				ESP82_compactResponse();
+			}else{
+				// No header in what we have, wait for more.
+				ESP82_inProgress = false;
+				return ESP82_RECEIVE_NOTHING;
 			}
+
+			// Wait for the length.
+			expectedLength = 0;
+			internalState = ESP82_State2;
 		}
 		else if(availableLength == 0){
 			ESP82_inProgress = false;
 			return ESP82_RECEIVE_NOTHING;
 			// recv nothing;
 		}
-			
+		else{
+			break;
+		}
 
-		break;
+		//nobreak;
 	case ESP82_State2:
-		// Get the incoming data length.
-		if(availableLength >= 2){
-			// Check the length termination character.
-			if(NULL != (terminatorPosition = memchr(&ESP82_resBuffer[ESP82_resBufferFront], ':', availableLength))){
-				// Terminate the string and get the length.
-				*terminatorPosition = '\0';
-				expectedLength = atoi(&ESP82_resBuffer[ESP82_resBufferFront]);
-
-				// Check if buffer is enough for the incoming data.
-				if((expectedLength > dataLengthMax) || !expectedLength){
-					// Error occured.
-					ESP82_inProgress = false;
-					return ESP82_ERROR;
-				}
-
-				// Update the front pointer.
-				ESP82_resBufferFront = (terminatorPosition - ESP82_resBuffer) + 1;
+		// Get the incoming data length: decimal digits up to ':', at most dataLengthMax.
+		while((ESP82_resBufferFront < ESP82_resBufferBack) && (ESP82_resBuffer[ESP82_resBufferFront] != ':')){
+			char digit = ESP82_resBuffer[ESP82_resBufferFront++];
 
-				// Switch to next state and wait for length.
-				internalState = ESP82_State3;
+			expectedLength = expectedLength * 10 + (digit - '0');
+			if((digit < '0') || (digit > '9') || (expectedLength > dataLengthMax)){
+				// Not a length or too long for the buffer: drop the header, the next call resyncs to the next one.
+				ESP82_inProgress = false;
+				return ESP82_RECEIVE_NOTHING;
 			}
 		}
+		if(ESP82_resBufferFront == ESP82_resBufferBack){
+			break;
+		}
+		if(!expectedLength){
+			// Empty frame: drop the header as well.
+			ESP82_inProgress = false;
+			return ESP82_RECEIVE_NOTHING;
+		}
 
-		break;
+		// Skip the ':' and wait for the data.
+		ESP82_resBufferFront++;
+		internalState = ESP82_State3;
+
+		//nobreak;
 	case ESP82_State3:
 		// Get data.
-		if(availableLength >= expectedLength){
-			// Check the length termination character.
+		if((uint16_t)(ESP82_resBufferBack - ESP82_resBufferFront) >= expectedLength){
 			memcpy(data, &ESP82_resBuffer[ESP82_resBufferFront], expectedLength);
 			ESP82_resBufferFront+= expectedLength;
 			// Success, data received.
@@ -701,7 +941,10 @@ ESP82_Result_t ESP82_Receive(char * const data, const uint8_t dataLengthMax) {
 
 void HAL_UART_IdleCpltCallback(UART_HandleTypeDef *huart){
 	if(huart == &huart2 && recv_end_flag == 1){
-		fifo_in(&rxFifo, rxBuffer, rx_len);
+		UART_CAPTURE_RX_CHUNK(rxBuffer, rx_len);
+		unsigned int pushed = fifo_in(&rxFifo, rxBuffer, rx_len);
+		METRICS_ADD(fifo_overflow, rx_len - pushed);
+		METRICS_MAX(fifo_high_water, fifo_used(&rxFifo));
 		memset(rxBuffer+rx_len,0,RX_BUFFER_SIZE-rx_len);
 		HAL_UART_Receive_DMA(&huart2, rxBuffer, RX_BUFFER_SIZE);
 	}
@@ -41,6 +41,14 @@ typedef int32_t ESP82_Result_t;
 #define ESP82_SUCCESS    (1)
 #define ESP82_RECEIVE_NOTHING    (-2)
 
+// One buffer of a scattered send.
+typedef struct {
+	const char * data;
+	uint16_t length;
+} ESP82_Segment_t;
+#define ESP82_SEGMENTS_MAX 4
+#define ESP82_SEND_MAX     2048///< AT+CIPSEND limit per send.
+
 // Prototypes.
 void ESP82_Init(const uint32_t baud, const uint8_t parity, uint32_t (* const getTime_ms_functionHandler)(void));
 ESP82_Result_t ESP82_CheckPresence(void);
@@ -49,6 +57,7 @@ ESP82_Result_t ESP82_IsConnectedWifi(void);
 ESP82_Result_t ESP82_StartTCP(const char * host, const uint16_t port, const uint16_t keepalive, const bool ssl);
 ESP82_Result_t ESP82_CloseTCP(void);
 ESP82_Result_t ESP82_Send(const char * const data, const uint8_t dataLength);
+ESP82_Result_t ESP82_SendV(const ESP82_Segment_t * const segments, const uint8_t count);
 ESP82_Result_t ESP82_Receive(char * const data, const uint8_t dataLengthMax);
 ESP82_Result_t ESP82_Delay(const uint16_t delay_ms);
 
@@ -29,6 +29,7 @@
 // Includes.
 #include "networkwrapper.h"
 #include "ESP8266Client.h"
+#include "mem_config.h"
 #include <string.h>
 
 // Variables.
@@ -40,7 +41,7 @@ static int network_send_state = 0;///< Internal state of send.
 static int network_recv_state = 0;///< Internal state of recv.
 
 // Global time provider.
-extern long unsigned int network_gettime_ms(void);///< Returns 32bit ms time value.
+extern uint32_t network_gettime_ms(void);///< Returns 32bit ms time value.
 
 void network_init(void){ }
 
@@ -62,6 +63,17 @@ int network_connect(const char * host, const unsigned short int port, const unsi
 }
 
 int network_send(unsigned char *address, unsigned int bytes){
+	transport_iovec_t iov = { address, bytes };
+
+	return network_sendv(&iov, 1);
+}
+
+int network_sendv(const transport_iovec_t *iov, int iovcnt){
+	ESP82_Segment_t segments[ESP82_SEGMENTS_MAX];
+	uint8_t count = 0;
+	unsigned int bytes = 0;
+	int i;
+
 	// State Machine.
 	ESP82_Result_t espResult = ESP82_SUCCESS;
 	switch(network_send_state) {
@@ -107,8 +119,22 @@ int network_send(unsigned char *address, unsigned int bytes){
 		}
 		break;
 	case 5:
+		// Gather the non-empty buffers.
+		for(i = 0; i < iovcnt; i++){
+			if(iov[i].len == 0){
+				continue;
+			}
+			if(count == ESP82_SEGMENTS_MAX){
+				return -1;
+			}
+			segments[count].data = (const char *)iov[i].base;
+			segments[count].length = iov[i].len;
+			bytes += iov[i].len;
+			count++;
+		}
+
 		// Send the data.
-		espResult = ESP82_Send(address, bytes);
+		espResult = ESP82_SendV(segments, count);
 		if(espResult == ESP82_SUCCESS){
 			// Return the actual number of bytes. Stay in this state unless error occurs.
 			return bytes;
@@ -138,7 +164,7 @@ int network_send(unsigned char *address, unsigned int bytes){
 }
 
 int network_recv(unsigned char *address, unsigned int maxbytes){
-	static char receiveBuffer[128];
+	static char receiveBuffer[MEM_NET_RX_SIZE] MEM_SECTION("mqtt");
 	static int receiveBufferBack = 0;
 	static int receiveBufferFront = 0;
 	int actualLength;
@@ -147,7 +173,7 @@ int network_recv(unsigned char *address, unsigned int maxbytes){
 	ESP82_Result_t espResult;
 	switch(network_recv_state) {
 	case 0:
-		espResult = ESP82_Receive(receiveBuffer, 128);
+		espResult = ESP82_Receive(receiveBuffer, sizeof(receiveBuffer));
 		if(espResult > 0){
 			// Set the buffer pointers.
 			receiveBufferBack = espResult;
@@ -29,6 +29,9 @@
 #ifndef _NETWORKWRAPPER_H
 #define _NETWORKWRAPPER_H
 
+// Includes.
+#include "transport.h"
+
 // Socket data type.
 #ifndef network_socket_t
 #define network_socket_t void*
@@ -62,6 +65,14 @@ int network_connect(const char * host, const unsigned short int port, const unsi
  */
 int network_send(unsigned char *address, unsigned int bytes);
 
+/*
+ * @brief NON-BLOCKING Sends data gathered from several buffers as one unit, without copying.
+ * @param iov The buffers, at most ESP82_SEGMENTS_MAX non-empty ones.
+ * @param iovcnt Number of buffers.
+ * @return Returns the total number of bytes sent, 0 while in progress or negative on error.
+ */
+int network_sendv(const transport_iovec_t *iov, int iovcnt);
+
 /*
  * @brief NON-BLOCKING Receives data and mimics transparency.
  * @param address Pointer to the memory into that the received data is stored.
@@ -139,12 +139,21 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 	MQTTConnackFlags flags = {0};
 
 	FUNC_ENTRY;
+	if (buflen < 2)
+		goto exit;
 	header.byte = readChar(&curdata);
 	if (header.bits.type != CONNACK)
 		goto exit;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	rc = MQTTPacket_decodeRange(curdata, buf + buflen, &mylen); /* read remaining length */
+	if (rc <= 0 || mylen > buf + buflen - (curdata + rc)) /* bad length field, or more than the data */
+	{
+		rc = 0;
+		goto exit;
+	}
+	curdata += rc;
 	enddata = curdata + mylen;
+	rc = 0;
 	if (enddata - curdata < 2)
 		goto exit;
 
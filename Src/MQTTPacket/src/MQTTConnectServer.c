@@ -60,14 +60,24 @@ int MQTTDeserialize_connect(MQTTPacket_connectData* data, unsigned char* buf, in
 	int mylen = 0;
 
 	FUNC_ENTRY;
+	if (len < 2)
+		goto exit;
 	header.byte = readChar(&curdata);
 	if (header.bits.type != CONNECT)
 		goto exit;
 
-	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	rc = MQTTPacket_decodeRange(curdata, enddata, &mylen); /* read remaining length */
+	if (rc <= 0 || mylen > enddata - (curdata + rc)) /* bad length field, or more than the data */
+	{
+		rc = 0;
+		goto exit;
+	}
+	curdata += rc;
+	enddata = curdata + mylen;
+	rc = 0;
 
 	if (!readMQTTLenString(&Protocol, &curdata, enddata) ||
-		enddata - curdata < 0) /* do we have enough data to read the protocol version byte? */
+		enddata - curdata < 4) /* do we have enough data to read the version, flags and keep alive? */
 		goto exit;
 
 	version = (int)readChar(&curdata); /* Protocol version */
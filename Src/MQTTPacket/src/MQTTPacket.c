@@ -20,26 +20,51 @@
 
 #include <string.h>
 
+/**
+ * Number of bytes the remaining length field takes for a given length
+ * @param rem_len the remaining length
+ * @return 1 to 4
+ */
+static int MQTTPacket_lenBytes(int rem_len)
+{
+	return 1 + (rem_len >= 128) + (rem_len >= 16384) + (rem_len >= 2097152);
+}
+
+
 /**
  * Encodes the message length according to the MQTT algorithm
  * @param buf the buffer into which the encoded data is written
- * @param length the length to be encoded
+ * @param length the length to be encoded, at most 268435455
  * @return the number of bytes written to buffer
  */
 int MQTTPacket_encode(unsigned char* buf, int length)
 {
-	int rc = 0;
+	unsigned int v = (unsigned int)length;
+	int rc = MQTTPacket_lenBytes(length);
 
 	FUNC_ENTRY;
-	do
+	/* the stores truncate to 7 bits plus the continuation bit, no division needed */
+	switch (rc)
 	{
-		char d = length % 128;
-		length /= 128;
-		/* if there are more digits to encode, set the top bit of this digit */
-		if (length > 0)
-			d |= 0x80;
-		buf[rc++] = d;
-	} while (length > 0);
+	case 1:
+		buf[0] = (unsigned char)v;
+		break;
+	case 2:
+		buf[0] = (unsigned char)(v | 0x80);
+		buf[1] = (unsigned char)(v >> 7);
+		break;
+	case 3:
+		buf[0] = (unsigned char)(v | 0x80);
+		buf[1] = (unsigned char)((v >> 7) | 0x80);
+		buf[2] = (unsigned char)(v >> 14);
+		break;
+	default:
+		buf[0] = (unsigned char)(v | 0x80);
+		buf[1] = (unsigned char)((v >> 7) | 0x80);
+		buf[2] = (unsigned char)((v >> 14) | 0x80);
+		buf[3] = (unsigned char)(v >> 21);
+		break;
+	}
 	FUNC_EXIT_RC(rc);
 	return rc;
 }
@@ -54,9 +79,7 @@ int MQTTPacket_encode(unsigned char* buf, int length)
 int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value)
 {
 	unsigned char c;
-	int multiplier = 1;
 	int len = 0;
-#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
 
 	FUNC_ENTRY;
 	*value = 0;
@@ -72,8 +95,7 @@ int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value)
 		rc = (*getcharfn)(&c, 1);
 		if (rc != 1)
 			goto exit;
-		*value += (c & 127) * multiplier;
-		multiplier *= 128;
+		*value |= (c & 127) << (7 * (len - 1));
 	} while ((c & 128) != 0);
 exit:
 	FUNC_EXIT_RC(len);
@@ -81,39 +103,92 @@ exit:
 }
 
 
-int MQTTPacket_len(int rem_len)
+/**
+ * Decodes a remaining length field that is known to be readable up to its end
+ * @param buf the first byte of the remaining length field
+ * @param value the decoded length returned
+ * @return the number of bytes of the field, or MQTTPACKET_READ_ERROR if it is longer than 4 bytes
+ */
+static int MQTTPacket_decodeField(const unsigned char* buf, int* value)
 {
-	rem_len += 1; /* header byte */
-
-	/* now remaining_length field */
-	if (rem_len < 128)
-		rem_len += 1;
-	else if (rem_len < 16384)
-		rem_len += 2;
-	else if (rem_len < 2097151)
-		rem_len += 3;
-	else
-		rem_len += 4;
-	return rem_len;
-}
+	/* unrolled rather than branch-free: the branches are well predicted, so
+	   the next field can be started before this length has been computed */
+	int v = buf[0] & 127;
+	int rc = 1;
 
+	if ((buf[0] & 128) == 0)
+		goto exit;
+	v |= (buf[1] & 127) << 7;
+	rc = 2;
+	if ((buf[1] & 128) == 0)
+		goto exit;
+	v |= (buf[2] & 127) << 14;
+	rc = 3;
+	if ((buf[2] & 128) == 0)
+		goto exit;
+	v |= (buf[3] & 127) << 21;
+	rc = 4;
+	if ((buf[3] & 128) == 0)
+		goto exit;
+	rc = MQTTPACKET_READ_ERROR;	/* bad data */
+exit:
+	*value = v;
+	return rc;
+}
 
-static unsigned char* bufptr;
 
-int bufchar(unsigned char* c, int count)
+/**
+ * Decodes the message length from a range of bytes, never reading past its end
+ * @param buf the first byte of the remaining length field
+ * @param enddata pointer to the end of the data available
+ * @param value the decoded length returned
+ * @return the number of bytes of the length field, 0 if the range ends inside it,
+ * or MQTTPACKET_READ_ERROR if it is longer than 4 bytes
+ */
+int MQTTPacket_decodeRange(const unsigned char* buf, const unsigned char* enddata, int* value)
 {
-	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (enddata - buf >= MAX_NO_OF_REMAINING_LENGTH_BYTES)
+	{
+		rc = MQTTPacket_decodeField(buf, value);
+		goto exit;
+	}
+	*value = 0;
+	while (buf + rc < enddata)
+	{
+		unsigned char c = buf[rc];
 
-	for (i = 0; i < count; ++i)
-		*c = *bufptr++;
-	return count;
+		*value |= (c & 127) << (7 * rc++);
+		if ((c & 128) == 0)
+			goto exit;
+	}
+	rc = 0;	/* the field continues past enddata */
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
 }
 
 
+int MQTTPacket_len(int rem_len)
+{
+	/* header byte, remaining length field, then the rest */
+	return 1 + MQTTPacket_lenBytes(rem_len) + rem_len;
+}
+
+
+/**
+ * Decodes the message length from a buffer known to hold the whole field
+ * @param buf the first byte of the remaining length field
+ * @param value the decoded length returned
+ * @return the number of bytes read, 5 if the field is longer than 4 bytes
+ */
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
 {
-	bufptr = buf;
-	return MQTTPacket_decode(bufchar, value);
+	int rc = MQTTPacket_decodeField(buf, value);
+
+	return (rc == MQTTPACKET_READ_ERROR) ? MAX_NO_OF_REMAINING_LENGTH_BYTES + 1 : rc;
 }
 
 
@@ -40,6 +40,8 @@ enum errors
 	MQTTPACKET_READ_COMPLETE
 };
 
+#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
+
 enum msgTypes
 {
 	CONNECT = 1, CONNACK, PUBLISH, PUBACK, PUBREC, PUBREL,
@@ -93,16 +95,26 @@ int MQTTstrlen(MQTTString mqttstring);
 #include "MQTTSubscribe.h"
 #include "MQTTUnsubscribe.h"
 #include "MQTTFormat.h"
+#include "MQTTPacketParser.h"
+#include "MQTTTopic.h"
 
 DLLExport int MQTTSerialize_ack(unsigned char* buf, int buflen, unsigned char type, unsigned char dup, unsigned short packetid);
 DLLExport int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid, unsigned char* buf, int buflen);
 
+/*
+ * The serializers and deserializers keep no state between calls, so they can
+ * run in several threads at once, or in an ISR and the main loop, as long as
+ * each works on its own buffer. MQTTPacket_read passes no context to getfn,
+ * which pushes the caller towards globals: use MQTTPacket_readnb or MQTTParser
+ * where that matters.
+ */
 int MQTTPacket_len(int rem_len);
 DLLExport int MQTTPacket_equals(MQTTString* a, char* b);
 
 DLLExport int MQTTPacket_encode(unsigned char* buf, int length);
 int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value);
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value);
+int MQTTPacket_decodeRange(const unsigned char* buf, const unsigned char* enddata, int* value);
 
 int readInt(unsigned char** pptr);
 char readChar(unsigned char** pptr);
@@ -0,0 +1,234 @@
+/*******************************************************************************
+ * Push-style MQTT packet parser, see MQTTPacketParser.h.
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+enum
+{
+	PARSER_HEADER, PARSER_LENGTH, PARSER_BODY, PARSER_SKIP, PARSER_ERROR
+};
+
+
+/**
+  * Decodes the fixed header at the start of data
+  * @param data the bytes received
+  * @param len the number of bytes in data
+  * @param rem_len returned integer - the remaining length
+  * @return the fixed header length, 0 if incomplete, or -1 if malformed
+  */
+static int MQTTParser_frame(const unsigned char* data, int len, int* rem_len)
+{
+	int rc;
+
+	*rem_len = 0;
+	if (len < 2)
+		return 0;
+	rc = MQTTPacket_decodeRange(data + 1, data + len, rem_len);
+	return (rc > 0) ? 1 + rc : rc;
+}
+
+
+/**
+  * Fills in the view of a complete packet and hands it to the callback
+  * @param parser the parser
+  * @param data the whole packet
+  * @param hdrlen the fixed header length
+  * @param len the packet length
+  * @return 0 to carry on, 1 if the callback asked to stop, or MQTTPACKET_READ_ERROR if malformed
+  */
+static int MQTTParser_deliver(MQTTParser* parser, unsigned char* data, int hdrlen, int len)
+{
+	MQTTParsedPacket packet;
+	unsigned char* curdata = data + hdrlen;
+	unsigned char* enddata = data + len;
+	int rc = MQTTPACKET_READ_ERROR;
+
+	FUNC_ENTRY;
+	memset(&packet, 0, sizeof(packet));
+	packet.data = data;
+	packet.len = len;
+	packet.type = data[0] >> 4;
+	packet.flags = data[0] & 0x0F;
+	packet.hdrlen = hdrlen;
+
+	switch (packet.type)
+	{
+	case PUBLISH:
+		if (!readMQTTLenString(&packet.topicName, &curdata, enddata))
+			goto exit;
+		if ((packet.flags & 0x06) != 0) /* QoS > 0 */
+		{
+			if (enddata - curdata < 2)
+				goto exit;
+			packet.packetid = readInt(&curdata);
+		}
+		packet.payload = curdata;
+		packet.payloadlen = enddata - curdata;
+		break;
+	case PUBACK:
+	case PUBREC:
+	case PUBREL:
+	case PUBCOMP:
+	case SUBSCRIBE:
+	case SUBACK:
+	case UNSUBSCRIBE:
+	case UNSUBACK:
+		if (enddata - curdata < 2)
+			goto exit;
+		packet.packetid = readInt(&curdata);
+		break;
+	default:
+		break;
+	}
+	rc = ((*parser->callback)(parser->context, &packet) != 0) ? 1 : 0;
+exit:
+	if (rc == MQTTPACKET_READ_ERROR)
+		parser->state = PARSER_ERROR;
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Initializes a parser
+  * @param parser the parser
+  * @param buf buffer for packets that arrive split across chunks, at least 5 bytes
+  * @param buflen the length in bytes of buf
+  * @param callback called for every complete packet
+  * @param context passed to the callback
+  */
+void MQTTParser_init(MQTTParser* parser, unsigned char* buf, int buflen, MQTTParser_callback callback, void* context)
+{
+	memset(parser, 0, sizeof(*parser));
+	parser->buf = buf;
+	parser->buflen = buflen;
+	parser->callback = callback;
+	parser->context = context;
+}
+
+
+/**
+  * Drops any partial packet and clears an error, e.g. on reconnect
+  * @param parser the parser
+  */
+void MQTTParser_reset(MQTTParser* parser)
+{
+	parser->state = PARSER_HEADER;
+	parser->have = 0;
+	parser->skip = 0;
+}
+
+
+/**
+  * Parses the next chunk of the byte stream
+  * @param parser the parser
+  * @param data the bytes received
+  * @param len the number of bytes in data
+  * @return the number of bytes consumed, less than len if the callback asked to stop,
+  * or MQTTPACKET_READ_ERROR on a malformed packet (call MQTTParser_reset to resync)
+  */
+int MQTTParser_feed(MQTTParser* parser, unsigned char* data, int len)
+{
+	int pos = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	while (pos < len)
+	{
+		int n;
+
+		switch (parser->state)
+		{
+		case PARSER_HEADER:
+		{
+			int rem_len;
+			int hdrlen = MQTTParser_frame(data + pos, len - pos, &rem_len);
+
+			if (hdrlen < 0)
+			{
+				parser->state = PARSER_ERROR;
+				break;
+			}
+			if (hdrlen > 0 && rem_len <= len - pos - hdrlen)
+			{
+				/* the whole packet is in this chunk: no copy */
+				n = hdrlen + rem_len;
+				if ((rc = MQTTParser_deliver(parser, data + pos, hdrlen, n)) < 0)
+					goto exit;
+				pos += n;
+				if (rc)
+					goto done;
+				break;
+			}
+			/* split packet: assemble it in buf */
+			parser->buf[0] = data[pos++];
+			parser->have = 1;
+			parser->rem_len = 0;
+			parser->state = PARSER_LENGTH;
+			break;
+		}
+		case PARSER_LENGTH:
+			if (parser->have > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			{
+				parser->state = PARSER_ERROR;
+				break;
+			}
+			parser->rem_len |= (data[pos] & 127) << (7 * (parser->have - 1));
+			parser->buf[parser->have++] = data[pos];
+			if ((data[pos++] & 128) != 0)
+				break;
+			parser->hdrlen = parser->have;
+			if (parser->hdrlen + parser->rem_len > parser->buflen)
+			{
+				parser->oversized++;
+				parser->skip = parser->rem_len;
+				parser->state = PARSER_SKIP;
+			}
+			else
+				parser->state = PARSER_BODY;
+			break;
+		case PARSER_BODY:
+			n = parser->hdrlen + parser->rem_len - parser->have;
+			if (n > len - pos)
+				n = len - pos;
+			memcpy(parser->buf + parser->have, data + pos, n);
+			parser->have += n;
+			pos += n;
+			break;
+		case PARSER_SKIP:
+			n = (parser->skip < len - pos) ? parser->skip : len - pos;
+			parser->skip -= n;
+			pos += n;
+			break;
+		default:
+			rc = MQTTPACKET_READ_ERROR;
+			goto exit;
+		}
+
+		/* a split packet is complete */
+		if (parser->state == PARSER_BODY && parser->have == parser->hdrlen + parser->rem_len)
+		{
+			parser->state = PARSER_HEADER;
+			if ((rc = MQTTParser_deliver(parser, parser->buf, parser->hdrlen, parser->have)) < 0)
+				goto exit;
+			if (rc)
+				goto done;
+		}
+		else if (parser->state == PARSER_SKIP && parser->skip == 0)
+			parser->state = PARSER_HEADER;
+	}
+	if (parser->state == PARSER_ERROR)
+	{
+		rc = MQTTPACKET_READ_ERROR;
+		goto exit;
+	}
+done:
+	rc = pos;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
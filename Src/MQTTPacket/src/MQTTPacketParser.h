@@ -0,0 +1,65 @@
+/*******************************************************************************
+ * Push-style MQTT packet parser.
+ *
+ * Bytes are fed in chunks of any size, as they arrive. Every complete packet
+ * is handed to a callback as a view: packets that lie whole in a chunk are
+ * not copied, packets split across chunks are assembled in the buffer given
+ * to MQTTParser_init. For PUBLISH the view has the topic and payload in
+ * place; for acks the packet identifier.
+ *******************************************************************************/
+
+#ifndef MQTTPACKETPARSER_H_
+#define MQTTPACKETPARSER_H_
+
+#if !defined(DLLImport)
+  #define DLLImport
+#endif
+#if !defined(DLLExport)
+  #define DLLExport
+#endif
+
+/**
+ * A framed packet, valid during the callback only.
+ */
+typedef struct
+{
+	unsigned char* data;	/**< the whole packet, fixed header included */
+	int len;	/**< length of data */
+	unsigned char type;	/**< MQTT packet type */
+	unsigned char flags;	/**< low nibble of the header byte */
+	int hdrlen;	/**< fixed header length, the variable header starts at data + hdrlen */
+	unsigned short packetid;	/**< PUBLISH QoS > 0, acks, SUBSCRIBE/SUBACK, UNSUBSCRIBE/UNSUBACK */
+	MQTTString topicName;	/**< PUBLISH only, points into data */
+	unsigned char* payload;	/**< PUBLISH only, points into data */
+	int payloadlen;
+} MQTTParsedPacket;
+
+/**
+ * @return 0 to carry on, anything else stops MQTTParser_feed after this packet
+ */
+typedef int (*MQTTParser_callback)(void* context, MQTTParsedPacket* packet);
+
+typedef struct
+{
+	int state;
+	unsigned char* buf;	/**< assembly buffer for split packets */
+	int buflen;
+	int have;	/**< bytes of the current packet in buf */
+	int rem_len;	/**< remaining length, while being decoded */
+	int hdrlen;	/**< fixed header length of the current packet */
+	int skip;	/**< bytes left of a packet too big for buf */
+	unsigned long oversized;	/**< packets dropped because they did not fit buf */
+	MQTTParser_callback callback;
+	void* context;
+} MQTTParser;
+
+/**
+ * buflen must be at least 5, the longest fixed header; packets longer than
+ * buflen are still framed when they arrive in one chunk, and skipped otherwise.
+ */
+DLLExport void MQTTParser_init(MQTTParser* parser, unsigned char* buf, int buflen, MQTTParser_callback callback,
+		void* context);
+DLLExport void MQTTParser_reset(MQTTParser* parser);
+DLLExport int MQTTParser_feed(MQTTParser* parser, unsigned char* data, int len);
+
+#endif /* MQTTPACKETPARSER_H_ */
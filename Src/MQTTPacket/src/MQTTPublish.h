@@ -27,6 +27,69 @@
 
 DLLExport int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
 		MQTTString topicName, unsigned char* payload, int payloadlen);
+DLLExport int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, int payloadlen);
+
+/**
+ * One message of a batch, the arguments of MQTTSerialize_publish.
+ */
+typedef struct
+{
+	unsigned char dup;
+	int qos;
+	unsigned char retained;
+	unsigned short packetid;
+	MQTTString topicName;
+	unsigned char* payload;
+	int payloadlen;
+} MQTTPublishMessage;
+
+DLLExport int MQTTSerialize_publishBatch(unsigned char* buf, int buflen, MQTTPublishMessage* msgs, int count,
+		int* serialized);
+
+#if !defined(MQTTPREPARED_TOPIC_MAX)
+  #define MQTTPREPARED_TOPIC_MAX 30
+#endif
+
+/**
+ * A publish on a fixed topic with its header byte and length-prefixed topic
+ * encoded once, see MQTTPrepare_publish.
+ */
+typedef struct
+{
+	unsigned char header;	/**< fixed header byte */
+	int qos;
+	int prefixlen;	/**< length of prefix */
+	unsigned char prefix[2 + MQTTPREPARED_TOPIC_MAX];	/**< encoded topic name */
+} MQTTPreparedPublish;
+
+DLLExport int MQTTPrepare_publish(MQTTPreparedPublish* pp, unsigned char dup, int qos, unsigned char retained,
+		MQTTString topicName);
+DLLExport int MQTTSerialize_preparedPublishHeader(unsigned char* buf, int buflen, const MQTTPreparedPublish* pp,
+		unsigned short packetid, int payloadlen);
+DLLExport int MQTTSerialize_preparedPublish(unsigned char* buf, int buflen, const MQTTPreparedPublish* pp,
+		unsigned short packetid, unsigned char* payload, int payloadlen);
+
+/**
+ * A received publish re-headed to be passed on, see MQTTRelay_publish: the
+ * parts in order make the new packet, the topic and payload still pointing
+ * into the received one.
+ */
+typedef struct
+{
+	unsigned char header[5];	/**< fixed header byte and remaining length */
+	int headerlen;
+	unsigned char* topic;	/**< length-prefixed topic name, in the received packet */
+	int topiclen;
+	unsigned char packetid[2];	/**< above QoS 0 only */
+	int packetidlen;
+	unsigned char* payload;	/**< in the received packet */
+	int payloadlen;
+} MQTTRelayedPublish;
+
+DLLExport int MQTTRelay_publish(MQTTRelayedPublish* rp, int qos, unsigned char retained, unsigned short packetid,
+		unsigned char* buf, int buflen);
+DLLExport int MQTTSerialize_relayedPublish(unsigned char* buf, int buflen, const MQTTRelayedPublish* rp);
 
 DLLExport int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
 		unsigned char** payload, int* payloadlen, unsigned char* buf, int len);
@@ -40,20 +40,20 @@ int MQTTSerialize_publishLength(int qos, MQTTString topicName, int payloadlen)
 
 
 /**
-  * Serializes the supplied publish data into the supplied buffer, ready for sending
-  * @param buf the buffer into which the packet will be serialized
+  * Serializes everything of a publish but the payload, so that the payload can be sent from
+  * where it is (see transport_sendPacketVector)
+  * @param buf the buffer into which the header will be serialized
   * @param buflen the length in bytes of the supplied buffer
   * @param dup integer - the MQTT dup flag
   * @param qos integer - the MQTT QoS value
   * @param retained integer - the MQTT retained flag
   * @param packetid integer - the MQTT packet identifier
   * @param topicName MQTTString - the MQTT topic in the publish
-  * @param payload byte buffer - the MQTT publish payload
-  * @param payloadlen integer - the length of the MQTT payload
-  * @return the length of the serialized data.  <= 0 indicates error
+  * @param payloadlen integer - the length of the MQTT payload that will follow
+  * @return the length of the serialized header.  <= 0 indicates error
   */
-int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
-		MQTTString topicName, unsigned char* payload, int payloadlen)
+int MQTTSerialize_publishHeader(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained,
+		unsigned short packetid, MQTTString topicName, int payloadlen)
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -61,7 +61,7 @@ int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int
 	int rc = 0;
 
 	FUNC_ENTRY;
-	if (MQTTPacket_len(rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen)) > buflen)
+	if (MQTTPacket_len(rem_len = MQTTSerialize_publishLength(qos, topicName, payloadlen)) - payloadlen > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -80,8 +80,176 @@ int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int
 	if (qos > 0)
 		writeInt(&ptr, packetid);
 
-	memcpy(ptr, payload, payloadlen);
-	ptr += payloadlen;
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied publish data into the supplied buffer, ready for sending
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, unsigned char* payload, int payloadlen)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTSerialize_publishHeader(buf, buflen - payloadlen, dup, qos, retained, packetid, topicName, payloadlen)) > 0)
+	{
+		memcpy(buf + rc, payload, payloadlen);
+		rc += payloadlen;
+	}
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+
+/**
+  * Serializes a vector of publishes back to back into the supplied buffer, in one pass.
+  * Each topic is measured per message, so callers can rewrite their topic buffers between
+  * messages; a lenstring topic costs nothing to measure, a cstring one a strlen (for fixed
+  * topics, MQTTPrepare_publish encodes the topic once).
+  * Only whole packets are written: when the buffer is full the messages serialized so far
+  * are returned, the caller sends them and calls again with the rest.
+  * @param buf the buffer into which the packets will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param msgs the messages to serialize
+  * @param count the number of messages
+  * @param serialized returns the number of messages serialized
+  * @return the length of the serialized data.  < 0 if not even the first message fits
+  */
+int MQTTSerialize_publishBatch(unsigned char* buf, int buflen, MQTTPublishMessage* msgs, int count,
+		int* serialized)
+{
+	unsigned char *ptr = buf;
+	unsigned char *end = buf + buflen;
+	int i;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+	{
+		MQTTPublishMessage* m = &msgs[i];
+		const char* topic = (m->topicName.lenstring.len > 0) ? m->topicName.lenstring.data : m->topicName.cstring;
+		int topiclen = (m->topicName.lenstring.len > 0) ? m->topicName.lenstring.len : (topic ? strlen(topic) : 0);
+		MQTTHeader header = {0};
+		int rem_len;
+
+		rem_len = 2 + topiclen + m->payloadlen + ((m->qos > 0) ? 2 : 0);
+		if (MQTTPacket_len(rem_len) > end - ptr)
+			break;
+
+		header.bits.type = PUBLISH;
+		header.bits.dup = m->dup;
+		header.bits.qos = m->qos;
+		header.bits.retain = m->retained;
+		writeChar(&ptr, header.byte); /* write header */
+
+		ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */
+
+		writeInt(&ptr, topiclen);
+		memcpy(ptr, topic, topiclen);
+		ptr += topiclen;
+
+		if (m->qos > 0)
+			writeInt(&ptr, m->packetid);
+
+		memcpy(ptr, m->payload, m->payloadlen);
+		ptr += m->payloadlen;
+	}
+	*serialized = i;
+	rc = (i == 0 && count > 0) ? MQTTPACKET_BUFFER_TOO_SHORT : ptr - buf;
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Prepares a publish on a fixed topic: encodes the fixed header byte and the
+  * length-prefixed topic once, for MQTTSerialize_preparedPublish
+  * @param pp the prepared publish to fill in
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @return 1 if successful, 0 if the topic is longer than MQTTPREPARED_TOPIC_MAX
+  */
+int MQTTPrepare_publish(MQTTPreparedPublish* pp, unsigned char dup, int qos, unsigned char retained, MQTTString topicName)
+{
+	unsigned char *ptr = pp->prefix;
+	MQTTHeader header = {0};
+	int topiclen = (topicName.lenstring.len > 0) ? topicName.lenstring.len :
+			(topicName.cstring ? strlen(topicName.cstring) : 0);
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (topiclen > MQTTPREPARED_TOPIC_MAX)
+		goto exit;
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	pp->header = header.byte;
+	pp->qos = qos;
+
+	writeMQTTString(&ptr, topicName);
+	pp->prefixlen = ptr - pp->prefix;
+	rc = 1;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the header of a publish on a prepared topic, the payload is sent separately
+  * @param buf the buffer into which the header will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param pp the prepared publish, see MQTTPrepare_publish
+  * @param packetid integer - the MQTT packet identifier, ignored for QoS 0
+  * @param payloadlen integer - the length of the MQTT payload that will follow
+  * @return the length of the serialized header.  <= 0 indicates error
+  */
+int MQTTSerialize_preparedPublishHeader(unsigned char* buf, int buflen, const MQTTPreparedPublish* pp,
+		unsigned short packetid, int payloadlen)
+{
+	unsigned char *ptr = buf;
+	int rem_len = pp->prefixlen + payloadlen + ((pp->qos > 0) ? 2 : 0);
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (MQTTPacket_len(rem_len) - payloadlen > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	*ptr++ = pp->header;
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */
+
+	memcpy(ptr, pp->prefix, pp->prefixlen);
+	ptr += pp->prefixlen;
+
+	if (pp->qos > 0)
+		writeInt(&ptr, packetid);
 
 	rc = ptr - buf;
 
@@ -91,6 +259,137 @@ exit:
 }
 
 
+/**
+  * Serializes a publish on a prepared topic: only the remaining length is encoded,
+  * the rest is copied
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param pp the prepared publish, see MQTTPrepare_publish
+  * @param packetid integer - the MQTT packet identifier, ignored for QoS 0
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_preparedPublish(unsigned char* buf, int buflen, const MQTTPreparedPublish* pp, unsigned short packetid,
+		unsigned char* payload, int payloadlen)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if ((rc = MQTTSerialize_preparedPublishHeader(buf, buflen - payloadlen, pp, packetid, payloadlen)) > 0)
+	{
+		memcpy(buf + rc, payload, payloadlen);
+		rc += payloadlen;
+	}
+
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Re-heads a received publish to pass it on: only the fixed header and packet identifier
+  * are written, the topic name and payload are left in the received packet
+  * @param rp the relayed publish to fill in, its parts sent in order make the new packet
+  * @param qos integer - the MQTT QoS to relay at
+  * @param retained integer - the MQTT retained flag to relay with
+  * @param packetid integer - the MQTT packet identifier, ignored for QoS 0
+  * @param buf the raw buffer data of the received publish, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return the length of the relayed packet.  <= 0 indicates error
+  */
+int MQTTRelay_publish(MQTTRelayedPublish* rp, int qos, unsigned char retained, unsigned short packetid,
+		unsigned char* buf, int buflen)
+{
+	unsigned char *ptr = buf + 1;
+	unsigned char *enddata = buf + buflen;
+	MQTTHeader header = {0};
+	int rem_len = 0;
+	int inqos = 0;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (buflen < 2)
+		goto exit;
+	header.byte = buf[0];
+	inqos = header.bits.qos;
+	if (header.bits.type != PUBLISH || inqos > 2 || qos < 0 || qos > 2)
+		goto exit;
+	if ((rc = MQTTPacket_decodeRange(ptr, enddata, &rem_len)) <= 0)
+		goto exit;
+	ptr += rc;
+	rc = 0;
+	if (rem_len != enddata - ptr || enddata - ptr < 2)
+		goto exit;
+
+	rp->topic = ptr;
+	rp->topiclen = 2 + ((ptr[0] << 8) | ptr[1]);
+	ptr += rp->topiclen;
+	if (inqos > 0)
+		ptr += 2;
+	if (ptr > enddata)
+		goto exit;
+	rp->payload = ptr;
+	rp->payloadlen = enddata - ptr;
+
+	rp->packetidlen = 0;
+	if (qos > 0)
+	{
+		unsigned char *pid = rp->packetid;
+
+		writeInt(&pid, packetid);
+		rp->packetidlen = 2;
+	}
+
+	header.bits.dup = 0;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	rp->header[0] = header.byte;
+	rem_len = rp->topiclen + rp->packetidlen + rp->payloadlen;
+	rp->headerlen = 1 + MQTTPacket_encode(rp->header + 1, rem_len);
+	rc = rp->headerlen + rem_len;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes a relayed publish, see MQTTRelay_publish: its parts are copied in order
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param rp the relayed publish
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_relayedPublish(unsigned char* buf, int buflen, const MQTTRelayedPublish* rp)
+{
+	unsigned char *ptr = buf;
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (rp->headerlen + rp->topiclen + rp->packetidlen + rp->payloadlen > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	memcpy(ptr, rp->header, rp->headerlen);
+	ptr += rp->headerlen;
+	memcpy(ptr, rp->topic, rp->topiclen);
+	ptr += rp->topiclen;
+	memcpy(ptr, rp->packetid, rp->packetidlen);
+	ptr += rp->packetidlen;
+	memcpy(ptr, rp->payload, rp->payloadlen);
+	ptr += rp->payloadlen;
+
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
 
 /**
   * Serializes the ack packet into the supplied buffer.
@@ -0,0 +1,768 @@
+/*******************************************************************************
+ * Topic filter matching and subscription trie, see MQTTTopic.h.
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "StackTrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	NODE_ROOT, NODE_EXACT, NODE_PLUS, NODE_POUND, NODE_FREE
+};
+
+/* every label in the pool is preceded by its owner node, or by -1 - length once freed */
+#define LABEL_HEADER ((int)sizeof(int))
+
+/* bytes of label pool given to each node by MQTTTopicTrie_initStatic */
+#define STATIC_LABEL_BYTES 16
+
+
+/**
+  * Checks a topic filter: '+' must be a whole level, '#' the whole last level
+  * @param filter the topic filter
+  * @param len the length of filter
+  * @return 1 if valid, 0 otherwise
+  */
+int MQTTTopic_isValidFilter(const char* filter, int len)
+{
+	int i;
+
+	if (len < 1 || len > 65535)
+		return 0;
+	for (i = 0; i < len; ++i)
+	{
+		if (filter[i] == '+')
+		{
+			if ((i > 0 && filter[i - 1] != '/') || (i + 1 < len && filter[i + 1] != '/'))
+				return 0;
+		}
+		else if (filter[i] == '#')
+		{
+			if ((i > 0 && filter[i - 1] != '/') || i + 1 < len)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+/**
+  * Matches one topic name against one topic filter
+  * @param filter the topic filter, '+' for one level, '#' for the rest
+  * @param flen the length of filter
+  * @param topic the topic name
+  * @param tlen the length of topic
+  * @return 1 if the topic matches, 0 otherwise
+  */
+int MQTTTopic_matches(const char* filter, int flen, const char* topic, int tlen)
+{
+	int f = 0, t = 0;
+
+	/* wildcards at the first level do not match $-topics */
+	if (tlen > 0 && topic[0] == '$' && flen > 0 && (filter[0] == '+' || filter[0] == '#'))
+		return 0;
+	while (f < flen)
+	{
+		if (filter[f] == '#')
+			return 1;	/* also matches the parent level */
+		if (filter[f] == '+')
+		{
+			while (t < tlen && topic[t] != '/')
+				++t;
+			++f;
+		}
+		else
+		{
+			if (t >= tlen)
+				break;
+			if (filter[f] != topic[t])
+				return 0;
+			++f;
+			++t;
+			continue;
+		}
+		/* after '+': both must be at a separator or at the end */
+		if (f == flen || t == tlen)
+			break;
+		if (filter[f] != '/' || topic[t] != '/')
+			return 0;
+	}
+	if (f == flen && t == tlen)
+		return 1;
+	/* "a/#" matches "a" */
+	return (t == tlen && flen - f == 2 && filter[f] == '/' && filter[f + 1] == '#');
+}
+
+
+static unsigned int MQTTTopicTrie_levelHash(const char* label, int len)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)label[i]) * 16777619u;
+	return h;
+}
+
+
+/**
+  * Hash of an edge: the level name hash is computed once per topic level and
+  * combined with each parent it is looked up under
+  */
+static unsigned int MQTTTopicTrie_edgeHash(int parent, unsigned int levelhash)
+{
+	unsigned int h = levelhash ^ ((unsigned int)parent * 2654435761u);
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	return h;
+}
+
+
+static int MQTTTopicTrie_reserve(void** array, int* size, int need, int elemsize, int fixed)
+{
+	int newsize = (*size > 0) ? *size : 8;
+	void* p;
+
+	if (need <= *size)
+		return 0;
+	if (fixed)
+		return -1;
+	while (newsize < need)
+		newsize *= 2;
+	if ((p = realloc(*array, (size_t)newsize * elemsize)) == NULL)
+		return -1;
+	*array = p;
+	*size = newsize;
+	return 0;
+}
+
+
+static int MQTTTopicTrie_newNode(MQTTTopicTrie* trie, int parent, int kind)
+{
+	MQTTTopicNode* node;
+	int n = trie->freenode;
+
+	if (n >= 0)
+		trie->freenode = trie->nodes[n].parent;
+	else
+	{
+		if (MQTTTopicTrie_reserve((void**)&trie->nodes, &trie->maxnodes, trie->nodecount + 1, sizeof(MQTTTopicNode),
+				trie->fixed) < 0)
+			return -1;
+		n = trie->nodecount++;
+	}
+	node = &trie->nodes[n];
+	memset(node, 0, sizeof(*node));
+	node->parent = parent;
+	node->subs = node->plus = node->pound = -1;
+	node->kind = kind;
+	return n;
+}
+
+
+static void MQTTTopicTrie_freeNode(MQTTTopicTrie* trie, int n)
+{
+	trie->nodes[n].kind = NODE_FREE;
+	trie->nodes[n].parent = trie->freenode;
+	trie->freenode = n;
+}
+
+
+/**
+  * Slides the live labels to the front of the pool, in place
+  */
+static void MQTTTopicTrie_compact(MQTTTopicTrie* trie)
+{
+	int rd = 0, wr = 0;
+
+	while (rd < trie->labelused)
+	{
+		int owner, len;
+
+		memcpy(&owner, trie->labels + rd, LABEL_HEADER);
+		len = (owner >= 0) ? trie->nodes[owner].labellen : -1 - owner;
+		if (owner >= 0)
+		{
+			if (wr != rd)
+				memmove(trie->labels + wr, trie->labels + rd, LABEL_HEADER + len);
+			trie->nodes[owner].label = wr + LABEL_HEADER;
+			wr += LABEL_HEADER + len;
+		}
+		rd += LABEL_HEADER + len;
+	}
+	trie->labelused = wr;
+	trie->garbage = 0;
+}
+
+
+static int MQTTTopicTrie_newLabel(MQTTTopicTrie* trie, int n, const char* label, int len)
+{
+	int need = trie->labelused + LABEL_HEADER + len;
+
+	if (need > trie->labelsize && trie->garbage > 0 && (trie->fixed || trie->garbage >= trie->labelused / 4))
+	{
+		MQTTTopicTrie_compact(trie);
+		need = trie->labelused + LABEL_HEADER + len;
+	}
+	if (MQTTTopicTrie_reserve((void**)&trie->labels, &trie->labelsize, need, 1, trie->fixed) < 0)
+		return -1;
+	memcpy(trie->labels + trie->labelused, &n, LABEL_HEADER);
+	memcpy(trie->labels + trie->labelused + LABEL_HEADER, label, len);
+	trie->nodes[n].label = trie->labelused + LABEL_HEADER;
+	trie->nodes[n].labellen = len;
+	trie->labelused = need;
+	return 0;
+}
+
+
+static void MQTTTopicTrie_freeLabel(MQTTTopicTrie* trie, int n)
+{
+	MQTTTopicNode* node = &trie->nodes[n];
+	int header = -1 - node->labellen;
+
+	if ((int)node->label + node->labellen == trie->labelused)
+		trie->labelused = node->label - LABEL_HEADER;	/* last in the pool */
+	else
+	{
+		memcpy(trie->labels + node->label - LABEL_HEADER, &header, LABEL_HEADER);
+		trie->garbage += LABEL_HEADER + node->labellen;
+	}
+}
+
+
+static void MQTTTopicTrie_link(MQTTTopicTrie* trie, int n, unsigned int hash)
+{
+	unsigned int mask = trie->edgesize - 1;
+	unsigned int i = hash & mask;
+
+	while (trie->edges[i].node >= 0)
+		i = (i + 1) & mask;
+	trie->edges[i].node = n;
+	trie->edges[i].hash = hash;
+	trie->edgecount++;
+}
+
+
+static void MQTTTopicTrie_unlink(MQTTTopicTrie* trie, int n)
+{
+	const MQTTTopicNode* node = &trie->nodes[n];
+	unsigned int mask = trie->edgesize - 1;
+	unsigned int i = MQTTTopicTrie_edgeHash(node->parent, MQTTTopicTrie_levelHash(trie->labels + node->label,
+			node->labellen)) & mask;
+	unsigned int j;
+
+	while (trie->edges[i].node != n)
+		i = (i + 1) & mask;
+	/* backward shift: move up the entries that probed past the hole */
+	for (j = (i + 1) & mask; trie->edges[j].node >= 0; j = (j + 1) & mask)
+	{
+		unsigned int k = trie->edges[j].hash & mask;
+
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		trie->edges[i] = trie->edges[j];
+		i = j;
+	}
+	trie->edges[i].node = -1;
+	trie->edgecount--;
+}
+
+
+/**
+  * Keeps the edge table at most half full
+  */
+static int MQTTTopicTrie_reserveEdges(MQTTTopicTrie* trie, int count)
+{
+	MQTTTopicEdge* old = trie->edges;
+	int oldsize = trie->edgesize;
+	int size = (oldsize > 0) ? oldsize : 16;
+	int i;
+
+	if (count * 2 <= oldsize)
+		return 0;
+	if (trie->fixed)
+		return -1;
+	while (count * 2 > size)
+		size *= 2;
+	if ((trie->edges = malloc(size * sizeof(MQTTTopicEdge))) == NULL)
+	{
+		trie->edges = old;
+		return -1;
+	}
+	memset(trie->edges, 0xFF, size * sizeof(MQTTTopicEdge));
+	trie->edgesize = size;
+	trie->edgecount = 0;
+	for (i = 0; i < oldsize; ++i)
+		if (old[i].node >= 0)
+			MQTTTopicTrie_link(trie, old[i].node, old[i].hash);
+	free(old);
+	return 0;
+}
+
+
+static int MQTTTopicTrie_find(const MQTTTopicTrie* trie, int parent, const char* label, int len, unsigned int levelhash)
+{
+	unsigned int hash = MQTTTopicTrie_edgeHash(parent, levelhash);
+	unsigned int mask = trie->edgesize - 1;
+	const MQTTTopicEdge* edge;
+	unsigned int i;
+
+	if (trie->edgesize == 0)
+		return -1;
+	/* the hash is in the table, so only a likely match reads the node */
+	for (i = hash & mask; (edge = &trie->edges[i])->node >= 0; i = (i + 1) & mask)
+	{
+		const MQTTTopicNode* node = &trie->nodes[edge->node];
+
+		if (edge->hash == hash && node->parent == parent && node->labellen == len
+				&& memcmp(trie->labels + node->label, label, len) == 0)
+			return edge->node;
+	}
+	return -1;
+}
+
+
+/**
+  * Finds, or creates, the child of parent for one filter level
+  * @return the child node, or -1 if absent and not created
+  */
+static int MQTTTopicTrie_child(MQTTTopicTrie* trie, int parent, const char* label, int len, int create)
+{
+	unsigned int levelhash;
+	int n;
+
+	if (len == 1 && (label[0] == '+' || label[0] == '#'))
+	{
+		int kind = (label[0] == '+') ? NODE_PLUS : NODE_POUND;
+
+		n = (kind == NODE_PLUS) ? trie->nodes[parent].plus : trie->nodes[parent].pound;
+		if (n >= 0 || !create || (n = MQTTTopicTrie_newNode(trie, parent, kind)) < 0)
+			return n;
+		if (kind == NODE_PLUS)
+			trie->nodes[parent].plus = n;
+		else
+			trie->nodes[parent].pound = n;
+		trie->nodes[parent].children++;
+		return n;
+	}
+	levelhash = MQTTTopicTrie_levelHash(label, len);
+	if ((n = MQTTTopicTrie_find(trie, parent, label, len, levelhash)) >= 0 || !create)
+		return n;
+	if (MQTTTopicTrie_reserveEdges(trie, trie->edgecount + 1) < 0 || (n = MQTTTopicTrie_newNode(trie, parent, NODE_EXACT)) < 0)
+		return -1;
+	if (MQTTTopicTrie_newLabel(trie, n, label, len) < 0)
+	{
+		MQTTTopicTrie_freeNode(trie, n);
+		return -1;
+	}
+	MQTTTopicTrie_link(trie, n, MQTTTopicTrie_edgeHash(parent, levelhash));
+	trie->nodes[parent].children++;
+	return n;
+}
+
+
+/**
+  * Removes the nodes that no filter ends at or passes through, from n up
+  */
+static void MQTTTopicTrie_prune(MQTTTopicTrie* trie, int n)
+{
+	while (n > 0 && trie->nodes[n].subcount == 0 && trie->nodes[n].children == 0)
+	{
+		MQTTTopicNode* node = &trie->nodes[n];
+		int parent = node->parent;
+
+		if (node->kind == NODE_PLUS)
+			trie->nodes[parent].plus = -1;
+		else if (node->kind == NODE_POUND)
+			trie->nodes[parent].pound = -1;
+		else
+		{
+			MQTTTopicTrie_unlink(trie, n);
+			MQTTTopicTrie_freeLabel(trie, n);
+		}
+		trie->nodes[parent].children--;
+		MQTTTopicTrie_freeNode(trie, n);
+		n = parent;
+	}
+}
+
+
+/**
+  * Takes a block of 2^subclass subscriptions, from the unused ones of that size
+  * or from the end of the array
+  * @return the first subscription of the block, or -1
+  */
+static int MQTTTopicTrie_newSubs(MQTTTopicTrie* trie, int subclass)
+{
+	int s = trie->freesubs[subclass];
+
+	if (s >= 0)
+		trie->freesubs[subclass] = trie->subs[s].qos;
+	else if (MQTTTopicTrie_reserve((void**)&trie->subs, &trie->maxsubs, trie->subcount + (1 << subclass),
+			sizeof(MQTTTopicSub), trie->fixed) == 0)
+	{
+		s = trie->subcount;
+		trie->subcount += 1 << subclass;
+	}
+	return s;
+}
+
+
+static void MQTTTopicTrie_freeSubs(MQTTTopicTrie* trie, int s, int subclass)
+{
+	trie->subs[s].subscriber = NULL;
+	trie->subs[s].qos = trie->freesubs[subclass];
+	trie->freesubs[subclass] = s;
+}
+
+
+/**
+  * Walks the levels of a filter from the root
+  * @return the node of the last level, or -1
+  */
+static int MQTTTopicTrie_walk(MQTTTopicTrie* trie, const char* filter, int len, int create)
+{
+	const char* p = filter;
+	const char* end = filter + len;
+	int n = 0;
+
+	if (trie->nodecount == 0 && (!create || MQTTTopicTrie_newNode(trie, -1, NODE_ROOT) != 0))
+		return -1;
+	for (;;)
+	{
+		const char* q = memchr(p, '/', end - p);
+		int child;
+
+		if (q == NULL)
+			q = end;
+		if ((child = MQTTTopicTrie_child(trie, n, p, q - p, create)) < 0)
+		{
+			MQTTTopicTrie_prune(trie, n);	/* levels created before running out of memory */
+			return -1;
+		}
+		n = child;
+		if (q == end)
+			return n;
+		p = q + 1;
+	}
+}
+
+
+/**
+  * Initializes an empty trie whose storage grows with realloc
+  * @param trie the trie
+  */
+void MQTTTopicTrie_init(MQTTTopicTrie* trie)
+{
+	int i;
+
+	memset(trie, 0, sizeof(*trie));
+	trie->freenode = -1;
+	for (i = 0; i < MQTTTOPICTRIE_SUBCLASSES; ++i)
+		trie->freesubs[i] = -1;
+}
+
+
+/**
+  * Initializes an empty trie in a fixed block of memory, e.g. a static array
+  * @param trie the trie
+  * @param mem the storage
+  * @param memsize the size of mem in bytes
+  * @return the number of nodes (filter levels) that fit, 0 if mem is too small
+  */
+int MQTTTopicTrie_initStatic(MQTTTopicTrie* trie, void* mem, int memsize)
+{
+	int unit = sizeof(MQTTTopicNode) + sizeof(MQTTTopicSub) + 2 * sizeof(MQTTTopicEdge) + STATIC_LABEL_BYTES;
+	int skip = (int)((sizeof(void*) - (size_t)mem % sizeof(void*)) % sizeof(void*));
+	char* p = (char*)mem + skip;
+	int maxnodes, edgesize;
+
+	MQTTTopicTrie_init(trie);
+	if (memsize - skip < 2 * unit)
+		return 0;
+	/* as many nodes as fit with the edge table, a power of 2, at most half full */
+	for (maxnodes = (memsize - skip) / unit; ; --maxnodes)
+	{
+		for (edgesize = 1; edgesize < 2 * maxnodes; edgesize *= 2)
+			;
+		if (maxnodes * (unit - 2 * (int)sizeof(MQTTTopicEdge)) + edgesize * (int)sizeof(MQTTTopicEdge) <= memsize - skip)
+			break;
+	}
+	trie->fixed = 1;
+	trie->subs = (MQTTTopicSub*)p;
+	trie->maxsubs = maxnodes;
+	p += maxnodes * sizeof(MQTTTopicSub);
+	trie->nodes = (MQTTTopicNode*)p;
+	trie->maxnodes = maxnodes;
+	p += maxnodes * sizeof(MQTTTopicNode);
+	trie->edges = (MQTTTopicEdge*)p;
+	trie->edgesize = edgesize;
+	memset(trie->edges, 0xFF, edgesize * sizeof(MQTTTopicEdge));
+	p += edgesize * sizeof(MQTTTopicEdge);
+	trie->labels = p;
+	trie->labelsize = (int)((char*)mem + memsize - p);
+	return maxnodes;
+}
+
+
+/**
+  * Releases the storage of a trie and empties it
+  * @param trie the trie
+  */
+void MQTTTopicTrie_free(MQTTTopicTrie* trie)
+{
+	if (!trie->fixed)
+	{
+		free(trie->nodes);
+		free(trie->subs);
+		free(trie->edges);
+		free(trie->labels);
+	}
+	MQTTTopicTrie_init(trie);
+}
+
+
+/**
+  * Adds a subscription, or updates its QoS
+  * @param trie the trie
+  * @param filter the topic filter
+  * @param len the length of filter
+  * @param subscriber identifies the subscriber, passed back by MQTTTopicTrie_match
+  * @param qos the QoS of the subscription
+  * @return 1 if added, 0 if the QoS was updated, -1 for an invalid filter or no memory
+  */
+int MQTTTopicTrie_add(MQTTTopicTrie* trie, const char* filter, int len, void* subscriber, int qos)
+{
+	MQTTTopicNode* node;
+	int rc = -1;
+	int n, s, i;
+
+	FUNC_ENTRY;
+	if (!MQTTTopic_isValidFilter(filter, len) || (n = MQTTTopicTrie_walk(trie, filter, len, 1)) < 0)
+		goto exit;
+	node = &trie->nodes[n];
+	for (i = 0; i < node->subcount; ++i)
+		if (trie->subs[node->subs + i].subscriber == subscriber)
+		{
+			trie->subs[node->subs + i].qos = qos;
+			rc = 0;
+			goto exit;
+		}
+	if (node->subcount == 0 || node->subcount == 1 << node->subclass)
+	{
+		/* move to a block twice the size */
+		int subclass = (node->subcount == 0) ? 0 : node->subclass + 1;
+
+		if (subclass == MQTTTOPICTRIE_SUBCLASSES || (s = MQTTTopicTrie_newSubs(trie, subclass)) < 0)
+		{
+			MQTTTopicTrie_prune(trie, n);
+			goto exit;
+		}
+		node = &trie->nodes[n];
+		if (node->subcount > 0)
+		{
+			memcpy(&trie->subs[s], &trie->subs[node->subs], node->subcount * sizeof(MQTTTopicSub));
+			MQTTTopicTrie_freeSubs(trie, node->subs, node->subclass);
+		}
+		node->subs = s;
+		node->subclass = subclass;
+	}
+	trie->subs[node->subs + node->subcount].subscriber = subscriber;
+	trie->subs[node->subs + node->subcount].qos = qos;
+	node->subcount++;
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Removes a subscription
+  * @param trie the trie
+  * @param filter the topic filter
+  * @param len the length of filter
+  * @param subscriber the subscriber given to MQTTTopicTrie_add
+  * @return 1 if the subscription existed and was removed, 0 otherwise
+  */
+int MQTTTopicTrie_remove(MQTTTopicTrie* trie, const char* filter, int len, void* subscriber)
+{
+	MQTTTopicNode* node;
+	int rc = 0;
+	int n, i;
+
+	FUNC_ENTRY;
+	if (!MQTTTopic_isValidFilter(filter, len) || (n = MQTTTopicTrie_walk(trie, filter, len, 0)) < 0)
+		goto exit;
+	node = &trie->nodes[n];
+	for (i = 0; i < node->subcount; ++i)
+		if (trie->subs[node->subs + i].subscriber == subscriber)
+		{
+			/* the last one fills the gap */
+			trie->subs[node->subs + i] = trie->subs[node->subs + node->subcount - 1];
+			if (--node->subcount == 0)
+			{
+				MQTTTopicTrie_freeSubs(trie, node->subs, node->subclass);
+				node->subs = -1;
+				MQTTTopicTrie_prune(trie, n);
+			}
+			rc = 1;
+			break;
+		}
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+static const char* MQTTTopicTrie_string(MQTTString* s, int* len)
+{
+	if (s->cstring)
+	{
+		*len = (int)strlen(s->cstring);
+		return s->cstring;
+	}
+	*len = s->lenstring.len;
+	return s->lenstring.data;
+}
+
+
+/**
+  * Adds the subscriptions of a SUBSCRIBE packet, with room for all of them
+  * reserved at once
+  * @param trie the trie
+  * @param subscriber identifies the subscriber
+  * @param count the number of topic filters
+  * @param topicFilters the topic filters, e.g. from MQTTDeserialize_subscribe
+  * @param qoss the QoS of each filter, set to 0x80 where the filter was refused,
+  * ready for MQTTSerialize_suback
+  * @return the number of subscriptions added or updated
+  */
+int MQTTTopicTrie_subscribe(MQTTTopicTrie* trie, void* subscriber, int count, MQTTString topicFilters[], int qoss[])
+{
+	int levels = 0, bytes = 0, done = 0;
+	int i, len;
+
+	FUNC_ENTRY;
+	if (!trie->fixed)
+	{
+		for (i = 0; i < count; ++i)
+		{
+			const char* filter = MQTTTopicTrie_string(&topicFilters[i], &len);
+			int j, n = 1;
+
+			for (j = 0; j < len; ++j)
+				n += (filter[j] == '/');
+			levels += n;
+			bytes += len + LABEL_HEADER * n;
+		}
+		/* best effort: the adds below still fail one by one if memory runs out */
+		MQTTTopicTrie_reserve((void**)&trie->nodes, &trie->maxnodes, trie->nodecount + levels + 1, sizeof(MQTTTopicNode), 0);
+		MQTTTopicTrie_reserve((void**)&trie->subs, &trie->maxsubs, trie->subcount + count, sizeof(MQTTTopicSub), 0);
+		MQTTTopicTrie_reserve((void**)&trie->labels, &trie->labelsize, trie->labelused + bytes, 1, 0);
+		MQTTTopicTrie_reserveEdges(trie, trie->edgecount + levels);
+	}
+	for (i = 0; i < count; ++i)
+	{
+		const char* filter = MQTTTopicTrie_string(&topicFilters[i], &len);
+
+		if (MQTTTopicTrie_add(trie, filter, len, subscriber, qoss[i]) < 0)
+			qoss[i] = 0x80;
+		else
+			++done;
+	}
+	FUNC_EXIT_RC(done);
+	return done;
+}
+
+
+/**
+  * Removes the subscriptions of an UNSUBSCRIBE packet
+  * @param trie the trie
+  * @param subscriber identifies the subscriber
+  * @param count the number of topic filters
+  * @param topicFilters the topic filters, e.g. from MQTTDeserialize_unsubscribe
+  * @return the number of subscriptions removed
+  */
+int MQTTTopicTrie_unsubscribe(MQTTTopicTrie* trie, void* subscriber, int count, MQTTString topicFilters[])
+{
+	int done = 0;
+	int i, len;
+
+	FUNC_ENTRY;
+	for (i = 0; i < count; ++i)
+	{
+		const char* filter = MQTTTopicTrie_string(&topicFilters[i], &len);
+
+		done += MQTTTopicTrie_remove(trie, filter, len, subscriber);
+	}
+	FUNC_EXIT_RC(done);
+	return done;
+}
+
+
+static int MQTTTopicTrie_deliver(const MQTTTopicTrie* trie, int n, MQTTTopicTrie_callback callback, void* context)
+{
+	const MQTTTopicSub* sub = trie->subs + trie->nodes[n].subs;
+	int count = trie->nodes[n].subcount;
+	int i;
+
+	for (i = 0; i < count; ++i)
+		(*callback)(sub[i].subscriber, sub[i].qos, context);
+	return count;
+}
+
+
+/**
+  * Matches the topic levels from p on below node n
+  * @param p the start of the next level, NULL once all levels are consumed
+  */
+static int MQTTTopicTrie_visit(const MQTTTopicTrie* trie, int n, const char* p, const char* end,
+		MQTTTopicTrie_callback callback, void* context)
+{
+	const MQTTTopicNode* node = &trie->nodes[n];
+	/* wildcards at the first level do not match $-topics */
+	int wild = (n != 0 || *p != '$');
+	unsigned int levelhash = 2166136261u;
+	const char* q;
+	int count = 0;
+	int child;
+
+	if (node->pound >= 0 && wild)
+		count += MQTTTopicTrie_deliver(trie, node->pound, callback, context);	/* the rest, or none */
+	if (p == NULL)
+		return count + MQTTTopicTrie_deliver(trie, n, callback, context);
+	for (q = p; q < end && *q != '/'; ++q)
+		levelhash = (levelhash ^ (unsigned char)*q) * 16777619u;
+	if ((child = MQTTTopicTrie_find(trie, n, p, q - p, levelhash)) >= 0)
+		count += MQTTTopicTrie_visit(trie, child, (q < end) ? q + 1 : NULL, end, callback, context);
+	if (node->plus >= 0 && wild)
+		count += MQTTTopicTrie_visit(trie, node->plus, (q < end) ? q + 1 : NULL, end, callback, context);
+	return count;
+}
+
+
+/**
+  * Calls callback for every subscription whose filter matches a topic name
+  * @param trie the trie
+  * @param topic the topic name, without wildcards
+  * @param len the length of topic
+  * @param callback called with the subscriber and QoS of each match
+  * @param context passed to callback
+  * @return the number of matching subscriptions
+  */
+int MQTTTopicTrie_match(MQTTTopicTrie* trie, const char* topic, int len, MQTTTopicTrie_callback callback, void* context)
+{
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (trie->nodecount > 0 && len > 0)
+		rc = MQTTTopicTrie_visit(trie, 0, topic, topic + len, callback, context);
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
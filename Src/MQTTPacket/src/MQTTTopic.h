@@ -0,0 +1,98 @@
+/*******************************************************************************
+ * MQTT 3.1.1 topic filter matching.
+ *
+ * MQTTTopic_matches compares one filter with one topic name. MQTTTopicTrie
+ * holds many subscriptions and finds those matching a topic in O(levels):
+ * one node per filter level, with the children of all nodes in a single hash
+ * table keyed by parent and level name, and the '+' and '#' children held in
+ * the node itself. Nodes refer to each other by index and the level names
+ * live in one pool, so the storage is a handful of flat arrays that grow with
+ * realloc, or a fixed block given by the caller (no malloc on the device).
+ *******************************************************************************/
+
+#ifndef MQTTTOPIC_H_
+#define MQTTTOPIC_H_
+
+#if !defined(DLLImport)
+  #define DLLImport
+#endif
+#if !defined(DLLExport)
+  #define DLLExport
+#endif
+
+#define MQTTTOPICTRIE_SUBCLASSES 24	/**< subscription arrays of up to 2^23 entries */
+
+/**
+ * One level of one or more filters, 32 bytes.
+ */
+typedef struct
+{
+	int parent;	/**< -1 for the root, next free node when unused */
+	unsigned int label;	/**< offset of the level name in the label pool */
+	int subs;	/**< first of the subscriptions of the filter ending here, -1 if none */
+	int subcount;
+	int plus;	/**< child for '+', -1 if none */
+	int pound;	/**< child for '#', -1 if none */
+	int children;	/**< child nodes, wildcards included */
+	unsigned short labellen;
+	unsigned char kind;
+	unsigned char subclass;	/**< the subscription array has room for 2^subclass */
+} MQTTTopicNode;
+
+/**
+ * The subscriptions of a filter are contiguous, so delivering to them is a
+ * sequential read. Unused blocks are chained through qos.
+ */
+typedef struct
+{
+	void* subscriber;
+	int qos;
+} MQTTTopicSub;
+
+typedef struct
+{
+	int node;	/**< -1 if the slot is empty */
+	unsigned int hash;	/**< of parent and level name */
+} MQTTTopicEdge;
+
+typedef struct
+{
+	MQTTTopicNode* nodes;
+	int nodecount;	/**< nodes handed out, free ones included */
+	int maxnodes;
+	int freenode;
+	MQTTTopicSub* subs;
+	int subcount;	/**< subscription slots handed out, free ones included */
+	int maxsubs;
+	int freesubs[MQTTTOPICTRIE_SUBCLASSES];	/**< unused blocks of each size */
+	MQTTTopicEdge* edges;	/**< open addressing, linear probing */
+	int edgecount;
+	int edgesize;	/**< power of 2 */
+	char* labels;
+	int labelused;	/**< bytes used in the pool, freed labels included */
+	int labelsize;
+	int garbage;	/**< bytes of freed labels in the pool */
+	int fixed;	/**< storage given by the caller, never reallocated */
+} MQTTTopicTrie;
+
+/**
+ * Called for every subscription matching a topic.
+ */
+typedef void (*MQTTTopicTrie_callback)(void* subscriber, int qos, void* context);
+
+DLLExport int MQTTTopic_isValidFilter(const char* filter, int len);
+DLLExport int MQTTTopic_matches(const char* filter, int flen, const char* topic, int tlen);
+
+DLLExport void MQTTTopicTrie_init(MQTTTopicTrie* trie);
+DLLExport int MQTTTopicTrie_initStatic(MQTTTopicTrie* trie, void* mem, int memsize);
+DLLExport void MQTTTopicTrie_free(MQTTTopicTrie* trie);
+
+DLLExport int MQTTTopicTrie_add(MQTTTopicTrie* trie, const char* filter, int len, void* subscriber, int qos);
+DLLExport int MQTTTopicTrie_remove(MQTTTopicTrie* trie, const char* filter, int len, void* subscriber);
+DLLExport int MQTTTopicTrie_subscribe(MQTTTopicTrie* trie, void* subscriber, int count, MQTTString topicFilters[],
+		int qoss[]);
+DLLExport int MQTTTopicTrie_unsubscribe(MQTTTopicTrie* trie, void* subscriber, int count, MQTTString topicFilters[]);
+DLLExport int MQTTTopicTrie_match(MQTTTopicTrie* trie, const char* topic, int len, MQTTTopicTrie_callback callback,
+		void* context);
+
+#endif /* MQTTTOPIC_H_ */
@@ -41,19 +41,32 @@ int MQTTDeserialize_unsubscribe(unsigned char* dup, unsigned short* packetid, in
 	int mylen = 0;
 
 	FUNC_ENTRY;
+	if (len < 2)
+		goto exit;
 	header.byte = readChar(&curdata);
 	if (header.bits.type != UNSUBSCRIBE)
 		goto exit;
 	*dup = header.bits.dup;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	rc = MQTTPacket_decodeRange(curdata, buf + len, &mylen); /* read remaining length */
+	if (rc <= 0 || mylen > buf + len - (curdata + rc)) /* bad length field, or more than the data */
+	{
+		rc = 0;
+		goto exit;
+	}
+	curdata += rc;
 	enddata = curdata + mylen;
+	rc = 0;
 
+	if (enddata - curdata < 2)
+		goto exit;
 	*packetid = readInt(&curdata);
 
 	*count = 0;
 	while (curdata < enddata)
 	{
+		if (*count >= maxcount)
+			goto exit;
 		if (!readMQTTLenString(&topicFilters[*count], &curdata, enddata))
 			goto exit;
 		(*count)++;
@@ -79,6 +79,29 @@ int rc;
 	return TRANSPORT_ERROR;
 }
 
+int transport_sendPacketVector(int sock, const transport_iovec_t *iov, int iovcnt)
+{
+transport_iofunctions_t *myio = io;	// io[sock] or mystruct[sock].io
+int rc, i, total = 0;
+
+	assert((myio != NULL) && (iov != NULL));
+	if(myio->sendv != NULL){
+		while((rc = myio->sendv(iov, iovcnt)) == 0){
+			/* this is unlikely to loop forever unless there is a hardware problem */
+		}
+		return (rc > 0) ? rc : TRANSPORT_ERROR;
+	}
+	for(i = 0; i < iovcnt; i++){
+		if(iov[i].len == 0)
+			continue;
+		if(transport_sendPacketBuffer(sock, iov[i].base, iov[i].len) != (int)iov[i].len){
+			return TRANSPORT_ERROR;
+		}
+		total += iov[i].len;
+	}
+	return total;
+}
+
 
 int transport_getdata(unsigned char* buf, int count)
 {
@@ -15,9 +15,21 @@
  *    Sergio R. Caprile - media specifics, nice api doc :^)
  *******************************************************************************/
 
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+/**
+One buffer of a gathered send, see transport_sendPacketVector()
+*/
+typedef struct {
+	unsigned char *base;
+	unsigned int len;
+} transport_iovec_t;
+
 typedef struct {
 	int (*send)(unsigned char *address, unsigned int bytes); 	///< pointer to function to send 'bytes' bytes, returns the actual number of bytes sent
 	int (*recv)(unsigned char *address, unsigned int maxbytes); 	///< pointer to function to receive upto 'maxbytes' bytes, returns the actual number of bytes copied
+	int (*sendv)(const transport_iovec_t *iov, int iovcnt);	///< optional, sends all buffers as one unit, returns the total bytes sent, 0 for call again or negative on error
 } transport_iofunctions_t;
 
 #define TRANSPORT_DONE	1
@@ -27,6 +39,14 @@ typedef struct {
 @note Blocks until requested buflen is sent
 */
 int transport_sendPacketBuffer(int sock, unsigned char* buf, int buflen);
+
+/**
+Sends a packet gathered from several buffers, e.g. a header serialized into a small buffer and
+the payload straight from where it lives, without assembling it first
+@note Blocks until everything is sent. Without a sendv function the buffers are sent one by one
+@returns the total number of bytes sent or TRANSPORT_ERROR
+*/
+int transport_sendPacketVector(int sock, const transport_iovec_t *iov, int iovcnt);
 /**
 @note Blocks until requested count is received, as MQTTPacket_read() expects
 @warning This function is not supported (not implemented)
@@ -68,3 +88,5 @@ the AT+xSENDx / AT+xRECVx commands into the former sendPacketBuffer() and getdat
 */
 int transport_open(transport_iofunctions_t *thisio);
 int transport_close(int sock);
+
+#endif /* TRANSPORT_H_ */
@@ -0,0 +1,100 @@
+/* Includes -----------------------------------------------------------------*/
+#include "adaptive.h"
+#include "stdlib.h"
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+void adaptive_sampler_init(struct adaptive_sampler *s)
+{
+	s->last = -1;
+	s->interval = ADAPTIVE_SAMPLE_MIN;
+	/* a tick to start the first conversion, one to read it */
+	s->countdown = 2;
+}
+
+/*
+ * Called on every TIM2 tick, returns whether the sensor is to be read.
+ */
+int adaptive_sampler_tick(struct adaptive_sampler *s)
+{
+	if (s->countdown > 0)
+		s->countdown--;
+	return s->countdown == 0;
+}
+
+/*
+ * Whether the conversion for the next read is to be started on this tick.
+ */
+int adaptive_sampler_starting(const struct adaptive_sampler *s)
+{
+	return s->countdown == 1;
+}
+
+/*
+ * Sets the ticks to the next sample from the lux just read: the interval
+ * doubles, unless at the rate the lux went since the last sample it would
+ * move by more than half its deadband, or half the way to the threshold,
+ * before the next. Near the threshold, and after a failed read, every tick.
+ */
+void adaptive_sampler_update(struct adaptive_sampler *s, int lux)
+{
+	unsigned int next = s->interval * 2;
+	unsigned int delta, distance, room;
+
+	if (lux < 0 || s->last < 0) {
+		next = ADAPTIVE_SAMPLE_MIN;
+	} else {
+		delta = abs(lux - s->last);
+		distance = abs(lux - ADAPTIVE_LUX_THRESHOLD);
+		if (distance <= ADAPTIVE_LUX_NEAR) {
+			next = ADAPTIVE_SAMPLE_MIN;
+		} else if (delta) {
+			room = ADAPTIVE_LUX_DEADBAND(lux);
+			if (room > distance - ADAPTIVE_LUX_NEAR)
+				room = distance - ADAPTIVE_LUX_NEAR;
+			if (room * s->interval / (2 * delta) < next)
+				next = room * s->interval / (2 * delta);
+		}
+	}
+	if (next < ADAPTIVE_SAMPLE_MIN)
+		next = ADAPTIVE_SAMPLE_MIN;
+	if (next > ADAPTIVE_SAMPLE_MAX)
+		next = ADAPTIVE_SAMPLE_MAX;
+	s->last = lux;
+	s->interval = next;
+	s->countdown = next;
+}
+
+/*
+ * Publishes the next value at once, from the shortest interval: on a new
+ * session the broker has nothing retained of ours.
+ */
+void adaptive_pub_reset(struct adaptive_pub *p)
+{
+	p->fresh = 1;
+	p->interval_ms = ADAPTIVE_PUB_MIN_MS;
+}
+
+int adaptive_pub_due(const struct adaptive_pub *p, int value, int deadband, uint32_t now)
+{
+	return p->fresh || abs(value - p->value) > deadband
+			|| now - p->last_ms >= p->interval_ms;
+}
+
+/*
+ * Called once the value is published: a change beyond the deadband starts
+ * over from the shortest interval, anything else doubles it.
+ */
+void adaptive_pub_done(struct adaptive_pub *p, int value, int deadband, uint32_t now)
+{
+	if (p->fresh || abs(value - p->value) > deadband)
+		p->interval_ms = ADAPTIVE_PUB_MIN_MS;
+	else if (p->interval_ms < ADAPTIVE_PUB_MAX_MS / 2)
+		p->interval_ms *= 2;
+	else
+		p->interval_ms = ADAPTIVE_PUB_MAX_MS;
+	p->value = value;
+	p->last_ms = now;
+	p->fresh = 0;
+}
@@ -0,0 +1,66 @@
+/* Includes -----------------------------------------------------------------*/
+#include "cmd_queue.h"
+#include "string.h"
+
+/* Private typedef -----------------------------------------------------------*/
+struct cmd {
+	topic_handler_t handler;
+	unsigned char	len;
+	unsigned char	payload[CMD_PAYLOAD_MAX];
+};
+
+/* Variables -----------------------------------------------------------------*/
+static struct cmd cmd_queue[CMD_QUEUE_SIZE];
+static unsigned int cmd_in;	///< Free running, like the fifo indices.
+static unsigned int cmd_out;
+
+_Static_assert((CMD_QUEUE_SIZE & (CMD_QUEUE_SIZE - 1)) == 0, "CMD_QUEUE_SIZE must be a power of 2");
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+/*
+ * internal helper to run the oldest command
+ */
+static void cmd_queue_apply_one(void)
+{
+	struct cmd *c = &cmd_queue[cmd_out & (CMD_QUEUE_SIZE - 1)];
+
+	cmd_out++;
+	c->handler(c->payload, c->len);
+}
+
+unsigned int cmd_queue_used(void)
+{
+	return cmd_in - cmd_out;
+}
+
+/*
+ * Queues a command, applying the oldest first if the queue is full.
+ */
+void cmd_queue_put(topic_handler_t handler, const unsigned char *payload, int payloadlen)
+{
+	struct cmd *c;
+
+	if (cmd_queue_used() == CMD_QUEUE_SIZE)
+		cmd_queue_apply_one();
+	c = &cmd_queue[cmd_in & (CMD_QUEUE_SIZE - 1)];
+	c->handler = handler;
+	c->len = (payloadlen < 0) ? 0 : (payloadlen > CMD_PAYLOAD_MAX) ? CMD_PAYLOAD_MAX : payloadlen;
+	memcpy(c->payload, payload, c->len);
+	cmd_in++;
+}
+
+/*
+ * Applies the queued commands in order. Returns how many there were.
+ */
+int cmd_queue_apply(void)
+{
+	int n = 0;
+
+	while (cmd_in != cmd_out) {
+		cmd_queue_apply_one();
+		n++;
+	}
+	return n;
+}
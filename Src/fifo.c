@@ -21,6 +21,7 @@ unsigned int fifo_used(struct fifo *fifo)
   return (fifo->in - fifo->out);
 }
 
+#ifndef STATIC_MEMORY
 signed int fifo_alloc(struct fifo *fifo, unsigned int size)
 {
 /*
@@ -32,6 +33,9 @@ signed int fifo_alloc(struct fifo *fifo, unsigned int size)
 
 	fifo->in = 1;
 	fifo->out = 1;
+	fifo->overflow = 0;
+	fifo->watermark = 0;
+	fifo->on_watermark = NULL;
 
 	if (size < 2){
 		fifo->data = NULL;
@@ -57,6 +61,7 @@ void fifo_free(struct fifo *fifo)
 	fifo->data = NULL;
 	fifo->mask = 0;
 }
+#endif
 
 int fifo_init(struct fifo *fifo, unsigned char *buffer, unsigned int size)
 {
@@ -66,6 +71,9 @@ int fifo_init(struct fifo *fifo, unsigned char *buffer, unsigned int size)
 	fifo->in = 0;
 	fifo->out = 0;
 	fifo->data = buffer;
+	fifo->overflow = 0;
+	fifo->watermark = 0;
+	fifo->on_watermark = NULL;
 
 	if (size < 2) {
 		fifo->mask = 0;
@@ -89,20 +97,41 @@ static void fifo_copy_in(struct fifo *fifo, unsigned char *src, unsigned int len
 	memcpy(fifo->data, src + l, len - l);
 }
 
+/*
+ * Bytes that do not fit are dropped and added to fifo->overflow, so the
+ * consumer can detect the loss. on_watermark is called (from the producer
+ * context, usually an interrupt) when the fill level crosses the watermark
+ * or data was dropped.
+ */
 unsigned int fifo_in(struct fifo *fifo, unsigned char *buf, unsigned int len)
 {
-	unsigned int l;
+	unsigned int l, used, dropped = 0;
 
+	used = fifo->in - fifo->out;
 	l = fifo_unused(fifo);
-	if (len > l)
+	if (len > l) {
+		dropped = len - l;
+		fifo->overflow += dropped;
 		len = l;
+	}
 
 	fifo_copy_in(fifo, buf, len, fifo->in);
 	fifo->in += len;
 
+	/* crossed the watermark, or lost data while above it */
+	if (fifo->on_watermark && fifo->watermark && (used + len >= fifo->watermark)
+			&& (used < fifo->watermark || dropped))
+		fifo->on_watermark(fifo);
+
 	return len;
 }
 
+void fifo_set_watermark(struct fifo *fifo, unsigned int level, void (*on_watermark)(struct fifo *fifo))
+{
+	fifo->watermark = level;
+	fifo->on_watermark = on_watermark;
+}
+
 static void fifo_copy_out(struct fifo *fifo, unsigned char *dst, unsigned int len, unsigned int off)
 {
 	unsigned int size = fifo->mask + 1;
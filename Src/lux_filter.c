@@ -0,0 +1,75 @@
+/* Includes -----------------------------------------------------------------*/
+#include "lux_filter.h"
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+/*
+ * internal helper, the median of 3 in at most 3 compares
+ */
+static int lux_median3(int a, int b, int c)
+{
+	int lo = (a < b) ? a : b;
+	int hi = (a < b) ? b : a;
+
+	return (c < lo) ? lo : (c > hi) ? hi : c;
+}
+
+void lux_filter_init(struct lux_filter *f)
+{
+	f->next = 0;
+	f->primed = 0;
+}
+
+/*
+ * Takes a sample, 0 lx or more, returns the filtered lux.
+ */
+int lux_filter_put(struct lux_filter *f, int lux)
+{
+	int m;
+
+	if (!f->primed) {
+		/* start from the first sample rather than from 0 */
+		f->window[0] = f->window[1] = f->window[2] = lux;
+		f->ema = lux << LUX_FRAC_BITS;
+		f->primed = 1;
+	}
+	f->window[f->next] = lux;
+	f->next = (f->next == 2) ? 0 : f->next + 1;
+	m = lux_median3(f->window[0], f->window[1], f->window[2]);
+	/* a division, not a shift: the difference can be negative */
+	f->ema += ((m << LUX_FRAC_BITS) - f->ema) / (1 << LUX_EMA_SHIFT);
+	return (f->ema + (1 << (LUX_FRAC_BITS - 1))) >> LUX_FRAC_BITS;
+}
+
+/*
+ * The lamp starts off and free to switch.
+ */
+void lux_switch_init(struct lux_switch *s, int low, int high,
+		unsigned int min_on, unsigned int min_off)
+{
+	s->low = low;
+	s->high = high;
+	s->min_on = min_on;
+	s->min_off = min_off;
+	s->dwell = (min_on > min_off) ? min_on : min_off;
+	s->on = 0;
+}
+
+/*
+ * Called on every TIM2 tick with the filtered lux, below 0 if there is none,
+ * returns whether the lamp is on.
+ */
+int lux_switch_update(struct lux_switch *s, int lux)
+{
+	if (s->dwell < s->min_on || s->dwell < s->min_off)
+		s->dwell++;
+	if (lux < 0)
+		return s->on;
+	if (s->on ? (lux >= s->high && s->dwell >= s->min_on)
+			: (lux < s->low && s->dwell >= s->min_off)) {
+		s->on = !s->on;
+		s->dwell = 0;
+	}
+	return s->on;
+}
@@ -34,10 +34,17 @@
 #include "transport.h"
 #include "networkwrapper.h"
 #include "stdio.h"
+#include "string.h"
 #include "fifo.h"
 #include "bh1750_i2c_drv.h"
 #include "topic_name_helper.h"
+#include "cmd_queue.h"
+#include "adaptive.h"
+#include "lux_filter.h"
 #include "wifi_credentials.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "uart_capture.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -65,20 +72,31 @@ PUTCHAR_PROTO //重写fputc函数
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-uint8_t rxBuffer[RX_BUFFER_SIZE] = { 0 };
-uint8_t debugSentBuffer[RX_BUFFER_SIZE];
+uint8_t rxBuffer[RX_BUFFER_SIZE] MEM_SECTION("uart");
+uint8_t debugSentBuffer[MEM_LOG_SIZE] MEM_SECTION("log");
 extern UART_HandleTypeDef huart1;
 extern UART_HandleTypeDef huart2;
 extern TIM_HandleTypeDef htim2;
 int recv_end_flag = 0;
 int rx_len = 0;
 struct fifo rxFifo;
+#ifdef STATIC_MEMORY
+static unsigned char rxFifoBuffer[FIFO_BUFFER_SIZE] MEM_SECTION("fifo");
+#endif
 uint8_t dat[2] = { 0 };
 int ledMode = 2;
 int ledSwitch = 0;
-int lightSensorValue = 0;
+int lightSensorValue = -1;	///< Last good filtered lux, -1 before the first sample.
 int ledStatus = 0;
+static struct adaptive_sampler luxSampler;
+static struct lux_filter luxFilter;
+static struct lux_switch luxSwitch;	///< Auto mode.
+static int luxStarted = 0;	///< A conversion was started for the next read.
 int MQTT_connected = 0;
+volatile int rxBackpressure = 0;	///< Set from the uart interrupt when rxFifo crosses its watermark.
+#ifdef PROFILER_ENABLE
+static int profDumpRegion = PROF_REGION_MAX;	///< Next region to publish, PROF_REGION_MAX when idle.
+#endif
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -86,12 +104,14 @@ void SystemClock_Config(void);
 /* USER CODE BEGIN PFP */
 void MqttHandlerTask();
 int lightSensorLux();
+void lightSensorStart();
 void updateDeviceInfo();
+static void rxFifoWatermark(struct fifo *fifo);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-long unsigned int network_gettime_ms(void) {
+uint32_t network_gettime_ms(void) {
 	return (HAL_GetTick());
 }
 /* USER CODE END 0 */
@@ -130,8 +150,22 @@ int main(void) {
 	MX_TIM2_Init();
 	/* USER CODE BEGIN 2 */
 	// HAL_UART_Receive_IT(&huart5, (uint8_t *)rxBuffer, 8);
+#ifdef UART_CAPTURE_ENABLE
+	uart_capture_init();
+#endif
+	prof_init();
+	adaptive_sampler_init(&luxSampler);
+	lux_filter_init(&luxFilter);
+	lux_switch_init(&luxSwitch, ADAPTIVE_LUX_THRESHOLD - LUX_HYSTERESIS,
+			ADAPTIVE_LUX_THRESHOLD + LUX_HYSTERESIS, LUX_MIN_ON_TICKS, LUX_MIN_OFF_TICKS);
 	HAL_TIM_Base_Start_IT(&htim2);
+#ifdef STATIC_MEMORY
+	fifo_init(&rxFifo, rxFifoBuffer, FIFO_BUFFER_SIZE);
+#else
 	fifo_alloc(&rxFifo, FIFO_BUFFER_SIZE);
+#endif
+	fifo_set_watermark(&rxFifo, FIFO_WATERMARK, rxFifoWatermark);
+	metrics_init();
 	HAL_UART_Receive_DMA(&huart2, rxBuffer, RX_BUFFER_SIZE);
 	__HAL_UART_ENABLE_IT(&huart2, UART_IT_IDLE);
 	/* USER CODE END 2 */
@@ -186,21 +220,32 @@ void SystemClock_Config(void) {
 void MqttHandlerTask() {
 	/* USER CODE BEGIN MqttHandlerTask */
 
-	unsigned char buffer[128];
+	static unsigned char buffer[MEM_MQTT_TX_SIZE] MEM_SECTION("mqtt");
 	MQTTTransport transporter;
 	int result;
 	int length;
 	int startTime = HAL_GetTick();
 	// Transport layer uses the esp8266 networkwrapper.
-	static transport_iofunctions_t iof = { network_send, network_recv };
+	static transport_iofunctions_t iof = { network_send, network_recv, network_sendv };
 	int transport_socket = transport_open(&iof);
 
+	// Publish cycle topics, header and topic encoded once, each on its own rate.
+	static MQTTPreparedPublish cyclePub[3];
+	static struct adaptive_pub cycleRate[3];
+	static char *cycleTopics[3] = { "ledmode", "light", "ledh" };
+	for (int i = 0; i < 3; i++) {
+		MQTTString cycleTopic = MQTTString_initializer;
+		cycleTopic.cstring = cycleTopics[i];
+		MQTTPrepare_publish(&cyclePub[i], 0, 1, 0, cycleTopic);
+	}
+
 	// State machine.
 	int internalState = 0;
 	while (true) {
 		switch (internalState) {
 		case 0: {
 			MQTT_connected = 0;
+			METRICS_INC(connects);
 			// Initialize the network and connect to
 			network_init();
 			if (network_connect(SERVER_ADDR, 1883, CONNECTION_KEEPALIVE_S,
@@ -272,12 +317,19 @@ void MqttHandlerTask() {
 			MQTTString mode_TopicString = MQTTString_initializer;
 			leds_TopicString.cstring = "leds";
 			mode_TopicString.cstring = "mode";
+#ifdef PROFILER_ENABLE
+			MQTTString prof_TopicString = MQTTString_initializer;
+			prof_TopicString.cstring = "prof";
+			MQTTString topicFilters[3] = { leds_TopicString, mode_TopicString, prof_TopicString };
+			int rQos[3] = { 0 };
+#else
 			MQTTString topicFilters[2] = { leds_TopicString, mode_TopicString };
 			int rQos[2] = { 0 };
+#endif
 			// length = MQTTSerialize_publish(buffer, sizeof(buffer), 0, 1, 0, 0,
 			//                                topicString, payload, (length = sprintf(payload, "%d", lightSensorLux())));
-			length = MQTTSerialize_subscribe(buffer, sizeof(buffer), 0, 9527, 2,
-					topicFilters, rQos);
+			length = MQTTSerialize_subscribe(buffer, sizeof(buffer), 0, 9527,
+					sizeof(topicFilters) / sizeof(topicFilters[0]), topicFilters, rQos);
 
 			// Send SUBSCRIBE to the mqtt broker.
 			if ((result = transport_sendPacketBuffer(transport_socket, buffer,
@@ -300,12 +352,14 @@ void MqttHandlerTask() {
 				if ((result = MQTTPacket_readnb(buffer, sizeof(buffer),
 						&transporter)) == SUBACK) {
 					// Check if the connection was accepted.
-					unsigned char sessionPresent;
-					int maxcount;
+					unsigned short packetId;
 					int qCount;
 					int qArray[5];
-					if ((MQTTDeserialize_suback(&sessionPresent, 1, &qCount,
+					if ((MQTTDeserialize_suback(&packetId, 5, &qCount,
 							qArray, buffer, sizeof(buffer)) == 1)) {
+						// New session: publish every topic at once.
+						for (int i = 0; i < 3; i++)
+							adaptive_pub_reset(&cycleRate[i]);
 						internalState++;
 
 						break;
@@ -325,52 +379,94 @@ void MqttHandlerTask() {
 
 		case 5: {
 			static int pub_state;
+			static int metricsRecord = METRICS_RECORD_MAX;	///< Next metrics record, METRICS_RECORD_MAX when idle.
+			uint32_t pubStart;
 			MQTT_connected = 1;
-			// Populate the publish message.
+			// Populate the publish message: header in buffer, payload sent from where it is.
 			unsigned char payload[16];
+			char record[96];
+			unsigned char *pubPayload = payload;
+			int pubPayloadLen = 0;
+			int cycleTopic = -1, cycleValueSent = 0, cycleDeadbandSent = 0;
+			int *pubNext = NULL;	// Record index to advance once it is sent.
 			int rQos[1] = { 0 };
 			MQTTString topicString = MQTTString_initializer;
 
-			// Polling publish
-			switch (pub_state) {
-			case 0: {
-				pub_state++;
-				topicString.cstring = "ledmode";
-				length = MQTTSerialize_publish(buffer, sizeof(buffer), 0, 1, 0,
-						0, topicString, payload,
-						(length = sprintf(payload, "%d", ledMode)));
-			}
-				break;
-			case 1: {
-				pub_state++;
-				topicString.cstring = "light";
-				length = MQTTSerialize_publish(buffer, sizeof(buffer), 0, 1, 0,
-						0, topicString, payload,
-						(length = sprintf(payload, "%d", lightSensorValue)));
-			}
-				break;
-			case 2: {
-				pub_state=0;
-				topicString.cstring = "ledh";
-				length = MQTTSerialize_publish(buffer, sizeof(buffer), 0, 1, 0,
-						0, topicString, payload,
-						(length = sprintf(payload, "%d", ledStatus)));
-			}
-				break;
-			default:
-				pub_state = 0;
-				break;
+			if (metricsRecord == METRICS_RECORD_MAX && metrics_due(HAL_GetTick()))
+				metricsRecord = 0;
+
+#ifdef PROFILER_ENABLE
+			// Profile dump requested: one region per publish.
+			if (profDumpRegion < PROF_REGION_MAX) {
+				topicString.cstring = "profdata";
+				pubPayload = (unsigned char*) record;
+				pubPayloadLen = prof_format(profDumpRegion, record, sizeof(record));
+				pubNext = &profDumpRegion;
+				length = MQTTSerialize_publishHeader(buffer, sizeof(buffer), 0, 1,
+						0, 0, topicString, pubPayloadLen);
+			} else
+#endif
+			// Metrics records are due: one record per publish.
+			if (metricsRecord < METRICS_RECORD_MAX) {
+				topicString.cstring = (char*) metrics_topic(metricsRecord);
+				pubPayload = (unsigned char*) record;
+				pubPayloadLen = metrics_format(metricsRecord, record, sizeof(record));
+				pubNext = &metricsRecord;
+				length = MQTTSerialize_publishHeader(buffer, sizeof(buffer), 0, 1,
+						0, 0, topicString, pubPayloadLen);
+			} else
+			// Polling publish: the next topic due, round robin.
+			{
+				int cycleValue[3] = { ledMode, lightSensorValue, ledStatus };
+				int cycleDeadband[3] = { 0, ADAPTIVE_LUX_DEADBAND(lightSensorValue), 0 };
+				uint32_t now = HAL_GetTick();
+
+				for (int i = 0; i < 3 && cycleTopic < 0; i++) {
+					int k = (pub_state + i) % 3;
+					if (k == 1 && lightSensorValue < 0)
+						continue;	// No lux yet.
+					if (adaptive_pub_due(&cycleRate[k], cycleValue[k], cycleDeadband[k], now))
+						cycleTopic = k;
+				}
+				if (cycleTopic < 0) {
+					// Nothing due: wait for commands.
+					internalState++;
+					break;
+				}
+				pub_state = (cycleTopic + 1) % 3;
+				cycleValueSent = cycleValue[cycleTopic];
+				cycleDeadbandSent = cycleDeadband[cycleTopic];
+				PROF_BEGIN(PROF_PAYLOAD_FMT);
+				pubPayloadLen = sprintf(payload, "%d", cycleValueSent);
+				PROF_END(PROF_PAYLOAD_FMT);
+				PROF_BEGIN(PROF_MQTT_SERIALIZE);
+				length = MQTTSerialize_preparedPublishHeader(buffer, sizeof(buffer),
+						&cyclePub[cycleTopic], 0, pubPayloadLen);
+				PROF_END(PROF_MQTT_SERIALIZE);
 			}
 
-			if (recv_end_flag == 1) {
+			if (recv_end_flag == 1 || rxBackpressure) {
 				internalState++;
 				break;
 			}
 			// Send PUBLISH to the mqtt broker.
-			if ((result = transport_sendPacketBuffer(transport_socket, buffer,
-					length)) == length) {
-				int len = sprintf(debugSentBuffer, "Published.\r\n");
-				HAL_UART_Transmit_DMA(&huart1, debugSentBuffer, len);
+			transport_iovec_t pubIov[2] = { { buffer, length }, { pubPayload, pubPayloadLen } };
+			pubStart = HAL_GetTick();
+			if ((result = transport_sendPacketVector(transport_socket, pubIov, 2))
+					== length + pubPayloadLen) {
+				metrics_publish_latency(HAL_GetTick() - pubStart);
+				if (pubNext)
+					(*pubNext)++;
+				if (cycleTopic >= 0)
+					adaptive_pub_done(&cycleRate[cycleTopic], cycleValueSent,
+							cycleDeadbandSent, HAL_GetTick());
+#ifndef UART_CAPTURE_ENABLE
+				// Skipped while the echo of the last segment is still going out of the buffer.
+				if (huart1.gState == HAL_UART_STATE_READY) {
+					int len = sprintf(debugSentBuffer, "Published.\r\n");
+					HAL_UART_Transmit_DMA(&huart1, debugSentBuffer, len);
+				}
+#endif
 				internalState++;
 			} else {
 				// Start over.
@@ -380,78 +476,59 @@ void MqttHandlerTask() {
 			break;
 		case 6: {
 			MQTT_connected = 1;
+			rxBackpressure = 0;
 			startTime = HAL_GetTick();
-			// Wait for CONNACK response from the mqtt broker.
-			static unsigned char buf[128];
+			// Read every complete packet there is, queue the commands and apply them in one go.
+			static unsigned char buf[MEM_MQTT_RX_SIZE] MEM_SECTION("mqtt");
+			int received = 0;
 			while (true) {
-				memset(buf, 0, sizeof(buf));
-				result = MQTTPacket_readnb(buf, sizeof(buffer), &transporter);
-				// Wait until the transfer is done.
+				PROF_BEGIN(PROF_MQTT_READNB);
+				result = MQTTPacket_readnb(buf, sizeof(buf), &transporter);
+				PROF_END(PROF_MQTT_READNB);
 				if (result == PUBLISH) {
 
 					unsigned char dup;
-					int buflen = sizeof(buf);
 					int qos;
 					unsigned char retained;
 					unsigned short msgid;
 					int payloadlen_in;
 					unsigned char *payload_in;
-					int rc;
-					char topicName[16] = { 0 };
-					char *tnStart, *tnEnd;
 					MQTTString receivedTopic;
 
 					if (1
-							!= MQTTDeserialize_publish(&dup, &qos, &retained,
+							== MQTTDeserialize_publish(&dup, &qos, &retained,
 									&msgid, &receivedTopic, &payload_in,
-									&payloadlen_in, buf, buflen)) {
-						if (HAL_GetTick() - startTime > PUB_WAIT_TIMEOUT) {
-							internalState--;
-							break;
+									&payloadlen_in, buf, transporter.len)) {
+						// The payload is in buf, the queue keeps a copy.
+						topic_handler_t handler = getTopicHandler(&receivedTopic);
+						if (handler) {
+							cmd_queue_put(handler, payload_in, payloadlen_in);
+							received++;
 						}
-					} else {
-
-						memcpy(topicName, receivedTopic.lenstring.data,
-								receivedTopic.lenstring.len);
-						int topic = getTopicCode(topicName);
-						switch (topic) {
-						case LEDS_TOPIC: {
-							ledSwitch = getPayLoadValue(payload_in);
-							if (ledMode == 1)
-								HAL_GPIO_WritePin(LED0_GPIO_Port, LED0_Pin,
-										!ledSwitch);
-						}
-							break;
-						case MODE_TOPIC: {
-							ledMode = getPayLoadValue(payload_in);
-						}
-							break;
-
-						default:
-							break;
-						}
-
-						// To the next state.
-						recv_end_flag = 0;
-						internalState--;
-						break;
 					}
-				} else if (result == -1) {
+					// Read on without waiting.
+					continue;
+				} else if (result > 0) {
+					// Not a command, read on.
+					continue;
+				}
+
+				// Nothing complete left: apply what was read.
+				cmd_queue_apply();
+				if (result == -1) {
 					// Start over.
 					internalState = 0;
 					break;
 				}
-				// result !=0 and timeout
-				else if (HAL_GetTick() - startTime > PUB_WAIT_TIMEOUT) {
+				// Commands applied, or timeout with the fifo below the watermark: publish.
+				if (received || (HAL_GetTick() - startTime > PUB_WAIT_TIMEOUT
+						&& fifo_used(&rxFifo) < FIFO_WATERMARK)) {
 					recv_end_flag = 0;
 					internalState--;
 					break;
 				}
-				// result !=0 and not timeout
-				else {
-					// updateDeviceInfo();
-					HAL_Delay(PUB_WAIT_TICK);
-				}
+				// updateDeviceInfo();
+				HAL_Delay(PUB_WAIT_TICK);
 			}
 		}
 			break;
@@ -462,22 +539,93 @@ void MqttHandlerTask() {
 	/* USER CODE END MqttHandlerTask */
 }
 
-int lightSensorLux() {
-	if (HAL_OK == BH1750_Send_Cmd(ONCE_L_MODE)) {
-		if (HAL_OK == BH1750_Read_Dat(dat))
-			return BH1750_Dat_To_Lux(dat);
-		else
-			return -1;
+/*
+ * Command topic handlers, see Inc/topic_table.def.
+ */
+void onLedsTopic(const unsigned char *payload, int payloadlen) {
+	if (payloadlen < 1)
+		return;
+	ledSwitch = getPayLoadValue(payload);
+	if (ledMode == 1)
+		HAL_GPIO_WritePin(LED0_GPIO_Port, LED0_Pin, !ledSwitch);
+}
+
+void onModeTopic(const unsigned char *payload, int payloadlen) {
+	if (payloadlen < 1)
+		return;
+	ledMode = getPayLoadValue(payload);
+}
+
+void onProfTopic(const unsigned char *payload, int payloadlen) {
+#ifdef PROFILER_ENABLE
+	if (payloadlen < 1)
+		return;
+	// 1: dump over uart and mqtt, 0: reset.
+	if (getPayLoadValue(payload) == 1) {
+		prof_print();
+		profDumpRegion = 0;
+	} else {
+		prof_reset();
 	}
+#endif
+}
+
+/*
+ * Called from the uart interrupt when rxFifo fills past FIFO_WATERMARK (or
+ * drops data): get the publish loop to drain it before anything else.
+ */
+static void rxFifoWatermark(struct fifo *fifo) {
+	rxBackpressure = 1;
+}
+
+/*
+ * Starts a one time conversion, done well before the next tick.
+ */
+void lightSensorStart() {
+	PROF_BEGIN(PROF_I2C_READ);
+	luxStarted = (HAL_OK == BH1750_Send_Cmd(ONCE_L_MODE));
+	PROF_END(PROF_I2C_READ);
+}
+
+/*
+ * Reads the conversion lightSensorStart() started, -1 if there is none.
+ */
+int lightSensorLux() {
+	int lux = -1;
+
+	if (!luxStarted)
+		return lux;
+	luxStarted = 0;
+	PROF_BEGIN(PROF_I2C_READ);
+	if (HAL_OK == BH1750_Read_Dat(dat))
+		lux = BH1750_Dat_To_Lux(dat);
+	PROF_END(PROF_I2C_READ);
+	return lux;
 }
 
 void updateDeviceInfo() {
+	int lampOn;
+
 	ledStatus = HAL_GPIO_ReadPin(LED0_GPIO_Port, LED0_Pin);
 	ledStatus = !ledStatus;
-	lightSensorValue = lightSensorLux();
+	// Sample on the ticks the lux is due, see adaptive.h, and filter it, see lux_filter.h.
+	// A failed read keeps the last lux, is counted, and is retried on the next tick.
+	if (adaptive_sampler_tick(&luxSampler)) {
+		int lux = lightSensorLux();
+
+		if (lux >= 0)
+			lightSensorValue = lux_filter_put(&luxFilter, lux);
+		else
+			METRICS_INC(sensor_errors);
+		adaptive_sampler_update(&luxSampler, (lux >= 0) ? lightSensorValue : -1);
+	}
+	if (adaptive_sampler_starting(&luxSampler))
+		lightSensorStart();
+	// The dwell runs in every mode.
+	lampOn = lux_switch_update(&luxSwitch, lightSensorValue);
 	if (ledMode == 2)      // Auto mode
 			{
-		HAL_GPIO_WritePin(LED0_GPIO_Port, LED0_Pin, lightSensorValue >= 50);
+		HAL_GPIO_WritePin(LED0_GPIO_Port, LED0_Pin, !lampOn);
 	} else if (ledMode == 1) {      // Manual mode
 		HAL_GPIO_WritePin(LED0_GPIO_Port, LED0_Pin, !ledSwitch);
 	}
@@ -0,0 +1,174 @@
+/* Includes -----------------------------------------------------------------*/
+#include "metrics.h"
+#include "stdio.h"
+#include "string.h"
+#if defined(__arm__)
+#include <unistd.h>
+#endif
+
+/* Variables -----------------------------------------------------------------*/
+struct metrics metrics;
+
+static uint32_t metrics_now_ms;		///< Time of the last metrics_due() call.
+static uint32_t metrics_last_ms;	///< Time of the last publish round.
+
+#define METRICS_AT_PREFIX(id, prefix, name) prefix,
+static const char *metrics_at_prefixes[] = { METRICS_AT_COMMANDS(METRICS_AT_PREFIX) };
+#undef METRICS_AT_PREFIX
+#define METRICS_AT_NAME(id, prefix, name) name,
+static const char *metrics_at_names[METRICS_AT_MAX] = { METRICS_AT_COMMANDS(METRICS_AT_NAME) "data" };
+#undef METRICS_AT_NAME
+
+#if defined(__arm__)
+#define METRICS_STACK_PAINT 0xA5A5A5A5UL
+extern char _estack;			///< Top of the stack, from the linker script.
+static uint32_t *metrics_paint_bottom;	///< Lowest painted stack word.
+#endif
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+#if defined(__arm__)
+/*
+ * internal helper to paint the free ram between the heap and the stack, the
+ * deepest stack use is found later as the lowest overwritten word.
+ */
+static void metrics_paint_stack(void)
+{
+	register char *sp asm("sp");
+	uint32_t *p = (uint32_t *)(((uintptr_t)sbrk(0) + 3) & ~3UL);
+	uint32_t *top = (uint32_t *)(sp - 64);
+
+	metrics_paint_bottom = p;
+	while (p < top)
+		*p++ = METRICS_STACK_PAINT;
+}
+
+static uint32_t metrics_stack_used(void)
+{
+	uint32_t *p = metrics_paint_bottom;
+	uint32_t *heap = (uint32_t *)(((uintptr_t)sbrk(0) + 3) & ~3UL);
+
+	/* ignore what the heap has taken since the painting */
+	if (p < heap)
+		p = heap;
+	while (p < (uint32_t *)&_estack && *p == METRICS_STACK_PAINT)
+		p++;
+	return (char *)&_estack - (char *)p;
+}
+
+static uint32_t metrics_heap_free(void)
+{
+	register char *sp asm("sp");
+
+	return sp - (char *)sbrk(0);
+}
+#else
+static uint32_t metrics_stack_used(void) { return 0; }
+static uint32_t metrics_heap_free(void) { return 0; }
+#endif
+
+/*
+ * internal helper to get the upper bound (ms) of the given latency percentile
+ */
+static uint32_t metrics_percentile(unsigned int percent)
+{
+	uint32_t total = 0, acc = 0;
+	unsigned int b;
+
+	for (b = 0; b < METRICS_LAT_BUCKETS; b++)
+		total += metrics.pub_latency[b];
+	if (!total)
+		return 0;
+	for (b = 0; b < METRICS_LAT_BUCKETS; b++) {
+		acc += metrics.pub_latency[b];
+		if (acc * 100 >= total * percent)
+			break;
+	}
+	return 2UL << b;
+}
+
+void metrics_init(void)
+{
+	memset(&metrics, 0, sizeof(metrics));
+	metrics_last_ms = 0;
+#if defined(__arm__)
+	metrics_paint_stack();
+#endif
+}
+
+metrics_at_t metrics_at_classify(const char *command)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(metrics_at_prefixes) / sizeof(metrics_at_prefixes[0]); i++) {
+		if (!strncmp(command, metrics_at_prefixes[i], strlen(metrics_at_prefixes[i])))
+			return (metrics_at_t)i;
+	}
+	return METRICS_AT_DATA;
+}
+
+void metrics_publish_latency(uint32_t ms)
+{
+	unsigned int b = (ms < 2) ? 0 : 31 - __builtin_clz(ms);
+
+	metrics.pub_latency[(b < METRICS_LAT_BUCKETS) ? b : METRICS_LAT_BUCKETS - 1]++;
+}
+
+/*
+ * Returns 1 once per METRICS_PERIOD_MS, the caller then publishes all records.
+ */
+int metrics_due(uint32_t now_ms)
+{
+	metrics_now_ms = now_ms;
+	if (!METRICS_PERIOD_MS || (now_ms - metrics_last_ms) < METRICS_PERIOD_MS)
+		return 0;
+	metrics_last_ms = now_ms;
+	return 1;
+}
+
+const char *metrics_topic(metrics_record_t record)
+{
+	return (record == METRICS_RECORD_AT) ? METRICS_TOPIC_AT : METRICS_TOPIC_CORE;
+}
+
+/*
+ * Formats one compact key=value record. Returns the length written.
+ */
+int metrics_format(metrics_record_t record, char *buf, unsigned int len)
+{
+	int n = 0, w;
+	unsigned int i;
+
+	if (!len)
+		return 0;
+	buf[0] = 0;
+	if (record == METRICS_RECORD_CORE) {
+		n = snprintf(buf, len, "up=%lu rc=%lu hw=%lu ov=%lu rs=%lu se=%lu p50=%lu p90=%lu p99=%lu heap=%lu stk=%lu",
+				(unsigned long)(metrics_now_ms / 1000),
+				(unsigned long)(metrics.connects ? metrics.connects - 1 : 0),
+				(unsigned long)metrics.fifo_high_water, (unsigned long)metrics.fifo_overflow,
+				(unsigned long)metrics.rx_resync, (unsigned long)metrics.sensor_errors,
+				(unsigned long)metrics_percentile(50), (unsigned long)metrics_percentile(90),
+				(unsigned long)metrics_percentile(99),
+				(unsigned long)metrics_heap_free(), (unsigned long)metrics_stack_used());
+	} else {
+		/* error/timeout pairs of the commands that had any */
+		for (i = 0; i < METRICS_AT_MAX; i++) {
+			if (!metrics.at_error[i] && !metrics.at_timeout[i])
+				continue;
+			w = snprintf(buf + n, len - n, "%s%s=%lu/%lu", n ? " " : "", metrics_at_names[i],
+					(unsigned long)metrics.at_error[i], (unsigned long)metrics.at_timeout[i]);
+			if (w < 0 || w >= (int)(len - n)) {
+				buf[n] = 0;
+				break;
+			}
+			n += w;
+		}
+		if (!n)
+			n = snprintf(buf, len, "ok");
+	}
+	if (n < 0)
+		return 0;
+	return (n < (int)len) ? n : (int)len - 1;
+}
@@ -0,0 +1,161 @@
+/* Includes -----------------------------------------------------------------*/
+#include "profiler.h"
+#include "stdio.h"
+#include "string.h"
+#if defined(__arm__)
+#include "main.h"
+#else
+#include <time.h>
+#endif
+
+/* Variables -----------------------------------------------------------------*/
+static struct prof_stats prof_stats[PROF_REGION_MAX];
+
+#define PROF_NAME(id, name) name,
+static const char *prof_names[PROF_REGION_MAX] = { PROF_REGIONS(PROF_NAME) };
+#undef PROF_NAME
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+/*
+ * internal helper to map a duration to its log2 histogram bucket
+ */
+static __inline unsigned int prof_bucket(uint32_t ticks)
+{
+	unsigned int b;
+
+	if (ticks < 2)
+		return 0;
+	b = 31 - __builtin_clz(ticks);
+	return (b < PROF_HIST_BUCKETS) ? b : PROF_HIST_BUCKETS - 1;
+}
+
+/*
+ * internal helper to copy the stats of a region, with interrupts off on
+ * target as the TIM2 interrupt times regions too (PROF_I2C_READ)
+ */
+static void prof_snapshot(prof_region_t region, struct prof_stats *out)
+{
+#if defined(__arm__)
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	*out = prof_stats[region];
+	__set_PRIMASK(primask);
+#else
+	*out = prof_stats[region];
+#endif
+}
+
+/*
+ * internal helper to format a copy of the stats of a region
+ */
+static int prof_format_stats(prof_region_t region, const struct prof_stats *s, char *buf, unsigned int len)
+{
+	unsigned long mean = s->count ? (unsigned long)(s->sum / s->count) : 0;
+	int n;
+
+	n = snprintf(buf, len, "%s n=%lu min=%lu avg=%lu max=%lu", prof_names[region],
+			(unsigned long)s->count, s->count ? (unsigned long)s->min : 0UL,
+			mean, (unsigned long)s->max);
+	if (n < 0)
+		return 0;
+	return (n < (int)len) ? n : (int)len - 1;
+}
+
+void prof_reset(void)
+{
+	unsigned int i;
+
+	memset(prof_stats, 0, sizeof(prof_stats));
+	for (i = 0; i < PROF_REGION_MAX; i++)
+		prof_stats[i].min = 0xFFFFFFFFUL;
+}
+
+/*
+ * On target the DWT cycle counter is used (1 tick = 1 cpu cycle), on host
+ * builds CLOCK_MONOTONIC (1 tick = 1 ns).
+ */
+void prof_init(void)
+{
+#if defined(__arm__)
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+	prof_reset();
+}
+
+uint32_t prof_now(void)
+{
+#if defined(__arm__)
+	return DWT->CYCCNT;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+#endif
+}
+
+void prof_begin(prof_region_t region)
+{
+	prof_stats[region].start = prof_now();
+}
+
+void prof_end(prof_region_t region)
+{
+	struct prof_stats *s = &prof_stats[region];
+	uint32_t ticks = prof_now() - s->start;	/* wraps correctly */
+
+	s->count++;
+	s->sum += ticks;
+	if (ticks < s->min)
+		s->min = ticks;
+	if (ticks > s->max)
+		s->max = ticks;
+	s->hist[prof_bucket(ticks)]++;
+}
+
+const struct prof_stats *prof_get(prof_region_t region)
+{
+	return &prof_stats[region];
+}
+
+const char *prof_name(prof_region_t region)
+{
+	return prof_names[region];
+}
+
+/*
+ * Formats the summary of one region as a single line, short enough for one
+ * MQTT publish. Returns the length written.
+ */
+int prof_format(prof_region_t region, char *buf, unsigned int len)
+{
+	struct prof_stats s;
+
+	prof_snapshot(region, &s);
+	return prof_format_stats(region, &s, buf, len);
+}
+
+/*
+ * Dumps all regions with their histograms over the debug uart (printf).
+ */
+void prof_print(void)
+{
+	struct prof_stats s;
+	char line[80];
+	unsigned int i, b;
+
+	for (i = 0; i < PROF_REGION_MAX; i++) {
+		prof_snapshot(i, &s);
+		prof_format_stats(i, &s, line, sizeof(line));
+		printf("%s\r\n", line);
+		for (b = 0; b < PROF_HIST_BUCKETS; b++) {
+			if (s.hist[b])
+				printf("  >=%lu: %lu\r\n", 1UL << b, (unsigned long)s.hist[b]);
+		}
+	}
+}
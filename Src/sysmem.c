@@ -49,6 +49,9 @@
 /* Includes */
 #include <errno.h>
 #include <stdio.h>
+#ifdef STATIC_MEMORY
+#include "mem_config.h"
+#endif
 
 /* Variables */
 extern int errno;
@@ -70,7 +73,12 @@ caddr_t _sbrk(int incr)
 		heap_end = &end;
 
 	prev_heap_end = heap_end;
-	if (heap_end + incr > stack_ptr)
+	if (heap_end + incr > stack_ptr
+#ifdef STATIC_MEMORY
+		/* no data path buffers on the heap: keep it inside its budget */
+		|| heap_end + incr > &end + MEM_HEAP_RESERVE
+#endif
+		)
 	{
 		errno = ENOMEM;
 		return (caddr_t) -1;
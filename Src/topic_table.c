@@ -0,0 +1,80 @@
+/*
+ * Generated by tools/gen_topic_table.py from Inc/topic_table.def, do not edit.
+ */
+#include "topic_name_helper.h"
+#include <string.h>
+
+#define TOPIC_HASH_SIZE 4
+#define TOPIC_HASH_MUL  3u
+#define TOPIC_HASH_SEED 0u
+
+struct topic_entry {
+	const char *name;
+	unsigned char len;
+	unsigned char code;
+	topic_handler_t handler;
+};
+
+static const struct topic_entry topic_table[TOPIC_HASH_SIZE] = {
+	[0] = { "leds", 4, LEDS_TOPIC, onLedsTopic },
+	[1] = { "prof", 4, PROF_TOPIC, onProfTopic },
+	[3] = { "mode", 4, MODE_TOPIC, onModeTopic }
+};
+
+static unsigned int topic_hash(const unsigned char *name, int len)
+{
+	unsigned int h = TOPIC_HASH_SEED;
+
+	while (len-- > 0)
+		h = h * TOPIC_HASH_MUL + *name++;
+	return h & (TOPIC_HASH_SIZE - 1);
+}
+
+/*
+ * Looks up the topic of a received PUBLISH in place (no copy, no NUL needed).
+ * Returns the table entry or NULL.
+ */
+static const struct topic_entry *topic_lookup(const MQTTString *topic)
+{
+	const struct topic_entry *e;
+	const unsigned char *name;
+	int len;
+
+	if (topic->cstring) {
+		name = (const unsigned char *)topic->cstring;
+		len = strlen(topic->cstring);
+	} else {
+		name = (const unsigned char *)topic->lenstring.data;
+		len = topic->lenstring.len;
+	}
+	if (len <= 0)
+		return NULL;
+	e = &topic_table[topic_hash(name, len)];
+	if (e->len != len || memcmp(e->name, name, len))
+		return NULL;
+	return e;
+}
+
+int getTopicCode(const MQTTString *topic)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	return e ? e->code : TOPIC_UNKNOWN;
+}
+
+topic_handler_t getTopicHandler(const MQTTString *topic)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	return e ? e->handler : NULL;
+}
+
+int topic_dispatch(const MQTTString *topic, const unsigned char *payload, int payloadlen)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	if (!e)
+		return TOPIC_UNKNOWN;
+	e->handler(payload, payloadlen);
+	return e->code;
+}
@@ -0,0 +1,115 @@
+/* Includes -----------------------------------------------------------------*/
+#include "uart_capture.h"
+
+#ifdef UART_CAPTURE_ENABLE
+#include "main.h"
+#include "usart.h"
+#include "fifo.h"
+#include "string.h"
+
+/* Variables -----------------------------------------------------------------*/
+static unsigned char captureBuffer[MEM_CAPTURE_SIZE] MEM_SECTION("capture");
+static struct fifo captureFifo;
+static unsigned int captureSending;	///< Bytes of the USART1 DMA transfer in progress, 0 when idle.
+static uint16_t captureDropped;		///< Records dropped since the last LOST record.
+
+/* Private functions ---------------------------------------------------------*/
+/******************************************************************************/
+
+/*
+ * internal helper to get the time in us, from the HAL tick and the SysTick
+ * counter (counting down from LOAD within each ms)
+ */
+static uint32_t uart_capture_now_us(void)
+{
+	uint32_t ms = HAL_GetTick();
+	uint32_t load = SysTick->LOAD + 1;
+	uint32_t val = SysTick->VAL;
+
+	/* wrapped, the tick interrupt has not run yet */
+	if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) && val > load / 2)
+		ms++;
+	return ms * 1000 + (load - 1 - val) * 1000 / load;
+}
+
+/*
+ * internal helper to start sending the contiguous part of the ring, with
+ * interrupts disabled
+ */
+static void uart_capture_kick(void)
+{
+	unsigned int used = fifo_used(&captureFifo);
+	unsigned int off = captureFifo.out & captureFifo.mask;
+
+	if (captureSending || !used || huart1.gState != HAL_UART_STATE_READY)
+		return;
+	captureSending = min(used, captureFifo.mask + 1 - off);
+	if (HAL_UART_Transmit_DMA(&huart1, captureFifo.data + off, captureSending) != HAL_OK)
+		captureSending = 0;	/* tried again at the next record */
+}
+
+/*
+ * internal helper to write one record, the caller checked the room
+ */
+static void uart_capture_put(uint8_t type, uint32_t time, const void *data, uint16_t len)
+{
+	unsigned char header[UART_CAPTURE_HEADER];
+
+	header[0] = type;
+	header[1] = time;
+	header[2] = time >> 8;
+	header[3] = time >> 16;
+	header[4] = time >> 24;
+	header[5] = len;
+	header[6] = len >> 8;
+	fifo_in(&captureFifo, header, sizeof(header));
+	fifo_in(&captureFifo, (unsigned char *)data, len);
+}
+
+void uart_capture_init(void)
+{
+	fifo_init(&captureFifo, captureBuffer, MEM_CAPTURE_SIZE);
+	captureSending = 0;
+	captureDropped = 0;
+	fifo_in(&captureFifo, (unsigned char *)UART_CAPTURE_MAGIC, UART_CAPTURE_MAGIC_SIZE);
+	uart_capture_kick();
+}
+
+/*
+ * Called from the USART2 idle-line interrupt for received chunks and from
+ * the main loop for sent data: the ring is written with interrupts off.
+ */
+void uart_capture_record(uint8_t type, const void *data, uint16_t len)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t time = uart_capture_now_us();
+	unsigned int room, lost;
+
+	__disable_irq();
+	room = (captureFifo.mask + 1) - fifo_used(&captureFifo);
+	lost = captureDropped ? UART_CAPTURE_HEADER + 2 : 0;
+	if (room < lost + UART_CAPTURE_HEADER + len) {
+		if (captureDropped < 0xFFFF)
+			captureDropped++;
+	} else {
+		if (lost) {
+			unsigned char count[2] = { captureDropped, captureDropped >> 8 };
+
+			uart_capture_put(UART_CAPTURE_LOST, time, count, sizeof(count));
+			captureDropped = 0;
+		}
+		uart_capture_put(type, time, data, len);
+		uart_capture_kick();
+	}
+	__set_PRIMASK(primask);
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if (huart == &huart1 && captureSending) {
+		captureFifo.out += captureSending;
+		captureSending = 0;
+		uart_capture_kick();
+	}
+}
+#endif
@@ -0,0 +1,31 @@
+/*******************************************************************************
+ * Timing helpers shared by the host micro-benchmarks.
+ *******************************************************************************/
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Prints one result line: ops per second and nanoseconds per op.
+ */
+static inline void bench_report(const char* name, uint64_t ops, uint64_t ns)
+{
+	printf("%-40s %12.0f ops/s %9.1f ns/op\n", name, ops * 1e9 / ns, (double)ns / ops);
+}
+
+/* Keeps results alive so the measured code is not optimized away. */
+static volatile unsigned bench_sink;
+
+#endif /* BENCH_H_ */
@@ -0,0 +1,267 @@
+/*******************************************************************************
+ * Broker scaling benchmark: the same load on 1, 2, 4 ... shards.
+ *
+ * The broker runs in-process. Load generator threads, as many as there are
+ * shards, drive device connections over loopback TCP: each device publishes
+ * QoS 1 to site<s>/dev<n>/light with a window of publishes outstanding, and
+ * one subscriber per site takes site<s>/#, so every PUBLISH crosses to the
+ * shard of its site's subscriber as often as not. Per shard count, the
+ * publishes acknowledged and delivered per second are reported, with the
+ * scaling against one shard.
+ *
+ * Shards are pinned to the first CPUs and the load generators to the next
+ * ones, so a full run wants twice as many CPUs as the largest shard count.
+ *
+ * usage: broker_bench [max shards] [devices] [window] [seconds] [uring|epoll]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "MQTTPacket.h"
+#include "../broker/broker.h"
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SITES 8
+
+struct device
+{
+	int id;	/* SITES and up are devices, below are the subscribers of the sites */
+	struct loadgen* g;
+};
+
+struct loadgen
+{
+	pthread_t thread;
+	struct netio* io;
+	struct device* devices;
+	int count;
+	int cpu;
+	unsigned long acks, deliveries;
+};
+
+static struct
+{
+	int devices, window;
+	double seconds;
+	enum netio_backend backend;
+	struct sockaddr_in addr;
+	int stop;
+} cfg = { 2000, 4, 2.0, NETIO_URING };
+
+
+static int frame_length(const unsigned char* buf, int len)
+{
+	int rem_len, rc;
+
+	if (len < 2)
+		return 0;
+	if ((rc = MQTTPacket_decodeRange(buf + 1, buf + len, &rem_len)) <= 0)
+		return rc;
+	return 1 + rc + rem_len;
+}
+
+
+static int send_publishes(struct device* d, struct netio_conn* c, int count)
+{
+	MQTTString topic = MQTTString_initializer;
+	char name[48];
+	int i;
+
+	topic.lenstring.data = name;
+	topic.lenstring.len = sprintf(name, "site%d/dev%d/light", d->id % SITES, d->id);
+	for (i = 0; i < count; ++i)
+	{
+		int len = MQTTPacket_len(2 + topic.lenstring.len + 2 + 3);
+		unsigned char* p = netio_reserve(d->g->io, c, len);
+
+		if (!p)
+			return -1;
+		netio_commit(c, MQTTSerialize_publish(p, len, 0, 1, 0, 1, topic, (unsigned char*)"417", 3));
+	}
+	return 0;
+}
+
+
+static int on_connect(struct netio_conn* c)
+{
+	struct device* d = c->user;
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	char id[24];
+	unsigned char* p = netio_reserve(d->g->io, c, 64);
+
+	if (!p)
+		return -1;
+	snprintf(id, sizeof(id), "bench-%d", d->id);
+	data.clientID.cstring = id;
+	data.keepAliveInterval = 60;
+	netio_commit(c, MQTTSerialize_connect(p, 64, &data));
+	return 0;
+}
+
+
+static int on_data(struct netio_conn* c, unsigned char* data, int len)
+{
+	struct device* d = c->user;
+	int off = 0, flen;
+
+	while ((flen = frame_length(data + off, len - off)) > 0 && flen <= len - off)
+	{
+		unsigned char type = data[off] >> 4;
+
+		if (type == CONNACK && d->id < SITES)
+		{
+			MQTTString filter = MQTTString_initializer;
+			unsigned char* p = netio_reserve(d->g->io, c, 32);
+			char name[16];
+			int qos = 0;
+
+			if (!p)
+				return -1;
+			filter.cstring = name;
+			sprintf(name, "site%d/#", d->id);
+			netio_commit(c, MQTTSerialize_subscribe(p, 32, 0, 1, 1, &filter, &qos));
+		}
+		else if (type == CONNACK && send_publishes(d, c, cfg.window) < 0)
+			return -1;
+		else if (type == PUBACK)
+		{
+			d->g->acks++;
+			if (!__atomic_load_n(&cfg.stop, __ATOMIC_RELAXED) && send_publishes(d, c, 1) < 0)
+				return -1;
+		}
+		else if (type == PUBLISH)
+			d->g->deliveries++;
+		off += flen;
+	}
+	return (flen < 0) ? -1 : off;
+}
+
+
+static const struct netio_handler handler = { NULL, on_connect, on_data, NULL };
+
+
+static void* loadgen_run(void* arg)
+{
+	struct loadgen* g = arg;
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(g->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	while (!__atomic_load_n(&cfg.stop, __ATOMIC_RELAXED))
+		netio_run(g->io, 10);
+	return NULL;
+}
+
+
+static unsigned long total(struct loadgen* g, int n, int deliveries)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		sum += __atomic_load_n(deliveries ? &g[i].deliveries : &g[i].acks, __ATOMIC_RELAXED);
+	return sum;
+}
+
+
+/**
+ * @return publishes acknowledged per second, 0 on error
+ */
+static double run(int shards)
+{
+	struct broker_config bc = { 0, shards, cfg.backend, NULL, NULL, 0, SHARE_LEAST_LOADED, 0 };
+	struct loadgen* g = calloc(shards, sizeof(*g));
+	struct device* devices = calloc(cfg.devices + SITES, sizeof(*devices));
+	unsigned long acks, deliveries;
+	struct broker_stats st;
+	struct broker* b;
+	uint64_t start, ns;
+	int i, ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (!g || !devices || !(b = broker_start(&bc)))
+		return 0;
+	cfg.addr.sin_family = AF_INET;
+	cfg.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	cfg.addr.sin_port = htons(broker_port(b));
+	cfg.stop = 0;
+	for (i = 0; i < shards; ++i)
+		if (!(g[i].io = netio_create(cfg.backend, &handler, 0)))
+			return 0;
+	/* the subscribers first, then the devices round the load generators */
+	for (i = 0; i < cfg.devices + SITES; ++i)
+	{
+		struct loadgen* lg = &g[i % shards];
+
+		devices[i].id = i;
+		devices[i].g = lg;
+		if (!netio_connect(lg->io, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr), &devices[i]))
+			return 0;
+	}
+	for (i = 0; i < shards; ++i)
+	{
+		g[i].cpu = (shards + i) % ncpu;
+		pthread_create(&g[i].thread, NULL, loadgen_run, &g[i]);
+	}
+
+	usleep(500000);	/* connected and going */
+	acks = total(g, shards, 0);
+	deliveries = total(g, shards, 1);
+	start = bench_now_ns();
+	usleep((useconds_t)(cfg.seconds * 1e6));
+	ns = bench_now_ns() - start;
+	acks = total(g, shards, 0) - acks;
+	deliveries = total(g, shards, 1) - deliveries;
+	broker_stats(b, &st);
+
+	__atomic_store_n(&cfg.stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < shards; ++i)
+	{
+		pthread_join(g[i].thread, NULL);
+		netio_destroy(g[i].io);
+	}
+	broker_stop(b);
+	printf("%2d shards: %10.0f publishes/s %10.0f deliveries/s  (%lu clients moved, %lu dropped)",
+			shards, acks * 1e9 / ns, deliveries * 1e9 / ns, st.handovers, st.dropped);
+	free(g);
+	free(devices);
+	return acks * 1e9 / ns;
+}
+
+
+int main(int argc, char** argv)
+{
+	int ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int max = (argc > 1) ? atoi(argv[1]) : (ncpu / 2 > 1 ? ncpu / 2 : 2);
+	double base = 0, rate;
+	int shards;
+
+	if (argc > 2)
+		cfg.devices = atoi(argv[2]);
+	if (argc > 3)
+		cfg.window = atoi(argv[3]);
+	if (argc > 4)
+		cfg.seconds = atof(argv[4]);
+	if (argc > 5 && strcmp(argv[5], "epoll") == 0)
+		cfg.backend = NETIO_EPOLL;
+	printf("%d devices x %d publishes outstanding, %d site subscribers, %d CPUs\n", cfg.devices, cfg.window, SITES, ncpu);
+	if (2 * max > ncpu)
+		printf("fewer CPUs than shards and load generators: the scaling below is not the broker's\n");
+	for (shards = 1; shards <= max; shards *= 2)
+	{
+		if ((rate = run(shards)) == 0)
+			return 1;
+		if (shards == 1)
+			base = rate;
+		printf("  x%.2f, %3.0f%% of linear\n", rate / base, 100 * rate / (base * shards));
+	}
+	return 0;
+}
@@ -0,0 +1,315 @@
+/*******************************************************************************
+ * Multi-threaded deserialization benchmark.
+ *
+ * One read-only stream of the packets a broker and a client receive
+ * (PUBLISH at QoS 0-2, acks, CONNECT/CONNACK, SUBSCRIBE/SUBACK,
+ * UNSUBSCRIBE/UNSUBACK) is decoded with the MQTTDeserialize_* functions by
+ * 1, 2, 4, ... threads at once, each thread making the same number of
+ * passes. Every pass folds the decoded fields into a checksum that must match
+ * a single threaded run, so shared state in the decoders would show up as a
+ * failure. Per thread throughput should stay flat as threads are added, up
+ * to the number of cores.
+ *
+ * usage: decode_bench [max threads] [passes]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STREAM_SIZE (256 * 1024)
+
+struct stream
+{
+	unsigned char* data;
+	int len;
+	int* offsets;	/* offsets[i] .. offsets[i + 1] is packet i */
+	int count;
+};
+
+struct worker
+{
+	pthread_t thread;
+	struct stream* s;
+	pthread_barrier_t* start;
+	int passes;
+	unsigned long expect;
+	int failed;
+	uint64_t ns;
+} __attribute__((aligned(64)));
+
+static uint64_t rng = 88172645463325252ull;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+static void random_topic(char* topic, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+		topic[i] = (i % 8 == 7) ? '/' : 'a' + rnd(26);
+	topic[len] = '\0';
+}
+
+
+static int build_one(unsigned char* p, int buflen)
+{
+	static unsigned char payload[512];
+	char topic[64];
+	MQTTString topicString = MQTTString_initializer;
+	int kind = rnd(20);
+
+	random_topic(topic, 4 + rnd(40));
+	topicString.cstring = topic;
+	if (kind < 10)
+		return MQTTSerialize_publish(p, buflen, 0, rnd(3), rnd(2), 1 + rnd(65535), topicString, payload,
+				(rnd(10) == 0) ? rnd(sizeof(payload)) : rnd(16));
+	if (kind < 14)
+		return MQTTSerialize_ack(p, buflen, PUBACK + rnd(4), 0, 1 + rnd(65535));
+	if (kind == 14)
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+		data.clientID = topicString;
+		data.keepAliveInterval = 60;
+		return MQTTSerialize_connect(p, buflen, &data);
+	}
+	if (kind == 15)
+		return MQTTSerialize_connack(p, buflen, 0, 0);
+	if (kind == 16)
+	{
+		int qos = rnd(3);
+
+		return MQTTSerialize_subscribe(p, buflen, 0, 1 + rnd(65535), 1, &topicString, &qos);
+	}
+	if (kind == 17)
+	{
+		int qos[2] = { rnd(3), 0x80 };
+
+		return MQTTSerialize_suback(p, buflen, 1 + rnd(65535), 2, qos);
+	}
+	if (kind == 18)
+		return MQTTSerialize_unsubscribe(p, buflen, 0, 1 + rnd(65535), 1, &topicString);
+	return MQTTSerialize_unsuback(p, buflen, 1 + rnd(65535));
+}
+
+
+static void build(struct stream* s)
+{
+	int cap = 1024;
+
+	s->data = malloc(STREAM_SIZE + 1024);
+	s->offsets = malloc((cap + 1) * sizeof(int));
+	s->len = s->count = 0;
+	while (s->len < STREAM_SIZE)
+	{
+		if (s->count == cap)
+			s->offsets = realloc(s->offsets, ((cap *= 2) + 1) * sizeof(int));
+		s->offsets[s->count++] = s->len;
+		s->len += build_one(s->data + s->len, 1024);
+	}
+	s->offsets[s->count] = s->len;
+}
+
+
+/**
+ * Decodes one packet.
+ * @return a checksum of the decoded fields, 0 if the decoder failed
+ */
+static unsigned long decode(unsigned char* buf, int len)
+{
+	unsigned short packetid = 0;
+	unsigned char dup, type;
+	int count;
+
+	switch (buf[0] >> 4)
+	{
+	case PUBLISH:
+	{
+		unsigned char retained;
+		int qos, payloadlen;
+		unsigned char* payload;
+		MQTTString topic;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload, &payloadlen, buf, len) != 1)
+			return 0;
+		return 1 + qos + packetid + topic.lenstring.len * 7 + (unsigned long)(payload - buf) + payloadlen;
+	}
+	case PUBACK:
+	case PUBREC:
+	case PUBREL:
+	case PUBCOMP:
+		if (MQTTDeserialize_ack(&type, &dup, &packetid, buf, len) != 1)
+			return 0;
+		return 1 + type + packetid;
+	case CONNECT:
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+		if (MQTTDeserialize_connect(&data, buf, len) != 1)
+			return 0;
+		return 1 + data.clientID.lenstring.len + data.keepAliveInterval + data.MQTTVersion;
+	}
+	case CONNACK:
+	{
+		unsigned char sessionPresent, rc;
+
+		if (MQTTDeserialize_connack(&sessionPresent, &rc, buf, len) != 1)
+			return 0;
+		return 2 + sessionPresent + rc;
+	}
+	case SUBSCRIBE:
+	{
+		MQTTString filters[4];
+		int qos[4];
+
+		if (MQTTDeserialize_subscribe(&dup, &packetid, 4, &count, filters, qos, buf, len) != 1)
+			return 0;
+		return 1 + packetid + count + filters[0].lenstring.len + qos[0];
+	}
+	case SUBACK:
+	{
+		int granted[4];
+
+		if (MQTTDeserialize_suback(&packetid, 4, &count, granted, buf, len) != 1)
+			return 0;
+		return 1 + packetid + count + granted[0] + granted[count - 1];
+	}
+	case UNSUBSCRIBE:
+	{
+		MQTTString filters[4];
+
+		if (MQTTDeserialize_unsubscribe(&dup, &packetid, 4, &count, filters, buf, len) != 1)
+			return 0;
+		return 1 + packetid + count + filters[0].lenstring.len;
+	}
+	case UNSUBACK:
+		if (MQTTDeserialize_unsuback(&packetid, buf, len) != 1)
+			return 0;
+		return 1 + packetid;
+	}
+	return 0;
+}
+
+
+/**
+ * @return the checksum of one pass, 0 if any packet failed to decode
+ */
+static unsigned long decode_pass(struct stream* s)
+{
+	unsigned long sum = 0;
+	int i;
+
+	for (i = 0; i < s->count; ++i)
+	{
+		unsigned long c = decode(s->data + s->offsets[i], s->offsets[i + 1] - s->offsets[i]);
+
+		if (c == 0)
+			return 0;
+		sum = sum * 31 + c;
+	}
+	return sum;
+}
+
+
+static void* run_worker(void* arg)
+{
+	struct worker* w = arg;
+	uint64_t start;
+	int n;
+
+	pthread_barrier_wait(w->start);
+	start = bench_now_ns();
+	for (n = 0; n < w->passes; ++n)
+		if (decode_pass(w->s) != w->expect)
+			w->failed++;
+	w->ns = bench_now_ns() - start;
+	return NULL;
+}
+
+
+/**
+ * Runs threads workers at once.
+ * @return the wall time of the slowest, 0 if a checksum differed
+ */
+static uint64_t run(struct stream* s, int threads, int passes, unsigned long expect)
+{
+	struct worker* workers;
+	pthread_barrier_t start;
+	uint64_t ns = 0;
+	int i, failed = 0;
+
+	if (posix_memalign((void**)&workers, 64, threads * sizeof(*workers)) != 0)
+		return 0;
+	memset(workers, 0, threads * sizeof(*workers));
+	pthread_barrier_init(&start, NULL, threads);
+	for (i = 0; i < threads; ++i)
+	{
+		workers[i].s = s;
+		workers[i].start = &start;
+		workers[i].passes = passes;
+		workers[i].expect = expect;
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	}
+	for (i = 0; i < threads; ++i)
+	{
+		pthread_join(workers[i].thread, NULL);
+		failed += workers[i].failed;
+		if (workers[i].ns > ns)
+			ns = workers[i].ns;
+	}
+	pthread_barrier_destroy(&start);
+	free(workers);
+	return failed ? 0 : ns;
+}
+
+
+int main(int argc, char** argv)
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max = (argc > 1) ? atoi(argv[1]) : (int)cores;
+	int passes = (argc > 2) ? atoi(argv[2]) : 200;
+	struct stream s;
+	unsigned long expect;
+	double base = 0;
+	int threads;
+
+	build(&s);
+	if ((expect = decode_pass(&s)) == 0)
+	{
+		fprintf(stderr, "a packet of the stream did not decode\n");
+		return 1;
+	}
+	printf("%d packets, %d bytes, %ld cores\n", s.count, s.len, cores);
+	for (threads = 1; threads <= max; threads = (threads * 2 > max && threads < max) ? max : threads * 2)
+	{
+		uint64_t ns = run(&s, threads, passes, expect);
+		double rate;
+
+		if (ns == 0)
+		{
+			fprintf(stderr, "%d threads: checksums differ from the single threaded pass\n", threads);
+			return 1;
+		}
+		rate = (double)s.count * passes * threads * 1e9 / ns;
+		if (threads == 1)
+			base = rate;
+		printf("%3d threads %12.0f packets/s %10.0f per thread %6.1f%% of linear\n",
+				threads, rate, rate / threads, 100.0 * rate / (base * threads));
+	}
+	free(s.data);
+	free(s.offsets);
+	return 0;
+}
@@ -0,0 +1,258 @@
+/*******************************************************************************
+ * Auto mode switching at dusk.
+ *
+ * Dusks of random length and depth, daylight falling geometrically to the
+ * dark, go through what updateDeviceInfo() does on every TIM2 tick (0.5 s):
+ * the sampler of Src/adaptive.c picks the ticks the BH1750 is read on, the
+ * reading is the lux of the tick its conversion started with Gaussian noise
+ * of the given percentage, and now and then a spike (headlights), rounded as
+ * the sensor does, and the switch of Src/lux_filter.c turns the lamp on. All
+ * configurations see the same readings:
+ *
+ *   raw, every tick   the reading against 50 lx on every tick, as before
+ *   raw               the same on the ticks the sampler picks
+ *   filtered          the median/EMA output of lux_filter_put() instead
+ *   hysteresis        with the LUX_HYSTERESIS band around 50 lx
+ *   dwell             and the minimum on and off time, as the firmware
+ *
+ * Reported per configuration: lamp switches per dusk (1 is ideal), the
+ * dusks it chattered in (more than one), sensor reads per dusk, and how long
+ * after the noiseless lux crossed 50 lx the last switch came. Then the CPU
+ * time of the filter and of the switch per call, against the bare compare.
+ *
+ * usage: lux_bench [dusks] [noise %] [spikes per hour]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "adaptive.h"
+#include "lux_filter.h"
+#include "bench.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TICK_S 0.5	/* TIM2 */
+#define NIGHT_S 600	/* after the dusk, for late switches */
+#define LUX_NIGHT 0.5
+#define BH1750_LUX_SCALE 1.2
+#define CPU_SAMPLES (1 << 20)
+
+struct config
+{
+	const char* name;
+	int every_tick;
+	int filter;
+	int low, high;
+	unsigned min_on, min_off;
+};
+
+struct result
+{
+	unsigned long switches, reads, chattered;
+	unsigned max_switches;
+	double lag_total, lag_min, lag_max;
+};
+
+static const struct config configs[] = {
+	{ "raw, every tick", 1, 0, ADAPTIVE_LUX_THRESHOLD, ADAPTIVE_LUX_THRESHOLD, 0, 0 },
+	{ "raw", 0, 0, ADAPTIVE_LUX_THRESHOLD, ADAPTIVE_LUX_THRESHOLD, 0, 0 },
+	{ "filtered", 0, 1, ADAPTIVE_LUX_THRESHOLD, ADAPTIVE_LUX_THRESHOLD, 0, 0 },
+	{ "filtered, hysteresis", 0, 1, ADAPTIVE_LUX_THRESHOLD - LUX_HYSTERESIS,
+			ADAPTIVE_LUX_THRESHOLD + LUX_HYSTERESIS, 0, 0 },
+	{ "filtered, hysteresis, dwell", 0, 1, ADAPTIVE_LUX_THRESHOLD - LUX_HYSTERESIS,
+			ADAPTIVE_LUX_THRESHOLD + LUX_HYSTERESIS, LUX_MIN_ON_TICKS, LUX_MIN_OFF_TICKS },
+};
+
+#define CONFIGS (int)(sizeof(configs) / sizeof(configs[0]))
+
+static uint64_t rng = 88172645463325252ull;
+
+static double uniform(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double gauss(void)
+{
+	double u = uniform();
+
+	return sqrt(-2 * log(u > 0 ? u : 1e-300)) * cos(2 * M_PI * uniform());
+}
+
+
+/* what BH1750_Dat_To_Lux() gives for a lux */
+static int bh1750(double lux)
+{
+	long raw = lround(lux * BH1750_LUX_SCALE);
+
+	if (raw < 0)
+		raw = 0;
+	if (raw > 65535)
+		raw = 65535;
+	return (int)(raw / BH1750_LUX_SCALE);
+}
+
+
+/**
+ * Fills readings with a dusk, one per tick.
+ * @return its ticks, and the tick the noiseless lux goes below 50 lx
+ */
+static int dusk(int* readings, int size, double noise, double spikes, double* crossing)
+{
+	double length = 600 + uniform() * 3000, day = 300 + uniform() * 2700;
+	int ticks = (int)((length + NIGHT_S) / TICK_S), k;
+
+	if (ticks > size)
+		ticks = size;
+	for (k = 0; k < ticks; ++k)
+	{
+		double t = k * TICK_S, lux = (t < length) ? day * pow(LUX_NIGHT / day, t / length) : LUX_NIGHT;
+
+		lux *= 1 + noise * gauss();
+		if (uniform() < spikes * TICK_S / 3600)
+			lux += 100 + uniform() * 400;
+		readings[k] = bh1750(lux);
+	}
+	*crossing = length * log(day / ADAPTIVE_LUX_THRESHOLD) / log(day / LUX_NIGHT);
+	return ticks;
+}
+
+
+/* updateDeviceInfo() over a dusk */
+static void run(const struct config* c, const int* readings, int ticks, double crossing, struct result* r)
+{
+	struct adaptive_sampler sampler;
+	struct lux_filter filter;
+	struct lux_switch sw;
+	int value = -1, started = -1, on = 0, k;
+	unsigned switches = 0;
+	double last = 0, lag;
+
+	adaptive_sampler_init(&sampler);
+	lux_filter_init(&filter);
+	lux_switch_init(&sw, c->low, c->high, c->min_on, c->min_off);
+	for (k = 0; k < ticks; ++k)
+	{
+		if (c->every_tick || adaptive_sampler_tick(&sampler))
+		{
+			if (c->every_tick)	/* read right after the command: the last tick's */
+				value = k ? readings[k - 1] : -1;
+			else
+				value = (started >= 0) ? readings[started] : -1;
+			started = -1;
+			r->reads++;
+			if (value >= 0 && c->filter)
+				value = lux_filter_put(&filter, value);
+			adaptive_sampler_update(&sampler, value);
+		}
+		if (adaptive_sampler_starting(&sampler))
+			started = k;
+		if (lux_switch_update(&sw, value) != on)
+		{
+			on = !on;
+			switches++;
+			last = k * TICK_S;
+		}
+	}
+	r->switches += switches;
+	if (switches > r->max_switches)
+		r->max_switches = switches;
+	if (switches > 1)
+		r->chattered++;
+	lag = last - crossing;
+	r->lag_total += lag;
+	if (lag < r->lag_min)
+		r->lag_min = lag;
+	if (lag > r->lag_max)
+		r->lag_max = lag;
+}
+
+
+static void cpu_cost(const int* readings)
+{
+	struct lux_filter filter;
+	struct lux_switch sw;
+	unsigned on = 0;
+	uint64_t start;
+	int k;
+
+	start = bench_now_ns();
+	for (k = 0; k < CPU_SAMPLES; ++k)
+		on += readings[k] < ADAPTIVE_LUX_THRESHOLD;
+	bench_report("compare, as before", CPU_SAMPLES, bench_now_ns() - start);
+	bench_sink = on;
+
+	lux_filter_init(&filter);
+	start = bench_now_ns();
+	for (k = 0; k < CPU_SAMPLES; ++k)
+		on += lux_filter_put(&filter, readings[k]);
+	bench_report("lux_filter_put", CPU_SAMPLES, bench_now_ns() - start);
+	bench_sink = on;
+
+	lux_switch_init(&sw, ADAPTIVE_LUX_THRESHOLD - LUX_HYSTERESIS, ADAPTIVE_LUX_THRESHOLD + LUX_HYSTERESIS,
+			LUX_MIN_ON_TICKS, LUX_MIN_OFF_TICKS);
+	start = bench_now_ns();
+	for (k = 0; k < CPU_SAMPLES; ++k)
+		on += lux_switch_update(&sw, readings[k]);
+	bench_report("lux_switch_update", CPU_SAMPLES, bench_now_ns() - start);
+	bench_sink = on;
+
+	lux_filter_init(&filter);
+	lux_switch_init(&sw, ADAPTIVE_LUX_THRESHOLD - LUX_HYSTERESIS, ADAPTIVE_LUX_THRESHOLD + LUX_HYSTERESIS,
+			LUX_MIN_ON_TICKS, LUX_MIN_OFF_TICKS);
+	start = bench_now_ns();
+	for (k = 0; k < CPU_SAMPLES; ++k)
+		on += lux_switch_update(&sw, lux_filter_put(&filter, readings[k]));
+	bench_report("filter and switch", CPU_SAMPLES, bench_now_ns() - start);
+	bench_sink = on;
+}
+
+
+int main(int argc, char** argv)
+{
+	int dusks = (argc > 1) ? atoi(argv[1]) : 1000;
+	double noise = ((argc > 2) ? atof(argv[2]) : 5) / 100;
+	double spikes = (argc > 3) ? atof(argv[3]) : 20;
+	int size = (int)((3600 + NIGHT_S) / TICK_S), ticks, i, j;
+	int* readings = malloc((size > CPU_SAMPLES ? size : CPU_SAMPLES) * sizeof(*readings));
+	struct result results[CONFIGS] = { { 0 } };
+	double crossing;
+
+	if (dusks <= 0 || noise < 0 || spikes < 0 || !readings)
+	{
+		fprintf(stderr, "usage: lux_bench [dusks] [noise %%] [spikes per hour]\n");
+		return 2;
+	}
+	for (j = 0; j < CONFIGS; ++j)
+		results[j].lag_min = 1e9, results[j].lag_max = -1e9;
+	for (i = 0; i < dusks; ++i)
+	{
+		ticks = dusk(readings, size, noise, spikes, &crossing);
+		for (j = 0; j < CONFIGS; ++j)
+			run(&configs[j], readings, ticks, crossing, &results[j]);
+	}
+
+	printf("%d dusks of 10 to 60 min, noise %.1f%%, %.0f spikes/h; hysteresis %d lx, dwell %.1f/%.1f s\n", dusks,
+			noise * 100, spikes, LUX_HYSTERESIS, LUX_MIN_ON_TICKS * TICK_S, LUX_MIN_OFF_TICKS * TICK_S);
+	printf("%-28s %10s %8s %10s %10s %28s\n", "", "switches", "max", "chattered", "reads", "last switch after crossing");
+	for (j = 0; j < CONFIGS; ++j)
+	{
+		const struct result* r = &results[j];
+
+		printf("%-28s %10.2f %8u %9.1f%% %10.0f %8.1f s avg [%.1f, %.1f]\n", configs[j].name,
+				(double)r->switches / dusks, r->max_switches, 100.0 * r->chattered / dusks,
+				(double)r->reads / dusks, r->lag_total / dusks, r->lag_min, r->lag_max);
+	}
+
+	/* the cost on noisy readings around the threshold */
+	for (i = 0; i < CPU_SAMPLES; ++i)
+		readings[i] = bh1750(ADAPTIVE_LUX_THRESHOLD * (1 + noise * gauss()));
+	cpu_cost(readings);
+	free(readings);
+	return 0;
+}
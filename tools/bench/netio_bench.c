@@ -0,0 +1,206 @@
+/*******************************************************************************
+ * Transport benchmark: the epoll and io_uring backends of netio.
+ *
+ * A server loop and a client loop, each on its own thread, exchange QoS 1
+ * PUBLISH and PUBACK packets over loopback TCP: every client connection keeps
+ * a window of publishes outstanding and sends the next one as each PUBACK
+ * comes back. Per backend, the publishes acknowledged per second and the
+ * system calls of both loops per publish are reported.
+ *
+ * usage: netio_bench [connections] [window] [seconds]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "../net/netio.h"
+#include "bench.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct
+{
+	int connections, window;
+	double seconds;
+	struct sockaddr_in addr;
+	volatile int stop;
+	unsigned char publish[64];
+	int publen;
+	unsigned long acks, publishes;
+} cfg = { 1000, 4, 2.0 };
+
+
+static int frame_length(const unsigned char* buf, int len)
+{
+	int rem_len, rc;
+
+	if (len < 2)
+		return 0;
+	if ((rc = MQTTPacket_decodeRange(buf + 1, buf + len, &rem_len)) <= 0)
+		return rc;
+	return 1 + rc + rem_len;
+}
+
+
+static void* on_accept(struct netio* io, struct netio_conn* c)
+{
+	return io;
+}
+
+
+/* server: a PUBACK for every PUBLISH */
+static int server_data(struct netio_conn* c, unsigned char* data, int len)
+{
+	struct netio* io = c->user;
+	int off = 0, flen;
+
+	while ((flen = frame_length(data + off, len - off)) > 0 && flen <= len - off)
+	{
+		unsigned char dup, retained, *payload, *p;
+		unsigned short packetid;
+		int qos, payloadlen;
+		MQTTString topic;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload, &payloadlen, data + off, flen) != 1
+				|| !(p = netio_reserve(io, c, 4)))
+			return -1;
+		netio_commit(c, MQTTSerialize_puback(p, 4, packetid));
+		off += flen;
+	}
+	return (flen < 0) ? -1 : off;
+}
+
+
+static const struct netio_handler server_handler = { on_accept, NULL, server_data, NULL };
+
+
+static int client_send(struct netio* io, struct netio_conn* c, int count)
+{
+	unsigned char* p = netio_reserve(io, c, cfg.publen * count);
+	int i;
+
+	if (!p)
+		return -1;
+	for (i = 0; i < count; ++i)
+		memcpy(p + i * cfg.publen, cfg.publish, cfg.publen);
+	netio_commit(c, cfg.publen * count);
+	cfg.publishes += count;
+	return 0;
+}
+
+
+static int client_connect(struct netio_conn* c)
+{
+	return client_send(c->user, c, cfg.window);
+}
+
+
+/* client: the next PUBLISH for every PUBACK */
+static int client_data(struct netio_conn* c, unsigned char* data, int len)
+{
+	int n = len / 4;
+
+	cfg.acks += n;
+	return (cfg.stop || client_send(c->user, c, n) == 0) ? n * 4 : -1;
+}
+
+
+static const struct netio_handler client_handler = { NULL, client_connect, client_data, NULL };
+
+
+static void* server_run(void* arg)
+{
+	struct netio* io = arg;
+
+	while (!cfg.stop)
+		netio_run(io, 10);
+	return NULL;
+}
+
+
+static int run(enum netio_backend backend)
+{
+	struct netio* server = netio_create(backend, &server_handler, 0);
+	struct netio* client = netio_create(backend, &client_handler, 0);
+	struct netio_conn** conns = calloc(cfg.connections, sizeof(*conns));
+	socklen_t addrlen = sizeof(cfg.addr);
+	unsigned long acks, publishes, syscalls;
+	uint64_t start, ns;
+	pthread_t thread;
+	int lfd, i, one = 1;
+
+	if (!server || !client || !conns)
+		return -1;
+	if (netio_backend(server) != backend)
+	{
+		printf("%s not available\n", netio_backend_name(backend));
+		netio_destroy(server);
+		netio_destroy(client);
+		free(conns);
+		return 0;
+	}
+	lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&cfg.addr, 0, sizeof(cfg.addr));
+	cfg.addr.sin_family = AF_INET;
+	cfg.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr)) < 0 || listen(lfd, 4096) < 0
+			|| getsockname(lfd, (struct sockaddr*)&cfg.addr, &addrlen) < 0 || netio_listen(server, lfd) < 0)
+	{
+		perror("listen");
+		return -1;
+	}
+	cfg.stop = 0;
+	pthread_create(&thread, NULL, server_run, server);
+	for (i = 0; i < cfg.connections; ++i)
+		if (!(conns[i] = netio_connect(client, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr), client)))
+			return -1;
+
+	/* warm up: every connection established and going */
+	start = bench_now_ns();
+	while (bench_now_ns() - start < 300000000ull)
+		netio_run(client, 10);
+	cfg.acks = cfg.publishes = 0;
+	syscalls = netio_syscalls(client) + netio_syscalls(server);
+	start = bench_now_ns();
+	while ((ns = bench_now_ns() - start) < cfg.seconds * 1e9)
+		netio_run(client, 10);
+	acks = cfg.acks;
+	publishes = cfg.publishes;
+	syscalls = netio_syscalls(client) + netio_syscalls(server) - syscalls;	/* the server's read racily, near enough */
+	cfg.stop = 1;
+	pthread_join(thread, NULL);
+
+	printf("%-8s %6d connections x %d: %10.0f publishes/s %6.2f syscalls/publish  (%lu sent, %lu acked)\n",
+			netio_backend_name(backend), cfg.connections, cfg.window, acks * 1e9 / ns, (double)syscalls / acks,
+			publishes, acks);
+	for (i = 0; i < cfg.connections; ++i)
+		netio_close(client, conns[i]);
+	netio_run(client, 0);
+	netio_destroy(client);
+	netio_destroy(server);
+	close(lfd);
+	free(conns);
+	return acks > 0 ? 0 : -1;
+}
+
+
+int main(int argc, char** argv)
+{
+	MQTTString topic = MQTTString_initializer;
+
+	if (argc > 1)
+		cfg.connections = atoi(argv[1]);
+	if (argc > 2)
+		cfg.window = atoi(argv[2]);
+	if (argc > 3)
+		cfg.seconds = atof(argv[3]);
+	topic.cstring = "LightSensor-00042/light";
+	cfg.publen = MQTTSerialize_publish(cfg.publish, sizeof(cfg.publish), 0, 1, 0, 1, topic, (unsigned char*)"417", 3);
+	if (run(NETIO_EPOLL) < 0 || run(NETIO_URING) < 0)
+		return 1;
+	return 0;
+}
@@ -0,0 +1,355 @@
+/*******************************************************************************
+ * MQTTParser benchmark and differential check.
+ *
+ * A random stream of PUBLISH (QoS 0-2, small and large payloads), acks,
+ * SUBACK and PINGRESP packets is built with the serializers. Before timing,
+ * the stream is fed in random chunk sizes down to single bytes and every
+ * packet the parser frames is compared with the stream and with the
+ * MQTTDeserialize_* result; then randomly corrupted copies are fed to check
+ * that accepted packets still agree with the deserializers. Throughput is
+ * measured for TCP segment and large chunks against MQTTPacket_readnb
+ * pulling from the same memory.
+ *
+ * usage: parser_bench [megabytes] [seed]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct packet
+{
+	int offset, len;
+};
+
+struct stream
+{
+	unsigned char* data;
+	int len;
+	struct packet* packets;
+	int count;
+};
+
+struct check
+{
+	struct stream* s;
+	int next;	/* index of the next expected packet */
+	int strict;	/* every packet must arrive, in order */
+	int failed;
+	unsigned long delivered;
+};
+
+static uint64_t rng = 88172645463325252ull;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+static void build(struct stream* s, int size)
+{
+	static unsigned char payload[4096];
+	int cap = 1024;
+
+	s->data = malloc(size + 4096);
+	s->packets = malloc(cap * sizeof(*s->packets));
+	s->len = s->count = 0;
+	memset(payload, 'p', sizeof(payload));
+	while (s->len < size)
+	{
+		unsigned char* p = s->data + s->len;
+		int kind = rnd(10), len;
+
+		if (kind < 6)
+		{
+			char topic[48];
+			MQTTString topicString = MQTTString_initializer;
+			int tl = 1 + rnd(40), i;
+			int pl = (rnd(8) == 0) ? rnd(4000) : rnd(24);
+
+			for (i = 0; i < tl; ++i)
+				topic[i] = 'a' + rnd(26);
+			topic[tl] = '\0';
+			topicString.cstring = topic;
+			len = MQTTSerialize_publish(p, 4096, 0, rnd(3), rnd(2), rnd(65536), topicString, payload, pl);
+		}
+		else if (kind < 8)
+			len = MQTTSerialize_ack(p, 4, PUBACK + rnd(4), 0, rnd(65536));
+		else if (kind < 9)
+		{
+			int qos[3] = { 0, 1, 0x80 };
+
+			len = MQTTSerialize_suback(p, 8, rnd(65536), 1 + rnd(3), qos);
+		}
+		else
+		{
+			p[0] = PINGRESP << 4;
+			p[1] = 0;
+			len = 2;
+		}
+		if (s->count == cap)
+			s->packets = realloc(s->packets, (cap *= 2) * sizeof(*s->packets));
+		s->packets[s->count].offset = s->len;
+		s->packets[s->count].len = len;
+		s->count++;
+		s->len += len;
+	}
+}
+
+
+/**
+ * The parsed view must agree with the deserializers on the same bytes.
+ */
+static int agrees(MQTTParsedPacket* pk)
+{
+	unsigned char type = pk->type;
+
+	if (type == PUBLISH)
+	{
+		unsigned char dup, retained;
+		unsigned short packetid = 0;
+		int qos, payloadlen;
+		unsigned char* payload;
+		MQTTString topic;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload, &payloadlen, pk->data, pk->len) != 1)
+			return 0;
+		return topic.lenstring.len == pk->topicName.lenstring.len && topic.lenstring.data == pk->topicName.lenstring.data
+				&& payload == pk->payload && payloadlen == pk->payloadlen && (qos == 0 || packetid == pk->packetid);
+	}
+	if (type >= PUBACK && type <= PUBCOMP)
+	{
+		unsigned char t, dup;
+		unsigned short packetid;
+
+		return MQTTDeserialize_ack(&t, &dup, &packetid, pk->data, pk->len) == 1 && t == type && packetid == pk->packetid;
+	}
+	if (type == SUBACK)
+	{
+		static int granted[4096];	/* corrupted lengths can announce many */
+		unsigned short packetid;
+		int count;
+
+		return MQTTDeserialize_suback(&packetid, 4096, &count, granted, pk->data, pk->len) == 1 && packetid == pk->packetid;
+	}
+	return 1;
+}
+
+
+static int on_checked(void* context, MQTTParsedPacket* pk)
+{
+	struct check* c = context;
+	struct stream* s = c->s;
+
+	c->delivered++;
+	if (c->strict)
+	{
+		struct packet* want = &s->packets[c->next++];
+
+		if (pk->len != want->len || memcmp(pk->data, s->data + want->offset, pk->len) != 0)
+			c->failed++;
+	}
+	else
+	{
+		/* oversized packets may be skipped, the rest arrive in order */
+		while (c->next < s->count && (s->packets[c->next].len != pk->len
+				|| memcmp(pk->data, s->data + s->packets[c->next].offset, pk->len) != 0))
+			c->next++;
+		if (c->next++ >= s->count)
+			c->failed++;
+	}
+	if (!agrees(pk))
+		c->failed++;
+	return 0;
+}
+
+
+static int on_fuzzed(void* context, MQTTParsedPacket* pk)
+{
+	struct check* c = context;
+
+	c->delivered++;
+	if (!agrees(pk))
+		c->failed++;
+	return 0;
+}
+
+
+static int feed_random(MQTTParser* parser, unsigned char* data, int len, int maxchunk, int resync)
+{
+	int pos = 0;
+
+	while (pos < len)
+	{
+		int n = 1 + rnd(maxchunk);
+		int rc;
+
+		if (n > len - pos)
+			n = len - pos;
+		if ((rc = MQTTParser_feed(parser, data + pos, n)) < 0)
+		{
+			if (!resync)
+				return -1;
+			MQTTParser_reset(parser);
+		}
+		pos += n;
+	}
+	return 0;
+}
+
+
+static int verify(struct stream* s)
+{
+	static unsigned char buf[4096], small[128];
+	unsigned char* copy = malloc(s->len);
+	int chunks[] = { 1, 2, 7, 100, 1460, 65536 };
+	MQTTParser parser;
+	struct check c;
+	int i, round;
+
+	for (i = 0; i < (int)(sizeof(chunks) / sizeof(chunks[0])); ++i)
+	{
+		memset(&c, 0, sizeof(c));
+		c.s = s;
+		c.strict = 1;
+		MQTTParser_init(&parser, buf, sizeof(buf), on_checked, &c);
+		if (feed_random(&parser, s->data, s->len, chunks[i], 0) < 0 || c.failed || c.next != s->count)
+		{
+			free(copy);
+			fprintf(stderr, "chunks up to %d: %d of %d packets, %d mismatches\n", chunks[i], c.next, s->count, c.failed);
+			return 0;
+		}
+
+		/* a device sized buffer: split packets that do not fit are skipped */
+		memset(&c, 0, sizeof(c));
+		c.s = s;
+		MQTTParser_init(&parser, small, sizeof(small), on_checked, &c);
+		if (feed_random(&parser, s->data, s->len, chunks[i], 0) < 0 || c.failed
+				|| c.delivered + parser.oversized != (unsigned long)s->count)
+		{
+			fprintf(stderr, "small buffer, chunks up to %d: %lu + %lu oversized of %d packets, %d mismatches\n",
+					chunks[i], c.delivered, parser.oversized, s->count, c.failed);
+			free(copy);
+			return 0;
+		}
+	}
+
+	for (round = 0; round < 20; ++round)
+	{
+		memcpy(copy, s->data, s->len);
+		for (i = 0; i < 1 + s->len / 500; ++i)
+			copy[rnd(s->len)] ^= 1 << rnd(8);
+		memset(&c, 0, sizeof(c));
+		MQTTParser_init(&parser, round & 1 ? small : buf, round & 1 ? sizeof(small) : sizeof(buf), on_fuzzed, &c);
+		feed_random(&parser, copy, s->len, 1 + rnd(2000), 1);
+		if (c.failed)
+		{
+			fprintf(stderr, "corrupted stream %d: %d packets disagree with the deserializers\n", round, c.failed);
+			free(copy);
+			return 0;
+		}
+	}
+	free(copy);
+	return 1;
+}
+
+
+static int on_count(void* context, MQTTParsedPacket* pk)
+{
+	*(unsigned long*)context += pk->len + pk->payloadlen;
+	return 0;
+}
+
+
+static uint64_t run_parser(struct stream* s, int chunk, unsigned long* packets)
+{
+	static unsigned char buf[4096];
+	MQTTParser parser;
+	unsigned long sum = 0;
+	uint64_t start = bench_now_ns();
+	int pos;
+
+	MQTTParser_init(&parser, buf, sizeof(buf), on_count, &sum);
+	for (pos = 0; pos < s->len; pos += chunk)
+		MQTTParser_feed(&parser, s->data + pos, (s->len - pos < chunk) ? s->len - pos : chunk);
+	bench_sink = sum;
+	*packets = s->count;
+	return bench_now_ns() - start;
+}
+
+
+static struct stream* memsrc;
+static int mempos;
+
+
+static int memget(void* sck, unsigned char* buf, int count)
+{
+	if (count > memsrc->len - mempos)
+		count = memsrc->len - mempos;
+	memcpy(buf, memsrc->data + mempos, count);
+	mempos += count;
+	return count ? count : -1;
+}
+
+
+static uint64_t run_readnb(struct stream* s, unsigned long* packets)
+{
+	static unsigned char buf[4096];
+	MQTTTransport trp = { memget, NULL, 0, 0, 0, 0 };
+	unsigned long sum = 0, n = 0;
+	uint64_t start = bench_now_ns();
+	int type;
+
+	memsrc = s;
+	mempos = 0;
+	while ((type = MQTTPacket_readnb(buf, sizeof(buf), &trp)) > 0)
+	{
+		sum += type + buf[1];
+		n++;
+	}
+	bench_sink = sum;
+	*packets = n;
+	return bench_now_ns() - start;
+}
+
+
+static void report(const char* name, struct stream* s, unsigned long packets, uint64_t ns)
+{
+	printf("%-32s %8.1f MB/s %10.0f packets/s\n", name, s->len / (ns / 1e9) / 1e6, packets / (ns / 1e9));
+}
+
+
+int main(int argc, char** argv)
+{
+	int mb = (argc > 1) ? atoi(argv[1]) : 64;
+	struct stream check, s;
+	unsigned long packets;
+	uint64_t ns;
+
+	if (argc > 2)
+		rng += strtoull(argv[2], NULL, 0);
+	build(&check, 256 * 1024);
+	if (!verify(&check))
+		return 1;
+	printf("verified %d packets against the deserializers\n", check.count);
+
+	build(&s, mb * 1024 * 1024);
+	ns = run_readnb(&s, &packets);
+	report("MQTTPacket_readnb", &s, packets, ns);
+	ns = run_parser(&s, 1460, &packets);
+	report("MQTTParser_feed, 1460 B chunks", &s, packets, ns);
+	ns = run_parser(&s, 65536, &packets);
+	report("MQTTParser_feed, 64 KB chunks", &s, packets, ns);
+	free(check.data);
+	free(check.packets);
+	free(s.data);
+	free(s.packets);
+	return 0;
+}
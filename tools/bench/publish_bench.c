@@ -0,0 +1,264 @@
+/*******************************************************************************
+ * PUBLISH serialization benchmark.
+ *
+ * device: the ledmode/light/ledh cycle of MqttHandlerTask, one packet per
+ *         call into the 128 byte buffer, versus the 3 packets as one batch.
+ * fleet:  64 publishes back to back into a 4 KB send buffer, as a load
+ *         generator would queue them, per call versus one batch.
+ * prepared: the device cycle through MQTTSerialize_preparedPublish with the
+ *         three topics encoded once, as MqttHandlerTask does. On the target
+ *         the same cost shows up in the "mqtt_ser" profiler region.
+ * relay:  the broker passing the fleet's received publishes on at QoS 0,
+ *         deserialized and serialized again versus MQTTRelay_publish, which
+ *         rewrites the fixed header and copies the rest as received.
+ *
+ * usage: publish_bench [iterations]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FLEET_BATCH 64
+
+static char* deviceTopics[3] = { "ledmode", "light", "ledh" };
+
+
+static void fill(MQTTPublishMessage* msgs, int count, unsigned char payloads[][16])
+{
+	int i;
+
+	memset(msgs, 0, count * sizeof(*msgs));
+	for (i = 0; i < count; ++i)
+	{
+		msgs[i].qos = 1;
+		msgs[i].topicName.cstring = deviceTopics[i % 3];
+		msgs[i].payload = payloads[i];
+		msgs[i].payloadlen = sprintf((char*)payloads[i], "%d", (i * 37) % 1000);
+	}
+}
+
+
+static uint64_t run_single(MQTTPublishMessage* msgs, int count, unsigned char* buf, int buflen, long iterations)
+{
+	uint64_t start = bench_now_ns();
+	unsigned sum = 0;
+	long n;
+	int i;
+
+	for (n = 0; n < iterations; ++n)
+	{
+		int len = 0;
+
+		for (i = 0; i < count; ++i)
+			len += MQTTSerialize_publish(buf + len, buflen - len, msgs[i].dup, msgs[i].qos, msgs[i].retained,
+					msgs[i].packetid, msgs[i].topicName, msgs[i].payload, msgs[i].payloadlen);
+		sum += len + buf[len - 1];
+	}
+	bench_sink = sum;
+	return bench_now_ns() - start;
+}
+
+
+static uint64_t run_batch(MQTTPublishMessage* msgs, int count, unsigned char* buf, int buflen, long iterations)
+{
+	uint64_t start = bench_now_ns();
+	unsigned sum = 0;
+	long n;
+
+	for (n = 0; n < iterations; ++n)
+	{
+		int serialized;
+		int len = MQTTSerialize_publishBatch(buf, buflen, msgs, count, &serialized);
+
+		sum += len + buf[len - 1] + serialized;
+	}
+	bench_sink = sum;
+	return bench_now_ns() - start;
+}
+
+
+static uint64_t run_prepared(MQTTPublishMessage* msgs, int count, unsigned char* buf, int buflen, long iterations)
+{
+	MQTTPreparedPublish pp[3];
+	uint64_t start = bench_now_ns();
+	unsigned sum = 0;
+	long n;
+	int i;
+
+	for (i = 0; i < 3; ++i)
+		MQTTPrepare_publish(&pp[i], 0, 1, 0, msgs[i].topicName);
+	for (n = 0; n < iterations; ++n)
+	{
+		int len = 0;
+
+		for (i = 0; i < count; ++i)
+			len += MQTTSerialize_preparedPublish(buf + len, buflen - len, &pp[i % 3], msgs[i].packetid,
+					msgs[i].payload, msgs[i].payloadlen);
+		sum += len + buf[len - 1];
+	}
+	bench_sink = sum;
+	return bench_now_ns() - start;
+}
+
+
+/* received: count packets back to back, as serialized by run_single() */
+static uint64_t run_reserialize(unsigned char* received, int count, unsigned char* buf, int buflen, long iterations)
+{
+	uint64_t start = bench_now_ns();
+	unsigned sum = 0;
+	long n;
+	int i;
+
+	for (n = 0; n < iterations; ++n)
+	{
+		unsigned char* ptr = received;
+
+		for (i = 0; i < count; ++i)
+		{
+			unsigned char dup, retained, *payload;
+			unsigned short packetid;
+			int qos, payloadlen, rem_len;
+			int len = 1 + MQTTPacket_decodeBuf(ptr + 1, &rem_len) + rem_len;
+			MQTTString topic;
+
+			MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload, &payloadlen, ptr, len);
+			sum += MQTTSerialize_publish(buf, buflen, 0, 0, 0, 0, topic, payload, payloadlen) + buf[0];
+			ptr += len;
+		}
+	}
+	bench_sink = sum;
+	return bench_now_ns() - start;
+}
+
+
+static uint64_t run_relay(unsigned char* received, int count, unsigned char* buf, int buflen, long iterations)
+{
+	uint64_t start = bench_now_ns();
+	unsigned sum = 0;
+	long n;
+	int i;
+
+	for (n = 0; n < iterations; ++n)
+	{
+		unsigned char* ptr = received;
+
+		for (i = 0; i < count; ++i)
+		{
+			MQTTRelayedPublish rp;
+			int rem_len;
+			int len = 1 + MQTTPacket_decodeBuf(ptr + 1, &rem_len) + rem_len;
+
+			MQTTRelay_publish(&rp, 0, 0, 0, ptr, len);
+			sum += MQTTSerialize_relayedPublish(buf, buflen, &rp) + buf[0];
+			ptr += len;
+		}
+	}
+	bench_sink = sum;
+	return bench_now_ns() - start;
+}
+
+
+static int check_relay(unsigned char* received, int count)
+{
+	unsigned char* ptr = received;
+	unsigned char a[64], b[64];
+	int i;
+
+	for (i = 0; i < count; ++i)
+	{
+		unsigned char dup, retained, *payload;
+		unsigned short packetid;
+		int qos, payloadlen, len = MQTTPacket_len(ptr[1]);	/* all under 128 bytes */
+		MQTTRelayedPublish rp;
+		MQTTString topic;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload, &payloadlen, ptr, len) != 1
+				|| MQTTRelay_publish(&rp, 0, 0, 0, ptr, len) != MQTTSerialize_publish(a, sizeof(a), 0, 0, 0, 0,
+						topic, payload, payloadlen)
+				|| MQTTSerialize_relayedPublish(b, sizeof(b), &rp) != rp.headerlen + rp.topiclen + rp.payloadlen
+				|| memcmp(a, b, rp.headerlen + rp.topiclen + rp.payloadlen) != 0)
+			return 0;
+		/* and back to QoS 1 as received, retained */
+		if (MQTTRelay_publish(&rp, 1, 1, packetid, ptr, len) != len || MQTTSerialize_relayedPublish(b, sizeof(b), &rp) != len
+				|| b[0] != (ptr[0] | 1) || memcmp(b + 1, ptr + 1, len - 1) != 0)
+			return 0;
+		ptr += len;
+	}
+	return 1;
+}
+
+
+static int check(MQTTPublishMessage* msgs, int count, int buflen)
+{
+	unsigned char* a = malloc(buflen);
+	unsigned char* b = malloc(buflen);
+	int i, len = 0, serialized, blen, ok;
+
+	for (i = 0; i < count; ++i)
+		len += MQTTSerialize_publish(a + len, buflen - len, msgs[i].dup, msgs[i].qos, msgs[i].retained,
+				msgs[i].packetid, msgs[i].topicName, msgs[i].payload, msgs[i].payloadlen);
+	blen = MQTTSerialize_publishBatch(b, buflen, msgs, count, &serialized);
+	ok = (blen == len && serialized == count && memcmp(a, b, len) == 0);
+	if (ok)
+	{
+		MQTTPreparedPublish pp;
+
+		for (i = 0, blen = 0; i < count; ++i)
+		{
+			MQTTPrepare_publish(&pp, msgs[i].dup, msgs[i].qos, msgs[i].retained, msgs[i].topicName);
+			blen += MQTTSerialize_preparedPublish(b + blen, buflen - blen, &pp, msgs[i].packetid,
+					msgs[i].payload, msgs[i].payloadlen);
+		}
+		ok = (blen == len && memcmp(a, b, len) == 0);
+	}
+	free(a);
+	free(b);
+	return ok;
+}
+
+
+int main(int argc, char** argv)
+{
+	long iterations = (argc > 1) ? atol(argv[1]) : 2000000;
+	MQTTPublishMessage msgs[FLEET_BATCH];
+	unsigned char payloads[FLEET_BATCH][16];
+	static unsigned char deviceBuf[128], fleetBuf[4096], received[4096];
+	int i, len = 0;
+
+	fill(msgs, FLEET_BATCH, payloads);
+	if (!check(msgs, 3, sizeof(deviceBuf)) || !check(msgs, FLEET_BATCH, sizeof(fleetBuf)))
+	{
+		fprintf(stderr, "batch or prepared output differs from MQTTSerialize_publish\n");
+		return 1;
+	}
+	for (i = 0; i < FLEET_BATCH; ++i)	/* as the broker receives them from the devices */
+		len += MQTTSerialize_publish(received + len, sizeof(received) - len, 0, 1, 0, i + 1,
+				msgs[i].topicName, msgs[i].payload, msgs[i].payloadlen);
+	if (!check_relay(received, FLEET_BATCH))
+	{
+		fprintf(stderr, "relayed output differs from MQTTSerialize_publish\n");
+		return 1;
+	}
+
+	bench_report("device MQTTSerialize_publish", iterations * 3,
+			run_single(msgs, 3, deviceBuf, sizeof(deviceBuf), iterations));
+	bench_report("device MQTTSerialize_publishBatch", iterations * 3,
+			run_batch(msgs, 3, deviceBuf, sizeof(deviceBuf), iterations));
+	bench_report("device MQTTSerialize_preparedPublish", iterations * 3,
+			run_prepared(msgs, 3, deviceBuf, sizeof(deviceBuf), iterations));
+	iterations /= FLEET_BATCH / 3;
+	bench_report("fleet MQTTSerialize_publish", iterations * FLEET_BATCH,
+			run_single(msgs, FLEET_BATCH, fleetBuf, sizeof(fleetBuf), iterations));
+	bench_report("fleet MQTTSerialize_publishBatch", iterations * FLEET_BATCH,
+			run_batch(msgs, FLEET_BATCH, fleetBuf, sizeof(fleetBuf), iterations));
+	bench_report("fleet MQTTSerialize_preparedPublish", iterations * FLEET_BATCH,
+			run_prepared(msgs, FLEET_BATCH, fleetBuf, sizeof(fleetBuf), iterations));
+	bench_report("relay deserialize + serialize", iterations * FLEET_BATCH,
+			run_reserialize(received, FLEET_BATCH, deviceBuf, sizeof(deviceBuf), iterations));
+	bench_report("relay MQTTRelay_publish", iterations * FLEET_BATCH,
+			run_relay(received, FLEET_BATCH, deviceBuf, sizeof(deviceBuf), iterations));
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*******************************************************************************
+ * Retained message store benchmark.
+ *
+ * A retain_store backed by a snapshot file takes the retained values of a
+ * fleet of devices (light, ledmode, ledh per device), then random updates,
+ * some larger than the record they replace, and removals by empty payloads.
+ * The store is checked against a plain model after the updates and again
+ * after it is closed and reopened from the file, and wildcard matches are
+ * checked against MQTTTopic_matches over every topic. Timed: first publish,
+ * update in place, update that moves the record, restart from the snapshot,
+ * exact lookup as a dashboard subscribes to one topic, and a '#' subscription
+ * to a whole site.
+ *
+ * usage: retain_bench [devices] [snapshot file]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "../broker/retain.h"
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SITES 40
+#define MAX_PAYLOAD 96
+
+static const char* metrics[] = { "light", "ledmode", "ledh" };
+
+struct model
+{
+	char topic[48];
+	int tlen;
+	int plen;	/* 0 if nothing is retained */
+	unsigned version;
+	int seen;
+};
+
+struct check
+{
+	struct model* m;
+	int count;
+	int bad;
+};
+
+static uint64_t rng = 88172645463325252ull;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+static void fill_payload(unsigned char* p, int len, int id, unsigned version)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+		p[i] = (unsigned char)(id * 31 + version * 7 + i);
+}
+
+
+static int set(struct retain_store* rs, struct model* m, int id, int plen)
+{
+	unsigned char payload[MAX_PAYLOAD];
+
+	m[id].version++;
+	m[id].plen = plen;
+	fill_payload(payload, plen, id, m[id].version);
+	return retain_set(rs, m[id].topic, m[id].tlen, payload, plen, 1);
+}
+
+
+static void on_check(const char* topic, int tlen, const unsigned char* payload, int plen, int qos, void* ctx)
+{
+	struct check* c = ctx;
+	unsigned char expect[MAX_PAYLOAD];
+	struct model* m;
+	int id = 0, i;
+
+	for (i = tlen - 8; i < tlen; ++i)	/* the id closes every topic, see main */
+		id = id * 10 + topic[i] - '0';
+	m = &c->m[id];
+
+	fill_payload(expect, m->plen, id, m->version);
+	if (m->seen || m->tlen != tlen || memcmp(m->topic, topic, tlen) != 0 || m->plen != plen
+			|| memcmp(expect, payload, plen) != 0)
+		c->bad++;
+	m->seen = 1;
+	c->count++;
+}
+
+
+static void on_count(const char* topic, int tlen, const unsigned char* payload, int plen, int qos, void* ctx)
+{
+	*(unsigned long*)ctx += plen + payload[0];
+}
+
+
+/**
+ * Every retained message once, with the payload of the model, for one filter.
+ */
+static int check_filter(struct retain_store* rs, struct model* m, int n, const char* filter)
+{
+	struct check c = { m, 0, 0 };
+	int i, expect = 0;
+
+	for (i = 0; i < n; ++i)
+	{
+		m[i].seen = 0;
+		if (m[i].plen > 0 && MQTTTopic_matches(filter, strlen(filter), m[i].topic, m[i].tlen))
+			++expect;
+	}
+	retain_match(rs, filter, strlen(filter), on_check, &c);
+	if (c.bad || c.count != expect)
+	{
+		fprintf(stderr, "%s: %d retained messages, %d expected, %d wrong\n", filter, c.count, expect, c.bad);
+		return 0;
+	}
+	return 1;
+}
+
+
+static int check(struct retain_store* rs, struct model* m, int n, const char* when)
+{
+	int i, live = 0;
+
+	for (i = 0; i < n; ++i)
+		live += (m[i].plen > 0);
+	if (retain_count(rs) != live)
+	{
+		fprintf(stderr, "%s: %d retained messages, %d expected\n", when, retain_count(rs), live);
+		return 0;
+	}
+	for (i = 0; i < 200; ++i)
+		if (!check_filter(rs, m, n, m[rnd(n)].topic))
+			return 0;
+	if (!check_filter(rs, m, n, "#") || !check_filter(rs, m, n, "site7/+/+/ledmode/+")
+			|| !check_filter(rs, m, n, "+/b3/#"))
+		return 0;
+	printf("%s: %d retained messages match the model\n", when, live);
+	return 1;
+}
+
+
+int main(int argc, char** argv)
+{
+	int devices = (argc > 1) ? atoi(argv[1]) : 40000;
+	char path[64] = "/tmp/retain_bench.XXXXXX";
+	int n = devices * 3, i, fd;
+	struct model* m = calloc(n, sizeof(*m));
+	struct retain_store* rs;
+	unsigned long sum = 0;
+	uint64_t start;
+
+	if (argc > 2)
+		snprintf(path, sizeof(path), "%s", argv[2]);
+	else if ((fd = mkstemp(path)) >= 0)
+		close(fd);
+	unlink(path);
+	for (i = 0; i < n; ++i)
+		m[i].tlen = sprintf(m[i].topic, "site%d/b%d/dev%d/%s/%08d", (i / 3) % SITES, (i / 3) % 16, i / 3,
+				metrics[i % 3], i);
+	if (!(rs = retain_open(path)))
+		return 1;
+
+	start = bench_now_ns();
+	for (i = 0; i < n; ++i)
+		set(rs, m, i, 8 + rnd(16));
+	bench_report("retain_set, new topic", n, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for (i = 0; i < n; ++i)
+		set(rs, m, i, 1 + rnd(8));
+	bench_report("retain_set, in place", n, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for (i = 0; i < n; ++i)
+		set(rs, m, i, 32 + rnd(MAX_PAYLOAD - 32));
+	bench_report("retain_set, moved", n, bench_now_ns() - start);
+
+	for (i = 0; i < n; ++i)
+		set(rs, m, rnd(n), rnd(4) ? 1 + rnd(MAX_PAYLOAD) : 0);
+	if (!check(rs, m, n, "after updates"))
+		return 1;
+
+	retain_close(rs);
+	start = bench_now_ns();
+	rs = retain_open(path);
+	bench_report("retain_open, restart from snapshot", 1, bench_now_ns() - start);
+	if (!rs || !check(rs, m, n, "after restart"))
+		return 1;
+
+	start = bench_now_ns();
+	for (i = 0; i < 1000000; ++i)
+		retain_match(rs, m[i % n].topic, m[i % n].tlen, on_count, &sum);
+	bench_report("retain_match, exact topic", 1000000, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	for (i = 0; i < 200; ++i)
+	{
+		char filter[16];
+
+		retain_match(rs, filter, sprintf(filter, "site%d/#", i % SITES), on_count, &sum);
+	}
+	bench_report("retain_match, site/#", 200, bench_now_ns() - start);
+	bench_sink = sum;
+
+	retain_close(rs);
+	unlink(path);
+	free(m);
+	return 0;
+}
@@ -0,0 +1,276 @@
+/*******************************************************************************
+ * Persistent session log benchmark.
+ *
+ * A session_log backed by a file takes the sessions of a fleet of
+ * streetlights, each subscribed at QoS 1 to its own commands and to the
+ * commands of its site. Commands are queued while the lights are away, more
+ * than a queue holds for some, then the lights come back, are sent what is
+ * queued and acknowledge part of it. Churn of commands sent and acknowledged
+ * fills the log with dead records until it is compacted. The log is checked
+ * against a plain model after the churn, after compaction and again after it
+ * is closed and read back from the file. Timed: new sessions, queueing,
+ * sending and acknowledging, compaction and the restart.
+ *
+ * usage: session_bench [lights] [log file]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "../broker/session.h"
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SITES 40
+#define MAX_QUEUED 32
+
+static const char* commands[] = { "mode", "leds" };
+
+struct model
+{
+	char id[24];
+	unsigned short packetid[MAX_QUEUED];	/* queued, oldest at head */
+	unsigned version[MAX_QUEUED];
+	int head, count;
+	unsigned short lastid;
+	int ended;
+};
+
+static uint64_t rng = 88172645463325252ull;
+static unsigned version;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+/* a command as the broker receives it from the controller */
+static int command(unsigned char* buf, int buflen, int light, unsigned v)
+{
+	MQTTString topic = MQTTString_initializer;
+	char name[40], payload[16];
+
+	topic.cstring = name;
+	sprintf(name, "light%05d/cmd/%s", light, commands[v % 2]);
+	return MQTTSerialize_publish(buf, buflen, 0, 1, 0, 7, topic, (unsigned char*)payload,
+			sprintf(payload, "%u", v));
+}
+
+
+static int queue(struct session_log* sl, struct model* m, int light)
+{
+	struct session* s = session_find(sl, m[light].id);
+	struct model* lm = &m[light];
+	unsigned char buf[64];
+	int len = command(buf, sizeof(buf), light, ++version), rc;
+
+	if ((rc = session_queue(sl, s, buf, len)) < 0)
+		return -1;
+	if (lm->count == MAX_QUEUED)
+	{
+		lm->head = (lm->head + 1) % MAX_QUEUED;
+		lm->count--;
+	}
+	lm->lastid = (lm->lastid == 65535) ? 1 : lm->lastid + 1;
+	lm->packetid[(lm->head + lm->count) % MAX_QUEUED] = lm->lastid;
+	lm->version[(lm->head + lm->count) % MAX_QUEUED] = version;
+	lm->count++;
+	return 0;
+}
+
+
+/**
+ * Sends what is queued for a light and acknowledges the first n.
+ */
+static int send_ack(struct session_log* sl, struct model* m, int light, int n)
+{
+	struct session* s = session_find(sl, m[light].id);
+	struct model* lm = &m[light];
+	unsigned short acks[MAX_QUEUED];
+	unsigned char* packet;
+	int count = 0, len, i;
+
+	session_rewind(s);
+	while ((len = session_peek(sl, s, &packet)) > 0)
+	{
+		unsigned char dup, retained, *payload;
+		int qos, payloadlen;
+		MQTTString topic;
+
+		if (count == MAX_QUEUED || MQTTDeserialize_publish(&dup, &qos, &retained, &acks[count], &topic, &payload,
+				&payloadlen, packet, len) != 1)
+			return -1;
+		session_sent(sl, s);
+		count++;
+	}
+	for (i = 0; i < n && i < count; ++i)
+		if (session_ack(sl, s, acks[i]) != 1)
+			return -1;
+	for (i = 0; i < n && lm->count > 0; ++i)
+	{
+		lm->head = (lm->head + 1) % MAX_QUEUED;
+		lm->count--;
+	}
+	return 0;
+}
+
+
+static void on_filter(const char* filter, int len, int qos, void* ctx)
+{
+	int* n = ctx;
+
+	if (qos == 1 && (memcmp(filter, "light", 5) == 0 || memcmp(filter, "site", 4) == 0))
+		(*n)++;
+}
+
+
+/**
+ * Every session of the model with its subscriptions and queue, in order.
+ */
+static int check(struct session_log* sl, struct model* m, int n, const char* when)
+{
+	int i, live = 0, queued = 0;
+
+	for (i = 0; i < n; ++i)
+	{
+		struct session* s = session_find(sl, m[i].id);
+		unsigned char* packet;
+		int k = 0, filters = 0, len;
+
+		if (m[i].ended)
+		{
+			if (s)
+				goto bad;
+			continue;
+		}
+		live++;
+		if (!s || session_queued(s) != m[i].count)
+			goto bad;
+		session_filters(s, on_filter, &filters);
+		if (filters != 2)
+			goto bad;
+		session_rewind(s);
+		for (; (len = session_peek(sl, s, &packet)) > 0; ++k)
+		{
+			unsigned char dup, retained, *payload;
+			unsigned short packetid;
+			int qos, payloadlen, j = (m[i].head + k) % MAX_QUEUED;
+			MQTTString topic;
+			char expect[16];
+
+			if (k == m[i].count || MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topic, &payload,
+					&payloadlen, packet, len) != 1 || qos != 1 || packetid != m[i].packetid[j]
+					|| payloadlen != sprintf(expect, "%u", m[i].version[j]) || memcmp(payload, expect, payloadlen) != 0)
+				goto bad;
+			session_sent(sl, s);
+		}
+		if (k != m[i].count)
+			goto bad;
+		queued += k;
+		continue;
+bad:
+		fprintf(stderr, "%s: session %s differs from the model\n", when, m[i].id);
+		return 0;
+	}
+	if (session_count(sl) != live)
+	{
+		fprintf(stderr, "%s: %d sessions, %d expected\n", when, session_count(sl), live);
+		return 0;
+	}
+	printf("%s: %d sessions, %d messages queued match the model, %lu KB of log\n", when, live, queued,
+			session_log_size(sl) / 1024);
+	return 1;
+}
+
+
+int main(int argc, char** argv)
+{
+	int lights = (argc > 1) ? atoi(argv[1]) : 20000;
+	char path[64] = "/tmp/session_bench.XXXXXX";
+	struct model* m = calloc(lights, sizeof(*m));
+	struct session_log* sl;
+	uint64_t start;
+	long ops;
+	int i, fd;
+
+	if (argc > 2)
+		snprintf(path, sizeof(path), "%s", argv[2]);
+	else if ((fd = mkstemp(path)) >= 0)
+		close(fd);
+	unlink(path);
+	if (!(sl = session_open(path, MAX_QUEUED)))
+		return 1;
+
+	start = bench_now_ns();
+	for (i = 0; i < lights; ++i)
+	{
+		struct session* s;
+		char filter[32];
+
+		sprintf(m[i].id, "light%05d", i);
+		if (!(s = session_new(sl, m[i].id)) || session_subscribe(sl, s, filter, sprintf(filter, "light%05d/cmd/#", i), 1) < 0
+				|| session_subscribe(sl, s, filter, sprintf(filter, "site%d/cmd/#", i % SITES), 1) < 0)
+			return 1;
+	}
+	bench_report("session_new + 2 x session_subscribe", lights, bench_now_ns() - start);
+
+	/* away: a few commands each, a burst for some */
+	start = bench_now_ns();
+	for (ops = 0; ops < 8L * lights; ++ops)
+		if (queue(sl, m, (ops < 4L * lights) ? ops % lights : rnd(lights / 8 + 1)) < 0)
+			return 1;
+	bench_report("session_queue", ops, bench_now_ns() - start);
+
+	/* back: everything sent, most of it acknowledged */
+	start = bench_now_ns();
+	for (ops = i = 0; i < lights; ++i)
+	{
+		ops += m[i].count;
+		if (send_ack(sl, m, i, m[i].count - rnd(3)) < 0)
+			return 1;
+	}
+	bench_report("session_peek + session_sent + session_ack", ops, bench_now_ns() - start);
+
+	/* online: commands sent and acknowledged as they come */
+	start = bench_now_ns();
+	for (ops = 0; ops < 16L * lights; ++ops)
+	{
+		int light = rnd(lights);
+
+		if (queue(sl, m, light) < 0 || send_ack(sl, m, light, m[light].count - rnd(2)) < 0)
+			return 1;
+	}
+	bench_report("session_queue + send + session_ack", ops, bench_now_ns() - start);
+	for (i = 0; i < lights; i += 97)
+	{
+		session_end(sl, session_find(sl, m[i].id));
+		m[i].ended = 1;
+	}
+	if (!check(sl, m, lights, "after churn"))
+		return 1;
+
+	start = bench_now_ns();
+	session_sync(sl);
+	bench_report("session_sync, compacting", 1, bench_now_ns() - start);
+	if (!check(sl, m, lights, "after compaction"))
+		return 1;
+
+	session_close(sl);
+	start = bench_now_ns();
+	sl = session_open(path, MAX_QUEUED);
+	bench_report("session_open, restart from the log", 1, bench_now_ns() - start);
+	if (!sl || !check(sl, m, lights, "after restart"))
+		return 1;
+
+	session_close(sl);
+	unlink(path);
+	free(m);
+	return 0;
+}
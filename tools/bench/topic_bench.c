@@ -0,0 +1,365 @@
+/*******************************************************************************
+ * Topic matching benchmark for MQTTTopicTrie.
+ *
+ * Subscribers of 8 filters each fill the trie with 100k filters over a
+ * site/building/device/metric topic space: mostly exact, the rest with '+'
+ * and '#' at various levels. Before timing, the MQTT 3.1.1 examples are run
+ * through MQTTTopic_matches and the trie, and the trie's matches for sampled
+ * topics are compared with a scan of every filter, after the bulk subscribe
+ * and again after half the subscribers have unsubscribed. A trie in a fixed
+ * 4 KB block, as on the device, gets the same check.
+ *
+ * usage: topic_bench [filters] [topics]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "bench.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILTERS_PER_SUBSCRIBER 8
+#define SAMPLE 300
+
+struct filter
+{
+	char text[64];
+	int len;
+	int subscriber;
+	int live;
+};
+
+struct collect
+{
+	int* ids;
+	int count;
+};
+
+static uint64_t rng = 88172645463325252ull;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+static const char* metrics[] = { "light", "ledmode", "ledh", "temp", "cmd", "status" };
+
+
+static int make_topic(char* buf)
+{
+	return sprintf(buf, "site%u/b%u/dev%u/%s", rnd(40), rnd(16), rnd(500), metrics[rnd(6)]);
+}
+
+
+static int make_filter(char* buf)
+{
+	unsigned kind = rnd(100);
+	unsigned s = rnd(40), b = rnd(16), d = rnd(500);
+	const char* m = metrics[rnd(6)];
+
+	if (kind < 70)
+		return sprintf(buf, "site%u/b%u/dev%u/%s", s, b, d, m);
+	if (kind < 80)
+		return sprintf(buf, "site%u/b%u/dev%u/+", s, b, d);
+	if (kind < 90)
+		return sprintf(buf, "site%u/b%u/+/%s", s, b, m);
+	if (kind < 95)
+		return sprintf(buf, "site%u/b%u/#", s, b);
+	if (kind < 98)
+		return sprintf(buf, "site%u/+/dev%u/#", s, d);
+	if (kind < 99)
+		return sprintf(buf, "+/b%u/dev%u/%s", b, d, m);
+	return sprintf(buf, "site%u/#", s);
+}
+
+
+static void on_collect(void* subscriber, int qos, void* context)
+{
+	struct collect* c = context;
+
+	c->ids[c->count++] = (int)(intptr_t)subscriber;
+}
+
+
+static void on_count(void* subscriber, int qos, void* context)
+{
+	*(unsigned long*)context += (uintptr_t)subscriber;
+}
+
+
+static int cmp_int(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+
+/**
+ * The trie must report exactly the subscribers whose filters match.
+ */
+static int same_matches(MQTTTopicTrie* trie, struct filter* filters, int nfilters, const char* topic, int tlen, int* a,
+		int* b)
+{
+	struct collect c = { a, 0 };
+	int i, n = 0;
+
+	MQTTTopicTrie_match(trie, topic, tlen, on_collect, &c);
+	for (i = 0; i < nfilters; ++i)
+		if (filters[i].live && MQTTTopic_matches(filters[i].text, filters[i].len, topic, tlen))
+			b[n++] = filters[i].subscriber;
+	qsort(a, c.count, sizeof(int), cmp_int);
+	qsort(b, n, sizeof(int), cmp_int);
+	return c.count == n && memcmp(a, b, n * sizeof(int)) == 0;
+}
+
+
+static int check_examples(void)
+{
+	static const struct
+	{
+		const char* filter;
+		const char* topic;
+		int match;
+	} examples[] = {
+		{ "sport/tennis/player1/#", "sport/tennis/player1", 1 },
+		{ "sport/tennis/player1/#", "sport/tennis/player1/ranking", 1 },
+		{ "sport/tennis/player1/#", "sport/tennis/player1/score/wimbledon", 1 },
+		{ "sport/#", "sport", 1 },
+		{ "#", "sport/tennis", 1 },
+		{ "sport/tennis/+", "sport/tennis/player1", 1 },
+		{ "sport/tennis/+", "sport/tennis/player1/ranking", 0 },
+		{ "sport/+", "sport", 0 },
+		{ "sport/+", "sport/", 1 },
+		{ "+/+", "/finance", 1 },
+		{ "/+", "/finance", 1 },
+		{ "+", "/finance", 0 },
+		{ "+/tennis/#", "sport/tennis", 1 },
+		{ "#", "$SYS/broker", 0 },
+		{ "+/broker", "$SYS/broker", 0 },
+		{ "$SYS/#", "$SYS/broker", 1 },
+		{ "$SYS/+", "$SYS/broker", 1 },
+		{ "a//b", "a//b", 1 },
+		{ "a/+/b", "a//b", 1 },
+		{ "a/b", "a/b/", 0 },
+	};
+	static const char* invalid[] = { "", "sport/tennis#", "sport/tennis/#/ranking", "sport+", "+a/b", "a/#b" };
+	int i;
+
+	for (i = 0; i < (int)(sizeof(examples) / sizeof(examples[0])); ++i)
+	{
+		MQTTTopicTrie trie;
+		unsigned long sum = 0;
+		int tlen = strlen(examples[i].topic);
+
+		MQTTTopicTrie_init(&trie);
+		MQTTTopicTrie_add(&trie, examples[i].filter, strlen(examples[i].filter), (void*)1, 0);
+		MQTTTopicTrie_match(&trie, examples[i].topic, tlen, on_count, &sum);
+		MQTTTopicTrie_free(&trie);
+		if (MQTTTopic_matches(examples[i].filter, strlen(examples[i].filter), examples[i].topic, tlen) != examples[i].match
+				|| (int)sum != examples[i].match)
+		{
+			fprintf(stderr, "\"%s\" against \"%s\": expected %d\n", examples[i].filter, examples[i].topic, examples[i].match);
+			return 0;
+		}
+	}
+	for (i = 0; i < (int)(sizeof(invalid) / sizeof(invalid[0])); ++i)
+		if (MQTTTopic_isValidFilter(invalid[i], strlen(invalid[i])))
+		{
+			fprintf(stderr, "\"%s\" accepted as a filter\n", invalid[i]);
+			return 0;
+		}
+	return 1;
+}
+
+
+static int check_sample(MQTTTopicTrie* trie, struct filter* filters, int nfilters, const char* when)
+{
+	int* a = malloc(nfilters * sizeof(int));
+	int* b = malloc(nfilters * sizeof(int));
+	int i, ok = 1;
+
+	for (i = 0; i < SAMPLE && ok; ++i)
+	{
+		char topic[64];
+		int tlen = make_topic(topic);
+
+		if (!(ok = same_matches(trie, filters, nfilters, topic, tlen, a, b)))
+			fprintf(stderr, "%s: matches for %s differ from a scan of the filters\n", when, topic);
+	}
+	free(a);
+	free(b);
+	return ok;
+}
+
+
+/**
+ * As on the device: a fixed block, filled until full, then emptied.
+ */
+static int check_static(void)
+{
+	static unsigned char mem[4096];
+	struct filter filters[256];
+	MQTTTopicTrie trie;
+	int maxnodes = MQTTTopicTrie_initStatic(&trie, mem, sizeof(mem));
+	int n, i, ok;
+
+	for (n = 0; n < 256; ++n)
+	{
+		filters[n].len = make_filter(filters[n].text);
+		filters[n].subscriber = n + 1;
+		filters[n].live = 1;
+		if (MQTTTopicTrie_add(&trie, filters[n].text, filters[n].len, (void*)(intptr_t)(n + 1), 0) < 0)
+			break;
+	}
+	ok = check_sample(&trie, filters, n, "fixed block");
+	for (i = 0; i < n; ++i)
+		MQTTTopicTrie_remove(&trie, filters[i].text, filters[i].len, (void*)(intptr_t)(i + 1));
+	if (ok && trie.edgecount != 0)
+	{
+		fprintf(stderr, "fixed block: %d edges left after removing every filter\n", trie.edgecount);
+		ok = 0;
+	}
+	printf("fixed %u byte block: %d nodes, %d filters before full\n", (unsigned)sizeof(mem), maxnodes, n);
+	return ok;
+}
+
+
+static void subscribe_all(MQTTTopicTrie* trie, struct filter* filters, int nfilters)
+{
+	int i, j;
+
+	for (i = 0; i < nfilters; i += FILTERS_PER_SUBSCRIBER)
+	{
+		MQTTString strings[FILTERS_PER_SUBSCRIBER];
+		int qoss[FILTERS_PER_SUBSCRIBER];
+		int count = (nfilters - i < FILTERS_PER_SUBSCRIBER) ? nfilters - i : FILTERS_PER_SUBSCRIBER;
+
+		for (j = 0; j < count; ++j)
+		{
+			strings[j].cstring = NULL;
+			strings[j].lenstring.data = filters[i + j].text;
+			strings[j].lenstring.len = filters[i + j].len;
+			qoss[j] = 1;
+		}
+		MQTTTopicTrie_subscribe(trie, (void*)(intptr_t)filters[i].subscriber, count, strings, qoss);
+	}
+}
+
+
+static void unsubscribe_half(MQTTTopicTrie* trie, struct filter* filters, int nfilters)
+{
+	int i, j;
+
+	for (i = 0; i < nfilters; i += 2 * FILTERS_PER_SUBSCRIBER)
+	{
+		MQTTString strings[FILTERS_PER_SUBSCRIBER];
+		int count = (nfilters - i < FILTERS_PER_SUBSCRIBER) ? nfilters - i : FILTERS_PER_SUBSCRIBER;
+
+		for (j = 0; j < count; ++j)
+		{
+			strings[j].cstring = NULL;
+			strings[j].lenstring.data = filters[i + j].text;
+			strings[j].lenstring.len = filters[i + j].len;
+			filters[i + j].live = 0;
+		}
+		MQTTTopicTrie_unsubscribe(trie, (void*)(intptr_t)filters[i].subscriber, count, strings);
+	}
+}
+
+
+static void report_memory(MQTTTopicTrie* trie)
+{
+	size_t bytes = trie->maxnodes * sizeof(MQTTTopicNode) + trie->maxsubs * sizeof(MQTTTopicSub)
+			+ trie->edgesize * sizeof(MQTTTopicEdge) + trie->labelsize;
+
+	printf("%d nodes, %d subscriptions, %d label bytes: %.1f MB allocated\n", trie->nodecount, trie->subcount,
+			trie->labelused, bytes / 1e6);
+}
+
+
+int main(int argc, char** argv)
+{
+	int nfilters = (argc > 1) ? atoi(argv[1]) : 100000;
+	int ntopics = (argc > 2) ? atoi(argv[2]) : 2000000;
+	struct filter* filters = malloc(nfilters * sizeof(*filters));
+	char (*topics)[64] = malloc(4096 * sizeof(*topics));
+	int* tlens = malloc(4096 * sizeof(int));
+	MQTTTopicTrie trie;
+	unsigned long sum = 0, matched = 0;
+	uint64_t start;
+	int i, scan;
+
+	if (!check_examples() || !check_static())
+		return 1;
+	for (i = 0; i < nfilters; ++i)
+	{
+		int j = i - i % FILTERS_PER_SUBSCRIBER;
+
+		filters[i].len = make_filter(filters[i].text);
+		filters[i].subscriber = 1 + i / FILTERS_PER_SUBSCRIBER;
+		filters[i].live = 1;
+		for (; j < i; ++j)
+			if (strcmp(filters[j].text, filters[i].text) == 0)
+				break;
+		if (j < i)
+			--i;	/* the same subscriber twice on a filter is one subscription */
+	}
+	for (i = 0; i < 4096; ++i)
+		tlens[i] = make_topic(topics[i]);
+
+	MQTTTopicTrie_init(&trie);
+	start = bench_now_ns();
+	subscribe_all(&trie, filters, nfilters);
+	bench_report("MQTTTopicTrie_subscribe, per filter", nfilters, bench_now_ns() - start);
+	report_memory(&trie);
+	if (!check_sample(&trie, filters, nfilters, "after subscribe"))
+		return 1;
+
+	start = bench_now_ns();
+	for (i = 0; i < ntopics; ++i)
+		matched += MQTTTopicTrie_match(&trie, topics[i & 4095], tlens[i & 4095], on_count, &sum);
+	bench_report("MQTTTopicTrie_match", ntopics, bench_now_ns() - start);
+	printf("%.1f matching subscriptions per topic\n", (double)matched / ntopics);
+
+	scan = 200;
+	start = bench_now_ns();
+	for (i = 0; i < scan; ++i)
+	{
+		int j;
+
+		for (j = 0; j < nfilters; ++j)
+			sum += MQTTTopic_matches(filters[j].text, filters[j].len, topics[i & 4095], tlens[i & 4095]);
+	}
+	bench_report("MQTTTopic_matches over every filter", scan, bench_now_ns() - start);
+
+	start = bench_now_ns();
+	unsubscribe_half(&trie, filters, nfilters);
+	bench_report("MQTTTopicTrie_unsubscribe, per filter", (nfilters + 1) / 2, bench_now_ns() - start);
+	if (!check_sample(&trie, filters, nfilters, "after unsubscribe"))
+		return 1;
+	start = bench_now_ns();
+	for (i = 0, matched = 0; i < ntopics; ++i)
+		matched += MQTTTopicTrie_match(&trie, topics[i & 4095], tlens[i & 4095], on_count, &sum);
+	bench_report("MQTTTopicTrie_match, half unsubscribed", ntopics, bench_now_ns() - start);
+	printf("%.1f matching subscriptions per topic\n", (double)matched / ntopics);
+
+	for (i = 0; i < nfilters; ++i)
+		if (filters[i].live)
+			MQTTTopicTrie_remove(&trie, filters[i].text, filters[i].len, (void*)(intptr_t)filters[i].subscriber);
+	if (trie.edgecount != 0 || trie.nodes[0].children != 0)
+	{
+		fprintf(stderr, "%d edges left after removing every filter\n", trie.edgecount);
+		return 1;
+	}
+	bench_sink = sum;
+	MQTTTopicTrie_free(&trie);
+	free(filters);
+	free(topics);
+	free(tlens);
+	return 0;
+}
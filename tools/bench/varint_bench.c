@@ -0,0 +1,249 @@
+/*******************************************************************************
+ * Remaining length (varint) benchmark.
+ *
+ * The original division/modulo encoder and the decoder that pulls one byte
+ * at a time through a function pointer are kept here as the reference.
+ * Before timing, MQTTPacket_encode, MQTTPacket_decodeBuf, MQTTPacket_decodeRange
+ * and MQTTPacket_len are checked against it on every length up to 2^21 and
+ * on a sample of the 4 byte range, plus truncated and over-long fields.
+ * Each of the 1 to 4 byte cases is then timed on its own, and a stream of
+ * mixed sizes where the field length cannot be predicted. MQTTPacket.c is
+ * built into the benchmark, so both sides are plain calls.
+ *
+ * usage: varint_bench [iterations]
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define VALUES 4096
+
+static const int limits[5] = { 0, 128, 16384, 2097152, 268435456 };
+
+static uint64_t rng = 88172645463325252ull;
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+__attribute__((noinline, noclone)) static int ref_encode(unsigned char* buf, int length)
+{
+	int rc = 0;
+
+	do
+	{
+		char d = length % 128;
+
+		length /= 128;
+		if (length > 0)
+			d |= 0x80;
+		buf[rc++] = d;
+	} while (length > 0);
+	return rc;
+}
+
+
+static unsigned char* ref_ptr;
+
+
+static int ref_getchar(unsigned char* c, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i)
+		*c = *ref_ptr++;
+	return count;
+}
+
+
+__attribute__((noinline, noclone)) static int ref_decode(int (*getcharfn)(unsigned char*, int), int* value)
+{
+	unsigned char c;
+	int multiplier = 1, len = 0;
+
+	*value = 0;
+	do
+	{
+		if (++len > 4)
+			return len;
+		if ((*getcharfn)(&c, 1) != 1)
+			return len;
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return len;
+}
+
+
+static int ref_decodeBuf(unsigned char* buf, int* value)
+{
+	ref_ptr = buf;
+	return ref_decode(ref_getchar, value);
+}
+
+
+static int check_one(int v)
+{
+	unsigned char a[8], b[8];
+	int alen = ref_encode(a, v), blen = MQTTPacket_encode(b, v);
+	int value, n;
+
+	if (alen != blen || memcmp(a, b, alen) != 0)
+		return 0;
+	if (MQTTPacket_len(v) != 1 + alen + v)
+		return 0;
+	if (MQTTPacket_decodeBuf(b, &value) != alen || value != v)
+		return 0;
+	/* as the last bytes of the data, and with the next packet behind it */
+	if (MQTTPacket_decodeRange(b, b + alen, &value) != alen || value != v)
+		return 0;
+	memset(b + alen, 0xFF, sizeof(b) - alen);
+	if (MQTTPacket_decodeRange(b, b + sizeof(b), &value) != alen || value != v)
+		return 0;
+	for (n = 0; n < alen; ++n)
+		if (MQTTPacket_decodeRange(b, b + n, &value) != 0)
+			return 0;
+	return 1;
+}
+
+
+static int check(void)
+{
+	unsigned char bad[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0, 0, 0 };
+	int v, value, k, i;
+
+	for (v = 0; v < limits[3]; ++v)
+		if (!check_one(v))
+			goto fail;
+	for (i = 0; i < 1000000; ++i)
+		if (!check_one(v = limits[3] + rnd(limits[4] - limits[3])))
+			goto fail;
+	for (k = 1; k < 5; ++k)
+		for (v = limits[k] - 2; v <= limits[k] + 1 && v < limits[4]; ++v)
+			if (!check_one(v))
+				goto fail;
+	v = -1;
+	if (MQTTPacket_decodeRange(bad, bad + 8, &value) != MQTTPACKET_READ_ERROR
+			|| MQTTPacket_decodeRange(bad, bad + 3, &value) != 0
+			|| MQTTPacket_decodeBuf(bad, &value) != ref_decodeBuf(bad, &k))
+		goto fail;
+	return 1;
+fail:
+	fprintf(stderr, "remaining length %d: differs from the reference\n", v);
+	return 0;
+}
+
+
+/**
+ * Fills buf with VALUES encoded lengths of the given size, or of random sizes
+ * if bytes is 0, back to back.
+ */
+static int fill(int bytes, int* values, unsigned char* buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < VALUES; ++i)
+	{
+		int b = bytes ? bytes : 1 + rnd(4);
+
+		values[i] = limits[b - 1] + rnd(limits[b] - limits[b - 1]);
+		len += ref_encode(buf + len, values[i]);
+	}
+	return len;
+}
+
+
+int main(int argc, char** argv)
+{
+	long iterations = (argc > 1) ? atol(argv[1]) : 5000;
+	static int values[VALUES];
+	static unsigned char buf[VALUES * 4 + 4];
+	int bytes;
+
+	if (!check())
+		return 1;
+	printf("verified against the division/modulo reference\n");
+
+	for (bytes = 1; bytes <= 5; ++bytes)
+	{
+		uint64_t ops = (uint64_t)iterations * VALUES, start;
+		int len = fill(bytes % 5, values, buf);
+		unsigned sum = 0;
+		char size[16], name[64];
+		long n;
+		int i;
+
+		snprintf(size, sizeof(size), (bytes < 5) ? "%d byte" : "mixed", bytes);
+		start = bench_now_ns();
+		for (n = 0; n < iterations; ++n)
+			for (i = 0, len = 0; i < VALUES; ++i)
+				len += ref_encode(buf + len, values[i]);
+		sum += buf[len - 1];
+		snprintf(name, sizeof(name), "%s reference encode", size);
+		bench_report(name, ops, bench_now_ns() - start);
+
+		start = bench_now_ns();
+		for (n = 0; n < iterations; ++n)
+			for (i = 0, len = 0; i < VALUES; ++i)
+				len += MQTTPacket_encode(buf + len, values[i]);
+		sum += buf[len - 1];
+		snprintf(name, sizeof(name), "%s MQTTPacket_encode", size);
+		bench_report(name, ops, bench_now_ns() - start);
+
+		start = bench_now_ns();
+		for (n = 0; n < iterations; ++n)
+		{
+			unsigned char* p = buf;
+			int value;
+
+			for (i = 0; i < VALUES; ++i)
+			{
+				p += ref_decodeBuf(p, &value);
+				sum += value;
+			}
+		}
+		snprintf(name, sizeof(name), "%s reference decode", size);
+		bench_report(name, ops, bench_now_ns() - start);
+
+		start = bench_now_ns();
+		for (n = 0; n < iterations; ++n)
+		{
+			unsigned char* p = buf;
+			int value;
+
+			for (i = 0; i < VALUES; ++i)
+			{
+				p += MQTTPacket_decodeBuf(p, &value);
+				sum += value;
+			}
+		}
+		snprintf(name, sizeof(name), "%s MQTTPacket_decodeBuf", size);
+		bench_report(name, ops, bench_now_ns() - start);
+
+		start = bench_now_ns();
+		for (n = 0; n < iterations; ++n)
+		{
+			unsigned char* p = buf;
+			int value;
+
+			for (i = 0; i < VALUES; ++i)
+			{
+				p += MQTTPacket_decodeRange(p, buf + len, &value);
+				sum += value;
+			}
+		}
+		snprintf(name, sizeof(name), "%s MQTTPacket_decodeRange", size);
+		bench_report(name, ops, bench_now_ns() - start);
+		bench_sink = sum;
+	}
+	return 0;
+}
@@ -0,0 +1,1454 @@
+/*******************************************************************************
+ * Broker stand-in for the test rigs, built on the MQTTPacketServer library.
+ *
+ * Every shard runs a netio loop, over io_uring or epoll, on its own listening
+ * socket of the port (SO_REUSEPORT spreads the connections). Supports
+ * CONNECT, SUBSCRIBE/UNSUBSCRIBE (with '+'/'#' filters, in an MQTTTopicTrie
+ * per shard), PUBLISH with QoS 0/1/2 acknowledgement towards the publisher,
+ * PINGREQ and DISCONNECT.
+ *
+ * Messages are delivered to subscribers at QoS 0 as the bytes received,
+ * with only the fixed header rewritten and the packet identifier left out
+ * (MQTTRelay_publish). Small ones are copied onto the subscribers'
+ * connections straight from the receive buffer; larger ones, and those for
+ * other shards, are put together once and queued by reference. Retained messages are kept in a retain_store shared by the shards
+ * and sent to new subscriptions; it can be mapped from a snapshot file that
+ * survives restarts.
+ *
+ * Shared subscriptions, "$share/group/filter" as in MQTT 5, spread the
+ * messages of the filter over the members of the group: each goes to one
+ * shard with members, picked from the message's sequence number so that the
+ * shards agree without talking, and there to the member with the least
+ * output queued or the next in turn. They get no retained messages.
+ *
+ * A client with a persistent session (clean session false) is kept when its
+ * connection closes: its subscriptions stay in the trie, bar the shared
+ * ones, and QoS 1 messages for its QoS 1 subscriptions go to the queue of
+ * its session, online or not. They are sent at QoS 1 from there and stay
+ * until acknowledged; a new connection for the session takes the client
+ * over and gets them again. The session logs are per shard.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "MQTTPacket.h"
+#include "broker.h"
+#include "retain.h"
+#include "session.h"
+#include "../net/mpsc.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_PACKET_SIZE (256 * 1024)
+#define MAX_TX_BACKLOG (8 * 1024 * 1024)	/* drop deliveries to slower consumers */
+#define MAX_FILTERS_PER_PACKET 32
+#define SHARE_PREFIX "$share/"
+#define SHARE_PREFIX_LEN 7
+#define MIN_BATCH 64
+#define MAX_QUEUED 1000	/* per session, by default */
+
+/* what a subscription in the trie points to */
+enum
+{
+	SUB_CLIENT, SUB_GROUP
+};
+
+/* messages between shards */
+enum
+{
+	MSG_PUBLISH, MSG_ADOPT, MSG_SYNC
+};
+
+struct client
+{
+	int kind;	/* SUB_CLIENT */
+	struct netio_conn* conn;
+	int connected;
+	char id[SESSION_ID_MAX];
+	struct session* session;	/* if persistent, the client stays when the connection closes */
+	struct { char* filter; int len; }* filters;	/* to unsubscribe on close */
+	int nfilters, sizefilters;
+	struct client* prev;	/* every client of the shard */
+	struct client* next;
+};
+
+/* a shared subscription over all shards: which of them have members */
+struct share_entry
+{
+	char* name;
+	int len;
+	uint64_t shards;	/* a bit per shard, read without the lock */
+	int refs;	/* shards with a share_group */
+	struct share_entry* link;
+};
+
+/* the members of a shared subscription on one shard */
+struct share_group
+{
+	int kind;	/* SUB_GROUP */
+	char* name;	/* "$share/group/filter" */
+	int len;
+	int filter;	/* offset of the filter in name */
+	struct client** members;
+	int nmembers, sizemembers;
+	int next;	/* next in turn */
+	struct share_entry* entry;
+	struct share_group* link;
+};
+
+struct shard_msg
+{
+	struct mpsc_node node;
+	int type;
+};
+
+/* the PUBLISH packets of a loop round for another shard */
+struct publish_batch
+{
+	struct shard_msg hdr;
+	int count, size;
+	struct
+	{
+		struct netio_buf* packet;
+		uint64_t seq;
+		int qos;	/* as published */
+	} items[];
+};
+
+/* a connection moving to the shard of its client ID */
+struct adoption
+{
+	struct shard_msg hdr;
+	int fd;
+	int len;
+	unsigned char data[];	/* received and not handled yet, the CONNECT first */
+};
+
+struct shard
+{
+	struct broker* broker;
+	int id;
+	pthread_t thread;
+	struct netio* io;
+	int lfd;
+	MQTTTopicTrie subs;
+	struct share_group* groups;
+	struct client* all;
+	struct session_log* session_log;
+	struct mpsc inbox;
+	int signalled;	/* a netio_wake() is on its way */
+	struct publish_batch** out;	/* to each shard, sent after the loop round */
+	uint64_t seq;
+	unsigned long clients, sessions, msgs_in, msgs_out, dropped, handovers;
+};
+
+struct broker
+{
+	struct broker_config cfg;
+	int port;
+	int nshards;
+	struct shard* shards;
+	struct retain_store* retained;
+	pthread_mutex_t retain_lock;
+	struct share_entry* share_entries;
+	pthread_mutex_t share_lock;
+	int stop;
+};
+
+static __thread struct shard* self;	/* the shard of the netio callbacks */
+
+
+/**
+ * Queues bytes for sending, they are written once the current batch of
+ * packets is handled.
+ */
+static unsigned char* tx_reserve(struct client* c, int len)
+{
+	return netio_reserve(self->io, c->conn, len);
+}
+
+
+static void tx_commit(struct client* c, int len)
+{
+	netio_commit(c->conn, len);
+}
+
+
+static void wake(struct shard* s)
+{
+	if (!__atomic_exchange_n(&s->signalled, 1, __ATOMIC_ACQ_REL))
+		netio_wake(s->io);
+}
+
+
+static int shard_of(const struct broker* b, const char* id)
+{
+	uint32_t h = 2166136261u;
+
+	while (*id)
+		h = (h ^ (unsigned char)*id++) * 16777619u;
+	return (int)(h % (uint32_t)b->nshards);
+}
+
+
+/**
+ * @return the length of "$share/group/" at the start of a filter, 0 if it is
+ * not shared, -1 if malformed
+ */
+static int share_prefix(const char* f, int len)
+{
+	int i;
+
+	if (len < SHARE_PREFIX_LEN || memcmp(f, SHARE_PREFIX, SHARE_PREFIX_LEN) != 0)
+		return 0;
+	for (i = SHARE_PREFIX_LEN; i < len && f[i] != '/'; ++i)
+		if (f[i] == '+' || f[i] == '#')
+			return -1;
+	if (i == SHARE_PREFIX_LEN || i + 1 >= len)
+		return -1;
+	return i + 1;
+}
+
+
+static struct share_entry* share_enter(struct broker* b, const char* name, int len)
+{
+	struct share_entry* e;
+
+	pthread_mutex_lock(&b->share_lock);
+	for (e = b->share_entries; e; e = e->link)
+		if (e->len == len && memcmp(e->name, name, len) == 0)
+			break;
+	if (!e && (e = calloc(1, sizeof(*e))))
+	{
+		if (!(e->name = malloc(len)))
+		{
+			free(e);
+			e = NULL;
+		}
+		else
+		{
+			memcpy(e->name, name, len);
+			e->len = len;
+			e->link = b->share_entries;
+			b->share_entries = e;
+		}
+	}
+	if (e)
+	{
+		e->refs++;
+		__atomic_or_fetch(&e->shards, 1ull << self->id, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&b->share_lock);
+	return e;
+}
+
+
+static void share_exit(struct broker* b, struct share_entry* e)
+{
+	struct share_entry** pe;
+
+	pthread_mutex_lock(&b->share_lock);
+	__atomic_and_fetch(&e->shards, ~(1ull << self->id), __ATOMIC_RELEASE);
+	if (--e->refs == 0)
+	{
+		for (pe = &b->share_entries; *pe != e; pe = &(*pe)->link)
+			;
+		*pe = e->link;
+		free(e->name);
+		free(e);
+	}
+	pthread_mutex_unlock(&b->share_lock);
+}
+
+
+static struct share_group** share_find(const char* name, int len)
+{
+	struct share_group** g;
+
+	for (g = &self->groups; *g; g = &(*g)->link)
+		if ((*g)->len == len && memcmp((*g)->name, name, len) == 0)
+			break;
+	return g;
+}
+
+
+static void share_free(struct share_group* g)
+{
+	if (g->entry)
+		share_exit(self->broker, g->entry);
+	free(g->members);
+	free(g->name);
+	free(g);
+}
+
+
+static int share_join(struct client* c, const char* name, int len, int prefix)
+{
+	struct share_group** pg = share_find(name, len);
+	struct share_group* g = *pg;
+	int i;
+
+	if (!g)
+	{
+		if (!(g = calloc(1, sizeof(*g))) || !(g->name = malloc(len)))
+		{
+			free(g);
+			return -1;
+		}
+		g->kind = SUB_GROUP;
+		memcpy(g->name, name, len);
+		g->len = len;
+		g->filter = prefix;
+		if (!(g->entry = share_enter(self->broker, name, len))
+				|| MQTTTopicTrie_add(&self->subs, name + prefix, len - prefix, g, 0) < 0)
+		{
+			share_free(g);
+			return -1;
+		}
+		*pg = g;
+	}
+	for (i = 0; i < g->nmembers; ++i)
+		if (g->members[i] == c)
+			return 0;
+	if (g->nmembers == g->sizemembers)
+	{
+		int size = g->sizemembers ? g->sizemembers * 2 : 4;
+		void* p = realloc(g->members, size * sizeof(*g->members));
+
+		if (!p)
+			return -1;	/* an empty group stays until its next member leaves */
+		g->members = p;
+		g->sizemembers = size;
+	}
+	g->members[g->nmembers++] = c;
+	return 0;
+}
+
+
+static void share_leave(struct client* c, const char* name, int len)
+{
+	struct share_group** pg = share_find(name, len);
+	struct share_group* g = *pg;
+	int i;
+
+	if (!g)
+		return;
+	for (i = 0; i < g->nmembers; ++i)
+		if (g->members[i] == c)
+		{
+			g->members[i] = g->members[--g->nmembers];
+			break;
+		}
+	if (g->nmembers > 0)
+		return;
+	MQTTTopicTrie_remove(&self->subs, g->name + g->filter, g->len - g->filter, g);
+	*pg = g->link;
+	share_free(g);
+}
+
+
+/**
+ * Whether this shard delivers a message to a group: every shard with
+ * members works out the same one from the sequence number.
+ */
+static int share_ours(const struct share_group* g, uint64_t seq)
+{
+	uint64_t shards = __atomic_load_n(&g->entry->shards, __ATOMIC_ACQUIRE);
+	int n = __builtin_popcountll(shards), k;
+
+	if (n <= 1)
+		return 1;
+	for (k = (int)(((seq * 0x9E3779B97F4A7C15ull) >> 32) % n); k > 0; --k)
+		shards &= shards - 1;
+	return __builtin_ctzll(shards) == self->id;
+}
+
+
+/**
+ * The member of a group to send the next message to.
+ */
+static struct client* share_pick(struct share_group* g)
+{
+	int i, best, least = -1;
+
+	if (g->nmembers == 0)
+		return NULL;
+	if (g->next >= g->nmembers)
+		g->next = 0;
+	best = g->next;
+	if (self->broker->cfg.share_dispatch == SHARE_LEAST_LOADED)
+		/* starting with the next in turn, so that ties go round */
+		for (i = 0; i < g->nmembers; ++i)
+		{
+			int m = (g->next + i) % g->nmembers;
+			int queued = netio_queued(g->members[m]->conn);
+
+			if (least < 0 || queued < least)
+			{
+				least = queued;
+				best = m;
+			}
+		}
+	g->next = best + 1;
+	return g->members[best];
+}
+
+
+static int subscribe(struct client* c, const char* filter, int len, int qos)
+{
+	int prefix = share_prefix(filter, len);
+
+	if (prefix < 0)
+		return -1;
+	if (prefix > 0)
+		return share_join(c, filter, len, prefix);
+	return (MQTTTopicTrie_add(&self->subs, filter, len, c, qos) < 0) ? -1 : 0;
+}
+
+
+static void unsubscribe(struct client* c, const char* filter, int len)
+{
+	if (share_prefix(filter, len) > 0)
+		share_leave(c, filter, len);
+	else
+		MQTTTopicTrie_remove(&self->subs, filter, len, c);
+}
+
+
+static struct client* client_new(struct netio_conn* conn)
+{
+	struct client* c = calloc(1, sizeof(*c));
+
+	if (c)
+	{
+		c->kind = SUB_CLIENT;
+		c->conn = conn;
+		c->next = self->all;
+		if (self->all)
+			self->all->prev = c;
+		self->all = c;
+	}
+	return c;
+}
+
+
+static void client_free(struct client* c)
+{
+	int i;
+
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		self->all = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	for (i = 0; i < c->nfilters; ++i)
+		free(c->filters[i].filter);
+	free(c->filters);
+	free(c);
+}
+
+
+/**
+ * Ends the persistent session of a client without a connection, which is freed.
+ */
+static void end_session(struct client* c)
+{
+	int i;
+
+	for (i = 0; i < c->nfilters; ++i)
+		unsubscribe(c, c->filters[i].filter, c->filters[i].len);
+	session_end(self->session_log, c->session);
+	client_free(c);
+	self->sessions--;
+}
+
+
+static void on_close(struct netio_conn* conn)
+{
+	struct client* c = conn->user;
+	int i;
+
+	if (self->broker->cfg.verbose)
+		fprintf(stderr, "close %s (fd %d)\n", c->id[0] ? c->id : "?", conn->fd);
+	self->clients--;
+	if (c->session)
+	{
+		/* away: out of the shared subscriptions, the others stay to queue messages */
+		for (i = 0; i < c->nfilters; ++i)
+			if (share_prefix(c->filters[i].filter, c->filters[i].len) > 0)
+				share_leave(c, c->filters[i].filter, c->filters[i].len);
+		c->conn = NULL;
+		c->connected = 0;
+		return;
+	}
+	for (i = 0; i < c->nfilters; ++i)
+		unsubscribe(c, c->filters[i].filter, c->filters[i].len);
+	client_free(c);
+}
+
+
+struct delivery
+{
+	MQTTString topic;
+	unsigned char* publish;	/* as received, or forwarded by another shard */
+	int publishlen;
+	int qos;	/* as published */
+	MQTTRelayedPublish relay;	/* the publish at QoS 0 */
+	int len;
+	struct netio_buf* packet;	/* put together for the first subscriber that needs it */
+	uint64_t seq;	/* of the publishing shard */
+};
+
+
+static int serialize(struct delivery* d)
+{
+	if (!d->packet)
+	{
+		if (!(d->packet = netio_buf_new(d->len)))
+			return -1;
+		d->packet->len = MQTTSerialize_relayedPublish(d->packet->data, d->len, &d->relay);
+	}
+	return 0;
+}
+
+
+/**
+ * Queues a delivery on a connection, small ones copied from where they were
+ * received.
+ */
+static int send_delivery(struct client* c, struct delivery* d)
+{
+	if (!d->packet && d->len <= NETIO_BUF_COPY_MAX)
+	{
+		transport_iovec_t iov[3];
+		MQTTRelayedPublish* rp = &d->relay;
+
+		iov[0].base = rp->header;
+		iov[0].len = rp->headerlen;
+		iov[1].base = rp->topic;
+		iov[1].len = rp->topiclen;
+		iov[2].base = rp->payload;
+		iov[2].len = rp->payloadlen;
+		return netio_sendv(self->io, c->conn, iov, 3);
+	}
+	if (serialize(d) < 0)
+		return -1;
+	return netio_send_buf(self->io, c->conn, d->packet);
+}
+
+
+/**
+ * Sends the messages queued for a persistent session that were not sent on
+ * its connection yet, as many as there is room for.
+ */
+static void send_queued(struct client* c)
+{
+	unsigned char* packet;
+	unsigned char* p;
+	int len;
+
+	while (c->connected && (len = session_peek(self->session_log, c->session, &packet)) > 0)
+	{
+		if (!(p = tx_reserve(c, len)))
+			break;	/* the rest with the next PUBACK */
+		memcpy(p, packet, len);
+		tx_commit(c, len);
+		session_sent(self->session_log, c->session);
+		self->msgs_out++;
+	}
+}
+
+
+static void deliver(void* subscriber, int qos, void* ctx)
+{
+	struct client* c = subscriber;
+	struct delivery* d = ctx;
+
+	if (c->kind == SUB_GROUP && (!share_ours(subscriber, d->seq) || !(c = share_pick(subscriber))))
+		return;
+	if (c->session && qos > 0 && d->qos > 0)
+	{
+		if (session_queue(self->session_log, c->session, d->publish, d->publishlen) != 0)
+			self->dropped++;	/* the oldest message, or this one */
+		send_queued(c);
+		return;
+	}
+	if (!c->connected)
+		return;
+	if (send_delivery(c, d) < 0)
+	{
+		self->dropped++;
+		return;
+	}
+	self->msgs_out++;
+}
+
+
+/**
+ * Passes a PUBLISH on to the other shards, with the next loop round.
+ */
+static void forward(struct delivery* d)
+{
+	struct broker* b = self->broker;
+	int i;
+
+	if (serialize(d) < 0)
+	{
+		self->dropped += b->nshards - 1;
+		return;
+	}
+	for (i = 0; i < b->nshards; ++i)
+	{
+		struct publish_batch* pb = self->out[i];
+
+		if (i == self->id)
+			continue;
+		if (!pb || pb->count == pb->size)
+		{
+			int size = pb ? pb->size * 2 : MIN_BATCH;
+
+			if (!(pb = realloc(pb, sizeof(*pb) + size * sizeof(pb->items[0]))))
+			{
+				self->dropped++;
+				continue;
+			}
+			if (!self->out[i])
+			{
+				pb->hdr.type = MSG_PUBLISH;
+				pb->count = 0;
+			}
+			pb->size = size;
+			self->out[i] = pb;
+		}
+		pb->items[pb->count].packet = netio_buf_get(d->packet);
+		pb->items[pb->count].seq = d->seq;
+		pb->items[pb->count].qos = d->qos;
+		pb->count++;
+	}
+}
+
+
+static void send_batches(struct shard* s)
+{
+	int i;
+
+	for (i = 0; i < s->broker->nshards; ++i)
+		if (s->out[i])
+		{
+			mpsc_push(&s->broker->shards[i].inbox, &s->out[i]->hdr.node);
+			wake(&s->broker->shards[i]);
+			s->out[i] = NULL;
+		}
+}
+
+
+/**
+ * Sends a retained message to a new subscription, with the RETAIN flag set.
+ */
+static void send_retained(const char* topic, int tlen, const unsigned char* payload, int plen, int qos, void* ctx)
+{
+	struct client* c = ctx;
+	MQTTString topicString = MQTTString_initializer;
+	int len = MQTTPacket_len(2 + tlen + plen);
+	unsigned char* p;
+
+	if (!(p = tx_reserve(c, len)))
+	{
+		self->dropped++;
+		return;
+	}
+	topicString.lenstring.data = (char*)topic;
+	topicString.lenstring.len = tlen;
+	tx_commit(c, MQTTSerialize_publish(p, len, 0, 0, 1, 0, topicString, (unsigned char*)payload, plen));
+	self->msgs_out++;
+}
+
+
+static int add_filter(struct client* c, MQTTString* f)
+{
+	char* copy;
+	int i;
+
+	for (i = 0; i < c->nfilters; ++i)
+		if (c->filters[i].len == f->lenstring.len && memcmp(c->filters[i].filter, f->lenstring.data, f->lenstring.len) == 0)
+			return 0;	/* subscribed again */
+	if (c->nfilters == c->sizefilters)
+	{
+		int size = c->sizefilters ? c->sizefilters * 2 : 4;
+		void* p = realloc(c->filters, size * sizeof(*c->filters));
+
+		if (!p)
+			return -1;
+		c->filters = p;
+		c->sizefilters = size;
+	}
+	if (!(copy = malloc(f->lenstring.len)))
+		return -1;
+	memcpy(copy, f->lenstring.data, f->lenstring.len);
+	c->filters[c->nfilters].filter = copy;
+	c->filters[c->nfilters].len = f->lenstring.len;
+	c->nfilters++;
+	return 0;
+}
+
+
+/**
+ * @return 1 if the client had subscribed to the filter, 0 if not
+ */
+static int remove_filter(struct client* c, MQTTString* f)
+{
+	int i;
+
+	for (i = 0; i < c->nfilters; ++i)
+		if (c->filters[i].len == f->lenstring.len && memcmp(c->filters[i].filter, f->lenstring.data, f->lenstring.len) == 0)
+		{
+			free(c->filters[i].filter);
+			c->filters[i] = c->filters[--c->nfilters];
+			return 1;
+		}
+	return 0;
+}
+
+
+/**
+ * Sets up the session of a connecting client. A persistent one takes over
+ * the client of the session, from an earlier connection or a restart, with
+ * its subscriptions and queue.
+ * @return the client of the connection, NULL on error
+ */
+static struct client* open_session(struct client* c, int clean, int* present)
+{
+	struct session* s = c->id[0] ? session_find(self->session_log, c->id) : NULL;
+	struct client* old = s ? session_user(s) : NULL;
+	int i, prefix;
+
+	*present = 0;
+	if (old && old->conn)
+		netio_close(self->io, old->conn);	/* still connected: on_close keeps the session */
+	if (clean || !c->id[0])
+	{
+		if (old)
+			end_session(old);
+		return c;
+	}
+	if (!old)
+	{
+		if (!(c->session = session_new(self->session_log, c->id)))
+			return NULL;
+		session_set_user(c->session, c);
+		self->sessions++;
+		return c;
+	}
+	old->conn = c->conn;
+	old->conn->user = old;
+	client_free(c);
+	for (i = 0; i < old->nfilters; ++i)
+		if ((prefix = share_prefix(old->filters[i].filter, old->filters[i].len)) > 0)
+			share_join(old, old->filters[i].filter, old->filters[i].len, prefix);
+	session_rewind(s);
+	*present = 1;
+	return old;
+}
+
+
+static int send_ack(struct client* c, unsigned char type, unsigned short packetid)
+{
+	unsigned char* p = tx_reserve(c, 4);
+
+	if (!p)
+		return -1;
+	tx_commit(c, MQTTSerialize_ack(p, 4, type, 0, packetid));
+	return 0;
+}
+
+
+/**
+ * Handles one complete packet.
+ * @return 0 to keep the connection, -1 to close it, 1 to hand it to the
+ * shard of its client ID, the packet unhandled
+ */
+static int handle_packet(struct client* c, unsigned char* buf, int len)
+{
+	struct broker* b = self->broker;
+	MQTTHeader header = {0};
+	unsigned char* p;
+	int i;
+
+	header.byte = buf[0];
+	if (!c->connected && header.bits.type != CONNECT)
+		return -1;
+	switch (header.bits.type)
+	{
+	case CONNECT:
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		int n, present;
+
+		if (c->connected || MQTTDeserialize_connect(&data, buf, len) != 1)
+			return -1;
+		n = data.clientID.lenstring.len < (int)sizeof(c->id) - 1 ? data.clientID.lenstring.len : (int)sizeof(c->id) - 1;
+		memcpy(c->id, data.clientID.lenstring.data, n);
+		c->id[n] = '\0';
+		if (b->nshards > 1 && n > 0 && shard_of(b, c->id) != self->id)
+			return 1;
+		if (!(c = open_session(c, data.cleansession, &present)))
+			return -1;
+		c->connected = 1;
+		if (b->cfg.verbose)
+			fprintf(stderr, "connect %s (fd %d, shard %d%s)\n", c->id, c->conn->fd, self->id,
+					present ? ", session present" : c->session ? ", new session" : "");
+		if (!(p = tx_reserve(c, 4)))
+			return -1;
+		tx_commit(c, MQTTSerialize_connack(p, 4, 0, present));
+		if (c->session)
+			send_queued(c);
+		break;
+	}
+	case PUBLISH:
+	{
+		unsigned char dup, retained;
+		unsigned short packetid = 0;
+		int qos;
+		unsigned char* payload;
+		int payloadlen;
+		struct delivery d;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &d.topic, &payload, &payloadlen, buf, len) != 1
+				|| (d.len = MQTTRelay_publish(&d.relay, 0, 0, 0, buf, len)) <= 0)
+			return -1;
+		self->msgs_in++;
+		if (retained)
+		{
+			pthread_mutex_lock(&b->retain_lock);
+			if (retain_set(b->retained, d.topic.lenstring.data, d.topic.lenstring.len, payload, payloadlen, qos) < 0
+					&& b->cfg.verbose)
+				fprintf(stderr, "retained message on %.*s not stored\n", d.topic.lenstring.len, d.topic.lenstring.data);
+			pthread_mutex_unlock(&b->retain_lock);
+		}
+		d.publish = buf;
+		d.publishlen = len;
+		d.qos = qos;
+		d.packet = NULL;
+		d.seq = ((uint64_t)self->id << 48) | self->seq++;
+		MQTTTopicTrie_match(&self->subs, d.topic.lenstring.data, d.topic.lenstring.len, deliver, &d);
+		if (b->nshards > 1)
+			forward(&d);
+		netio_buf_put(d.packet);
+		if (qos == 1)
+			return send_ack(c, PUBACK, packetid);
+		if (qos == 2)
+			return send_ack(c, PUBREC, packetid);
+		break;
+	}
+	case PUBREL:
+	{
+		unsigned char type, dup;
+		unsigned short packetid;
+
+		if (MQTTDeserialize_ack(&type, &dup, &packetid, buf, len) != 1)
+			return -1;
+		return send_ack(c, PUBCOMP, packetid);
+	}
+	case PUBACK:
+	{
+		unsigned char type, dup;
+		unsigned short packetid;
+
+		if (MQTTDeserialize_ack(&type, &dup, &packetid, buf, len) != 1)
+			return -1;
+		if (c->session && session_ack(self->session_log, c->session, packetid))
+			send_queued(c);
+		break;
+	}
+	case PUBREC:
+	case PUBCOMP:
+		break;	/* nothing is sent above QoS 1 */
+	case SUBSCRIBE:
+	{
+		unsigned char dup;
+		unsigned short packetid;
+		int count, qoss[MAX_FILTERS_PER_PACKET];
+		MQTTString filters[MAX_FILTERS_PER_PACKET];
+
+		if (MQTTDeserialize_subscribe(&dup, &packetid, MAX_FILTERS_PER_PACKET, &count, filters, qoss, buf, len) != 1)
+			return -1;
+		for (i = 0; i < count; ++i)
+		{
+			const char* filter = filters[i].lenstring.data;
+			int flen = filters[i].lenstring.len;
+
+			/* QoS 1 granted to persistent sessions, bar shared subscriptions */
+			qoss[i] = (c->session && qoss[i] > 0 && share_prefix(filter, flen) == 0) ? 1 : 0;
+			if (subscribe(c, filter, flen, qoss[i]) < 0)
+				qoss[i] = 0x80;
+			else if (add_filter(c, &filters[i]) < 0
+					|| (c->session && session_subscribe(self->session_log, c->session, filter, flen, qoss[i]) < 0))
+			{
+				remove_filter(c, &filters[i]);
+				unsubscribe(c, filter, flen);
+				qoss[i] = 0x80;
+			}
+		}
+		if (!(p = tx_reserve(c, 4 + count)))
+			return -1;
+		tx_commit(c, MQTTSerialize_suback(p, 4 + count, packetid, count, qoss));
+		pthread_mutex_lock(&b->retain_lock);
+		for (i = 0; i < count; ++i)
+			if (qoss[i] != 0x80 && share_prefix(filters[i].lenstring.data, filters[i].lenstring.len) == 0)
+				retain_match(b->retained, filters[i].lenstring.data, filters[i].lenstring.len, send_retained, c);
+		pthread_mutex_unlock(&b->retain_lock);
+		break;
+	}
+	case UNSUBSCRIBE:
+	{
+		unsigned char dup;
+		unsigned short packetid;
+		int count;
+		MQTTString filters[MAX_FILTERS_PER_PACKET];
+
+		if (MQTTDeserialize_unsubscribe(&dup, &packetid, MAX_FILTERS_PER_PACKET, &count, filters, buf, len) != 1)
+			return -1;
+		for (i = 0; i < count; ++i)
+			if (remove_filter(c, &filters[i]))
+			{
+				unsubscribe(c, filters[i].lenstring.data, filters[i].lenstring.len);
+				if (c->session)
+					session_unsubscribe(self->session_log, c->session, filters[i].lenstring.data, filters[i].lenstring.len);
+			}
+		if (!(p = tx_reserve(c, 4)))
+			return -1;
+		tx_commit(c, MQTTSerialize_unsuback(p, 4, packetid));
+		break;
+	}
+	case PINGREQ:
+		if (!(p = tx_reserve(c, 2)))
+			return -1;
+		p[0] = PINGRESP << 4;
+		p[1] = 0;
+		tx_commit(c, 2);
+		break;
+	case DISCONNECT:
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Length of the packet at the start of buf.
+ * @return the total length, 0 if more data is needed, -1 if malformed
+ */
+static int frame_length(const unsigned char* buf, int len)
+{
+	int rem_len, rc;
+
+	if (len < 2)
+		return 0;
+	if ((rc = MQTTPacket_decodeRange(buf + 1, buf + len, &rem_len)) <= 0)
+		return rc;
+	return (1 + rc + rem_len > MAX_PACKET_SIZE) ? -1 : 1 + rc + rem_len;
+}
+
+
+/**
+ * Handles every complete packet.
+ * @return the bytes consumed, -1 to close the connection
+ */
+static int on_data(struct netio_conn* conn, unsigned char* data, int len)
+{
+	int off = 0, flen, rc;
+
+	while ((flen = frame_length(data + off, len - off)) > 0 && flen <= len - off)
+	{
+		if ((rc = handle_packet(conn->user, data + off, flen)) < 0)
+			return -1;
+		if (rc > 0)
+		{
+			netio_detach(self->io, conn);	/* on_detach takes the rest, the CONNECT first */
+			return off;
+		}
+		off += flen;
+	}
+	return (flen < 0) ? -1 : off;
+}
+
+
+static void* on_accept(struct netio* io, struct netio_conn* conn)
+{
+	struct client* c = client_new(conn);
+
+	if (c)
+		self->clients++;
+	return c;
+}
+
+
+static void on_detach(struct netio_conn* conn, int fd, unsigned char* rest, int len)
+{
+	struct client* c = conn->user;
+	struct shard* owner = &self->broker->shards[shard_of(self->broker, c->id)];
+	struct adoption* a = malloc(sizeof(*a) + len);
+
+	client_free(c);
+	self->clients--;
+	if (!a)
+	{
+		close(fd);
+		return;
+	}
+	a->hdr.type = MSG_ADOPT;
+	a->fd = fd;
+	a->len = len;
+	memcpy(a->data, rest, len);
+	mpsc_push(&owner->inbox, &a->hdr.node);
+	wake(owner);
+	self->handovers++;
+}
+
+
+static void receive_publishes(struct publish_batch* pb)
+{
+	int i;
+
+	for (i = 0; i < pb->count; ++i)
+	{
+		struct delivery d;
+		unsigned char dup, retained, *payload;
+		unsigned short packetid;
+		int qos, payloadlen;
+
+		d.packet = pb->items[i].packet;
+		d.len = d.packet->len;
+		d.publish = d.packet->data;
+		d.publishlen = d.packet->len;
+		d.qos = pb->items[i].qos;
+		d.seq = pb->items[i].seq;
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &d.topic, &payload, &payloadlen,
+				d.packet->data, d.packet->len) == 1)
+			MQTTTopicTrie_match(&self->subs, d.topic.lenstring.data, d.topic.lenstring.len, deliver, &d);
+		netio_buf_put(d.packet);
+	}
+	free(pb);
+}
+
+
+static void receive_adoption(struct adoption* a)
+{
+	struct client* c = client_new(NULL);
+
+	if (!c || !(c->conn = netio_adopt(self->io, a->fd, c, a->data, a->len)))
+	{
+		close(a->fd);
+		if (c)
+			client_free(c);
+	}
+	else
+		self->clients++;
+	free(a);
+}
+
+
+static void on_wake(struct netio* io)
+{
+	struct mpsc_node* n;
+
+	/* cleared first: a push from now on wakes the shard again */
+	__atomic_store_n(&self->signalled, 0, __ATOMIC_SEQ_CST);
+	while ((n = mpsc_pop(&self->inbox)))
+	{
+		struct shard_msg* m = (struct shard_msg*)n;
+
+		if (m->type == MSG_PUBLISH)
+			receive_publishes((struct publish_batch*)m);
+		else if (m->type == MSG_ADOPT)
+			receive_adoption((struct adoption*)m);
+		else
+		{
+			if (session_sync(self->session_log) < 0)
+				fprintf(stderr, "shard %d: session log not compacted\n", self->id);
+			free(m);
+		}
+	}
+}
+
+
+static const struct netio_handler handler = { on_accept, NULL, on_data, on_close, on_detach, on_wake };
+
+
+static int listen_on(int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/**
+ * Pins the calling thread to the n-th CPU it may run on, if there are that many.
+ */
+static void pin(int n)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0 || CPU_COUNT(&set) <= n)
+		return;
+	for (cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &set) && n-- == 0)
+			break;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+
+static void restore_filter(const char* filter, int len, int qos, void* ctx)
+{
+	struct client* c = ctx;
+	MQTTString f = MQTTString_initializer;
+
+	f.lenstring.data = (char*)filter;
+	f.lenstring.len = len;
+	if (add_filter(c, &f) == 0 && share_prefix(filter, len) == 0)
+		subscribe(c, filter, len, qos);	/* shared ones are joined on connecting */
+}
+
+
+/**
+ * Gives every session of the shard its client, without a connection.
+ */
+static int restore_sessions(struct shard* s)
+{
+	struct session* ss;
+	struct client* c;
+
+	self = s;
+	for (ss = session_next(s->session_log, NULL); ss; ss = session_next(s->session_log, ss))
+	{
+		if (!(c = client_new(NULL)))
+			return -1;
+		strcpy(c->id, session_id(ss));
+		c->session = ss;
+		session_set_user(ss, c);
+		session_filters(ss, restore_filter, c);
+		s->sessions++;
+	}
+	self = NULL;
+	return 0;
+}
+
+
+/**
+ * Moves the sessions of a log to the logs of the shards of their client IDs.
+ */
+static void sort_sessions(struct broker* b, struct session_log* sl)
+{
+	struct session* s = session_next(sl, NULL);
+
+	while (s)
+	{
+		struct session* next = session_next(sl, s);
+		struct shard* owner = &b->shards[shard_of(b, session_id(s))];
+
+		if (owner->session_log != sl && !session_move(owner->session_log, sl, s))
+			fprintf(stderr, "session %s not moved to shard %d\n", session_id(s), owner->id);
+		s = next;
+	}
+}
+
+
+/**
+ * Opens the session logs of the shards, "<session_file>.<shard>". The
+ * number of shards may have changed since they were written: sessions are
+ * moved to the shards of their client IDs, and the logs of shards that are
+ * gone emptied into them and removed.
+ */
+static int open_sessions(struct broker* b)
+{
+	const char* file = b->cfg.session_file;
+	int max_queued = b->cfg.max_queued > 0 ? b->cfg.max_queued : MAX_QUEUED;
+	char* path = file ? malloc(strlen(file) + 16) : NULL;
+	struct session_log* sl;
+	int i, rc = -1;
+
+	if (file && !path)
+		return -1;
+	for (i = 0; i < b->nshards; ++i)
+	{
+		if (file)
+			sprintf(path, "%s.%d", file, i);
+		if (!(b->shards[i].session_log = session_open(path, max_queued)))
+			goto exit;
+	}
+	for (i = 0; file && i < b->nshards; ++i)
+		sort_sessions(b, b->shards[i].session_log);
+	for (i = b->nshards; file; ++i)
+	{
+		sprintf(path, "%s.%d", file, i);
+		if (access(path, F_OK) != 0)
+			break;
+		if (!(sl = session_open(path, max_queued)))
+			goto exit;
+		sort_sessions(b, sl);
+		if (session_count(sl) == 0)
+			unlink(path);
+		session_close(sl);
+	}
+	for (i = 0; i < b->nshards; ++i)
+		if (restore_sessions(&b->shards[i]) < 0)
+			goto exit;
+	rc = 0;
+exit:
+	free(path);
+	return rc;
+}
+
+
+static void* shard_run(void* arg)
+{
+	struct shard* s = arg;
+
+	self = s;
+	pin(s->id);
+	while (!__atomic_load_n(&s->broker->stop, __ATOMIC_ACQUIRE))
+	{
+		netio_run(s->io, 1000);
+		send_batches(s);
+	}
+	return NULL;
+}
+
+
+static void shard_free(struct shard* s)
+{
+	struct mpsc_node* n;
+	int i;
+
+	self = s;
+	netio_destroy(s->io);
+	while (s->all)
+		client_free(s->all);
+	if (s->lfd >= 0)
+		close(s->lfd);
+	while ((n = mpsc_pop(&s->inbox)))
+	{
+		struct shard_msg* m = (struct shard_msg*)n;
+
+		if (m->type == MSG_PUBLISH)
+		{
+			struct publish_batch* pb = (struct publish_batch*)m;
+
+			for (i = 0; i < pb->count; ++i)
+				netio_buf_put(pb->items[i].packet);
+		}
+		else if (m->type == MSG_ADOPT)
+			close(((struct adoption*)m)->fd);
+		free(m);
+	}
+	for (i = 0; s->out && i < s->broker->nshards; ++i)
+		if (s->out[i])
+		{
+			int j;
+
+			for (j = 0; j < s->out[i]->count; ++j)
+				netio_buf_put(s->out[i]->items[j].packet);
+			free(s->out[i]);
+		}
+	free(s->out);
+	while (s->groups)
+	{
+		struct share_group* g = s->groups;
+
+		s->groups = g->link;
+		share_free(g);
+	}
+	MQTTTopicTrie_free(&s->subs);
+	session_close(s->session_log);
+	self = NULL;
+}
+
+
+struct broker* broker_start(const struct broker_config* cfg)
+{
+	struct broker* b = calloc(1, sizeof(*b));
+	int i, started = 0;
+
+	if (!b)
+		return NULL;
+	b->cfg = *cfg;
+	b->nshards = cfg->shards > 0 ? cfg->shards : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (b->nshards < 1)
+		b->nshards = 1;
+	if (b->nshards > BROKER_MAX_SHARDS)
+		b->nshards = BROKER_MAX_SHARDS;
+	pthread_mutex_init(&b->retain_lock, NULL);
+	pthread_mutex_init(&b->share_lock, NULL);
+	if (!(b->shards = calloc(b->nshards, sizeof(*b->shards))) || !(b->retained = retain_open(cfg->retained_file)))
+		goto fail;
+	b->port = cfg->port;
+	for (i = 0; i < b->nshards; ++i)
+	{
+		struct shard* s = &b->shards[i];
+
+		s->broker = b;
+		s->id = i;
+		s->lfd = -1;
+		mpsc_init(&s->inbox);
+		MQTTTopicTrie_init(&s->subs);
+	}
+	if (open_sessions(b) < 0)
+		goto fail;
+	for (i = 0; i < b->nshards; ++i)
+	{
+		struct shard* s = &b->shards[i];
+
+		if ((s->lfd = listen_on(b->port)) < 0)
+		{
+			perror("listen");
+			goto fail;
+		}
+		if (b->port == 0)
+		{
+			struct sockaddr_in addr;
+			socklen_t len = sizeof(addr);
+
+			getsockname(s->lfd, (struct sockaddr*)&addr, &len);
+			b->port = ntohs(addr.sin_port);
+		}
+		if (!(s->out = calloc(b->nshards, sizeof(*s->out)))
+				|| !(s->io = netio_create(cfg->backend, &handler, MAX_TX_BACKLOG)) || netio_listen(s->io, s->lfd) < 0)
+		{
+			perror("netio");
+			goto fail;
+		}
+	}
+	for (started = 0; started < b->nshards; ++started)
+		if (pthread_create(&b->shards[started].thread, NULL, shard_run, &b->shards[started]) != 0)
+			goto fail;
+	return b;
+fail:
+	__atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < started; ++i)
+	{
+		netio_wake(b->shards[i].io);
+		pthread_join(b->shards[i].thread, NULL);
+	}
+	for (i = 0; b->shards && i < b->nshards; ++i)
+		shard_free(&b->shards[i]);
+	free(b->shards);
+	retain_close(b->retained);
+	free(b);
+	return NULL;
+}
+
+
+void broker_stop(struct broker* b)
+{
+	int i;
+
+	__atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < b->nshards; ++i)
+		netio_wake(b->shards[i].io);
+	for (i = 0; i < b->nshards; ++i)
+		pthread_join(b->shards[i].thread, NULL);
+	for (i = 0; i < b->nshards; ++i)
+		shard_free(&b->shards[i]);
+	free(b->shards);
+	retain_close(b->retained);
+	pthread_mutex_destroy(&b->retain_lock);
+	pthread_mutex_destroy(&b->share_lock);
+	free(b);
+}
+
+
+int broker_port(const struct broker* b)
+{
+	return b->port;
+}
+
+
+int broker_shards(const struct broker* b)
+{
+	return b->nshards;
+}
+
+
+enum netio_backend broker_backend(const struct broker* b)
+{
+	return netio_backend(b->shards[0].io);
+}
+
+
+int broker_retained(struct broker* b)
+{
+	int n;
+
+	pthread_mutex_lock(&b->retain_lock);
+	n = retain_count(b->retained);
+	pthread_mutex_unlock(&b->retain_lock);
+	return n;
+}
+
+
+void broker_stats(const struct broker* b, struct broker_stats* st)
+{
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; i < b->nshards; ++i)
+	{
+		const struct shard* s = &b->shards[i];
+
+		st->clients += __atomic_load_n(&s->clients, __ATOMIC_RELAXED);
+		st->sessions += __atomic_load_n(&s->sessions, __ATOMIC_RELAXED);
+		st->msgs_in += __atomic_load_n(&s->msgs_in, __ATOMIC_RELAXED);
+		st->msgs_out += __atomic_load_n(&s->msgs_out, __ATOMIC_RELAXED);
+		st->dropped += __atomic_load_n(&s->dropped, __ATOMIC_RELAXED);
+		st->handovers += __atomic_load_n(&s->handovers, __ATOMIC_RELAXED);
+	}
+}
+
+
+void broker_sync(struct broker* b)
+{
+	int i;
+
+	pthread_mutex_lock(&b->retain_lock);
+	retain_sync(b->retained);
+	pthread_mutex_unlock(&b->retain_lock);
+	for (i = 0; i < b->nshards; ++i)
+	{
+		struct shard_msg* m = malloc(sizeof(*m));
+
+		if (!m)
+			continue;
+		m->type = MSG_SYNC;	/* the session log is the shard's own */
+		mpsc_push(&b->shards[i].inbox, &m->node);
+		wake(&b->shards[i]);
+	}
+}
@@ -0,0 +1,75 @@
+/*******************************************************************************
+ * Broker stand-in for the test rigs, as a library for its main and benches.
+ *
+ * The broker runs on shards: threads with a netio loop, topic trie and
+ * connections of their own. A client belongs to the shard its client ID
+ * hashes to; a connection accepted elsewhere moves there on CONNECT. A
+ * PUBLISH is relayed as received, only its fixed header rewritten, by the
+ * shard of its publisher to the subscribers there, and passed by reference
+ * to the other shards through a lock-free queue each, in one batch per loop
+ * round.
+ *
+ * Clients connecting with clean session false keep their session on the
+ * shard of their client ID, in a session_log: their subscriptions stay
+ * while they are away, and QoS 1 messages for their QoS 1 subscriptions
+ * are queued and sent at QoS 1 until acknowledged, across reconnects and
+ * restarts of the broker.
+ *******************************************************************************/
+
+#ifndef BROKER_H_
+#define BROKER_H_
+
+#include "../net/netio.h"
+
+#define BROKER_MAX_SHARDS 64
+
+enum broker_share_dispatch
+{
+	SHARE_LEAST_LOADED,	/* the member with the least output queued */
+	SHARE_ROUND_ROBIN
+};
+
+struct broker_config
+{
+	int port;	/* 0 for any */
+	int shards;	/* threads, 0 for one per CPU */
+	enum netio_backend backend;
+	const char* retained_file;	/* NULL to keep retained messages in memory */
+	const char* session_file;	/* "<session_file>.<shard>" for each shard, NULL to keep sessions in memory */
+	int max_queued;	/* messages per session, 0 for the default */
+	enum broker_share_dispatch share_dispatch;
+	int verbose;
+};
+
+struct broker_stats
+{
+	unsigned long clients, sessions, msgs_in, msgs_out, dropped, handovers;
+};
+
+struct broker;
+
+/**
+ * Starts the shards, each listening on the port.
+ * @return the broker, NULL on error
+ */
+struct broker* broker_start(const struct broker_config* cfg);
+
+/** Stops the shards and frees the broker. */
+void broker_stop(struct broker* b);
+
+/** @return the port listened on */
+int broker_port(const struct broker* b);
+int broker_shards(const struct broker* b);
+enum netio_backend broker_backend(const struct broker* b);
+int broker_retained(struct broker* b);
+
+/** Sums the counters of the shards, read while they run. */
+void broker_stats(const struct broker* b, struct broker_stats* st);
+
+/**
+ * Starts writing the retained messages back to their file, and has the
+ * shards do the same with their session logs.
+ */
+void broker_sync(struct broker* b);
+
+#endif /* BROKER_H_ */
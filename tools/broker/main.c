@@ -0,0 +1,92 @@
+/*******************************************************************************
+ * Broker stand-in for the test rigs, see broker.h.
+ *
+ * usage: mqtt-broker [-p port] [-t shards] [-b uring|epoll] [-r retained_file] [-P session_file]
+ *                    [-q max_queued] [-S least|rr] [-s stats_interval_s] [-v]
+ *******************************************************************************/
+
+#include "broker.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYNC_INTERVAL_S 5	/* retained message snapshot and session logs written back */
+
+static volatile sig_atomic_t stop;
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+
+int main(int argc, char** argv)
+{
+	struct broker_config cfg = { 1883, 0, NETIO_URING, NULL, NULL, 0, SHARE_LEAST_LOADED, 0 };
+	struct broker_stats st, last_st;
+	struct broker* b;
+	int stats = 0, opt;
+	time_t last, last_sync;
+
+	while ((opt = getopt(argc, argv, "p:t:b:r:P:q:S:s:v")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p': cfg.port = atoi(optarg); break;
+		case 't': cfg.shards = atoi(optarg); break;
+		case 'b': cfg.backend = (strcmp(optarg, "epoll") == 0) ? NETIO_EPOLL : NETIO_URING; break;
+		case 'r': cfg.retained_file = optarg; break;
+		case 'P': cfg.session_file = optarg; break;
+		case 'q': cfg.max_queued = atoi(optarg); break;
+		case 'S': cfg.share_dispatch = (strcmp(optarg, "rr") == 0) ? SHARE_ROUND_ROBIN : SHARE_LEAST_LOADED; break;
+		case 's': stats = atoi(optarg); break;
+		case 'v': cfg.verbose = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-p port] [-t shards] [-b uring|epoll] [-r retained_file] [-P session_file]\n"
+					"       [-q max_queued] [-S least|rr] [-s stats_interval_s] [-v]\n", argv[0]);
+			return 2;
+		}
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (!(b = broker_start(&cfg)))
+		return 1;
+	broker_stats(b, &st);
+	fprintf(stderr, "listening on port %d (%d shards, %s), %d retained messages, %lu sessions\n", broker_port(b),
+			broker_shards(b), netio_backend_name(broker_backend(b)), broker_retained(b), st.sessions);
+
+	last = last_sync = time(NULL);
+	broker_stats(b, &last_st);
+	while (!stop)
+	{
+		sleep(1);
+
+		if (time(NULL) - last_sync >= SYNC_INTERVAL_S)
+		{
+			broker_sync(b);
+			last_sync = time(NULL);
+		}
+
+		if (stats && time(NULL) - last >= stats)
+		{
+			time_t now = time(NULL);
+
+			broker_stats(b, &st);
+			fprintf(stderr, "clients %lu  sessions %lu  in %lu/s  out %lu/s  dropped %lu  handovers %lu\n", st.clients, st.sessions,
+					(st.msgs_in - last_st.msgs_in) / (now - last), (st.msgs_out - last_st.msgs_out) / (now - last),
+					st.dropped, st.handovers);
+			last = now;
+			last_st = st;
+		}
+	}
+	broker_stats(b, &st);
+	fprintf(stderr, "in %lu  out %lu  dropped %lu\n", st.msgs_in, st.msgs_out, st.dropped);
+	broker_stop(b);
+	return 0;
+}
@@ -0,0 +1,445 @@
+/*******************************************************************************
+ * Retained messages of the broker stand-in, see retain.h.
+ *******************************************************************************/
+
+#define _GNU_SOURCE	/* mremap */
+
+#include "retain.h"
+#include "MQTTPacket.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARENA_MIN (64 * 1024)
+#define ARENA_MAX 0x80000000u	/* offsets are 32 bits */
+#define ALIGN8(n) (((n) + 7u) & ~7u)
+
+static const char magic[8] = "MQTTRET1";
+
+struct retain_header
+{
+	char magic[8];
+	uint32_t used;	/* bytes of the arena in use, this header included */
+	uint32_t reserved[13];
+};
+
+/* followed by the topic and the payload, the whole record a multiple of 8 bytes */
+struct retain_rec
+{
+	uint32_t size;
+	uint32_t hash;
+	uint32_t plen;
+	uint16_t tlen;
+	uint8_t qos;
+	uint8_t live;
+};
+
+struct retain_slot
+{
+	uint32_t off;	/* 0 if empty */
+	uint32_t hash;
+};
+
+struct retain_store
+{
+	int fd;	/* -1 for memory only */
+	unsigned char* base;
+	size_t cap;
+	uint32_t used;
+	uint32_t garbage;	/* bytes of dead records */
+	struct retain_slot* slots;	/* open addressing, linear probing */
+	unsigned int nslots;	/* power of 2 */
+	int count;
+};
+
+
+static unsigned int hash(const char* s, int len)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+
+static struct retain_rec* rec_at(struct retain_store* rs, uint32_t off)
+{
+	return (struct retain_rec*)(rs->base + off);
+}
+
+
+static char* rec_topic(struct retain_rec* r)
+{
+	return (char*)(r + 1);
+}
+
+
+static unsigned char* rec_payload(struct retain_rec* r)
+{
+	return (unsigned char*)(r + 1) + r->tlen;
+}
+
+
+static int find(struct retain_store* rs, const char* topic, int tlen, unsigned int h)
+{
+	unsigned int mask = rs->nslots - 1;
+	unsigned int i;
+
+	for (i = h & mask; rs->slots[i].off; i = (i + 1) & mask)
+	{
+		struct retain_rec* r = rec_at(rs, rs->slots[i].off);
+
+		if (rs->slots[i].hash == h && r->tlen == tlen && memcmp(rec_topic(r), topic, tlen) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
+static void insert(struct retain_store* rs, uint32_t off, unsigned int h)
+{
+	unsigned int mask = rs->nslots - 1;
+	unsigned int i;
+
+	for (i = h & mask; rs->slots[i].off; i = (i + 1) & mask)
+		;
+	rs->slots[i].off = off;
+	rs->slots[i].hash = h;
+}
+
+
+static void unlink_slot(struct retain_store* rs, unsigned int i)
+{
+	unsigned int mask = rs->nslots - 1;
+	unsigned int j;
+
+	/* backward shift: move up the entries that probed past the hole */
+	for (j = (i + 1) & mask; rs->slots[j].off; j = (j + 1) & mask)
+	{
+		unsigned int k = rs->slots[j].hash & mask;
+
+		if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		rs->slots[i] = rs->slots[j];
+		i = j;
+	}
+	rs->slots[i].off = 0;
+}
+
+
+/**
+ * Keeps the offset table at most half full.
+ */
+static int reserve_slots(struct retain_store* rs, int count)
+{
+	struct retain_slot* old = rs->slots;
+	unsigned int oldsize = rs->nslots, size = oldsize ? oldsize : 1024, i;
+
+	if ((unsigned int)count * 2 <= oldsize)
+		return 0;
+	while ((unsigned int)count * 2 > size)
+		size *= 2;
+	if (!(rs->slots = calloc(size, sizeof(*rs->slots))))
+	{
+		rs->slots = old;
+		return -1;
+	}
+	rs->nslots = size;
+	for (i = 0; i < oldsize; ++i)
+		if (old[i].off)
+			insert(rs, old[i].off, old[i].hash);
+	free(old);
+	return 0;
+}
+
+
+static int grow(struct retain_store* rs, size_t need)
+{
+	size_t cap = rs->cap;
+	void* p;
+
+	if (need <= cap)
+		return 0;
+	while (cap < need)
+		cap *= 2;
+	if (cap > ARENA_MAX || (rs->fd >= 0 && ftruncate(rs->fd, cap) < 0))
+		return -1;
+	if ((p = mremap(rs->base, rs->cap, cap, MREMAP_MAYMOVE)) == MAP_FAILED)
+		return -1;
+	rs->base = p;
+	rs->cap = cap;
+	return 0;
+}
+
+
+static void set_used(struct retain_store* rs, uint32_t used)
+{
+	rs->used = used;
+	((struct retain_header*)rs->base)->used = used;
+}
+
+
+static void kill_rec(struct retain_store* rs, uint32_t off)
+{
+	struct retain_rec* r = rec_at(rs, off);
+
+	r->live = 0;
+	if (off + r->size == rs->used)
+		set_used(rs, off);	/* last in the arena */
+	else
+		rs->garbage += r->size;
+}
+
+
+/**
+ * Rebuilds the offset table from the arena, stopping at the first record
+ * that does not fit, e.g. the one being written when the broker died.
+ */
+static int rebuild(struct retain_store* rs)
+{
+	uint32_t off = sizeof(struct retain_header);
+	uint32_t used = ((struct retain_header*)rs->base)->used;
+
+	if (used > rs->cap)
+		used = rs->cap;
+	memset(rs->slots, 0, rs->nslots * sizeof(*rs->slots));
+	rs->count = 0;
+	rs->garbage = 0;
+	rs->used = used;
+	while (off + sizeof(struct retain_rec) <= used)
+	{
+		struct retain_rec* r = rec_at(rs, off);
+		int i;
+
+		if (r->size % 8 || r->size < sizeof(*r) + r->tlen + r->plen || r->size > used - off)
+			break;
+		if (!r->live)
+			rs->garbage += r->size;
+		else if ((i = find(rs, rec_topic(r), r->tlen, r->hash)) >= 0)
+		{
+			/* a replacement written before the old record was marked dead */
+			rec_at(rs, rs->slots[i].off)->live = 0;
+			rs->garbage += rec_at(rs, rs->slots[i].off)->size;
+			rs->slots[i].off = off;
+		}
+		else
+		{
+			if (reserve_slots(rs, rs->count + 1) < 0)
+				return -1;
+			insert(rs, off, r->hash);
+			rs->count++;
+		}
+		off += r->size;
+	}
+	set_used(rs, off);
+	return 0;
+}
+
+
+/**
+ * Slides the live records to the front of the arena.
+ */
+static int compact(struct retain_store* rs)
+{
+	uint32_t rd = sizeof(struct retain_header), wr = rd;
+
+	while (rd < rs->used)
+	{
+		struct retain_rec* r = rec_at(rs, rd);
+		uint32_t size = r->size;
+
+		if (r->live)
+		{
+			if (wr != rd)
+				memmove(rs->base + wr, r, size);
+			wr += size;
+		}
+		rd += size;
+	}
+	set_used(rs, wr);
+	return rebuild(rs);
+}
+
+
+struct retain_store* retain_open(const char* path)
+{
+	struct retain_store* rs = calloc(1, sizeof(*rs));
+	struct retain_header* hdr;
+	struct stat st;
+	char head[sizeof(magic)];
+
+	if (!rs)
+		return NULL;
+	rs->fd = -1;
+	rs->cap = ARENA_MIN;
+	if (path)
+	{
+		if ((rs->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 || fstat(rs->fd, &st) < 0)
+			goto syserr;
+		if (st.st_size > 0 && (pread(rs->fd, head, sizeof(magic), 0) != sizeof(magic)
+				|| memcmp(head, magic, sizeof(magic)) != 0))
+		{
+			fprintf(stderr, "%s: not a retained message snapshot\n", path);
+			goto fail;
+		}
+		/* the file is cut to its contents on close, the mapping covers whole arena sizes */
+		while (rs->cap < (size_t)st.st_size)
+			rs->cap *= 2;
+		if (rs->cap > ARENA_MAX || ftruncate(rs->fd, rs->cap) < 0)
+			goto syserr;
+		rs->base = mmap(NULL, rs->cap, PROT_READ | PROT_WRITE, MAP_SHARED, rs->fd, 0);
+	}
+	else
+		rs->base = mmap(NULL, rs->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rs->base == MAP_FAILED)
+	{
+		rs->base = NULL;
+		goto syserr;
+	}
+	hdr = (struct retain_header*)rs->base;
+	if (memcmp(hdr->magic, magic, sizeof(magic)) != 0)
+	{
+		memset(hdr, 0, sizeof(*hdr));
+		memcpy(hdr->magic, magic, sizeof(magic));
+		hdr->used = sizeof(*hdr);
+	}
+	if (reserve_slots(rs, 1) < 0 || rebuild(rs) < 0)
+		goto syserr;
+	return rs;
+syserr:
+	perror(path ? path : "retain_open");
+fail:
+	retain_close(rs);
+	return NULL;
+}
+
+
+void retain_close(struct retain_store* rs)
+{
+	if (!rs)
+		return;
+	if (rs->base)
+	{
+		if (rs->fd >= 0)
+			msync(rs->base, rs->used, MS_SYNC);
+		munmap(rs->base, rs->cap);
+	}
+	if (rs->fd >= 0)
+	{
+		if (rs->used && ftruncate(rs->fd, rs->used) < 0)
+			perror("retain_close");
+		close(rs->fd);
+	}
+	free(rs->slots);
+	free(rs);
+}
+
+
+int retain_set(struct retain_store* rs, const char* topic, int tlen, const unsigned char* payload, int plen, int qos)
+{
+	unsigned int h = hash(topic, tlen);
+	uint32_t size = ALIGN8(sizeof(struct retain_rec) + tlen + plen);
+	struct retain_rec* r;
+	int i = find(rs, topic, tlen, h);
+
+	if (i >= 0)
+	{
+		r = rec_at(rs, rs->slots[i].off);
+		if (plen == 0)
+		{
+			kill_rec(rs, rs->slots[i].off);
+			unlink_slot(rs, i);
+			rs->count--;
+			return 0;
+		}
+		if (sizeof(*r) + r->tlen + plen <= r->size)
+		{
+			memcpy(rec_payload(r), payload, plen);
+			r->plen = plen;
+			r->qos = qos;
+			return 0;
+		}
+	}
+	else if (plen == 0)
+		return 0;
+	if (rs->garbage >= size && rs->garbage > rs->used / 2)
+	{
+		if (compact(rs) < 0)
+			return -1;
+		i = find(rs, topic, tlen, h);
+	}
+	if (grow(rs, (size_t)rs->used + size) < 0 || (i < 0 && reserve_slots(rs, rs->count + 1) < 0))
+		return -1;
+	r = rec_at(rs, rs->used);
+	r->size = size;
+	r->hash = h;
+	r->plen = plen;
+	r->tlen = tlen;
+	r->qos = qos;
+	r->live = 1;
+	memcpy(rec_topic(r), topic, tlen);
+	memcpy(rec_payload(r), payload, plen);
+	set_used(rs, rs->used + size);
+	if (i >= 0)
+	{
+		kill_rec(rs, rs->slots[i].off);
+		rs->slots[i].off = (unsigned char*)r - rs->base;
+	}
+	else
+	{
+		insert(rs, (unsigned char*)r - rs->base, h);
+		rs->count++;
+	}
+	return 0;
+}
+
+
+int retain_match(struct retain_store* rs, const char* filter, int flen, retain_fn fn, void* ctx)
+{
+	uint32_t off;
+	int count = 0;
+
+	if (!memchr(filter, '+', flen) && !memchr(filter, '#', flen))
+	{
+		int i = find(rs, filter, flen, hash(filter, flen));
+		struct retain_rec* r;
+
+		if (i < 0)
+			return 0;
+		r = rec_at(rs, rs->slots[i].off);
+		fn(rec_topic(r), r->tlen, rec_payload(r), r->plen, r->qos, ctx);
+		return 1;
+	}
+	for (off = sizeof(struct retain_header); off < rs->used; off += rec_at(rs, off)->size)
+	{
+		struct retain_rec* r = rec_at(rs, off);
+
+		if (r->live && MQTTTopic_matches(filter, flen, rec_topic(r), r->tlen))
+		{
+			fn(rec_topic(r), r->tlen, rec_payload(r), r->plen, r->qos, ctx);
+			++count;
+		}
+	}
+	return count;
+}
+
+
+void retain_sync(struct retain_store* rs)
+{
+	if (rs->fd >= 0)
+		msync(rs->base, rs->used, MS_ASYNC);
+}
+
+
+int retain_count(const struct retain_store* rs)
+{
+	return rs->count;
+}
@@ -0,0 +1,55 @@
+/*******************************************************************************
+ * Retained messages of the broker stand-in.
+ *
+ * Every retained message is one record in an arena: a small header, the
+ * topic name and the payload, back to back. A topic is stored once; a new
+ * payload that fits the record overwrites it in place, a larger one moves the
+ * record to the end of the arena. A hash table of arena offsets finds the
+ * record of a topic. Filters with wildcards are matched by a sequential scan
+ * of the arena.
+ *
+ * Given a file, the arena is a shared mapping of it, so the file is the
+ * snapshot: on restart it is mapped again and only the offset table is
+ * rebuilt. Without a file the arena is anonymous memory.
+ *******************************************************************************/
+
+#ifndef RETAIN_H_
+#define RETAIN_H_
+
+typedef void (*retain_fn)(const char* topic, int tlen, const unsigned char* payload, int plen, int qos, void* ctx);
+
+struct retain_store;
+
+/**
+ * @param path the snapshot file, created if missing, or NULL to keep the
+ * messages in memory only
+ * @return the store, NULL if the file cannot be used
+ */
+struct retain_store* retain_open(const char* path);
+void retain_close(struct retain_store* rs);
+
+/**
+ * Retains a message, replacing the one of the same topic. An empty payload
+ * removes the retained message of the topic.
+ * @return 0, or -1 if out of memory or space in the file
+ */
+int retain_set(struct retain_store* rs, const char* topic, int tlen, const unsigned char* payload, int plen, int qos);
+
+/**
+ * Calls fn for every retained message whose topic matches filter. topic and
+ * payload point into the arena and are valid until the next retain_set.
+ * @return the number of messages
+ */
+int retain_match(struct retain_store* rs, const char* filter, int flen, retain_fn fn, void* ctx);
+
+/**
+ * Starts writing the snapshot back to the file, without waiting.
+ */
+void retain_sync(struct retain_store* rs);
+
+/**
+ * @return the number of retained messages
+ */
+int retain_count(const struct retain_store* rs);
+
+#endif /* RETAIN_H_ */
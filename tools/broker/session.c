@@ -0,0 +1,940 @@
+/*******************************************************************************
+ * Persistent sessions of the broker stand-in, see session.h.
+ *******************************************************************************/
+
+#define _GNU_SOURCE	/* mremap */
+
+#include "session.h"
+#include "MQTTPacket.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_MIN (64 * 1024)
+#define LOG_MAX 0x80000000u	/* offsets are 32 bits */
+#define COMPACT_MIN (256 * 1024)	/* smaller logs are not worth writing again */
+#define ALIGN8(n) (((n) + 7u) & ~7u)
+
+static const char magic[8] = "MQTTSES1";
+
+struct log_header
+{
+	char magic[8];
+	uint32_t used;	/* bytes of the log, this header included */
+	uint32_t reserved[13];
+};
+
+enum
+{
+	REC_OPEN = 1, REC_SUB, REC_UNSUB, REC_MSG, REC_ACK, REC_END
+};
+
+/* followed by the client ID, filter or PUBLISH packet, the whole record a multiple of 8 bytes */
+struct log_rec
+{
+	uint32_t size;
+	uint32_t num;	/* the session, numbered by its REC_OPEN */
+	uint32_t len;
+	uint16_t packetid;	/* of REC_MSG and REC_ACK */
+	uint8_t type;
+	uint8_t qos;	/* of REC_SUB */
+};
+
+struct sub
+{
+	char* filter;
+	int len;
+	int qos;
+	uint32_t size;	/* of its record */
+};
+
+struct entry
+{
+	uint32_t off;	/* of the REC_MSG */
+	uint16_t packetid;
+	uint8_t acked;	/* waiting for the ones before it */
+};
+
+struct session
+{
+	char id[SESSION_ID_MAX];
+	uint32_t num;
+	uint32_t size;	/* of its REC_OPEN */
+	void* user;
+	struct sub* subs;
+	int nsubs, sizesubs;
+	struct entry* queue;	/* ring, oldest at head */
+	int head, count, sizequeue;
+	int sent;	/* from head */
+	unsigned short lastid;
+	struct session* prev;	/* in order of creation */
+	struct session* next;
+	struct session* link;	/* in the hash chain */
+};
+
+struct session_log
+{
+	char* path;	/* NULL for memory only */
+	int fd;
+	unsigned char* base;
+	size_t cap;
+	uint32_t used;
+	uint32_t live;	/* bytes of live records, the header included */
+	int max_queued;
+	uint32_t lastnum;
+	struct session* first;
+	struct session* last;
+	struct session** buckets;
+	unsigned int nbuckets;	/* power of 2 */
+	int count;
+};
+
+
+static unsigned int hash(const char* s)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+
+static struct log_rec* rec_at(struct session_log* sl, uint32_t off)
+{
+	return (struct log_rec*)(sl->base + off);
+}
+
+
+static unsigned char* rec_data(struct log_rec* r)
+{
+	return (unsigned char*)(r + 1);
+}
+
+
+static uint32_t rec_size(int len)
+{
+	return ALIGN8(sizeof(struct log_rec) + len);
+}
+
+
+/**
+ * Writes a record at p.
+ * @return its size
+ */
+static uint32_t put_rec(unsigned char* p, int type, uint32_t num, int qos, unsigned short packetid,
+		const void* data, int len)
+{
+	struct log_rec* r = (struct log_rec*)p;
+
+	r->size = rec_size(len);
+	r->num = num;
+	r->len = len;
+	r->packetid = packetid;
+	r->type = type;
+	r->qos = qos;
+	memcpy(rec_data(r), data, len);
+	return r->size;
+}
+
+
+static struct entry* entry_at(struct session* s, int i)
+{
+	return &s->queue[(s->head + i) % s->sizequeue];
+}
+
+
+static void set_used(struct session_log* sl, uint32_t used)
+{
+	sl->used = used;
+	((struct log_header*)sl->base)->used = used;
+}
+
+
+/******************************************************************************
+ * sessions in memory, the live bytes of the log counted
+ ******************************************************************************/
+
+static int reserve_buckets(struct session_log* sl, int count)
+{
+	struct session** old = sl->buckets;
+	unsigned int oldsize = sl->nbuckets, size = oldsize ? oldsize : 256, i;
+
+	if ((unsigned int)count <= oldsize)
+		return 0;
+	while ((unsigned int)count > size)
+		size *= 2;
+	if (!(sl->buckets = calloc(size, sizeof(*sl->buckets))))
+	{
+		sl->buckets = old;
+		return -1;
+	}
+	sl->nbuckets = size;
+	for (i = 0; i < oldsize; ++i)
+		while (old[i])
+		{
+			struct session* s = old[i];
+			unsigned int b = hash(s->id) & (size - 1);
+
+			old[i] = s->link;
+			s->link = sl->buckets[b];
+			sl->buckets[b] = s;
+		}
+	free(old);
+	return 0;
+}
+
+
+static struct session* session_alloc(struct session_log* sl, const char* id, int len, uint32_t num)
+{
+	struct session* s;
+	unsigned int b;
+
+	if (len <= 0 || len >= SESSION_ID_MAX || reserve_buckets(sl, sl->count + 1) < 0 || !(s = calloc(1, sizeof(*s))))
+		return NULL;
+	memcpy(s->id, id, len);
+	s->num = num;
+	s->size = rec_size(len);
+	sl->live += s->size;
+	b = hash(s->id) & (sl->nbuckets - 1);
+	s->link = sl->buckets[b];
+	sl->buckets[b] = s;
+	s->prev = sl->last;
+	if (sl->last)
+		sl->last->next = s;
+	else
+		sl->first = s;
+	sl->last = s;
+	sl->count++;
+	return s;
+}
+
+
+static void session_free(struct session_log* sl, struct session* s)
+{
+	struct session** p = &sl->buckets[hash(s->id) & (sl->nbuckets - 1)];
+	int i;
+
+	while (*p != s)
+		p = &(*p)->link;
+	*p = s->link;
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		sl->first = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	else
+		sl->last = s->prev;
+	sl->live -= s->size;
+	for (i = 0; i < s->nsubs; ++i)
+	{
+		sl->live -= s->subs[i].size;
+		free(s->subs[i].filter);
+	}
+	for (i = 0; i < s->count; ++i)
+		if (!entry_at(s, i)->acked)
+			sl->live -= rec_at(sl, entry_at(s, i)->off)->size;
+	free(s->subs);
+	free(s->queue);
+	free(s);
+	sl->count--;
+}
+
+
+static int sub_find(const struct session* s, const char* filter, int len)
+{
+	int i;
+
+	for (i = 0; i < s->nsubs; ++i)
+		if (s->subs[i].len == len && memcmp(s->subs[i].filter, filter, len) == 0)
+			return i;
+	return -1;
+}
+
+
+/**
+ * Room for a new subscription, when it is not there already.
+ */
+static int sub_reserve(struct session* s, const char* filter, int len)
+{
+	int size;
+	void* p;
+
+	if (s->nsubs < s->sizesubs || sub_find(s, filter, len) >= 0)
+		return 0;
+	size = s->sizesubs ? s->sizesubs * 2 : 4;
+	if (!(p = realloc(s->subs, size * sizeof(*s->subs))))
+		return -1;
+	s->subs = p;
+	s->sizesubs = size;
+	return 0;
+}
+
+
+static int sub_set(struct session_log* sl, struct session* s, const char* filter, int len, int qos)
+{
+	int i = sub_find(s, filter, len);
+	struct sub* sub;
+
+	if (i >= 0)
+		sub = &s->subs[i];
+	else
+	{
+		if (sub_reserve(s, filter, len) < 0)
+			return -1;
+		sub = &s->subs[s->nsubs];
+		if (!(sub->filter = malloc(len)))
+			return -1;
+		memcpy(sub->filter, filter, len);
+		sub->len = len;
+		sub->size = rec_size(len);
+		sl->live += sub->size;
+		s->nsubs++;
+	}
+	sub->qos = qos;
+	return 0;
+}
+
+
+static void sub_remove(struct session_log* sl, struct session* s, int i)
+{
+	sl->live -= s->subs[i].size;
+	free(s->subs[i].filter);
+	s->subs[i] = s->subs[--s->nsubs];
+}
+
+
+/**
+ * Room for one more message in the queue, which grows up to max_queued.
+ */
+static int queue_reserve(struct session_log* sl, struct session* s)
+{
+	struct entry* q;
+	int size, i;
+
+	if (s->count < s->sizequeue)
+		return 0;
+	size = s->sizequeue ? s->sizequeue * 2 : 8;
+	if (size > sl->max_queued)
+		size = sl->max_queued;
+	if (!(q = malloc(size * sizeof(*q))))
+		return -1;
+	for (i = 0; i < s->count; ++i)
+		q[i] = *entry_at(s, i);
+	free(s->queue);
+	s->queue = q;
+	s->head = 0;
+	s->sizequeue = size;
+	return 0;
+}
+
+
+static void queue_push(struct session_log* sl, struct session* s, uint32_t off, unsigned short packetid)
+{
+	struct entry* e;
+
+	s->count++;
+	e = entry_at(s, s->count - 1);
+	e->off = off;
+	e->packetid = packetid;
+	e->acked = 0;
+	s->lastid = packetid;
+	sl->live += rec_at(sl, off)->size;
+}
+
+
+static int queue_find(struct session* s, unsigned short packetid)
+{
+	int i;
+
+	for (i = 0; i < s->count; ++i)
+		if (entry_at(s, i)->packetid == packetid && !entry_at(s, i)->acked)
+			return i;
+	return -1;
+}
+
+
+/**
+ * Removes a message, from the head of the queue on once the ones before it
+ * are gone too.
+ */
+static void queue_ack(struct session_log* sl, struct session* s, int i)
+{
+	struct entry* e = entry_at(s, i);
+
+	e->acked = 1;
+	sl->live -= rec_at(sl, e->off)->size;
+	while (s->count > 0 && entry_at(s, 0)->acked)
+	{
+		s->head = (s->head + 1) % s->sizequeue;
+		s->count--;
+		if (s->sent > 0)
+			s->sent--;
+	}
+}
+
+
+/******************************************************************************
+ * the log
+ ******************************************************************************/
+
+static int grow(struct session_log* sl, size_t need)
+{
+	size_t cap = sl->cap;
+	void* p;
+
+	if (need <= cap)
+		return 0;
+	while (cap < need)
+		cap *= 2;
+	if (cap > LOG_MAX || (sl->fd >= 0 && ftruncate(sl->fd, cap) < 0))
+		return -1;
+	if ((p = mremap(sl->base, sl->cap, cap, MREMAP_MAYMOVE)) == MAP_FAILED)
+		return -1;
+	sl->base = p;
+	sl->cap = cap;
+	return 0;
+}
+
+
+static unsigned char* map(int fd, size_t cap)
+{
+	void* p;
+
+	if (fd >= 0)
+		p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	else
+		p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+
+/**
+ * Writes the live records to a new log, which replaces the old one: the
+ * file through a rename, so that a crash leaves one or the other.
+ */
+static int compact(struct session_log* sl)
+{
+	size_t cap = LOG_MIN;
+	unsigned char* base;
+	char* tmp = NULL;
+	uint32_t off = sizeof(struct log_header), num = 0;
+	struct session* s;
+	int fd = -1, i;
+
+	while (cap < (size_t)sl->live * 2)
+		cap *= 2;
+	if (sl->path)
+	{
+		if (!(tmp = malloc(strlen(sl->path) + 5)))
+			return -1;
+		sprintf(tmp, "%s.tmp", sl->path);
+		if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0 || ftruncate(fd, cap) < 0)
+			goto fail;
+	}
+	if (!(base = map(fd, cap)))
+		goto fail;
+
+	memset(base, 0, sizeof(struct log_header));
+	memcpy(((struct log_header*)base)->magic, magic, sizeof(magic));
+	for (s = sl->first; s; s = s->next)
+	{
+		s->num = ++num;
+		off += put_rec(base + off, REC_OPEN, s->num, 0, 0, s->id, strlen(s->id));
+		for (i = 0; i < s->nsubs; ++i)
+			off += put_rec(base + off, REC_SUB, s->num, s->subs[i].qos, 0, s->subs[i].filter, s->subs[i].len);
+		for (i = 0; i < s->count; ++i)
+		{
+			struct entry* e = entry_at(s, i);
+			struct log_rec* r = rec_at(sl, e->off);
+
+			if (e->acked)
+				continue;
+			memcpy(base + off, r, r->size);
+			((struct log_rec*)(base + off))->num = s->num;
+			e->off = off;
+			off += r->size;
+		}
+	}
+	((struct log_header*)base)->used = off;
+
+	if (sl->path && (msync(base, off, MS_SYNC) < 0 || rename(tmp, sl->path) < 0))
+	{
+		munmap(base, cap);
+		goto fail;
+	}
+	munmap(sl->base, sl->cap);
+	if (sl->fd >= 0)
+		close(sl->fd);
+	sl->fd = fd;
+	sl->base = base;
+	sl->cap = cap;
+	sl->used = sl->live = off;
+	sl->lastnum = num;
+	free(tmp);
+	return 0;
+fail:
+	perror(tmp ? tmp : "session log");
+	if (fd >= 0)
+	{
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+	return -1;
+}
+
+
+/**
+ * A new record at the end of the log, to be filled and commit()ed. The log
+ * is compacted first rather than grown when most of it is dead.
+ * @return the record, NULL if out of space
+ */
+static struct log_rec* append(struct session_log* sl, int type, uint32_t num, int len)
+{
+	uint32_t size = rec_size(len);
+	struct log_rec* r;
+
+	if ((size_t)sl->used + size > sl->cap && sl->used >= COMPACT_MIN && sl->used - sl->live > sl->live)
+		compact(sl);	/* else grown */
+	if (grow(sl, (size_t)sl->used + size) < 0)
+		return NULL;
+	r = rec_at(sl, sl->used);
+	r->size = size;
+	r->num = num;
+	r->len = len;
+	r->packetid = 0;
+	r->type = type;
+	r->qos = 0;
+	return r;
+}
+
+
+static void commit(struct session_log* sl, struct log_rec* r)
+{
+	set_used(sl, sl->used + r->size);
+}
+
+
+static int log_rec(struct session_log* sl, int type, struct session* s, int qos, unsigned short packetid,
+		const void* data, int len)
+{
+	struct log_rec* r = append(sl, type, s->num, len);
+
+	if (!r)
+		return -1;
+	r->qos = qos;
+	r->packetid = packetid;
+	if (len > 0)
+		memcpy(rec_data(r), data, len);
+	commit(sl, r);
+	return 0;
+}
+
+
+/**
+ * Reads the sessions back from the log, stopping at the first record that
+ * does not fit, e.g. the one being written when the broker died.
+ */
+static int load(struct session_log* sl)
+{
+	struct session** bynum = NULL;
+	uint32_t nnum = 0, off = sizeof(struct log_header);
+	uint32_t used = ((struct log_header*)sl->base)->used;
+	int rc = -1;
+
+	if (used > sl->cap)
+		used = sl->cap;
+	sl->used = used;
+	while (off + sizeof(struct log_rec) <= used)
+	{
+		struct log_rec* r = rec_at(sl, off);
+		struct session* s = (r->num < nnum) ? bynum[r->num] : NULL;
+		char* data = (char*)rec_data(r);
+		int i;
+
+		if (r->size % 8 || r->size < sizeof(*r) + r->len || r->size > used - off)
+			break;
+		switch (r->type)
+		{
+		case REC_OPEN:
+			if (r->num >= nnum)
+			{
+				uint32_t size = nnum ? nnum : 64;
+				void* p;
+
+				while (size <= r->num)
+					size *= 2;
+				if (!(p = realloc(bynum, size * sizeof(*bynum))))
+					goto exit;
+				bynum = p;
+				memset(bynum + nnum, 0, (size - nnum) * sizeof(*bynum));
+				nnum = size;
+			}
+			if (r->len == 0 || r->len >= SESSION_ID_MAX || memchr(data, '\0', r->len))
+				goto done;
+			if (bynum[r->num])
+				session_free(sl, bynum[r->num]);
+			if (!(bynum[r->num] = session_alloc(sl, data, r->len, r->num)))
+				goto exit;
+			if (r->num > sl->lastnum)
+				sl->lastnum = r->num;
+			break;
+		case REC_SUB:
+			if (s && sub_set(sl, s, data, r->len, r->qos) < 0)
+				goto exit;
+			break;
+		case REC_UNSUB:
+			if (s && (i = sub_find(s, data, r->len)) >= 0)
+				sub_remove(sl, s, i);
+			break;
+		case REC_MSG:
+			if (!s)
+				break;
+			if (s->count == sl->max_queued)
+				queue_ack(sl, s, 0);	/* dropped by a smaller max_queued */
+			if (queue_reserve(sl, s) < 0)
+				goto exit;
+			queue_push(sl, s, off, r->packetid);
+			break;
+		case REC_ACK:
+			if (s && (i = queue_find(s, r->packetid)) >= 0)
+				queue_ack(sl, s, i);
+			break;
+		case REC_END:
+			if (s)
+			{
+				session_free(sl, s);
+				bynum[r->num] = NULL;
+			}
+			break;
+		default:
+			goto done;
+		}
+		off += r->size;
+	}
+done:
+	set_used(sl, off);
+	rc = 0;
+exit:
+	free(bynum);
+	return rc;
+}
+
+
+/******************************************************************************
+ * the API
+ ******************************************************************************/
+
+struct session_log* session_open(const char* path, int max_queued)
+{
+	struct session_log* sl = calloc(1, sizeof(*sl));
+	struct log_header* hdr;
+	struct stat st;
+	char head[sizeof(magic)];
+
+	if (!sl)
+		return NULL;
+	sl->fd = -1;
+	sl->cap = LOG_MIN;
+	sl->live = sizeof(struct log_header);
+	sl->max_queued = (max_queued < 1) ? 1 : (max_queued > SESSION_QUEUE_MAX) ? SESSION_QUEUE_MAX : max_queued;
+	if (path)
+	{
+		if (!(sl->path = strdup(path)) || (sl->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0
+				|| fstat(sl->fd, &st) < 0)
+			goto syserr;
+		if (st.st_size > 0 && (pread(sl->fd, head, sizeof(magic), 0) != sizeof(magic)
+				|| memcmp(head, magic, sizeof(magic)) != 0))
+		{
+			fprintf(stderr, "%s: not a session log\n", path);
+			goto fail;
+		}
+		/* the file is cut to its contents on close, the mapping covers whole log sizes */
+		while (sl->cap < (size_t)st.st_size)
+			sl->cap *= 2;
+		if (sl->cap > LOG_MAX || ftruncate(sl->fd, sl->cap) < 0)
+			goto syserr;
+	}
+	if (!(sl->base = map(sl->fd, sl->cap)))
+		goto syserr;
+	hdr = (struct log_header*)sl->base;
+	if (memcmp(hdr->magic, magic, sizeof(magic)) != 0)
+	{
+		memset(hdr, 0, sizeof(*hdr));
+		memcpy(hdr->magic, magic, sizeof(magic));
+		hdr->used = sizeof(*hdr);
+	}
+	if (reserve_buckets(sl, 1) < 0 || load(sl) < 0)
+		goto syserr;
+	if (sl->used >= COMPACT_MIN && sl->used - sl->live > sl->live && compact(sl) < 0)
+		goto fail;
+	return sl;
+syserr:
+	perror(path ? path : "session_open");
+fail:
+	session_close(sl);
+	return NULL;
+}
+
+
+void session_close(struct session_log* sl)
+{
+	if (!sl)
+		return;
+	while (sl->first)
+		session_free(sl, sl->first);
+	if (sl->base)
+	{
+		if (sl->fd >= 0)
+			msync(sl->base, sl->used, MS_SYNC);
+		munmap(sl->base, sl->cap);
+	}
+	if (sl->fd >= 0)
+	{
+		if (sl->used && ftruncate(sl->fd, sl->used) < 0)
+			perror("session_close");
+		close(sl->fd);
+	}
+	free(sl->buckets);
+	free(sl->path);
+	free(sl);
+}
+
+
+struct session* session_find(struct session_log* sl, const char* id)
+{
+	struct session* s;
+
+	for (s = sl->buckets[hash(id) & (sl->nbuckets - 1)]; s; s = s->link)
+		if (strcmp(s->id, id) == 0)
+			break;
+	return s;
+}
+
+
+struct session* session_new(struct session_log* sl, const char* id)
+{
+	int len = strlen(id);
+	struct session* s;
+
+	if (!(s = session_alloc(sl, id, len, sl->lastnum + 1)))
+		return NULL;
+	if (log_rec(sl, REC_OPEN, s, 0, 0, id, len) < 0)
+	{
+		session_free(sl, s);
+		return NULL;
+	}
+	sl->lastnum++;
+	return s;
+}
+
+
+void session_end(struct session_log* sl, struct session* s)
+{
+	if (log_rec(sl, REC_END, s, 0, 0, NULL, 0) < 0)
+		fprintf(stderr, "end of session %s not logged\n", s->id);
+	session_free(sl, s);
+}
+
+
+struct session* session_move(struct session_log* dst, struct session_log* src, struct session* s)
+{
+	struct session* n = session_new(dst, s->id);
+	int i;
+
+	if (!n)
+		return NULL;
+	for (i = 0; i < s->nsubs; ++i)
+		if (session_subscribe(dst, n, s->subs[i].filter, s->subs[i].len, s->subs[i].qos) < 0)
+			goto fail;
+	for (i = 0; i < s->count; ++i)
+	{
+		struct log_rec* r = rec_at(src, entry_at(s, i)->off);
+		struct log_rec* copy;
+
+		if (entry_at(s, i)->acked)
+			continue;
+		if (queue_reserve(dst, n) < 0 || !(copy = append(dst, REC_MSG, n->num, r->len)))
+			goto fail;
+		copy->packetid = r->packetid;
+		memcpy(rec_data(copy), rec_data(r), r->len);
+		commit(dst, copy);
+		queue_push(dst, n, (unsigned char*)copy - dst->base, r->packetid);
+	}
+	n->lastid = s->lastid;
+	n->user = s->user;
+	session_end(src, s);
+	return n;
+fail:
+	session_end(dst, n);
+	return NULL;
+}
+
+
+struct session* session_next(struct session_log* sl, struct session* s)
+{
+	return s ? s->next : sl->first;
+}
+
+
+const char* session_id(const struct session* s)
+{
+	return s->id;
+}
+
+
+void* session_user(const struct session* s)
+{
+	return s->user;
+}
+
+
+void session_set_user(struct session* s, void* user)
+{
+	s->user = user;
+}
+
+
+int session_subscribe(struct session_log* sl, struct session* s, const char* filter, int len, int qos)
+{
+	int i = sub_find(s, filter, len);
+
+	if (i >= 0 && s->subs[i].qos == qos)
+		return 0;
+	if (sub_reserve(s, filter, len) < 0 || log_rec(sl, REC_SUB, s, qos, 0, filter, len) < 0)
+		return -1;
+	return sub_set(sl, s, filter, len, qos);	/* a new record of the same size if it replaces one */
+}
+
+
+void session_unsubscribe(struct session_log* sl, struct session* s, const char* filter, int len)
+{
+	int i = sub_find(s, filter, len);
+
+	if (i < 0)
+		return;
+	if (log_rec(sl, REC_UNSUB, s, 0, 0, filter, len) < 0)
+		fprintf(stderr, "unsubscribe of session %s not logged\n", s->id);
+	sub_remove(sl, s, i);
+}
+
+
+void session_filters(const struct session* s, session_filter_fn fn, void* ctx)
+{
+	int i;
+
+	for (i = 0; i < s->nsubs; ++i)
+		fn(s->subs[i].filter, s->subs[i].len, s->subs[i].qos, ctx);
+}
+
+
+int session_queue(struct session_log* sl, struct session* s, unsigned char* publish, int len)
+{
+	unsigned short packetid = (s->lastid == 65535) ? 1 : s->lastid + 1;
+	MQTTRelayedPublish rp;
+	struct log_rec* r;
+	int dropped = 0, plen;
+
+	if ((plen = MQTTRelay_publish(&rp, 1, 0, packetid, publish, len)) <= 0)
+		return -1;
+	if (s->count == sl->max_queued)
+	{
+		session_ack(sl, s, entry_at(s, 0)->packetid);
+		dropped = 1;
+	}
+	if (queue_reserve(sl, s) < 0 || !(r = append(sl, REC_MSG, s->num, plen)))
+		return -1;
+	r->packetid = packetid;
+	MQTTSerialize_relayedPublish(rec_data(r), plen, &rp);
+	commit(sl, r);
+	queue_push(sl, s, (unsigned char*)r - sl->base, packetid);
+	return dropped;
+}
+
+
+int session_ack(struct session_log* sl, struct session* s, unsigned short packetid)
+{
+	int i = queue_find(s, packetid);
+
+	if (i < 0)
+		return 0;
+	if (log_rec(sl, REC_ACK, s, 0, packetid, NULL, 0) < 0)
+		fprintf(stderr, "acknowledgement for session %s not logged\n", s->id);
+	queue_ack(sl, s, i);
+	return 1;
+}
+
+
+int session_peek(struct session_log* sl, struct session* s, unsigned char** packet)
+{
+	struct log_rec* r;
+
+	while (s->sent < s->count && entry_at(s, s->sent)->acked)
+		s->sent++;
+	if (s->sent == s->count)
+		return 0;
+	r = rec_at(sl, entry_at(s, s->sent)->off);
+	*packet = rec_data(r);
+	return r->len;
+}
+
+
+void session_sent(struct session_log* sl, struct session* s)
+{
+	struct log_rec* r = rec_at(sl, entry_at(s, s->sent)->off);
+	MQTTHeader header = {0};
+
+	header.byte = rec_data(r)[0];
+	header.bits.dup = 1;	/* for the next time */
+	rec_data(r)[0] = header.byte;
+	s->sent++;
+}
+
+
+void session_rewind(struct session* s)
+{
+	s->sent = 0;
+}
+
+
+int session_queued(const struct session* s)
+{
+	int i, n = 0;
+
+	for (i = 0; i < s->count; ++i)
+		if (!s->queue[(s->head + i) % s->sizequeue].acked)
+			n++;
+	return n;
+}
+
+
+int session_sync(struct session_log* sl)
+{
+	int rc = 0;
+
+	if (sl->used >= COMPACT_MIN && sl->used - sl->live > sl->live)
+		rc = compact(sl);
+	if (sl->fd >= 0)
+		msync(sl->base, sl->used, MS_ASYNC);
+	return rc;
+}
+
+
+int session_count(const struct session_log* sl)
+{
+	return sl->count;
+}
+
+
+unsigned long session_log_size(const struct session_log* sl)
+{
+	return sl->used;
+}
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ * Persistent sessions of the broker stand-in, for clients connecting with
+ * clean session false.
+ *
+ * A session is a client ID, its subscriptions and the QoS 1 messages queued
+ * for it: not sent yet, or sent and not acknowledged. Every change is a
+ * record appended to a log; the queued messages live only there, as the
+ * PUBLISH packets to send, and memory holds an index of them, at most
+ * max_queued per session. Once the queue of a session is full its oldest
+ * message is dropped.
+ *
+ * Given a file, the log is a shared mapping of it and is read back on
+ * restart in one pass. When most of it is dead records (acknowledged
+ * messages, ended sessions) the live state is written to a new log that
+ * replaces it. Without a file the log is anonymous memory.
+ *
+ * A log is used by one thread at a time.
+ *******************************************************************************/
+
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#define SESSION_ID_MAX 64	/* with the terminating NUL */
+#define SESSION_QUEUE_MAX 65535	/* packet identifiers of the queued messages are distinct */
+
+typedef void (*session_filter_fn)(const char* filter, int len, int qos, void* ctx);
+
+struct session_log;
+struct session;
+
+/**
+ * @param path the log file, created if missing, or NULL to keep the sessions
+ * in memory only
+ * @param max_queued messages queued per session, up to SESSION_QUEUE_MAX
+ * @return the log, NULL if the file cannot be used
+ */
+struct session_log* session_open(const char* path, int max_queued);
+void session_close(struct session_log* sl);
+
+/** @return the session of a client ID, NULL if there is none */
+struct session* session_find(struct session_log* sl, const char* id);
+
+/** @return a new session, NULL if out of memory or space in the file */
+struct session* session_new(struct session_log* sl, const char* id);
+
+/** Ends a session, which is freed. */
+void session_end(struct session_log* sl, struct session* s);
+
+/**
+ * Moves a session to another log, e.g. of the shard its client ID belongs
+ * to after a restart with another number of shards.
+ * @return the session in dst, NULL on error, when it stays in src
+ */
+struct session* session_move(struct session_log* dst, struct session_log* src, struct session* s);
+
+/** Sessions in order of creation: the first with s NULL, NULL after the last. */
+struct session* session_next(struct session_log* sl, struct session* s);
+
+const char* session_id(const struct session* s);
+
+/** A pointer for the broker, not stored in the log. */
+void* session_user(const struct session* s);
+void session_set_user(struct session* s, void* user);
+
+/**
+ * Adds a subscription, or changes its QoS.
+ * @return 0, or -1 if out of memory or space in the file
+ */
+int session_subscribe(struct session_log* sl, struct session* s, const char* filter, int len, int qos);
+void session_unsubscribe(struct session_log* sl, struct session* s, const char* filter, int len);
+
+/** Calls fn for every subscription of the session. */
+void session_filters(const struct session* s, session_filter_fn fn, void* ctx);
+
+/**
+ * Queues a message for the session: a received PUBLISH, which is stored at
+ * QoS 1 under the next packet identifier of the session.
+ * @return 1 if the oldest message was dropped for it, 0 if not, -1 if not
+ * queued for want of memory or space in the file
+ */
+int session_queue(struct session_log* sl, struct session* s, unsigned char* publish, int len);
+
+/**
+ * Removes the message of a PUBACK.
+ * @return 1 if it was queued, 0 if not
+ */
+int session_ack(struct session_log* sl, struct session* s, unsigned short packetid);
+
+/**
+ * The next queued message not sent yet.
+ * @return its length, 0 if there is none. packet points into the log and is
+ * valid until the next call that writes to it
+ */
+int session_peek(struct session_log* sl, struct session* s, unsigned char** packet);
+
+/** Marks the message of session_peek() as sent: it is sent again with DUP set. */
+void session_sent(struct session_log* sl, struct session* s);
+
+/** Marks every queued message as not sent yet, for a new connection. */
+void session_rewind(struct session* s);
+
+/** @return the messages queued for the session */
+int session_queued(const struct session* s);
+
+/**
+ * Starts writing the log back to its file, without waiting, after writing
+ * a new one if most of it is dead.
+ * @return 0, or -1 if the log could not be compacted
+ */
+int session_sync(struct session_log* sl);
+
+/** @return the number of sessions */
+int session_count(const struct session_log* sl);
+
+/** @return the bytes of the log, live and dead records */
+unsigned long session_log_size(const struct session_log* sl);
+
+#endif /* SESSION_H_ */
@@ -0,0 +1,621 @@
+/*******************************************************************************
+ * Fleet simulator: N virtual light sensors in one process.
+ *
+ * Every device runs the MqttHandlerTask state machine of Src/main.c with the
+ * same MQTTPacket client serializers: CONNECT, SUBSCRIBE leds/mode, then the
+ * ledmode/light/ledh publish cycle at QoS 1 with packet id 0, handling
+ * incoming leds/mode commands like onLedsTopic()/onModeTopic(). The lux
+ * value follows a configurable curve and drives the auto mode LED.
+ *
+ * Devices are split over a few threads, each with its own netio loop, over
+ * io_uring or epoll, sending what a round of the schedule queued at once. Within
+ * a thread the devices are due at staggered, evenly spaced times, so the
+ * schedule is a cursor walking the device array instead of a timer queue.
+ * Publish latency is the PUBLISH to PUBACK round trip of the oldest
+ * outstanding publish of a device, PUBACKs come back in order.
+ *
+ * usage: fleet [-h host] [-p port] [-n devices] [-t threads] [-i interval_ms]
+ *              [-d duration_s] [-c sine|dusk|const] [-l lux] [-P period_s]
+ *              [-b uring|epoll]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "MQTTPacket.h"
+#include "../net/netio.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONNECTION_KEEPALIVE_S 60
+#define LUX_THRESHOLD 50	/* auto mode switch point, see updateDeviceInfo() */
+#define PUBACK_TIMEOUT_MS 5000
+#define RETRY_DELAY_MS 1000
+#define LAT_BUCKETS 256
+
+/* States of MqttHandlerTask. */
+enum
+{
+	DEV_CONNECT,	/* 0: network_connect */
+	DEV_CONNECTING,	/* 1: TCP connect in progress, then CONNECT */
+	DEV_CONNACK,	/* 2 */
+	DEV_SUBACK,	/* 3 and 4 */
+	DEV_PUBLISH	/* 5 and 6 */
+};
+
+#define DEV_LED_SWITCH 0x01	/* last leds command */
+#define DEV_LED_STATUS 0x02	/* LED0 lit */
+#define DEV_SAMPLED 0x04	/* latency sample outstanding */
+
+/* 24 bytes, 10k devices are 240 KB besides their connections. */
+struct device
+{
+	struct netio_conn* conn;	/* NULL while disconnected */
+	uint32_t due_ms;	/* earliest reconnect, relative to the run start */
+	uint32_t sent_us;	/* send time of the sampled publish */
+	uint16_t lux;
+	uint8_t state;
+	uint8_t pub_state;	/* ledmode, light, ledh */
+	uint8_t led_mode;	/* 1 manual, 2 auto */
+	uint8_t flags;
+	uint8_t inflight;	/* publishes without PUBACK */
+};
+
+_Static_assert(sizeof(struct device) <= 32, "struct device should stay within half a cache line");
+
+struct worker
+{
+	pthread_t thread;
+	struct netio* io;
+	struct device* devices;
+	int first, count;	/* global index of devices[0] */
+	int cursor;
+	uint64_t round_us;	/* start of the current round over the devices */
+	unsigned long publishes, acks, commands, timeouts, reconnects, errors;
+	unsigned long lat[LAT_BUCKETS];
+	uint32_t lat_max;
+	int connected;
+};
+
+static struct
+{
+	struct sockaddr_in addr;
+	int devices, threads;
+	uint32_t interval_ms;
+	double duration_s;
+	enum { CURVE_SINE, CURVE_DUSK, CURVE_CONST } curve;
+	int lux;
+	double period_s;
+	enum netio_backend backend;
+	struct timespec start;
+} cfg = { .devices = 1000, .threads = 4, .interval_ms = 500, .duration_s = 10,
+		.curve = CURVE_SINE, .lux = 400, .period_s = 60, .backend = NETIO_URING };
+
+static volatile sig_atomic_t stop;
+static __thread struct worker* self;	/* the worker of the netio callbacks */
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - cfg.start.tv_sec) * 1000000 + (ts.tv_nsec - cfg.start.tv_nsec) / 1000;
+}
+
+
+/**
+ * Lux seen by device i at time t, each device with its own phase.
+ */
+static int lux_at(int i, uint32_t t_ms)
+{
+	double phase = fmod(t_ms / (cfg.period_s * 1000.0) + (double)i / cfg.devices, 1.0);
+
+	switch (cfg.curve)
+	{
+	case CURVE_SINE:
+		return (int)(cfg.lux * (1.0 + sin(2 * M_PI * phase)) / 2);
+	case CURVE_DUSK:
+		return (int)(cfg.lux * (1.0 - phase));
+	default:
+		return cfg.lux;
+	}
+}
+
+
+/**
+ * Log-linear bucket: exact below 16 us, then 8 sub-buckets per power of 2.
+ */
+static int lat_bucket(uint32_t us)
+{
+	int msb;
+
+	if (us < 16)
+		return us;
+	msb = 31 - __builtin_clz(us);
+	return (msb - 3) * 8 + ((us >> (msb - 3)) & 7);
+}
+
+
+static uint32_t lat_value(int bucket)
+{
+	int msb;
+
+	if (bucket < 16)
+		return bucket;
+	msb = bucket / 8 + 3;
+	return (8 | (bucket & 7)) << (msb - 3);
+}
+
+
+/**
+ * Queues a packet, sent with the rest of this round once the loop runs.
+ */
+static int send_all(struct worker* w, struct device* d, unsigned char* buf, int len)
+{
+	unsigned char* p;
+
+	if (len <= 0 || !(p = netio_reserve(w->io, d->conn, len)))
+		return -1;
+	memcpy(p, buf, len);
+	netio_commit(d->conn, len);
+	return 0;
+}
+
+
+static void start_over(struct worker* w, struct device* d, uint32_t now_ms)
+{
+	if (d->conn)
+	{
+		struct netio_conn* conn = d->conn;
+
+		d->conn = NULL;	/* on_close has nothing left to do */
+		netio_close(w->io, conn);
+		w->reconnects++;
+	}
+	if (d->state == DEV_PUBLISH)
+		w->connected--;
+	d->state = DEV_CONNECT;
+	d->inflight = 0;
+	d->flags &= ~DEV_SAMPLED;
+	d->due_ms = now_ms + RETRY_DELAY_MS;
+}
+
+
+static int dev_connect(struct worker* w, struct device* d)
+{
+	if (!(d->conn = netio_connect(w->io, (struct sockaddr*)&cfg.addr, sizeof(cfg.addr), d)))
+		return -1;
+	d->state = DEV_CONNECTING;
+	return 0;
+}
+
+
+/* State 1: TCP is up, send CONNECT. */
+static int dev_send_connect(struct worker* w, struct device* d)
+{
+	MQTTPacket_connectData connectData = MQTTPacket_connectData_initializer;
+	unsigned char buffer[128];
+	char clientID[24];
+
+	snprintf(clientID, sizeof(clientID), "LightSensor-%05d", w->first + (int)(d - w->devices));
+	connectData.MQTTVersion = 3;
+	connectData.clientID.cstring = clientID;
+	connectData.keepAliveInterval = CONNECTION_KEEPALIVE_S * 2;
+	d->state = DEV_CONNACK;
+	return send_all(w, d, buffer, MQTTSerialize_connect(buffer, sizeof(buffer), &connectData));
+}
+
+
+/* State 3: SUBSCRIBE to the command topics. */
+static int dev_send_subscribe(struct worker* w, struct device* d)
+{
+	MQTTString topicFilters[2] = { MQTTString_initializer, MQTTString_initializer };
+	int rQos[2] = { 0 };
+	unsigned char buffer[128];
+
+	topicFilters[0].cstring = "leds";
+	topicFilters[1].cstring = "mode";
+	d->state = DEV_SUBACK;
+	return send_all(w, d, buffer, MQTTSerialize_subscribe(buffer, sizeof(buffer), 0, 9527, 2, topicFilters, rQos));
+}
+
+
+/* State 5: one publish of the ledmode/light/ledh cycle. */
+static int dev_publish(struct worker* w, struct device* d, uint32_t now_ms)
+{
+	MQTTString topicString = MQTTString_initializer;
+	unsigned char buffer[128];
+	char payload[16];
+	int length, value;
+
+	if (d->inflight == 255 || ((d->flags & DEV_SAMPLED) && (uint32_t)now_us() - d->sent_us > PUBACK_TIMEOUT_MS * 1000))
+	{
+		w->timeouts++;
+		return -1;
+	}
+
+	/* updateDeviceInfo() */
+	d->lux = lux_at(w->first + (int)(d - w->devices), now_ms);
+	if (d->led_mode == 2)
+		d->flags = (d->lux < LUX_THRESHOLD) ? d->flags | DEV_LED_STATUS : d->flags & ~DEV_LED_STATUS;
+	else if (d->led_mode == 1)
+		d->flags = (d->flags & DEV_LED_SWITCH) ? d->flags | DEV_LED_STATUS : d->flags & ~DEV_LED_STATUS;
+
+	switch (d->pub_state)
+	{
+	case 0:
+		topicString.cstring = "ledmode";
+		value = d->led_mode;
+		break;
+	case 1:
+		topicString.cstring = "light";
+		value = d->lux;
+		break;
+	default:
+		topicString.cstring = "ledh";
+		value = (d->flags & DEV_LED_STATUS) != 0;
+		break;
+	}
+	d->pub_state = (d->pub_state + 1) % 3;
+
+	length = sprintf(payload, "%d", value);
+	length = MQTTSerialize_publish(buffer, sizeof(buffer), 0, 1, 0, 0, topicString, (unsigned char*)payload, length);
+	if (d->inflight++ == 0)
+	{
+		d->sent_us = (uint32_t)now_us();
+		d->flags |= DEV_SAMPLED;
+	}
+	w->publishes++;
+	return send_all(w, d, buffer, length);
+}
+
+
+/* onLedsTopic() / onModeTopic() */
+static void dev_command(struct worker* w, struct device* d, MQTTString* topic, unsigned char* payload, int payloadlen)
+{
+	if (payloadlen < 1)
+		return;
+	w->commands++;
+	if (MQTTPacket_equals(topic, "leds"))
+		d->flags = (payload[0] - '0') ? d->flags | DEV_LED_SWITCH : d->flags & ~DEV_LED_SWITCH;
+	else if (MQTTPacket_equals(topic, "mode"))
+		d->led_mode = payload[0] - '0';
+}
+
+
+static int dev_packet(struct worker* w, struct device* d, unsigned char* buf, int len)
+{
+	int type = (buf[0] >> 4) & 0x0F;
+
+	switch (d->state)
+	{
+	case DEV_CONNACK:
+	{
+		unsigned char sessionPresent, connack_rc;
+
+		if (type != CONNACK || MQTTDeserialize_connack(&sessionPresent, &connack_rc, buf, len) != 1 || connack_rc != 0)
+			return -1;
+		return dev_send_subscribe(w, d);
+	}
+	case DEV_SUBACK:
+	{
+		unsigned short packetid;
+		int count, granted[2];
+
+		if (type != SUBACK || MQTTDeserialize_suback(&packetid, 2, &count, granted, buf, len) != 1)
+			return -1;
+		d->state = DEV_PUBLISH;
+		w->connected++;
+		return 0;
+	}
+	case DEV_PUBLISH:
+		if (type == PUBACK)
+		{
+			if (d->flags & DEV_SAMPLED)
+			{
+				uint32_t us = (uint32_t)now_us() - d->sent_us;
+
+				w->lat[lat_bucket(us)]++;
+				if (us > w->lat_max)
+					w->lat_max = us;
+				d->flags &= ~DEV_SAMPLED;
+			}
+			if (d->inflight)
+				d->inflight--;
+			w->acks++;
+		}
+		else if (type == PUBLISH)
+		{
+			unsigned char dup, retained;
+			unsigned short msgid;
+			int qos, payloadlen;
+			unsigned char* payload;
+			MQTTString topic;
+
+			if (MQTTDeserialize_publish(&dup, &qos, &retained, &msgid, &topic, &payload, &payloadlen, buf, len) == 1)
+				dev_command(w, d, &topic, payload, payloadlen);
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * Length of the packet at the start of buf.
+ * @return the total length, 0 if more data is needed, -1 if malformed
+ */
+static int frame_length(const unsigned char* buf, int len)
+{
+	int rem_len, rc;
+
+	if (len < 2)
+		return 0;
+	if ((rc = MQTTPacket_decodeRange(buf + 1, buf + len, &rem_len)) <= 0)
+		return rc;
+	return 1 + rc + rem_len;
+}
+
+
+/**
+ * Handles every complete packet, netio keeps the rest for the next read.
+ */
+static int on_data(struct netio_conn* conn, unsigned char* data, int len)
+{
+	struct device* d = conn->user;
+	int off = 0, flen;
+
+	while ((flen = frame_length(data + off, len - off)) > 0 && flen <= len - off)
+	{
+		if (dev_packet(self, d, data + off, flen) < 0)
+			return -1;
+		off += flen;
+	}
+	return (flen < 0) ? -1 : off;
+}
+
+
+static int on_connect(struct netio_conn* conn)
+{
+	return dev_send_connect(self, conn->user);
+}
+
+
+/* the broker closed the connection, or a packet made no sense */
+static void on_close(struct netio_conn* conn)
+{
+	struct device* d = conn->user;
+
+	if (d->conn != conn)
+		return;
+	self->errors++;
+	start_over(self, d, (uint32_t)(now_us() / 1000));
+}
+
+
+static const struct netio_handler handler = { NULL, on_connect, on_data, on_close };
+
+
+/**
+ * Devices due up to now: reconnect those that dropped, publish on the rest.
+ */
+static uint64_t cursor_due(struct worker* w)
+{
+	return w->round_us + (uint64_t)cfg.interval_ms * 1000 * w->cursor / w->count;
+}
+
+
+static void run_schedule(struct worker* w, uint32_t now_ms)
+{
+	int n;
+
+	for (n = 0; n < w->count && cursor_due(w) / 1000 <= now_ms; ++n)
+	{
+		struct device* d = &w->devices[w->cursor];
+
+		if (d->state == DEV_CONNECT && (int32_t)(now_ms - d->due_ms) >= 0)
+		{
+			if (dev_connect(w, d) < 0)
+				start_over(w, d, now_ms);
+		}
+		else if (d->state == DEV_PUBLISH && dev_publish(w, d, now_ms) < 0)
+		{
+			w->errors++;
+			start_over(w, d, now_ms);
+		}
+		if (++w->cursor == w->count)
+		{
+			w->cursor = 0;
+			w->round_us += cfg.interval_ms * 1000;
+		}
+	}
+}
+
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+
+	self = w;
+	while (!stop)
+	{
+		uint32_t now_ms = (uint32_t)(now_us() / 1000);
+		int timeout = (int)((int64_t)(cursor_due(w) / 1000) - now_ms);
+
+		if (now_ms >= cfg.duration_s * 1000)
+			break;
+		netio_run(w->io, timeout < 0 ? 0 : timeout > 100 ? 100 : timeout);
+		run_schedule(w, (uint32_t)(now_us() / 1000));
+	}
+	return NULL;
+}
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-n devices] [-t threads] [-i interval_ms]\n"
+			"       [-d duration_s] [-c sine|dusk|const] [-l lux] [-P period_s]\n"
+			"       [-b uring|epoll]\n", name);
+	exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* host = "127.0.0.1";
+	int port = 1883, opt, i, t;
+	struct worker* workers;
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *ai;
+	unsigned long last_pub = 0;
+	double last_s = 0;
+
+	while ((opt = getopt(argc, argv, "h:p:n:t:i:d:c:l:P:b:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h': host = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': cfg.devices = atoi(optarg); break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'i': cfg.interval_ms = atoi(optarg); break;
+		case 'd': cfg.duration_s = atof(optarg); break;
+		case 'l': cfg.lux = atoi(optarg); break;
+		case 'P': cfg.period_s = atof(optarg); break;
+		case 'b': cfg.backend = (strcmp(optarg, "epoll") == 0) ? NETIO_EPOLL : NETIO_URING; break;
+		case 'c':
+			if (strcmp(optarg, "sine") == 0)
+				cfg.curve = CURVE_SINE;
+			else if (strcmp(optarg, "dusk") == 0)
+				cfg.curve = CURVE_DUSK;
+			else if (strcmp(optarg, "const") == 0)
+				cfg.curve = CURVE_CONST;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (cfg.devices < 1 || cfg.threads < 1 || cfg.interval_ms < 1 || cfg.period_s <= 0)
+		usage(argv[0]);
+	if (cfg.threads > cfg.devices)
+		cfg.threads = cfg.devices;
+	if (getaddrinfo(host, NULL, &hints, &ai) != 0)
+	{
+		fprintf(stderr, "cannot resolve %s\n", host);
+		return 1;
+	}
+	cfg.addr = *(struct sockaddr_in*)ai->ai_addr;
+	cfg.addr.sin_port = htons(port);
+	freeaddrinfo(ai);
+	signal(SIGINT, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	workers = calloc(cfg.threads, sizeof(*workers));
+	clock_gettime(CLOCK_MONOTONIC, &cfg.start);
+	for (t = 0; t < cfg.threads; ++t)
+	{
+		struct worker* w = &workers[t];
+
+		w->first = (int)((long)cfg.devices * t / cfg.threads);
+		w->count = (int)((long)cfg.devices * (t + 1) / cfg.threads) - w->first;
+		w->devices = calloc(w->count, sizeof(*w->devices));
+		if (!w->devices || !(w->io = netio_create(cfg.backend, &handler, 0)))
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		for (i = 0; i < w->count; ++i)
+			w->devices[i].led_mode = 2;
+		/* offset the threads so their rounds interleave */
+		w->round_us = (uint64_t)cfg.interval_ms * 1000 / w->count * t / cfg.threads;
+		pthread_create(&w->thread, NULL, worker_run, w);
+	}
+	fprintf(stderr, "%d devices on %d threads (%s), %u ms interval, %zu bytes per device\n", cfg.devices, cfg.threads,
+			netio_backend_name(netio_backend(workers[0].io)), cfg.interval_ms, sizeof(struct device));
+
+	while (!stop)
+	{
+		double s;
+		unsigned long pub = 0;
+		int connected = 0;
+
+		usleep(1000000);
+		s = now_us() / 1e6;
+		for (t = 0; t < cfg.threads; ++t)
+		{
+			pub += workers[t].publishes;
+			connected += workers[t].connected;
+		}
+		fprintf(stderr, "%6.1fs  connected %6d  publish %8.0f/s\n", s, connected, (pub - last_pub) / (s - last_s));
+		last_pub = pub;
+		last_s = s;
+		if (s >= cfg.duration_s)
+			break;
+	}
+	stop = 1;
+
+	{
+		unsigned long lat[LAT_BUCKETS] = { 0 }, samples = 0, acc = 0;
+		unsigned long publishes = 0, acks = 0, commands = 0, timeouts = 0, reconnects = 0, errors = 0;
+		uint32_t lat_max = 0;
+		double pct[] = { 0.5, 0.9, 0.99, 0.999 };
+		int p = 0;
+
+		for (t = 0; t < cfg.threads; ++t)
+		{
+			struct worker* w = &workers[t];
+
+			pthread_join(w->thread, NULL);
+			publishes += w->publishes;
+			acks += w->acks;
+			commands += w->commands;
+			timeouts += w->timeouts;
+			reconnects += w->reconnects;
+			errors += w->errors;
+			if (w->lat_max > lat_max)
+				lat_max = w->lat_max;
+			for (i = 0; i < LAT_BUCKETS; ++i)
+			{
+				lat[i] += w->lat[i];
+				samples += w->lat[i];
+			}
+			netio_destroy(w->io);
+			free(w->devices);
+		}
+		printf("devices %d  threads %d  interval %u ms  duration %.1f s\n", cfg.devices, cfg.threads, cfg.interval_ms, last_s);
+		printf("publishes %lu (%.0f/s)  pubacks %lu  commands %lu\n", publishes, publishes / last_s, acks, commands);
+		printf("timeouts %lu  reconnects %lu  errors %lu\n", timeouts, reconnects, errors);
+		printf("latency (us, %lu samples):", samples);
+		for (i = 0; i < LAT_BUCKETS && p < 4; ++i)
+		{
+			acc += lat[i];
+			while (p < 4 && samples && acc >= pct[p] * samples)
+				printf(" p%g=%u", pct[p++] * 100, lat_value(i));
+		}
+		printf(" max=%u\n", lat_max);
+	}
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,315 @@
+/*******************************************************************************
+ * Fuzz target for the AT parser of the ESP8266 driver: ESP82_checkResponse()
+ * and ESP82_Receive() on whatever the module sends.
+ *
+ * The driver source is included so its static functions can be called. The
+ * first input byte picks the call, one the driver makes (low 3 bits), and how
+ * the rest of the input is cut into idle-line chunks (the next 3 bits); the
+ * chunks go through HAL_UART_IdleCpltCallback() into rxFifo as on the board.
+ * The call is made after each chunk, on a clock that stands still until the
+ * input is used up and then jumps past the timeouts. Once the call is done,
+ * the rest goes to ESP82_Receive() as it does after a send.
+ *
+ * Besides the sanitizers, the harness checks the invariants of the response
+ * buffer and that a received frame fits the buffer it was given, and it
+ * reads the input itself to check the outcome: a wait whose answer lines are
+ * all in the input, around the +IPD frames the driver keeps, must not time
+ * out, an input of well-formed +IPD frames only must come out of
+ * ESP82_Receive() frame by frame, and ESP82_Receive() must not fail, which
+ * costs a reconnect, before its timeout unless the input has a CLOSED line:
+ * a malformed header is skipped.
+ *
+ * Built with fuzz/fuzz_main.c, or with -fsanitize=fuzzer for libFuzzer.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "../../Src/ESP8266Client/src/ESP8266Client.c"
+
+#include <stdio.h>
+
+UART_HandleTypeDef huart1 = { USART1 }, huart2 = { USART2 };
+uint8_t rxBuffer[RX_BUFFER_SIZE];
+uint8_t debugSentBuffer[MEM_LOG_SIZE];
+int recv_end_flag;
+int rx_len;
+struct fifo rxFifo;
+static unsigned char rxFifoBuffer[MEM_FIFO_SIZE];
+static uint32_t now_ms;
+
+USART_TypeDef replay_usart1, replay_usart2;
+
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+	return HAL_OK;
+}
+
+
+uint32_t HAL_GetTick(void)
+{
+	return now_ms;
+}
+
+
+static uint32_t fuzz_time_ms(void)
+{
+	return now_ms;
+}
+
+
+/* the waits of the driver, ESP82_Receive() for 0 */
+static const struct
+{
+	uint32_t flags;
+	uint16_t timeout_ms;
+	uint8_t response;	/* response copied out */
+} calls[8] = {
+	{ 0, ESP82_TIMEOUT_MS_RECEIVE, 0 },
+	{ ESP82_RES_OK, ESP82_TIMEOUT_MS_CMD, 0 },
+	{ ESP82_RES_OK | ESP82_RES_WIFI_CONNECTED | ESP82_RES_WIFI_GOTIP, ESP82_TIMEOUT_MS_AP_CONNECT, 0 },
+	{ ESP82_RES_STATUS_GOTIP, ESP82_TIMEOUT_MS_CMD, 0 },
+	{ ESP82_RES_OK, ESP82_TIMEOUT_MS_HOST_CONNECT, 0 },
+	{ ESP82_RES_SEND_BEGIN, ESP82_TIMEOUT_MS_CMD, 0 },
+	{ ESP82_RES_SEND_OK, ESP82_TIMEOUT_MS_DATA_SEND, 0 },
+	{ ESP82_RES_OK, ESP82_TIMEOUT_MS_CMD, 64 },
+};
+
+static const uint16_t chunk_sizes[8] = { 1, 2, 3, 7, 16, 61, 128, RX_BUFFER_SIZE };
+
+/* the lines ESP82_checkResponse() takes, the conditional ones if expected */
+static const struct
+{
+	const char* line;
+	uint32_t flag;
+	int always;
+} lines[] = {
+	{ "OK", ESP82_RES_OK, 1 },
+	{ "ERROR", ESP82_RES_ERROR, 1 },
+	{ "FAIL", ESP82_RES_FAIL, 1 },
+	{ "busy p...", ESP82_RES_BUSY, 1 },
+	{ "busy s...", ESP82_RES_BUSY, 1 },
+	{ "WIFI CONNECTED", ESP82_RES_WIFI_CONNECTED, 0 },
+	{ "WIFI GOT IP", ESP82_RES_WIFI_GOTIP, 0 },
+	{ "STATUS:2", ESP82_RES_STATUS_GOTIP, 0 },
+	{ "SEND OK", ESP82_RES_SEND_OK, 0 },
+};
+
+static struct
+{
+	int frames;	/* well-formed +IPD frames in the input, -1 if there is anything else */
+	const uint8_t* payload[64];
+	int length[64];
+	int received;	/* frames out of ESP82_Receive() */
+	int timeout;	/* the wait timed out */
+	int closed;	/* the input has a CLOSED line */
+} expect;
+
+
+/**
+ * @return the length of the +IPD frame at data that ESP82_keepFrames() takes
+ * out of a response, 0 if there is none, -1 if it is not complete: the
+ * driver reads no line past it then
+ */
+static long kept_frame(const uint8_t* data, size_t size)
+{
+	size_t end = 5, length = 0;
+
+	if (size < 5 || memcmp(data, "+IPD,", 5))
+		return 0;
+	while (end < size && end < 8 && data[end] >= '0' && data[end] <= '9')
+		length = length * 10 + (data[end++] - '0');
+	if (end == size)
+		return -1;
+	if (data[end] != ':' || length == 0 || length > MEM_NET_RX_SIZE)
+		return 0;
+	return (end + 1 + length > size) ? -1 : (long)(end + 1 + length);
+}
+
+
+/**
+ * @return 1 if the complete lines of the input end the wait
+ */
+static int wait_ends(uint32_t expectedFlags, const uint8_t* data, size_t size)
+{
+	uint8_t* response = malloc(size ? size : 1);
+	uint32_t flags = 0;
+	size_t kept = 0, n = 0, start = 0, i, j;
+	long frame;
+
+	/* the lines without the frames, as long as there is room for them */
+	for (i = 0; i < size; ++i)
+	{
+		if ((frame = kept_frame(data + i, size - i)) < 0)
+			break;
+		if (frame && kept + frame <= ESP82_BUFFERSIZE_RESPONSE / 2)
+			kept += frame, i += frame - 1;
+		else
+			response[n++] = data[i];
+	}
+	for (i = 0; i + 1 < n; ++i)
+	{
+		if (response[i] != '\r' || response[i + 1] != '\n')
+			continue;
+		for (j = 0; j < sizeof(lines) / sizeof(lines[0]); ++j)
+		{
+			if ((lines[j].always || (expectedFlags & lines[j].flag)) && strlen(lines[j].line) == i - start
+					&& !memcmp(response + start, lines[j].line, i - start))
+				flags |= lines[j].flag;
+		}
+		start = ++i + 1;
+	}
+	free(response);
+	return (flags & (ESP82_RES_ERROR | ESP82_RES_FAIL | ESP82_RES_BUSY)) || (flags & expectedFlags) == expectedFlags;
+}
+
+
+/**
+ * @return the number of frames if the input is +IPD frames only, else -1
+ */
+static int read_frames(const uint8_t* data, size_t size)
+{
+	int frames = 0;
+
+	while (size > 0)
+	{
+		int length = 0, digits = 0;
+
+		if (size < 7 || memcmp(data, "\r\n+IPD,", 7) || frames == 64)
+			return -1;
+		data += 7, size -= 7;
+		while (size > 0 && *data >= '0' && *data <= '9' && digits < 3)
+			length = length * 10 + (*data++ - '0'), size--, digits++;
+		if (!digits || size == 0 || *data != ':' || length == 0 || length > MEM_NET_RX_SIZE || size - 1 < (size_t)length)
+			return -1;
+		expect.payload[frames] = ++data;
+		expect.length[frames++] = length;
+		data += length, size -= 1 + length;
+	}
+	return frames;
+}
+
+
+static void check(void)
+{
+	if (ESP82_resBufferKept > ESP82_resBufferFront || ESP82_resBufferFront > ESP82_resBufferBack
+			|| ESP82_resBufferBack >= ESP82_BUFFERSIZE_RESPONSE)
+	{
+		fprintf(stderr, "response buffer kept %u front %u back %u\n", ESP82_resBufferKept, ESP82_resBufferFront,
+				ESP82_resBufferBack);
+		abort();
+	}
+}
+
+
+/**
+ * One call of the current wait, ESP82_Receive() once the call is done.
+ * @return 1 while the call is in progress
+ */
+static int step(int* call, char* data, char* response)
+{
+	ESP82_Result_t result;
+
+	if (*call == 0)
+	{
+		result = ESP82_Receive(data, MEM_NET_RX_SIZE);
+		if (result > MEM_NET_RX_SIZE)
+		{
+			fprintf(stderr, "received %d bytes into %d\n", (int)result, MEM_NET_RX_SIZE);
+			abort();
+		}
+		if (result == ESP82_ERROR && !expect.closed && now_ms < ESP82_TIMEOUT_MS_RECEIVE)
+		{
+			fprintf(stderr, "receive failed on a link that is up\n");
+			abort();
+		}
+		if (result > 0 && expect.frames > 0)
+		{
+			int n = expect.received++;
+
+			if (n >= expect.frames || result != expect.length[n] || memcmp(data, expect.payload[n], result))
+			{
+				fprintf(stderr, "frame %d of %d received wrong\n", n + 1, expect.frames);
+				abort();
+			}
+		}
+	}
+	else
+	{
+		result = ESP82_checkResponse(calls[*call].flags, calls[*call].timeout_ms, calls[*call].response ? response : NULL,
+				calls[*call].response);
+		if (result != ESP82_INPROGRESS)
+		{
+			expect.timeout = (ESP82_receivedFlags & ESP82_RES_TIMEOUT) != 0;
+			*call = 0;
+		}
+	}
+	check();
+	return result == ESP82_INPROGRESS;
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	char* received;
+	char* response;
+	int call, i, ends;
+	uint16_t chunk;
+
+	if (size == 0)
+		return 0;
+	call = data[0] & 7;
+	chunk = chunk_sizes[(data[0] >> 3) & 7];
+	data++, size--;
+	received = malloc(MEM_NET_RX_SIZE);	/* exact sizes, for the sanitizer */
+	response = malloc(64);
+
+	fifo_init(&rxFifo, rxFifoBuffer, MEM_FIFO_SIZE);
+	ESP82_Init(115200, 0, fuzz_time_ms);
+	ESP82_SR_State = NULL;
+	ESP82_rxOverflowSeen = 0;
+	ESP82_cmdClass = METRICS_AT_DATA;
+	ESP82_resBufferKept = ESP82_resBufferFront = ESP82_resBufferBack = 0;
+	ESP82_receivedFlags = 0;
+	now_ms = 0;
+	memset(&expect, 0, sizeof(expect));
+	expect.frames = call ? -1 : read_frames(data, size);
+	expect.closed = memmem(data, size, "CLOSED\r\n", 8) != NULL;
+	ends = call && calls[call].flags != ESP82_RES_SEND_BEGIN && wait_ends(calls[call].flags, data, size);
+
+	while (size > 0)
+	{
+		rx_len = (size < chunk) ? size : chunk;
+		memcpy(rxBuffer, data, rx_len);
+		recv_end_flag = 1;
+		HAL_UART_IdleCpltCallback(&huart2);
+		data += rx_len, size -= rx_len;
+		step(&call, received, response);
+	}
+	/* what is left in rxFifo and the response buffer, then the timeouts */
+	for (i = 0; i < 64 && step(&call, received, response); ++i)
+		;
+	now_ms += ESP82_TIMEOUT_MS_AP_CONNECT + 1;
+	for (i = 0; i < 64 && step(&call, received, response); ++i)
+		;
+
+	if (ends && expect.timeout)
+	{
+		fprintf(stderr, "the answer was there, the wait timed out\n");
+		abort();
+	}
+	if (expect.frames > 0 && expect.received != expect.frames)
+	{
+		fprintf(stderr, "%d of %d frames received\n", expect.received, expect.frames);
+		abort();
+	}
+	free(received);
+	free(response);
+	return 0;
+}
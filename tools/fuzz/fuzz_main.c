@@ -0,0 +1,525 @@
+/*******************************************************************************
+ * Driver for the fuzz targets when libFuzzer is not at hand (gcc builds): the
+ * target only defines LLVMFuzzerTestOneInput(), as for libFuzzer.
+ *
+ * The target sources are built with -fsanitize-coverage=trace-pc, this file
+ * without: __sanitizer_cov_trace_pc() below hashes the edges between the
+ * blocks run into a map, with hit counts in buckets as AFL does, and an input
+ * that lights up a new bucket joins the corpus.
+ *
+ * Given only a corpus (files or directories), each input runs once, to check
+ * a corpus or reproduce a crash. With -t or -r it fuzzes for that many
+ * seconds or runs: a corpus entry gets a few stacked mutations (bit flips,
+ * bytes, blocks, tokens of the -d dictionary in AFL/libFuzzer format, a
+ * splice with another entry), new inputs are written to -o (the first corpus
+ * directory by default) and a crash writes the input to crash-<hash> before
+ * the sanitizer or the signal ends the process. With -b the corpus is run
+ * over and over for -t seconds (1 by default) as a throughput benchmark of
+ * the code under test; build without sanitizers for meaningful figures.
+ *
+ * The seeds are in fuzz/corpus/<target>, from captures by fuzz/seed_corpus.py
+ * plus the inputs of the bugs fixed so far, the dictionaries in
+ * fuzz/<target>.dict:
+ *
+ *   fuzz_esp82 -d fuzz/esp82.dict -o /tmp/esp82 -t 600 fuzz/corpus/esp82
+ *   fuzz_esp82_bench -b fuzz/corpus/esp82
+ *
+ * usage: fuzz_<target> [-t seconds] [-r runs] [-d dict] [-o dir] [-s seed] [-b] corpus...
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "../bench/bench.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAP_SIZE 65536
+#define INPUT_MAX 4096
+#define TOKENS_MAX 256
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+struct input
+{
+	uint8_t* data;
+	size_t len;
+};
+
+static uint8_t map[MAP_SIZE];	/* hit counts of the run */
+static uint8_t seen[MAP_SIZE];	/* buckets ever hit */
+static uintptr_t prev;
+
+static struct input* corpus;
+static int corpus_count, corpus_max;
+static struct input tokens[TOKENS_MAX];
+static int token_count;
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+static const char* out_dir;
+static const uint8_t* current;	/* input being run, for the crash file */
+static size_t current_len;
+
+
+void __sanitizer_cov_trace_pc(void)
+{
+	uintptr_t pc = (uintptr_t)__builtin_return_address(0);
+	uintptr_t cur = (pc ^ (pc >> 16) ^ (pc >> 32)) & (MAP_SIZE - 1);
+
+	map[cur ^ prev]++;
+	prev = cur >> 1;
+}
+
+
+/* set by the sanitizer runtime when there is one */
+void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+
+static uint64_t hash(const uint8_t* data, size_t len)
+{
+	uint64_t h = 14695981039346656037ull;
+
+	while (len--)
+		h = (h ^ *data++) * 1099511628211ull;
+	return h;
+}
+
+
+static unsigned rnd(unsigned n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return (unsigned)(rng % n);
+}
+
+
+/* async-signal-safe */
+static void write_input(const char* prefix, const uint8_t* data, size_t len)
+{
+	char path[512];
+	uint64_t h = hash(data, len);
+	int n = 0, fd, i;
+
+	if (out_dir && strcmp(prefix, "crash-") != 0)
+		n = snprintf(path, sizeof(path), "%s/", out_dir);
+	n += snprintf(path + n, sizeof(path) - n, "%s", prefix);
+	for (i = 60; i >= 0; i -= 4)
+		path[n++] = "0123456789abcdef"[(h >> i) & 15];
+	path[n] = '\0';
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0)
+	{
+		if (write(fd, data, len) < 0)
+			;
+		close(fd);
+	}
+}
+
+
+static void on_death(void)
+{
+	static const char msg[] = "crashing input written to crash-<hash>\n";
+
+	if (current)
+		write_input("crash-", current, current_len);
+	if (write(2, msg, sizeof(msg) - 1) < 0)
+		;
+}
+
+
+static void on_signal(int sig)
+{
+	on_death();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+
+/**
+ * Runs an input.
+ * @return 1 if it hit a bucket not seen before
+ */
+static int run(const uint8_t* data, size_t len)
+{
+	uint8_t* copy = malloc(len ? len : 1);	/* exact size, overreads hit the redzone */
+	int i, fresh = 0;
+
+	memcpy(copy, data, len);
+	current = copy;
+	current_len = len;
+	memset(map, 0, sizeof(map));
+	prev = 0;
+	LLVMFuzzerTestOneInput(copy, len);
+	current = NULL;
+	free(copy);
+
+	for (i = 0; i < MAP_SIZE; i += 8)
+	{
+		int j;
+
+		if (*(uint64_t*)&map[i] == 0)
+			continue;
+		for (j = i; j < i + 8; ++j)
+		{
+			unsigned hits = map[j];
+			uint8_t bucket;
+
+			if (!hits)
+				continue;
+			bucket = (hits < 4) ? 1 << (hits - 1) : (hits < 8) ? 8 : (hits < 16) ? 16 : (hits < 32) ? 32 : (hits < 128) ? 64 : 128;
+			if (!(seen[j] & bucket))
+			{
+				seen[j] |= bucket;
+				fresh = 1;
+			}
+		}
+	}
+	return fresh;
+}
+
+
+static void add(const uint8_t* data, size_t len)
+{
+	if (corpus_count == corpus_max)
+	{
+		corpus_max = corpus_max ? 2 * corpus_max : 256;
+		corpus = realloc(corpus, corpus_max * sizeof(*corpus));
+	}
+	corpus[corpus_count].data = malloc(len ? len : 1);
+	memcpy(corpus[corpus_count].data, data, len);
+	corpus[corpus_count++].len = len;
+}
+
+
+static void load_file(const char* path)
+{
+	uint8_t buf[INPUT_MAX];
+	FILE* f = fopen(path, "rb");
+	size_t len;
+
+	if (f == NULL)
+	{
+		perror(path);
+		exit(2);
+	}
+	len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	add(buf, len);
+}
+
+
+static void load(const char* path)
+{
+	struct stat st;
+	DIR* dir;
+	struct dirent* e;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+	{
+		load_file(path);
+		return;
+	}
+	if (out_dir == NULL)
+		out_dir = path;
+	if ((dir = opendir(path)) == NULL)
+		return;
+	while ((e = readdir(dir)) != NULL)
+	{
+		char file[512];
+
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+		if (stat(file, &st) == 0 && S_ISREG(st.st_mode))
+			load_file(file);
+	}
+	closedir(dir);
+}
+
+
+/* name="value" lines, \\ \" and \xNN escapes */
+static void load_dict(const char* path)
+{
+	char line[512];
+	FILE* f = fopen(path, "r");
+
+	if (f == NULL)
+	{
+		perror(path);
+		exit(2);
+	}
+	while (fgets(line, sizeof(line), f) && token_count < TOKENS_MAX)
+	{
+		char* p = strchr(line, '"');
+		char* end = strrchr(line, '"');
+		uint8_t value[256];
+		size_t len = 0;
+
+		if (line[0] == '#' || p == NULL || end == p)
+			continue;
+		for (++p; p < end && len < sizeof(value); ++p)
+		{
+			if (*p == '\\' && p[1] == 'x' && p + 3 < end)
+			{
+				char hex[3] = { p[2], p[3], 0 };
+
+				value[len++] = (uint8_t)strtoul(hex, NULL, 16);
+				p += 3;
+			}
+			else if (*p == '\\' && p + 1 < end)
+				value[len++] = *++p;
+			else
+				value[len++] = *p;
+		}
+		tokens[token_count].data = malloc(len ? len : 1);
+		memcpy(tokens[token_count].data, value, len);
+		tokens[token_count++].len = len;
+	}
+	fclose(f);
+}
+
+
+static void insert(uint8_t* buf, size_t* len, size_t at, const uint8_t* data, size_t n)
+{
+	if (*len + n > INPUT_MAX)
+		n = INPUT_MAX - *len;
+	memmove(buf + at + n, buf + at, *len - at);
+	memmove(buf + at, data, n);
+	*len += n;
+}
+
+
+static size_t mutate(uint8_t* buf, size_t len)
+{
+	static const uint8_t interesting[] = { 0, 1, 0x7f, 0x80, 0xff, '\r', '\n', ':', ',', '0', '9', ' ' };
+	int stack = 1 << rnd(3);
+
+	while (stack--)
+	{
+		size_t at = len ? rnd(len) : 0;
+		size_t n = 1 + rnd(len > 16 ? 16 : len + 1);
+
+		switch (rnd(token_count ? 10 : 8))
+		{
+		case 0:
+			if (len)
+				buf[at] ^= 1 << rnd(8);
+			break;
+		case 1:
+			if (len)
+				buf[at] = rnd(256);
+			break;
+		case 2:
+			if (len)
+				buf[at] = interesting[rnd(sizeof(interesting))];
+			break;
+		case 3:
+			if (len)
+				buf[at] += (rnd(2) ? 1 : -1) * (int)(1 + rnd(35));
+			break;
+		case 4:	/* delete a block */
+			if (at + n > len)
+				n = len - at;
+			memmove(buf + at, buf + at + n, len - at - n);
+			len -= n;
+			break;
+		case 5:	/* duplicate a block */
+			if (len && at + n <= len && len + n <= INPUT_MAX)
+			{
+				uint8_t block[16];
+
+				memcpy(block, buf + at, n);
+				insert(buf, &len, rnd(len + 1), block, n);
+			}
+			break;
+		case 6:	/* splice with another entry */
+		{
+			const struct input* other = &corpus[rnd(corpus_count)];
+
+			if (other->len)
+			{
+				size_t from = rnd(other->len);
+
+				len = at;
+				insert(buf, &len, len, other->data + from, other->len - from);
+			}
+			break;
+		}
+		case 7:	/* random bytes */
+			if (len + n <= INPUT_MAX)
+			{
+				uint8_t block[16];
+				size_t i;
+
+				for (i = 0; i < n; ++i)
+					block[i] = rnd(256);
+				insert(buf, &len, rnd(len + 1), block, n);
+			}
+			break;
+		case 8:	/* insert a token */
+		{
+			const struct input* token = &tokens[rnd(token_count)];
+
+			insert(buf, &len, rnd(len + 1), token->data, token->len);
+			break;
+		}
+		case 9:	/* overwrite with a token */
+		{
+			const struct input* token = &tokens[rnd(token_count)];
+
+			if (token->len <= len)
+				memcpy(buf + rnd(len - token->len + 1), token->data, token->len);
+			break;
+		}
+		}
+	}
+	return len;
+}
+
+
+static int edges(void)
+{
+	int i, count = 0;
+
+	for (i = 0; i < MAP_SIZE; ++i)
+		count += (seen[i] != 0);
+	return count;
+}
+
+
+static void bench(double seconds)
+{
+	uint64_t start = bench_now_ns(), end = start + (uint64_t)(seconds * 1e9), ns;
+	uint64_t inputs = 0, bytes = 0;
+
+	do
+	{
+		int i;
+
+		for (i = 0; i < corpus_count; ++i)
+		{
+			LLVMFuzzerTestOneInput(corpus[i].data, corpus[i].len);
+			bytes += corpus[i].len;
+		}
+		inputs += corpus_count;
+	} while (bench_now_ns() < end);
+	ns = bench_now_ns() - start;
+	bench_report("corpus input", inputs, ns);
+	printf("%-40s %12.1f MB/s %9.2f ns/byte\n", "corpus byte", bytes * 1e3 / ns, (double)ns / bytes);
+}
+
+
+static void fuzz(double seconds, uint64_t runs)
+{
+	uint64_t start = bench_now_ns(), end = seconds ? start + (uint64_t)(seconds * 1e9) : UINT64_MAX;
+	uint64_t execs = 0, report = 1;
+	uint8_t buf[INPUT_MAX];
+	int added = 0;
+
+	if (edges() == 0)
+	{
+		fprintf(stderr, "no coverage: the target is not built with -fsanitize-coverage=trace-pc\n");
+		exit(2);
+	}
+	if (corpus_count == 0)
+		add((const uint8_t*)"", 0);
+	while ((runs == 0 || execs < runs) && ((execs & 255) || bench_now_ns() < end))
+	{
+		const struct input* parent = &corpus[rnd(corpus_count)];
+		size_t len;
+
+		memcpy(buf, parent->data, parent->len);
+		len = mutate(buf, parent->len);
+		if (run(buf, len))
+		{
+			add(buf, len);
+			write_input("", buf, len);
+			added++;
+		}
+		if (++execs == report)
+		{
+			printf("#%llu\tcov: %d corpus: %d (+%d) exec/s: %.0f\n", (unsigned long long)execs, edges(), corpus_count,
+					added, execs * 1e9 / (bench_now_ns() - start + 1));
+			fflush(stdout);
+			report *= 2;
+		}
+	}
+	printf("done %llu runs in %.1f s, cov: %d corpus: %d (+%d)\n", (unsigned long long)execs,
+			(bench_now_ns() - start) / 1e9, edges(), corpus_count, added);
+}
+
+
+int main(int argc, char** argv)
+{
+	double seconds = 0;
+	uint64_t runs = 0;
+	int opt, benchmark = 0, i;
+
+	while ((opt = getopt(argc, argv, "t:r:d:o:s:b")) != -1)
+	{
+		switch (opt)
+		{
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'r':
+			runs = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			load_dict(optarg);
+			break;
+		case 'o':
+			out_dir = optarg;
+			break;
+		case 's':
+			rng ^= strtoull(optarg, NULL, 10) * 0x2545F4914F6CDD1Dull;
+			break;
+		case 'b':
+			benchmark = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t seconds] [-r runs] [-d dict] [-o dir] [-s seed] [-b] corpus...\n", argv[0]);
+			return 2;
+		}
+	}
+	for (i = optind; i < argc; ++i)
+		load(argv[i]);
+
+	/* the sanitizers report faults, not abort() of the checks in a target */
+	signal(SIGABRT, on_signal);
+	if (__sanitizer_set_death_callback)
+		__sanitizer_set_death_callback(on_death);
+	else
+	{
+		signal(SIGSEGV, on_signal);
+		signal(SIGBUS, on_signal);
+		signal(SIGFPE, on_signal);
+		signal(SIGILL, on_signal);
+	}
+
+	if (benchmark)
+	{
+		if (corpus_count == 0)
+		{
+			fprintf(stderr, "no corpus to run\n");
+			return 2;
+		}
+		bench(seconds ? seconds : 1);
+		return 0;
+	}
+
+	/* the corpus first, which also gives the coverage to start from */
+	for (i = 0; i < corpus_count; ++i)
+		run(corpus[i].data, corpus[i].len);
+	printf("%d inputs run, cov: %d\n", corpus_count, edges());
+	if (seconds || runs)
+		fuzz(seconds, runs);
+	return 0;
+}
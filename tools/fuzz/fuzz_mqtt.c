@@ -0,0 +1,148 @@
+/*******************************************************************************
+ * Fuzz target for the MQTT packet reading: MQTTPacket_readnb() and the
+ * deserializers, those of the packets the firmware gets from the broker and
+ * those of the test broker.
+ *
+ * The first input byte picks the path (low 3 bits): 0 to 6 hand the rest of
+ * the input as one packet to MQTTDeserialize_connack(), _suback(), _publish(),
+ * _ack(), _connect(), _subscribe() or _unsubscribe(), in a buffer of exactly
+ * its size. 7 reads packets out of the rest with MQTTPacket_readnb() into a
+ * MEM_MQTT_RX_SIZE buffer, as MqttHandlerTask() does, with the transport
+ * giving at most 1 << (the next 3 bits) bytes a call, and deserializes each
+ * by its type. Besides the sanitizers, the harness checks that what the
+ * deserializers return lies within the packet.
+ *
+ * Built with fuzz/fuzz_main.c, or with -fsanitize=fuzzer for libFuzzer.
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "MQTTConnect.h"
+#include "MQTTSubscribe.h"
+#include "MQTTUnsubscribe.h"
+#include "mem_config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct stream
+{
+	const uint8_t* data;
+	size_t size;
+	int max;	/* per call */
+};
+
+
+static int getfn(void* sck, unsigned char* buf, int count)
+{
+	struct stream* s = sck;
+
+	if (s->size == 0)
+		return -1;	/* the connection is gone */
+	if (count > s->max)
+		count = s->max;
+	if ((size_t)count > s->size)
+		count = s->size;
+	memcpy(buf, s->data, count);
+	s->data += count, s->size -= count;
+	return count;
+}
+
+
+#define FILTERS_MAX 4
+
+static int within(const void* p, int len, const unsigned char* buf, int buflen)
+{
+	return len >= 0 && (const unsigned char*)p >= buf && (const unsigned char*)p + len <= buf + buflen;
+}
+
+
+static void deserialize(int type, unsigned char* buf, int len)
+{
+	unsigned char sessionPresent, connack_rc, dup, retained, packettype;
+	unsigned short packetId;
+	int qos, count, granted[FILTERS_MAX], i;
+	MQTTString topic, filters[FILTERS_MAX];
+	MQTTPacket_connectData connect = MQTTPacket_connectData_initializer;
+	unsigned char* payload;
+	int payloadlen;
+
+	switch (type)
+	{
+	case CONNACK:
+		MQTTDeserialize_connack(&sessionPresent, &connack_rc, buf, len);
+		break;
+	case SUBACK:
+		if (MQTTDeserialize_suback(&packetId, FILTERS_MAX, &count, granted, buf, len) == 1
+				&& (count < 0 || count > FILTERS_MAX))
+			abort();
+		break;
+	case PUBLISH:
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetId, &topic, &payload, &payloadlen, buf, len) == 1
+				&& (!within(payload, payloadlen, buf, len) || !within(topic.lenstring.data, topic.lenstring.len, buf, len)))
+			abort();
+		break;
+	case CONNECT:
+		if (MQTTDeserialize_connect(&connect, buf, len) == 1
+				&& !within(connect.clientID.lenstring.data, connect.clientID.lenstring.len, buf, len))
+			abort();
+		break;
+	case SUBSCRIBE:
+		if (MQTTDeserialize_subscribe(&dup, &packetId, FILTERS_MAX, &count, filters, granted, buf, len) == 1)
+		{
+			if (count < 0 || count > FILTERS_MAX)
+				abort();
+			for (i = 0; i < count; ++i)
+				if (!within(filters[i].lenstring.data, filters[i].lenstring.len, buf, len))
+					abort();
+		}
+		break;
+	case UNSUBSCRIBE:
+		if (MQTTDeserialize_unsubscribe(&dup, &packetId, FILTERS_MAX, &count, filters, buf, len) == 1)
+		{
+			if (count < 0 || count > FILTERS_MAX)
+				abort();
+			for (i = 0; i < count; ++i)
+				if (!within(filters[i].lenstring.data, filters[i].lenstring.len, buf, len))
+					abort();
+		}
+		break;
+	default:
+		MQTTDeserialize_ack(&packettype, &dup, &packetId, buf, len);
+		break;
+	}
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+	static const int types[7] = { CONNACK, SUBACK, PUBLISH, PUBACK, CONNECT, SUBSCRIBE, UNSUBSCRIBE };
+	int path;
+
+	if (size == 0)
+		return 0;
+	path = data[0] & 7;
+	if (path < 7)
+	{
+		unsigned char* packet = malloc(size - 1 ? size - 1 : 1);
+
+		memcpy(packet, data + 1, size - 1);
+		deserialize(types[path], packet, size - 1);
+		free(packet);
+	}
+	else
+	{
+		unsigned char* buf = malloc(MEM_MQTT_RX_SIZE);
+		struct stream s = { data + 1, size - 1, 1 << ((data[0] >> 3) & 7) };
+		MQTTTransport transporter = { getfn, &s, 0, 0, 0, 0 };
+		int type;
+
+		while ((type = MQTTPacket_readnb(buf, MEM_MQTT_RX_SIZE, &transporter)) != -1)
+		{
+			if (type > 0)
+				deserialize(type, buf, transporter.len);
+		}
+		free(buf);
+	}
+	return 0;
+}
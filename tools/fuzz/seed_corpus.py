@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Seed corpus for the fuzz targets from USART2 captures (Inc/uart_capture.h).
+
+What the module sent between two sends of the firmware becomes an input of
+fuzz_esp82, for the wait the first send starts (the AT command, or SEND OK
+after the data), cut into chunks of about the size they came in. The +IPD
+payloads become inputs of fuzz_mqtt, one per packet for its deserializer and
+the packets of a window in a row for MQTTPacket_readnb(); the packets the
+firmware sent go to the deserializers of the broker side. Inputs are named by
+their SHA-1 as libFuzzer does, and at most -n are kept per kind.
+
+Usage:  python3 tools/fuzz/seed_corpus.py [-o tools/fuzz/corpus] [-n 8] capture...
+Then:   fuzz_esp82 -d tools/fuzz/esp82.dict -t 60 tools/fuzz/corpus/esp82
+"""
+import argparse
+import hashlib
+import os
+import re
+import struct
+import sys
+
+MAGIC = b"UARTCAP1"
+INPUT_MAX = 4096  # fuzz/fuzz_main.c
+CHUNK_SIZES = [1, 2, 3, 7, 16, 61, 128, 256]  # fuzz/fuzz_esp82.c
+
+# the wait an AT command starts, the low bits of the first fuzz_esp82 byte
+WAITS = [(b"AT+CWJAP=", 2), (b"AT+CIPSTATUS", 3), (b"AT+CIPSTART=", 4), (b"AT+CIPSEND=", 5)]
+WAIT_SEND_OK = 6
+# fuzz_mqtt paths of the packet types, 3 (MQTTDeserialize_ack) for the others
+PATHS = {2: 0, 9: 1, 3: 2, 1: 4, 8: 5, 10: 6}
+PATH_READNB = 7
+
+
+def read_capture(path):
+    """Returns the ('R' or 'T', bytes) records of a capture."""
+    with open(path, "rb") as f:
+        data = f.read()
+    at = data.find(MAGIC)
+    if at < 0:
+        sys.exit("%s: not a capture" % path)
+    at += len(MAGIC)
+    records = []
+    while at + 7 <= len(data):
+        kind, _, length = struct.unpack_from("<cIH", data, at)
+        if data[at:at + len(MAGIC)] == MAGIC:
+            break
+        at += 7
+        if kind in (b"R", b"T"):
+            records.append((kind.decode(), data[at:at + length]))
+        at += length
+    return records
+
+
+def windows(records):
+    """Yields (wait, [received chunks]) for each send of the firmware."""
+    wait, chunks = 0, []
+    for kind, data in records:
+        if kind == "R":
+            chunks.append(data)
+            continue
+        if chunks:
+            yield wait, chunks
+        chunks = []
+        if data.startswith(b"AT"):
+            wait = next((w for prefix, w in WAITS if data.startswith(prefix)), 1)
+        elif wait == 5:
+            wait = WAIT_SEND_OK
+    if chunks:
+        yield wait, chunks
+
+
+def chunk_bits(chunks):
+    """The fuzz_esp82 chunk size closest to the median of the window."""
+    median = sorted(len(c) for c in chunks)[len(chunks) // 2]
+    return min(range(len(CHUNK_SIZES)), key=lambda i: abs(CHUNK_SIZES[i] - median))
+
+
+def payloads(received):
+    """The +IPD payloads in what the module sent."""
+    for m in re.finditer(rb"\+IPD,(\d+):", received):
+        yield received[m.end():m.end() + int(m.group(1))]
+
+
+def split_packets(data):
+    """The whole MQTT packets in a row of bytes."""
+    at = 0
+    while at + 2 <= len(data):
+        length, shift, end = 0, 0, at + 1
+        while end < len(data) and end < at + 5:
+            length |= (data[end] & 127) << shift
+            shift += 7
+            end += 1
+            if not data[end - 1] & 128:
+                break
+        if end + length > len(data):
+            return
+        yield data[at:end + length]
+        at = end + length
+
+
+def sent(records):
+    """The data of each send of the firmware, its segments joined."""
+    data = b""
+    for kind, record in records:
+        if kind == "T" and not record.startswith(b"AT"):
+            data += record
+        elif kind == "T" and data:
+            yield data
+            data = b""
+    if data:
+        yield data
+
+
+def seeds(records):
+    """Returns {target: [input]}."""
+    out = {"esp82": [], "mqtt": []}
+    for data in sent(records):
+        for packet in split_packets(data):
+            out["mqtt"].append(bytes([PATHS.get(packet[0] >> 4, 3)]) + packet)
+    for wait, chunks in windows(records):
+        received = b"".join(chunks)
+        bits = chunk_bits(chunks)
+        out["esp82"].append(bytes([wait | bits << 3]) + received[:INPUT_MAX - 1])
+        packets = list(payloads(received))
+        for packet in packets:
+            if packet:
+                out["mqtt"].append(bytes([PATHS.get(packet[0] >> 4, 3)]) + packet)
+        if len(packets) > 1:
+            out["mqtt"].append(bytes([PATH_READNB | bits << 3]) + b"".join(packets))
+    return out
+
+
+def kind(target, data):
+    """What inputs are told apart by when picking -n of each."""
+    if target == "esp82":
+        return data[0] & 7, re.sub(rb"\d+", b"0", data[1:])[:24]
+    return data[0] & 7, data[1:2]
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("-o", default=os.path.join(os.path.dirname(__file__), "corpus"))
+    parser.add_argument("-n", type=int, default=8, help="inputs kept per kind")
+    parser.add_argument("captures", nargs="+")
+    args = parser.parse_args(argv[1:])
+
+    records = []
+    for path in args.captures:
+        records += read_capture(path)
+    for target, inputs in seeds(records).items():
+        directory = os.path.join(args.o, target)
+        os.makedirs(directory, exist_ok=True)
+        kept, counts = set(), {}
+        for data in inputs:
+            key = kind(target, data)
+            if data in kept or counts.get(key, 0) >= args.n:
+                continue
+            kept.add(data)
+            counts[key] = counts.get(key, 0) + 1
+            with open(os.path.join(directory, hashlib.sha1(data).hexdigest()), "wb") as f:
+                f.write(data)
+        print("%s: %d inputs of %d" % (directory, len(kept), len(inputs)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Generates Src/topic_table.c from Inc/topic_table.def.
+
+The table is indexed by a perfect hash over the whole topic name (a seeded
+multiplicative hash, seed and multiplier searched for), so any set of
+distinct names gets a table and dispatching an incoming PUBLISH costs one
+pass over the topic, one length compare and one memcmp on the
+length-prefixed topic in the packet.
+
+Standalone:  python3 tools/gen_topic_table.py
+PlatformIO:  extra_scripts = pre:tools/gen_topic_table.py
+"""
+import os
+import re
+import sys
+
+HEADER = """/*
+ * Generated by tools/gen_topic_table.py from Inc/topic_table.def, do not edit.
+ */
+#include "topic_name_helper.h"
+#include <string.h>
+
+#define TOPIC_HASH_SIZE %(size)d
+#define TOPIC_HASH_MUL  %(a)du
+#define TOPIC_HASH_SEED %(b)du
+
+struct topic_entry {
+	const char *name;
+	unsigned char len;
+	unsigned char code;
+	topic_handler_t handler;
+};
+
+static const struct topic_entry topic_table[TOPIC_HASH_SIZE] = {
+%(entries)s
+};
+
+static unsigned int topic_hash(const unsigned char *name, int len)
+{
+	unsigned int h = TOPIC_HASH_SEED;
+
+	while (len-- > 0)
+		h = h * TOPIC_HASH_MUL + *name++;
+	return h & (TOPIC_HASH_SIZE - 1);
+}
+"""
+
+BODY = """
+/*
+ * Looks up the topic of a received PUBLISH in place (no copy, no NUL needed).
+ * Returns the table entry or NULL.
+ */
+static const struct topic_entry *topic_lookup(const MQTTString *topic)
+{
+	const struct topic_entry *e;
+	const unsigned char *name;
+	int len;
+
+	if (topic->cstring) {
+		name = (const unsigned char *)topic->cstring;
+		len = strlen(topic->cstring);
+	} else {
+		name = (const unsigned char *)topic->lenstring.data;
+		len = topic->lenstring.len;
+	}
+	if (len <= 0)
+		return NULL;
+	e = &topic_table[topic_hash(name, len)];
+	if (e->len != len || memcmp(e->name, name, len))
+		return NULL;
+	return e;
+}
+
+int getTopicCode(const MQTTString *topic)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	return e ? e->code : TOPIC_UNKNOWN;
+}
+
+topic_handler_t getTopicHandler(const MQTTString *topic)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	return e ? e->handler : NULL;
+}
+
+int topic_dispatch(const MQTTString *topic, const unsigned char *payload, int payloadlen)
+{
+	const struct topic_entry *e = topic_lookup(topic);
+
+	if (!e)
+		return TOPIC_UNKNOWN;
+	e->handler(payload, payloadlen);
+	return e->code;
+}
+"""
+
+
+def read_topics(path):
+    topics = []
+    with open(path) as f:
+        for m in re.finditer(r'^TOPIC\(\s*(\w+)\s*,\s*"([^"]+)"\s*,\s*(\w+)\s*\)', f.read(), re.M):
+            topics.append(m.groups())
+    return topics
+
+
+MAX_SLOTS_PER_TOPIC = 64
+
+
+def topic_hash(raw, a, b, size):
+    """topic_hash() of the generated C, on 32-bit unsigned ints."""
+    h = b
+    for c in raw:
+        h = (h * a + c) & 0xFFFFFFFF
+    return h & (size - 1)
+
+
+def find_hash(names):
+    """Smallest power of 2 table, with a multiplier and seed, without collisions."""
+    raws = [n.encode() for n in names]
+    size = 1
+    while size < len(raws):
+        size *= 2
+    while size <= MAX_SLOTS_PER_TOPIC * len(raws):
+        for a in range(3, 256, 2):
+            for b in range(0, 64):
+                if len({topic_hash(r, a, b, size) for r in raws}) == len(raws):
+                    return size, a, b
+        size *= 2
+    raise SystemExit("topic_table.def: no perfect hash found for %d topics up to %d slots"
+                     % (len(raws), size // 2))
+
+
+def generate(root):
+    topics = read_topics(os.path.join(root, "Inc", "topic_table.def"))
+    names = [t[1] for t in topics]
+    if len(set(names)) != len(names):
+        raise SystemExit("topic_table.def: duplicate topic names")
+    if any(len(n.encode()) > 255 for n in names):
+        raise SystemExit("topic_table.def: topic names are limited to 255 bytes")
+    size, a, b = find_hash(names)
+    slots = {}
+    for code, name, handler in topics:
+        raw = name.encode()
+        slots[topic_hash(raw, a, b, size)] = (code, name, handler, len(raw))
+    entries = ",\n".join('\t[%d] = { "%s", %d, %s, %s }' % (h, n, l, c, fn)
+                         for h, (c, n, fn, l) in sorted(slots.items()))
+    text = HEADER % {"size": size, "a": a, "b": b, "entries": entries} + BODY
+    out = os.path.join(root, "Src", "topic_table.c")
+    old = open(out).read() if os.path.exists(out) else None
+    if text != old:
+        with open(out, "w") as f:
+            f.write(text)
+        print("generated %s (%d topics, %d slots)" % (out, len(topics), size))
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO (SCons)
+except NameError:
+    if __name__ == "__main__":
+        generate(os.path.dirname(os.path.dirname(os.path.abspath(sys.argv[0]))))
+else:
+    generate(env.subst("$PROJECT_DIR"))  # noqa: F821
@@ -0,0 +1,78 @@
+/*******************************************************************************
+ * Intrusive multi-producer single-consumer queue, after Dmitry Vyukov's.
+ *
+ * mpsc_push() is one atomic exchange and a store, from any thread, never
+ * waiting. mpsc_pop() is for the one consumer. It can return NULL while a
+ * push is between its two steps, with the node not linked yet: a producer
+ * that wakes the consumer after pushing makes it look again.
+ *******************************************************************************/
+
+#ifndef MPSC_H_
+#define MPSC_H_
+
+#include <stddef.h>
+
+struct mpsc_node
+{
+	struct mpsc_node* next;
+};
+
+struct mpsc
+{
+	struct mpsc_node* head __attribute__((aligned(64)));	/* last pushed, by the producers */
+	struct mpsc_node* tail __attribute__((aligned(64)));	/* next popped, by the consumer */
+	struct mpsc_node stub;
+};
+
+
+static inline void mpsc_init(struct mpsc* q)
+{
+	q->stub.next = NULL;
+	q->head = q->tail = &q->stub;
+}
+
+
+static inline void mpsc_push(struct mpsc* q, struct mpsc_node* n)
+{
+	struct mpsc_node* prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @return the oldest node, NULL if there is none or one is half pushed
+ */
+static inline struct mpsc_node* mpsc_pop(struct mpsc* q)
+{
+	struct mpsc_node* tail = q->tail;
+	struct mpsc_node* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &q->stub)
+	{
+		if (!next)
+			return NULL;
+		q->tail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;	/* a push is linking its node */
+	/* tail is the last node: the stub goes behind it so that it can be taken */
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next)
+	{
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+
+#endif /* MPSC_H_ */
@@ -0,0 +1,1320 @@
+/*******************************************************************************
+ * Connection loop of the host tools, see netio.h.
+ *
+ * io_uring is driven through the raw system calls and the kernel's
+ * <linux/io_uring.h>, it needs Linux 6.0 for multishot recv.
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "netio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RECV_CHUNK 16384	/* epoll: bytes per recv() */
+#define MAX_EVENTS 256
+#define RING_ENTRIES 4096
+#define RING_BUFS 1024	/* receive buffers registered with the kernel, a power of 2 */
+#define RING_BUF_SIZE 4096
+#define BUF_GROUP 0
+#define MIN_BUF 512
+#define MAX_IOV 64	/* segments per send */
+
+/* io_uring operations, in the low bits of user_data */
+enum
+{
+	OP_RECV = 1, OP_SEND, OP_CONNECT, OP_ACCEPT, OP_CANCEL, OP_WAKE
+};
+#define OP_MASK 7
+
+#define CONN_CONNECTING 0x01
+#define CONN_CLOSING 0x02
+#define CONN_DIRTY 0x04	/* on the flush list */
+#define CONN_WANT_WRITE 0x08	/* epoll: EPOLLOUT registered */
+#define CONN_SENDING 0x10	/* io_uring: out is in flight */
+#define CONN_DETACH 0x20	/* closing, the socket goes to on_detach */
+#define CONN_FEED 0x40	/* rx is to be passed to on_data */
+
+/* a run of output: bytes of the queue itself, or a shared buffer */
+struct seg
+{
+	struct netio_buf* buf;	/* NULL for the queue's bytes */
+	int off, len;
+};
+
+/* output of a connection, in order */
+struct outq
+{
+	unsigned char* bytes;
+	int nbytes, sizebytes;
+	struct seg* segs;
+	int nsegs, sizesegs;
+	int head;	/* first unsent segment */
+	int headoff;	/* bytes of it already sent */
+	int total;	/* bytes unsent */
+};
+
+struct conn
+{
+	struct netio_conn pub;
+	int flags;
+	int refs;	/* io_uring operations in flight */
+	unsigned char* rx;	/* unconsumed input */
+	int rxlen, rxsize;
+	struct outq tx;	/* queued output */
+	struct outq out;	/* io_uring: output owned by the kernel until the send completes */
+	struct msghdr* msg;	/* io_uring: the send of several segments, with room for MAX_IOV */
+	struct conn* next_dirty;
+	struct conn* next_dead;
+	struct conn* prev;	/* every connection of the loop */
+	struct conn* next;
+};
+
+struct netio
+{
+	enum netio_backend backend;
+	const struct netio_handler* h;
+	int max_tx;
+	unsigned long syscalls;
+	struct conn* all;
+	struct conn* dirty;
+	struct conn* dead;	/* freed at the end of netio_run() */
+	int lfd;
+	int wakefd;	/* eventfd of netio_wake(), if there is on_wake */
+	uint64_t wakeval;	/* io_uring: read into */
+
+	/* epoll */
+	int epfd;
+	unsigned char* rxbuf;
+
+	/* io_uring */
+	int ringfd;
+	void* sq_ptr;
+	size_t sq_len;
+	void* cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe* sqes;
+	size_t sqes_len;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask, sq_entries;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+	unsigned pending;	/* queued, not yet submitted */
+	struct io_uring_buf_ring* br;
+	size_t br_len;
+	unsigned char* bufs;
+	unsigned short br_tail;
+};
+
+static void conn_free(struct netio* io, struct conn* c);
+
+
+const char* netio_backend_name(enum netio_backend backend)
+{
+	return (backend == NETIO_URING) ? "io_uring" : "epoll";
+}
+
+
+enum netio_backend netio_backend(const struct netio* io)
+{
+	return io->backend;
+}
+
+
+unsigned long netio_syscalls(const struct netio* io)
+{
+	return io->syscalls;
+}
+
+
+static int grow(unsigned char** buf, int* size, int need)
+{
+	if (need > *size)
+	{
+		int n = *size ? *size : MIN_BUF;
+		unsigned char* p;
+
+		while (n < need)
+			n *= 2;
+		if (!(p = realloc(*buf, n)))
+			return -1;
+		*buf = p;
+		*size = n;
+	}
+	return 0;
+}
+
+
+static int grow_segs(struct outq* q, int need)
+{
+	if (need > q->sizesegs)
+	{
+		int n = q->sizesegs ? q->sizesegs * 2 : 8;
+		struct seg* p;
+
+		while (n < need)
+			n *= 2;
+		if (!(p = realloc(q->segs, n * sizeof(*p))))
+			return -1;
+		q->segs = p;
+		q->sizesegs = n;
+	}
+	return 0;
+}
+
+
+/**
+ * Room for len bytes at the end of the queue, and for the segment taking them.
+ */
+static unsigned char* outq_reserve(struct outq* q, int len)
+{
+	if (grow(&q->bytes, &q->sizebytes, q->nbytes + len) < 0 || grow_segs(q, q->nsegs + 1) < 0)
+		return NULL;
+	return q->bytes + q->nbytes;
+}
+
+
+static void outq_commit(struct outq* q, int len)
+{
+	struct seg* last;
+
+	/* bytes only ever go at the end, so the last segment of them can grow */
+	if (q->nsegs > q->head && !q->segs[q->nsegs - 1].buf)
+		q->segs[q->nsegs - 1].len += len;
+	else
+	{
+		last = &q->segs[q->nsegs++];
+		last->buf = NULL;
+		last->off = q->nbytes;
+		last->len = len;
+	}
+	q->nbytes += len;
+	q->total += len;
+}
+
+
+/**
+ * The unsent output as an iovec, from the first unsent byte.
+ * @return the number of entries
+ */
+static int outq_iov(const struct outq* q, struct iovec* iov, int max)
+{
+	int i, n = 0;
+
+	for (i = q->head; i < q->nsegs && n < max; ++i, ++n)
+	{
+		const struct seg* s = &q->segs[i];
+		int skip = (i == q->head) ? q->headoff : 0;
+
+		iov[n].iov_base = (s->buf ? s->buf->data : q->bytes) + s->off + skip;
+		iov[n].iov_len = s->len - skip;
+	}
+	return n;
+}
+
+
+/**
+ * Drops len bytes sent, and the references to shared buffers sent in full.
+ */
+static void outq_consume(struct outq* q, int len)
+{
+	int i, from;
+
+	q->total -= len;
+	while (len > 0)
+	{
+		struct seg* s = &q->segs[q->head];
+		int left = s->len - q->headoff;
+
+		if (len < left)
+		{
+			q->headoff += len;
+			break;
+		}
+		len -= left;
+		if (s->buf)
+			netio_buf_put(s->buf);
+		q->head++;
+		q->headoff = 0;
+	}
+	if (q->head == q->nsegs)
+	{
+		q->head = q->nsegs = q->nbytes = 0;
+		return;
+	}
+	/* keep what is left at the start, as output stuck behind a full socket
+	 * would otherwise have the queue grow without end */
+	for (i = q->head, from = q->nbytes; i < q->nsegs; ++i)
+		if (!q->segs[i].buf)
+		{
+			from = q->segs[i].off;
+			break;
+		}
+	memmove(q->bytes, q->bytes + from, q->nbytes - from);
+	q->nbytes -= from;
+	for (i = q->head; i < q->nsegs; ++i)
+		if (!q->segs[i].buf)
+			q->segs[i].off -= from;
+	memmove(q->segs, q->segs + q->head, (q->nsegs - q->head) * sizeof(*q->segs));
+	q->nsegs -= q->head;
+	q->head = 0;
+}
+
+
+static void outq_free(struct outq* q)
+{
+	int i;
+
+	for (i = q->head; i < q->nsegs; ++i)
+		if (q->segs[i].buf)
+			netio_buf_put(q->segs[i].buf);
+	free(q->bytes);
+	free(q->segs);
+	memset(q, 0, sizeof(*q));
+}
+
+
+static void mark_dirty(struct netio* io, struct conn* c)
+{
+	if (!(c->flags & CONN_DIRTY))
+	{
+		c->flags |= CONN_DIRTY;
+		c->next_dirty = io->dirty;
+		io->dirty = c;
+	}
+}
+
+
+static struct conn* conn_new(struct netio* io, int fd, int flags)
+{
+	struct conn* c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+	c->pub.fd = fd;
+	c->flags = flags;
+	c->next = io->all;
+	if (io->all)
+		io->all->prev = c;
+	io->all = c;
+	return c;
+}
+
+
+/**
+ * Queues the connection for freeing once the kernel and the flush list are
+ * done with it.
+ */
+static void conn_release(struct netio* io, struct conn* c)
+{
+	if (!(c->flags & CONN_CLOSING) || c->refs > 0 || (c->flags & CONN_DIRTY) || c->pub.fd == -2)
+		return;
+	if (c->flags & CONN_DETACH)
+	{
+		io->h->on_detach(&c->pub, c->pub.fd, c->rx, c->rxlen);
+		c->pub.user = NULL;
+	}
+	else if (c->pub.fd >= 0)
+	{
+		close(c->pub.fd);
+		io->syscalls++;
+	}
+	c->pub.fd = -2;	/* on the dead list */
+	c->next_dead = io->dead;
+	io->dead = c;
+}
+
+
+static void conn_free(struct netio* io, struct conn* c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		io->all = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	free(c->rx);
+	outq_free(&c->tx);
+	outq_free(&c->out);
+	free(c->msg);
+	free(c);
+}
+
+
+/**
+ * Passes what is in rx to on_data.
+ * @return 0, or -1 if the connection was closed
+ */
+static int feed(struct netio* io, struct conn* c)
+{
+	int n;
+
+	if ((n = io->h->on_data(&c->pub, c->rx, c->rxlen)) < 0)
+	{
+		netio_close(io, &c->pub);
+		return -1;
+	}
+	memmove(c->rx, c->rx + n, c->rxlen - n);
+	c->rxlen -= n;
+	return 0;
+}
+
+
+/**
+ * Passes data to on_data after what was left over.
+ * @return 0, or -1 if the connection was closed
+ */
+static int deliver(struct netio* io, struct conn* c, unsigned char* data, int len)
+{
+	int n;
+
+	if (c->flags & CONN_CLOSING)
+	{
+		/* detaching: kept for whoever takes the socket over */
+		if ((c->flags & CONN_DETACH) && grow(&c->rx, &c->rxsize, c->rxlen + len) == 0)
+		{
+			memcpy(c->rx + c->rxlen, data, len);
+			c->rxlen += len;
+		}
+		return -1;
+	}
+	if (c->rxlen == 0)
+	{
+		if ((n = io->h->on_data(&c->pub, data, len)) < 0)
+			goto close;
+		data += n;
+		len -= n;
+		if (len == 0)
+			return 0;
+		if (grow(&c->rx, &c->rxsize, len) < 0)
+			goto close;
+		memcpy(c->rx, data, len);
+		c->rxlen = len;
+		return 0;
+	}
+	if (grow(&c->rx, &c->rxsize, c->rxlen + len) < 0)
+		goto close;
+	memcpy(c->rx + c->rxlen, data, len);
+	c->rxlen += len;
+	return feed(io, c);
+close:
+	netio_close(io, &c->pub);
+	return -1;
+}
+
+
+unsigned char* netio_reserve(struct netio* io, struct netio_conn* pub, int len)
+{
+	struct conn* c = (struct conn*)pub;
+	unsigned char* p;
+
+	if (c->flags & CONN_CLOSING)
+		return NULL;
+	if (io->max_tx && c->tx.total + c->out.total + len > io->max_tx)
+		return NULL;
+	if (!(p = outq_reserve(&c->tx, len)))
+		return NULL;
+	mark_dirty(io, c);
+	return p;
+}
+
+
+void netio_commit(struct netio_conn* pub, int len)
+{
+	outq_commit(&((struct conn*)pub)->tx, len);
+}
+
+
+struct netio_buf* netio_buf_new(int len)
+{
+	struct netio_buf* b = malloc(sizeof(*b) + len);
+
+	if (b)
+	{
+		b->refs = 1;
+		b->len = len;
+	}
+	return b;
+}
+
+
+struct netio_buf* netio_buf_get(struct netio_buf* b)
+{
+	__atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+
+void netio_buf_put(struct netio_buf* b)
+{
+	if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(b);
+}
+
+
+int netio_send_buf(struct netio* io, struct netio_conn* pub, struct netio_buf* b)
+{
+	struct conn* c = (struct conn*)pub;
+	struct outq* q = &c->tx;
+	struct seg* s;
+	unsigned char* p;
+
+	if (b->len <= NETIO_BUF_COPY_MAX)
+	{
+		if (!(p = netio_reserve(io, pub, b->len)))
+			return -1;
+		memcpy(p, b->data, b->len);
+		netio_commit(pub, b->len);
+		return 0;
+	}
+	if ((c->flags & CONN_CLOSING) || (io->max_tx && c->tx.total + c->out.total + b->len > io->max_tx)
+			|| grow_segs(q, q->nsegs + 1) < 0)
+		return -1;
+	s = &q->segs[q->nsegs++];
+	s->buf = b;
+	s->off = 0;
+	s->len = b->len;
+	q->total += b->len;
+	netio_buf_get(b);
+	mark_dirty(io, c);
+	return 0;
+}
+
+
+int netio_queued(const struct netio_conn* pub)
+{
+	const struct conn* c = (const struct conn*)pub;
+
+	return c->tx.total + c->out.total;
+}
+
+
+int netio_sendv(struct netio* io, struct netio_conn* c, const transport_iovec_t* iov, int iovcnt)
+{
+	unsigned char* p;
+	int i, len = 0;
+
+	for (i = 0; i < iovcnt; ++i)
+		len += iov[i].len;
+	if (!(p = netio_reserve(io, c, len)))
+		return -1;
+	for (i = 0; i < iovcnt; ++i)
+	{
+		memcpy(p, iov[i].base, iov[i].len);
+		p += iov[i].len;
+	}
+	netio_commit(c, len);
+	return 0;
+}
+
+
+/******************************************************************************
+ * epoll
+ ******************************************************************************/
+
+static int ep_ctl(struct netio* io, int op, struct conn* c, unsigned int events)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = c;
+	io->syscalls++;
+	return epoll_ctl(io->epfd, op, c->pub.fd, &ev);
+}
+
+
+static void ep_flush(struct netio* io, struct conn* c)
+{
+	while (c->tx.total > 0)
+	{
+		struct iovec iov[MAX_IOV];
+		struct msghdr msg;
+		ssize_t n;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = outq_iov(&c->tx, iov, MAX_IOV);
+		n = (msg.msg_iovlen == 1) ? send(c->pub.fd, iov[0].iov_base, iov[0].iov_len, MSG_NOSIGNAL)
+				: sendmsg(c->pub.fd, &msg, MSG_NOSIGNAL);
+		io->syscalls++;
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				netio_close(io, &c->pub);
+				return;
+			}
+			break;
+		}
+		outq_consume(&c->tx, n);
+	}
+	if ((c->tx.total > 0) != ((c->flags & CONN_WANT_WRITE) != 0) && !(c->flags & CONN_CONNECTING))
+	{
+		c->flags ^= CONN_WANT_WRITE;
+		ep_ctl(io, EPOLL_CTL_MOD, c, EPOLLIN | ((c->flags & CONN_WANT_WRITE) ? EPOLLOUT : 0));
+	}
+}
+
+
+static void ep_accept(struct netio* io)
+{
+	for (;;)
+	{
+		struct conn* c;
+		int fd = accept4(io->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		int one = 1;
+
+		io->syscalls++;
+		if (fd < 0)
+			return;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		io->syscalls++;
+		if (!(c = conn_new(io, fd, 0)))
+		{
+			close(fd);
+			continue;
+		}
+		if (ep_ctl(io, EPOLL_CTL_ADD, c, EPOLLIN) < 0 || !(c->pub.user = io->h->on_accept(io, &c->pub)))
+		{
+			c->flags |= CONN_CLOSING;
+			conn_release(io, c);
+		}
+	}
+}
+
+
+static void ep_connected(struct netio* io, struct conn* c)
+{
+	int err = 0;
+	socklen_t errlen = sizeof(err);
+
+	io->syscalls++;
+	if (getsockopt(c->pub.fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err)
+	{
+		netio_close(io, &c->pub);
+		return;
+	}
+	c->flags &= ~(CONN_CONNECTING | CONN_WANT_WRITE);
+	ep_ctl(io, EPOLL_CTL_MOD, c, EPOLLIN);
+	if (c->tx.total > 0)
+		mark_dirty(io, c);
+	if (io->h->on_connect && io->h->on_connect(&c->pub) < 0)
+		netio_close(io, &c->pub);
+}
+
+
+static void ep_read(struct netio* io, struct conn* c)
+{
+	for (;;)
+	{
+		ssize_t n = recv(c->pub.fd, io->rxbuf, RECV_CHUNK, 0);
+
+		io->syscalls++;
+		if (n == 0)
+		{
+			netio_close(io, &c->pub);
+			return;
+		}
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				netio_close(io, &c->pub);
+			return;
+		}
+		if (deliver(io, c, io->rxbuf, n) < 0 || n < RECV_CHUNK)
+			return;	/* a short read emptied the socket, level triggered epoll reports more */
+	}
+}
+
+
+static int ep_wait(struct netio* io, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n = epoll_wait(io->epfd, events, MAX_EVENTS, timeout_ms);
+
+	io->syscalls++;
+	for (i = 0; i < n; ++i)
+	{
+		struct conn* c = events[i].data.ptr;
+
+		if (!c)
+			ep_accept(io);
+		else if ((void*)c == (void*)&io->wakefd)
+		{
+			uint64_t v;
+
+			io->syscalls++;
+			if (read(io->wakefd, &v, sizeof(v)) > 0)
+				io->h->on_wake(io);
+		}
+		else if (c->flags & CONN_CLOSING)
+			continue;
+		else if (c->flags & CONN_CONNECTING)
+			ep_connected(io, c);
+		else
+		{
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				ep_read(io, c);
+			if ((events[i].events & EPOLLOUT) && !(c->flags & CONN_CLOSING))
+				mark_dirty(io, c);
+		}
+	}
+	return (n < 0 && errno == EINTR) ? 0 : n;
+}
+
+
+/******************************************************************************
+ * io_uring
+ ******************************************************************************/
+
+static int sys_setup(unsigned entries, struct io_uring_params* p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(struct netio* io, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t argsz)
+{
+	io->syscalls++;
+	return (int)syscall(__NR_io_uring_enter, io->ringfd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int sys_register(int fd, unsigned op, void* arg, unsigned nr)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+
+static void ur_submit(struct netio* io)
+{
+	int n;
+
+	if (io->pending == 0)
+		return;
+	n = sys_enter(io, io->pending, 0, 0, NULL, 0);
+	if (n > 0)
+		io->pending -= (n < (int)io->pending) ? n : io->pending;
+}
+
+
+static struct io_uring_sqe* ur_sqe(struct netio* io, void* owner, int op)
+{
+	unsigned tail = *io->sq_tail;
+	struct io_uring_sqe* sqe;
+
+	while (tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE) >= io->sq_entries)
+		ur_submit(io);
+	sqe = &io->sqes[tail & io->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+	__atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	io->pending++;
+	return sqe;
+}
+
+
+static void ur_recv(struct netio* io, struct conn* c)
+{
+	struct io_uring_sqe* sqe = ur_sqe(io, c, OP_RECV);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->pub.fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	c->refs++;
+}
+
+
+static void ur_accept(struct netio* io)
+{
+	struct io_uring_sqe* sqe = ur_sqe(io, NULL, OP_ACCEPT);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = io->lfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+
+static void ur_wake(struct netio* io)
+{
+	struct io_uring_sqe* sqe = ur_sqe(io, NULL, OP_WAKE);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = io->wakefd;
+	sqe->addr = (uint64_t)(uintptr_t)&io->wakeval;
+	sqe->len = sizeof(io->wakeval);
+}
+
+
+static void ur_send(struct netio* io, struct conn* c)
+{
+	struct io_uring_sqe* sqe = ur_sqe(io, c, OP_SEND);
+	struct iovec one = { 0 };
+
+	sqe->fd = c->pub.fd;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	c->refs++;
+	if (c->out.nsegs - c->out.head > 1 && (c->msg || (c->msg = malloc(sizeof(*c->msg) + MAX_IOV * sizeof(struct iovec)))))
+	{
+		memset(c->msg, 0, sizeof(*c->msg));
+		c->msg->msg_iov = (struct iovec*)(c->msg + 1);
+		c->msg->msg_iovlen = outq_iov(&c->out, c->msg->msg_iov, MAX_IOV);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (uint64_t)(uintptr_t)c->msg;
+		sqe->len = 1;
+		return;
+	}
+	/* one segment, or one at a time without memory for more */
+	outq_iov(&c->out, &one, 1);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->addr = (uint64_t)(uintptr_t)one.iov_base;
+	sqe->len = one.iov_len;
+}
+
+
+static void ur_flush(struct netio* io, struct conn* c)
+{
+	struct outq q;
+
+	if ((c->flags & (CONN_SENDING | CONN_CONNECTING)) || c->tx.total == 0)
+		return;
+	/* the queued output goes to the kernel, the empty queue it had comes back for more */
+	q = c->out;
+	c->out = c->tx;
+	c->tx = q;
+	c->flags |= CONN_SENDING;
+	ur_send(io, c);
+}
+
+
+static void ur_recycle(struct netio* io, int bid)
+{
+	struct io_uring_buf* buf = &io->br->bufs[io->br_tail & (RING_BUFS - 1)];
+
+	/* field by field: the ring tail shares the first entry */
+	buf->addr = (uint64_t)(uintptr_t)(io->bufs + (size_t)bid * RING_BUF_SIZE);
+	buf->len = RING_BUF_SIZE;
+	buf->bid = bid;
+	__atomic_store_n(&io->br->tail, ++io->br_tail, __ATOMIC_RELEASE);
+}
+
+
+static void ur_completion(struct netio* io, struct io_uring_cqe* cqe)
+{
+	struct conn* c = (struct conn*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+	int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+	int res = cqe->res;
+
+	switch (cqe->user_data & OP_MASK)
+	{
+	case OP_ACCEPT:
+		if (res >= 0)
+		{
+			int one = 1;
+
+			setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			io->syscalls++;
+			if (!(c = conn_new(io, res, 0)))
+				close(res);
+			else if (!(c->pub.user = io->h->on_accept(io, &c->pub)))
+			{
+				c->flags |= CONN_CLOSING;
+				conn_release(io, c);
+			}
+			else
+				ur_recv(io, c);
+		}
+		if (!more && io->lfd >= 0)
+			ur_accept(io);
+		break;
+	case OP_RECV:
+		if (!more)
+			c->refs--;
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+		{
+			int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+			if (res > 0)
+				deliver(io, c, io->bufs + (size_t)bid * RING_BUF_SIZE, res);
+			ur_recycle(io, bid);
+		}
+		if (c->flags & CONN_CLOSING)
+			conn_release(io, c);
+		else if (res == 0 || (res < 0 && res != -ENOBUFS))
+			netio_close(io, &c->pub);
+		else if (!more)
+			ur_recv(io, c);	/* ended, e.g. out of buffers for a moment */
+		break;
+	case OP_SEND:
+		c->refs--;
+		if (!(c->flags & CONN_CLOSING) && res <= 0)
+			netio_close(io, &c->pub);
+		if (c->flags & CONN_CLOSING)
+		{
+			conn_release(io, c);
+			break;
+		}
+		outq_consume(&c->out, res);
+		if (c->out.total > 0)
+			ur_send(io, c);
+		else
+		{
+			c->flags &= ~CONN_SENDING;
+			if (c->tx.total > 0)
+				mark_dirty(io, c);
+		}
+		break;
+	case OP_CONNECT:
+		c->refs--;
+		if (!(c->flags & CONN_CLOSING) && res < 0)
+			netio_close(io, &c->pub);
+		if (c->flags & CONN_CLOSING)
+		{
+			conn_release(io, c);
+			break;
+		}
+		c->flags &= ~CONN_CONNECTING;
+		ur_recv(io, c);
+		if (c->tx.total > 0)
+			mark_dirty(io, c);
+		if (io->h->on_connect && io->h->on_connect(&c->pub) < 0)
+			netio_close(io, &c->pub);
+		break;
+	case OP_WAKE:
+		if (io->wakefd >= 0)
+			ur_wake(io);
+		if (res > 0)
+			io->h->on_wake(io);
+		break;
+	default:
+		break;	/* OP_CANCEL */
+	}
+}
+
+
+static int ur_wait(struct netio* io, int timeout_ms)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	unsigned head = *io->cq_head;
+	int n = 0;
+
+	memset(&arg, 0, sizeof(arg));
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts = (timeout_ms < 0) ? 0 : (uint64_t)(uintptr_t)&ts;
+	/* submit everything queued and wait for completions in one call */
+	if (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE) || timeout_ms == 0)
+		ur_submit(io);
+	else
+	{
+		int rc = sys_enter(io, io->pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+		if (rc >= 0)
+			io->pending -= (rc < (int)io->pending) ? rc : io->pending;
+		else if (errno != ETIME && errno != EINTR && errno != EBUSY)
+			return -1;
+	}
+	for (;;)
+	{
+		unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+			break;
+		while (head != tail)
+		{
+			struct io_uring_cqe cqe = io->cqes[head & io->cq_mask];
+
+			__atomic_store_n(io->cq_head, ++head, __ATOMIC_RELEASE);
+			ur_completion(io, &cqe);
+			++n;
+		}
+	}
+	return n;
+}
+
+
+static void ur_unmap(struct netio* io)
+{
+	/* The ring is torn down in the background after close(), with the
+	 * sockets of whatever is still in flight: a listening socket would stay
+	 * bound for a while. Cancel everything here and now. */
+	if (io->ringfd >= 0 && io->sqes)
+	{
+		struct io_uring_sync_cancel_reg reg;
+
+		memset(&reg, 0, sizeof(reg));
+		reg.flags = IORING_ASYNC_CANCEL_ANY;
+		reg.timeout.tv_sec = reg.timeout.tv_nsec = -1;
+		sys_register(io->ringfd, IORING_REGISTER_SYNC_CANCEL, &reg, 1);
+	}
+	if (io->sqes)
+		munmap(io->sqes, io->sqes_len);
+	if (io->cq_ptr && io->cq_ptr != io->sq_ptr)
+		munmap(io->cq_ptr, io->cq_len);
+	if (io->sq_ptr)
+		munmap(io->sq_ptr, io->sq_len);
+	if (io->br)
+		munmap(io->br, io->br_len);
+	free(io->bufs);
+	if (io->ringfd >= 0)
+		close(io->ringfd);
+	io->sqes = NULL;
+	io->sq_ptr = io->cq_ptr = NULL;
+	io->br = NULL;
+	io->bufs = NULL;
+	io->ringfd = -1;
+}
+
+
+/**
+ * @return 0, or -1 if this kernel cannot do what the backend needs
+ */
+static int ur_init(struct netio* io)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned* array;
+	unsigned i;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+	p.cq_entries = RING_ENTRIES * 4;
+	if ((io->ringfd = sys_setup(RING_ENTRIES, &p)) < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+		goto fail;
+	io->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	io->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		io->sq_len = io->cq_len = (io->sq_len > io->cq_len) ? io->sq_len : io->cq_len;
+	io->sq_ptr = mmap(NULL, io->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd, IORING_OFF_SQ_RING);
+	if (io->sq_ptr == MAP_FAILED)
+	{
+		io->sq_ptr = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		io->cq_ptr = io->sq_ptr;
+	else if ((io->cq_ptr = mmap(NULL, io->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd,
+			IORING_OFF_CQ_RING)) == MAP_FAILED)
+	{
+		io->cq_ptr = NULL;
+		goto fail;
+	}
+	io->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((io->sqes = mmap(NULL, io->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringfd,
+			IORING_OFF_SQES)) == MAP_FAILED)
+	{
+		io->sqes = NULL;
+		goto fail;
+	}
+	io->sq_head = (unsigned*)((char*)io->sq_ptr + p.sq_off.head);
+	io->sq_tail = (unsigned*)((char*)io->sq_ptr + p.sq_off.tail);
+	io->sq_mask = *(unsigned*)((char*)io->sq_ptr + p.sq_off.ring_mask);
+	io->sq_entries = p.sq_entries;
+	array = (unsigned*)((char*)io->sq_ptr + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; ++i)
+		array[i] = i;
+	io->cq_head = (unsigned*)((char*)io->cq_ptr + p.cq_off.head);
+	io->cq_tail = (unsigned*)((char*)io->cq_ptr + p.cq_off.tail);
+	io->cq_mask = *(unsigned*)((char*)io->cq_ptr + p.cq_off.ring_mask);
+	io->cqes = (struct io_uring_cqe*)((char*)io->cq_ptr + p.cq_off.cqes);
+
+	/* receive buffers: the kernel picks one per completion of a multishot recv */
+	io->br_len = RING_BUFS * sizeof(struct io_uring_buf);
+	if ((io->br = mmap(NULL, io->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		io->br = NULL;
+		goto fail;
+	}
+	if (!(io->bufs = malloc((size_t)RING_BUFS * RING_BUF_SIZE)))
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)io->br;
+	reg.ring_entries = RING_BUFS;
+	reg.bgid = BUF_GROUP;
+	if (sys_register(io->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (i = 0; i < RING_BUFS; ++i)
+		ur_recycle(io, i);
+	return 0;
+fail:
+	ur_unmap(io);
+	return -1;
+}
+
+
+/******************************************************************************
+ * Common
+ ******************************************************************************/
+
+struct netio* netio_create(enum netio_backend backend, const struct netio_handler* handler, int max_tx)
+{
+	struct netio* io = calloc(1, sizeof(*io));
+
+	if (!io)
+		return NULL;
+	io->h = handler;
+	io->max_tx = max_tx;
+	io->lfd = io->epfd = io->ringfd = io->wakefd = -1;
+	if (handler->on_wake && (io->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
+		goto fail;
+	if (backend == NETIO_URING && ur_init(io) == 0)
+	{
+		io->backend = NETIO_URING;
+		if (io->wakefd >= 0)
+			ur_wake(io);
+		return io;
+	}
+	io->backend = NETIO_EPOLL;
+	if ((io->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || !(io->rxbuf = malloc(RECV_CHUNK)))
+		goto fail;
+	if (io->wakefd >= 0)
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &io->wakefd;
+		if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wakefd, &ev) < 0)
+			goto fail;
+	}
+	return io;
+fail:
+	netio_destroy(io);
+	return NULL;
+}
+
+
+void netio_destroy(struct netio* io)
+{
+	if (!io)
+		return;
+	while (io->all)
+	{
+		if (io->all->pub.fd >= 0)
+			close(io->all->pub.fd);
+		conn_free(io, io->all);
+	}
+	if (io->backend == NETIO_URING)
+		ur_unmap(io);
+	if (io->epfd >= 0)
+		close(io->epfd);
+	if (io->wakefd >= 0)
+		close(io->wakefd);
+	free(io->rxbuf);
+	free(io);
+}
+
+
+int netio_listen(struct netio* io, int lfd)
+{
+	io->lfd = lfd;
+	if (io->backend == NETIO_URING)
+	{
+		ur_accept(io);
+		return 0;
+	}
+	else
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		io->syscalls++;
+		return epoll_ctl(io->epfd, EPOLL_CTL_ADD, lfd, &ev);
+	}
+}
+
+
+struct netio_conn* netio_connect(struct netio* io, const struct sockaddr* addr, socklen_t addrlen, void* user)
+{
+	int type = SOCK_STREAM | SOCK_CLOEXEC | ((io->backend == NETIO_EPOLL) ? SOCK_NONBLOCK : 0);
+	int fd = socket(addr->sa_family, type, 0);
+	int one = 1;
+	struct conn* c;
+
+	io->syscalls += 2;
+	if (fd < 0)
+		return NULL;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (!(c = conn_new(io, fd, CONN_CONNECTING)))
+	{
+		close(fd);
+		return NULL;
+	}
+	c->pub.user = user;
+	if (io->backend == NETIO_URING)
+	{
+		struct io_uring_sqe* sqe = ur_sqe(io, c, OP_CONNECT);
+
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)addr;
+		sqe->off = addrlen;
+		c->refs++;
+		return &c->pub;
+	}
+	io->syscalls++;
+	if ((connect(fd, addr, addrlen) < 0 && errno != EINPROGRESS) || ep_ctl(io, EPOLL_CTL_ADD, c, EPOLLOUT) < 0)
+	{
+		c->flags |= CONN_CLOSING;
+		conn_release(io, c);
+		return NULL;
+	}
+	return &c->pub;
+}
+
+
+void netio_close(struct netio* io, struct netio_conn* pub)
+{
+	struct conn* c = (struct conn*)pub;
+
+	if (c->flags & CONN_CLOSING)
+		return;
+	c->flags |= CONN_CLOSING;
+	if (io->backend == NETIO_EPOLL)
+	{
+		io->syscalls++;
+		epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->pub.fd, NULL);
+	}
+	else if (c->refs > 0)
+	{
+		/* the completions of everything in flight on the socket release it */
+		struct io_uring_sqe* sqe = ur_sqe(io, NULL, OP_CANCEL);
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = c->pub.fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+	if (io->h->on_close)
+		io->h->on_close(&c->pub);
+	c->pub.user = NULL;
+	conn_release(io, c);
+}
+
+
+void netio_detach(struct netio* io, struct netio_conn* pub)
+{
+	struct conn* c = (struct conn*)pub;
+
+	if (c->flags & CONN_CLOSING)
+		return;
+	c->flags |= CONN_CLOSING | CONN_DETACH;
+	if (io->backend == NETIO_EPOLL)
+	{
+		io->syscalls++;
+		epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->pub.fd, NULL);
+	}
+	else if (c->refs > 0)
+	{
+		/* a recv completing before the cancel adds to rx */
+		struct io_uring_sqe* sqe = ur_sqe(io, NULL, OP_CANCEL);
+
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = c->pub.fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+	/* released from the flush list: called from on_data, the rest of the
+	 * input is only put in rx on return */
+	mark_dirty(io, c);
+}
+
+
+struct netio_conn* netio_adopt(struct netio* io, int fd, void* user, const unsigned char* data, int len)
+{
+	struct conn* c = conn_new(io, fd, 0);
+
+	if (!c)
+		return NULL;
+	c->pub.user = user;
+	if ((len > 0 && grow(&c->rx, &c->rxsize, len) < 0)
+			|| (io->backend == NETIO_EPOLL && ep_ctl(io, EPOLL_CTL_ADD, c, EPOLLIN) < 0))
+	{
+		conn_free(io, c);
+		return NULL;
+	}
+	if (io->backend == NETIO_URING)
+		ur_recv(io, c);
+	if (len > 0)
+	{
+		/* passed on by the next netio_run(), as if just received */
+		memcpy(c->rx, data, len);
+		c->rxlen = len;
+		c->flags |= CONN_FEED;
+		mark_dirty(io, c);
+	}
+	return &c->pub;
+}
+
+
+void netio_wake(struct netio* io)
+{
+	uint64_t one = 1;
+
+	if (write(io->wakefd, &one, sizeof(one)) < 0)
+		return;	/* the counter is full, a wake is pending anyway */
+}
+
+
+int netio_run(struct netio* io, int timeout_ms)
+{
+	int n;
+
+	while (io->dirty)
+	{
+		struct conn* c = io->dirty;
+
+		io->dirty = c->next_dirty;
+		c->flags &= ~CONN_DIRTY;
+		if ((c->flags & (CONN_FEED | CONN_CLOSING)) == CONN_FEED)
+		{
+			c->flags &= ~CONN_FEED;
+			if (c->rxlen > 0 && feed(io, c) < 0)
+				continue;
+			if (c->flags & CONN_DIRTY)
+				continue;	/* back on the list with output */
+		}
+		if (c->flags & CONN_CLOSING)
+			conn_release(io, c);
+		else if (io->backend == NETIO_URING)
+			ur_flush(io, c);
+		else if (!(c->flags & CONN_CONNECTING))
+			ep_flush(io, c);
+	}
+	n = (io->backend == NETIO_URING) ? ur_wait(io, timeout_ms) : ep_wait(io, timeout_ms);
+	while (io->dead)
+	{
+		struct conn* c = io->dead;
+
+		io->dead = c->next_dead;
+		conn_free(io, c);
+	}
+	return n;
+}
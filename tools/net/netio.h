@@ -0,0 +1,154 @@
+/*******************************************************************************
+ * Connection loop of the host tools, over epoll or io_uring.
+ *
+ * transport_iofunctions_t gives the device one send/recv pair for its single
+ * link. The host tools drive thousands of sockets from each thread, so here
+ * a backend is a table of the same kind of functions taking the connection,
+ * and one loop per thread calls back with whatever arrived:
+ *
+ *  - epoll: readiness, then recv() until EAGAIN and send() of the pending
+ *    output, EPOLLOUT only while the socket buffer is full.
+ *  - io_uring: one multishot accept, one multishot recv per connection
+ *    filling buffers from a ring registered with the kernel, and one send in
+ *    flight per connection. Everything queued while handling a batch of
+ *    completions goes to the kernel with the wait for the next batch, in a
+ *    single io_uring_enter().
+ *
+ * Output is appended to the connection and sent once the callbacks of the
+ * current batch have run, so the replies to many packets leave together.
+ * A packet for many connections can be built once in a netio_buf and queued
+ * on each of them by reference; the sends gather it with the rest.
+ * A connection closed by either side gets on_close once; its memory lives
+ * on until the kernel has let go of it.
+ *
+ * A loop belongs to one thread. Other threads can only netio_wake() it, and
+ * a connection moves to another loop by netio_detach() there and
+ * netio_adopt() here, with the input not yet consumed.
+ *******************************************************************************/
+
+#ifndef NETIO_H_
+#define NETIO_H_
+
+#include "transport.h"
+
+#include <sys/socket.h>
+
+enum netio_backend
+{
+	NETIO_EPOLL,
+	NETIO_URING
+};
+
+struct netio;
+
+struct netio_conn
+{
+	int fd;
+	void* user;	/* for the callbacks */
+};
+
+/** Output shared by connections, of any loop, freed with the last reference. */
+struct netio_buf
+{
+	int refs;
+	int len;
+	unsigned char data[];
+};
+
+struct netio_handler
+{
+	/** A connection was accepted. @return the user pointer, NULL to close it */
+	void* (*on_accept)(struct netio* io, struct netio_conn* c);
+	/** A netio_connect() completed. @return -1 to close it */
+	int (*on_connect)(struct netio_conn* c);
+	/** Data arrived, the unconsumed rest is passed again with the next data.
+	 * @return the bytes consumed, -1 to close the connection */
+	int (*on_data)(struct netio_conn* c, unsigned char* data, int len);
+	/** The connection is gone, c must not be used after this */
+	void (*on_close)(struct netio_conn* c);
+	/** A netio_detach() is done: the socket is the caller's, with the input
+	 * not consumed yet. c must not be used after this */
+	void (*on_detach)(struct netio_conn* c, int fd, unsigned char* rest, int len);
+	/** netio_wake() was called, from any thread */
+	void (*on_wake)(struct netio* io);
+};
+
+/**
+ * @param backend the backend wanted, epoll is used if io_uring is not available
+ * @param max_tx bytes of unsent output per connection beyond which
+ * netio_reserve() fails, 0 for no limit
+ * @return the loop, NULL on error
+ */
+struct netio* netio_create(enum netio_backend backend, const struct netio_handler* handler, int max_tx);
+void netio_destroy(struct netio* io);
+enum netio_backend netio_backend(const struct netio* io);
+const char* netio_backend_name(enum netio_backend backend);
+
+/** Accepts connections on a listening socket. @return 0 or -1 */
+int netio_listen(struct netio* io, int lfd);
+
+/**
+ * Starts a non-blocking connect, on_connect follows.
+ * @param addr read by the next netio_run()
+ * @return the connection, NULL on error
+ */
+struct netio_conn* netio_connect(struct netio* io, const struct sockaddr* addr, socklen_t addrlen, void* user);
+
+/** Closes a connection, calls on_close. */
+void netio_close(struct netio* io, struct netio_conn* c);
+
+/**
+ * Stops handling a connection without closing its socket, on_detach follows
+ * once nothing is in flight on it. Output not sent yet is dropped.
+ */
+void netio_detach(struct netio* io, struct netio_conn* c);
+
+/**
+ * Takes over a socket, e.g. from the on_detach of another loop.
+ * @param data input received already, passed to on_data by the next netio_run()
+ * @return the connection, NULL on error
+ */
+struct netio_conn* netio_adopt(struct netio* io, int fd, void* user, const unsigned char* data, int len);
+
+/** Has on_wake called by the loop soon, safe from any thread. */
+void netio_wake(struct netio* io);
+
+/**
+ * Room for len bytes of output, to be filled and netio_commit()ed.
+ * @return NULL when over the max_tx limit or out of memory
+ */
+unsigned char* netio_reserve(struct netio* io, struct netio_conn* c, int len);
+void netio_commit(struct netio_conn* c, int len);
+
+/** Queues output gathered from several buffers. @return 0 or -1 as netio_reserve() */
+int netio_sendv(struct netio* io, struct netio_conn* c, const transport_iovec_t* iov, int iovcnt);
+
+/** A buffer of len bytes to fill, with one reference for the caller. @return NULL if out of memory */
+struct netio_buf* netio_buf_new(int len);
+struct netio_buf* netio_buf_get(struct netio_buf* b);
+void netio_buf_put(struct netio_buf* b);
+
+#define NETIO_BUF_COPY_MAX 256	/* shared buffers up to this size are copied, cheaper than an iovec entry */
+
+/**
+ * Queues a shared buffer, which must not change any more. A connection takes
+ * a reference until it is sent, buffers up to NETIO_BUF_COPY_MAX are copied
+ * instead.
+ * @return 0 or -1 as netio_reserve()
+ */
+int netio_send_buf(struct netio* io, struct netio_conn* c, struct netio_buf* b);
+
+/** @return the bytes of output not yet sent */
+int netio_queued(const struct netio_conn* c);
+
+/**
+ * Sends the queued output, waits up to timeout_ms for the next events and
+ * runs their callbacks.
+ * @return the number of events, -1 on error
+ */
+int netio_run(struct netio* io, int timeout_ms);
+
+/** System calls made by the loop, to compare the backends. */
+unsigned long netio_syscalls(const struct netio* io);
+
+#endif /* NETIO_H_ */
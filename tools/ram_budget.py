@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""RAM budget report for the STATIC_MEMORY firmware build.
+
+Sums the .bss.ram_<subsystem> input sections (see Inc/mem_config.h) from the
+linker map file, adds the rest of .data/.bss and the heap and stack
+reserves, and fails when the total does not fit the F103RC's RAM.
+
+Standalone:  python3 tools/ram_budget.py firmware.map
+PlatformIO:  extra_scripts = post:tools/ram_budget.py
+"""
+import os
+import re
+import sys
+
+RAM_SIZE = 48 * 1024
+
+
+def read_reserves(header):
+    """Heap and stack reserves from Inc/mem_config.h, so there is one source."""
+    values = {}
+    with open(header) as f:
+        for line in f:
+            m = re.match(r"#define\s+(MEM_\w+_RESERVE)\s+(0x[0-9a-fA-F]+|\d+)", line)
+            if m:
+                values[m.group(1)] = int(m.group(2), 0)
+    return values
+
+
+def parse_map(path):
+    """Returns ({subsystem: bytes}, {output section: bytes})."""
+    subsystems = {}
+    outputs = {}
+    pending = None
+    with open(path) as f:
+        for line in f:
+            m = re.match(r"^(\.data|\.bss)\s+0x[0-9a-f]+\s+(0x[0-9a-f]+)", line)
+            if m:
+                outputs[m.group(1)] = int(m.group(2), 16)
+                continue
+            m = re.match(r"^ \.bss\.ram_(\w+)\s*(?:0x[0-9a-f]+\s+(0x[0-9a-f]+))?", line)
+            if m:
+                if m.group(2) is None:
+                    pending = m.group(1)  # name alone, address on the next line
+                    continue
+                subsystems[m.group(1)] = subsystems.get(m.group(1), 0) + int(m.group(2), 16)
+                continue
+            if pending:
+                m = re.match(r"^\s+0x[0-9a-f]+\s+(0x[0-9a-f]+)", line)
+                if m:
+                    subsystems[pending] = subsystems.get(pending, 0) + int(m.group(1), 16)
+                pending = None
+    return subsystems, outputs
+
+
+def report(map_path, header):
+    reserves = read_reserves(header)
+    subsystems, outputs = parse_map(map_path)
+    stack = reserves.get("MEM_STACK_RESERVE", 0)
+    heap = reserves.get("MEM_HEAP_RESERVE", 0)
+    static = outputs.get(".data", 0) + outputs.get(".bss", 0)
+    buffers = sum(subsystems.values())
+
+    print("RAM budget (%s)" % os.path.basename(map_path))
+    for name in sorted(subsystems):
+        print("  %-12s %6d" % (name, subsystems[name]))
+    print("  %-12s %6d" % ("other", static - buffers))
+    print("  %-12s %6d" % ("heap", heap))
+    print("  %-12s %6d" % ("stack", stack))
+    total = static + heap + stack
+    print("  %-12s %6d / %d (%d free)" % ("total", total, RAM_SIZE, RAM_SIZE - total))
+    return total <= RAM_SIZE
+
+
+def main(argv):
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    if len(argv) != 2:
+        print("usage: %s firmware.map" % argv[0])
+        return 2
+    return 0 if report(argv[1], os.path.join(root, "Inc", "mem_config.h")) else 1
+
+
+try:
+    Import("env")  # noqa: F821 - provided by PlatformIO (SCons)
+except NameError:
+    if __name__ == "__main__":
+        sys.exit(main(sys.argv))
+else:
+    _map = os.path.join(env.subst("$BUILD_DIR"), "firmware.map")  # noqa: F821
+    env.Append(LINKFLAGS=["-Wl,-Map," + _map])  # noqa: F821
+
+    def _check(source, target, env):
+        if not report(_map, os.path.join(env.subst("$PROJECT_DIR"), "Inc", "mem_config.h")):
+            sys.stderr.write("RAM budget exceeded: heap/stack would collide\n")
+            env.Exit(1)
+
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", _check)  # noqa: F821
@@ -0,0 +1,328 @@
+/*******************************************************************************
+ * A scripted ESP8266 with an MQTT broker behind it, see esp_model.h.
+ *******************************************************************************/
+
+#include "esp_model.h"
+#include "MQTTPacket.h"
+#include "mem_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTE_US 87	/* 10 bits at 115200 baud */
+#define CHUNK_MAX 256	/* the DMA buffer */
+#define QUEUE_MAX 512
+#define PENDING_MAX 4096
+
+struct chunk
+{
+	uint64_t due;
+	int len;
+	int commands;	/* command packets whose frame ends in the chunk */
+	unsigned char data[CHUNK_MAX];
+};
+
+static struct
+{
+	struct chunk queue[QUEUE_MAX];
+	int head, count;
+	uint64_t tail;	/* the line is busy until then */
+	uint64_t rng;
+
+	char line[128];	/* command being received */
+	int linelen;
+	int data_left;	/* of an AT+CIPSEND */
+	int data_len;
+	unsigned char pending[PENDING_MAX];	/* data for the broker */
+	int pendinglen;
+
+	int tcp;	/* connected */
+	int subscribed;
+	uint64_t next_command;
+	int burst;	/* commands at a time */
+	unsigned commands;	/* out of the module */
+} m;
+
+
+static unsigned rnd(unsigned n)
+{
+	m.rng ^= m.rng << 13;
+	m.rng ^= m.rng >> 7;
+	m.rng ^= m.rng << 17;
+	return (unsigned)(m.rng % n);
+}
+
+
+/**
+ * Queues output of the module from a time on, cut where the line goes idle.
+ * @return the last chunk of it, NULL if the queue is full
+ */
+static struct chunk* emit(uint64_t at, const void* bytes, int len)
+{
+	const unsigned char* p = bytes;
+	uint64_t t = (at > m.tail) ? at : m.tail;
+	struct chunk* c = NULL;
+
+	while (len > 0 && m.count < QUEUE_MAX)
+	{
+		int n = (rnd(4) == 0) ? 1 + rnd(8) : 1 + rnd(120);
+
+		c = &m.queue[(m.head + m.count++) % QUEUE_MAX];
+		if (n > len)
+			n = len;
+		memcpy(c->data, p, n);
+		c->len = n;
+		c->commands = 0;
+		t += (uint64_t)n * BYTE_US + BYTE_US;	/* idle detected one character later */
+		c->due = t;
+		t += (rnd(10) < 7) ? 200 + rnd(1800) : 5000 + rnd(35000);
+		p += n;
+		len -= n;
+	}
+	m.tail = t;
+	return c;
+}
+
+
+static void emit_str(uint64_t at, const char* s)
+{
+	emit(at, s, strlen(s));
+}
+
+
+/* an +IPD frame of the connection */
+static struct chunk* emit_frame(uint64_t at, const unsigned char* packet, int len)
+{
+	unsigned char frame[32 + CHUNK_MAX];
+	int n = sprintf((char*)frame, "\r\n+IPD,%d:", len);
+
+	memcpy(frame + n, packet, len);
+	return emit(at, frame, n + len);
+}
+
+
+static void emit_boot(uint64_t at)
+{
+	unsigned char noise[24];
+	int i;
+
+	for (i = 0; i < (int)sizeof(noise); ++i)
+		noise[i] = 0x80 | rnd(128);	/* the boot log at 74880 baud */
+	emit(at, noise, sizeof(noise));
+	emit_str(at, "\r\nready\r\n");
+}
+
+
+/**
+ * The broker side of complete packets in pending.
+ */
+static void broker(uint64_t now)
+{
+	int used = 0;
+
+	while (m.pendinglen - used >= 2)
+	{
+		unsigned char* p = m.pending + used, reply[8 + 16];
+		int remaining = 0, multiplier = 1, i = 1, len, n = 0;
+
+		do
+			remaining += (p[i] & 127) * multiplier, multiplier *= 128;
+		while ((p[i++] & 128) && i < 5 && i < m.pendinglen - used);
+		len = i + remaining;
+		if (len > m.pendinglen - used)
+			break;
+		switch (p[0] >> 4)
+		{
+		case CONNECT:
+			reply[n++] = CONNACK << 4, reply[n++] = 2, reply[n++] = 0, reply[n++] = 0;
+			break;
+		case SUBSCRIBE:
+		{
+			int at = i + 2, topics = 0;
+
+			while (at + 2 < len && topics < 16)
+			{
+				at += 2 + (p[at] << 8 | p[at + 1]) + 1;
+				topics++;
+			}
+			reply[n++] = SUBACK << 4, reply[n++] = 2 + topics, reply[n++] = p[i], reply[n++] = p[i + 1];
+			while (topics--)
+				reply[n++] = 0;
+			m.subscribed = 1;
+			m.next_command = now + 2000000;
+			break;
+		}
+		case PUBLISH:
+			if (((p[0] >> 1) & 3) == 1)
+			{
+				int at = i + 2 + (p[i] << 8 | p[i + 1]);
+
+				reply[n++] = PUBACK << 4, reply[n++] = 2, reply[n++] = p[at], reply[n++] = p[at + 1];
+			}
+			break;
+		case PINGREQ:
+			reply[n++] = PINGRESP << 4, reply[n++] = 0;
+			break;
+		}
+		if (n)
+			emit_frame(now + 20000 + rnd(60000), reply, n);
+		used += len;
+	}
+	memmove(m.pending, m.pending + used, m.pendinglen - used);
+	m.pendinglen -= used;
+}
+
+
+static void command(uint64_t now, const char* cmd)
+{
+	char echo[160];
+
+	snprintf(echo, sizeof(echo), "%s\r\r\n", cmd);
+	emit_str(now + 300, echo);
+	if (strcmp(cmd, "AT+RESTORE") == 0)
+	{
+		emit_str(now, "\r\nOK\r\n");
+		m.tcp = m.subscribed = 0;
+		emit_boot(m.tail + 300000);
+	}
+	else if (strncmp(cmd, "AT+CWMODE=", 10) == 0 || strncmp(cmd, "AT+CIPSSLSIZE=", 14) == 0)
+		emit_str(now, "\r\nOK\r\n");
+	else if (strncmp(cmd, "AT+CWJAP=", 9) == 0)
+	{
+		emit_str(now + 1200000, "WIFI CONNECTED\r\n");
+		emit_str(m.tail + 800000, "WIFI GOT IP\r\n\r\nOK\r\n");
+	}
+	else if (strcmp(cmd, "AT+CIPSTATUS") == 0)
+		emit_str(now + 2000, m.tcp ? "STATUS:3\r\n+CIPSTATUS:0,\"TCP\"\r\n\r\nOK\r\n" : "STATUS:2\r\n\r\nOK\r\n");
+	else if (strncmp(cmd, "AT+CIPSTART=", 12) == 0)
+	{
+		emit_str(now + 100000 + rnd(100000), "CONNECT\r\n\r\nOK\r\n");
+		m.tcp = 1;
+	}
+	else if (strncmp(cmd, "AT+CIPSEND=", 11) == 0 && m.tcp)
+	{
+		m.data_left = m.data_len = atoi(cmd + 11);
+		emit_str(now, "\r\nOK\r\n> ");
+	}
+	else if (strcmp(cmd, "AT+CIPCLOSE") == 0)
+	{
+		emit_str(now, "CLOSED\r\n\r\nOK\r\n");
+		m.tcp = m.subscribed = 0;
+	}
+	else
+		emit_str(now, "\r\nERROR\r\n");
+}
+
+
+void esp_model_init(unsigned seed, int burst)
+{
+	memset(&m, 0, sizeof(m));
+	m.rng = 88172645463325252ull ^ seed;
+	m.burst = (burst > 0) ? burst : 0;
+	emit_boot(200000);
+}
+
+
+void esp_model_send(uint64_t now, const unsigned char* data, int len)
+{
+	int i;
+
+	for (i = 0; i < len; ++i)
+	{
+		if (m.data_left > 0)
+		{
+			if (m.pendinglen < PENDING_MAX)
+				m.pending[m.pendinglen++] = data[i];
+			if (--m.data_left == 0)
+			{
+				char recv[40];
+
+				sprintf(recv, "\r\nRecv %d bytes\r\n\r\nSEND OK\r\n", m.data_len);
+				emit_str(now + 5000 + rnd(20000), recv);
+				broker(now);
+			}
+		}
+		else if (data[i] == '\n')
+		{
+			if (m.linelen > 0 && m.line[m.linelen - 1] == '\r')
+				m.linelen--;
+			m.line[m.linelen] = '\0';
+			if (m.linelen > 0)
+				command(now, m.line);
+			m.linelen = 0;
+		}
+		else if (m.linelen < (int)sizeof(m.line) - 1)
+			m.line[m.linelen++] = data[i];
+	}
+}
+
+
+/* command packets in one frame, due at the next command time */
+static void flush_commands(const unsigned char* packets, int len, int count)
+{
+	struct chunk* c = emit_frame(m.next_command, packets, len);
+
+	if (c)
+		c->commands += count;
+}
+
+
+uint64_t esp_model_due(uint64_t now)
+{
+	uint64_t due;
+
+	/* commands from the controller, not into a send in progress; a burst
+	 * comes in as few frames as the network buffer of the firmware allows */
+	while (m.burst && m.subscribed && m.data_left == 0 && m.next_command <= now)
+	{
+		static const char* topics[] = { "mode", "leds" };
+		unsigned char packets[MEM_NET_RX_SIZE];
+		int len = 0, count = 0, i;
+
+		for (i = 0; i < m.burst; ++i)
+		{
+			char payload[2] = { '0' + rnd(3), 0 };
+			MQTTString topic = MQTTString_initializer;
+			unsigned char packet[32];
+			int n;
+
+			topic.cstring = (char*)topics[rnd(2)];
+			if (topic.cstring[0] == 'l')
+				payload[0] = '0' + rnd(2);
+			n = MQTTSerialize_publish(packet, sizeof(packet), 0, 0, 0, 0, topic, (unsigned char*)payload, 1);
+			if (len + n > (int)sizeof(packets))
+				flush_commands(packets, len, count), len = count = 0;
+			memcpy(packets + len, packet, n);
+			len += n, count++;
+		}
+		flush_commands(packets, len, count);
+		m.next_command += 2000000 + rnd(3000000);
+	}
+	due = (m.burst && m.subscribed && m.data_left == 0) ? m.next_command : UINT64_MAX;
+	if (m.count > 0 && m.queue[m.head].due < due)
+		due = m.queue[m.head].due;
+	return due;
+}
+
+
+int esp_model_take(uint64_t now, unsigned char* buf, int size)
+{
+	struct chunk* c = &m.queue[m.head];
+	int len;
+
+	if (m.count == 0 || c->due > now)
+		return 0;
+	len = (c->len < size) ? c->len : size;
+	memcpy(buf, c->data, len);
+	m.commands += c->commands;
+	m.head = (m.head + 1) % QUEUE_MAX;
+	m.count--;
+	return len;
+}
+
+
+unsigned esp_model_commands(void)
+{
+	return m.commands;
+}
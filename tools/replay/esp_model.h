@@ -0,0 +1,42 @@
+/*******************************************************************************
+ * A scripted ESP8266 in AT command mode with an MQTT broker behind it, for
+ * replay to run the firmware without a capture and write one.
+ *
+ * Commands get the answers of the AT firmware, echo included, AT+CIPSEND
+ * the prompt, then SEND OK once the announced bytes are in. The data is
+ * taken as MQTT packets: CONNECT, SUBSCRIBE, QoS 1 PUBLISH and PINGREQ are
+ * answered in +IPD frames, and commands on "mode" and "leds" come in every
+ * few seconds, in bursts of a given size, if any. The output goes out in chunks of random size and spacing,
+ * as the idle-line interrupt cuts it, often splitting lines and frames.
+ *******************************************************************************/
+
+#ifndef ESP_MODEL_H_
+#define ESP_MODEL_H_
+
+#include <stdint.h>
+
+/** burst: commands sent at a time, 0 for none */
+void esp_model_init(unsigned seed, int burst);
+
+/** Bytes the firmware sends to the module at time now (us). */
+void esp_model_send(uint64_t now, const unsigned char* data, int len);
+
+/**
+ * @return the time of the next chunk out of the module, UINT64_MAX if
+ * nothing is coming without another send
+ */
+uint64_t esp_model_due(uint64_t now);
+
+/**
+ * Takes the next chunk, due by now.
+ * @return its length, 0 if there is none
+ */
+int esp_model_take(uint64_t now, unsigned char* buf, int size);
+
+/**
+ * @return the command packets the module has sent so far, counted when the
+ * last chunk of their frame is taken
+ */
+unsigned esp_model_commands(void);
+
+#endif /* ESP_MODEL_H_ */
@@ -0,0 +1,135 @@
+/*******************************************************************************
+ * Host stand-in for the STM32F1 HAL, just what the firmware sources built
+ * into the replay harness use. The functions are implemented by
+ * replay/replay.c on a virtual clock.
+ *******************************************************************************/
+
+#ifndef STM32F1XX_HAL_H_
+#define STM32F1XX_HAL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum
+{
+	HAL_OK = 0,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+#define RESET GPIO_PIN_RESET
+#define SET GPIO_PIN_SET
+
+typedef struct
+{
+	uint32_t ODR;	/* output pins as last written */
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef replay_gpioa, replay_gpiod;
+#define GPIOA (&replay_gpioa)
+#define GPIOD (&replay_gpiod)
+#define GPIO_PIN_2 ((uint16_t)0x0004)
+#define GPIO_PIN_8 ((uint16_t)0x0100)
+
+typedef enum
+{
+	HAL_UART_STATE_RESET = 0x00,
+	HAL_UART_STATE_READY = 0x20,
+	HAL_UART_STATE_BUSY_TX = 0x21
+} HAL_UART_StateTypeDef;
+
+typedef struct
+{
+	int id;
+} USART_TypeDef, TIM_TypeDef;
+
+extern USART_TypeDef replay_usart1, replay_usart2;
+extern TIM_TypeDef replay_tim2;
+#define USART1 (&replay_usart1)
+#define USART2 (&replay_usart2)
+#define TIM2 (&replay_tim2)
+
+typedef struct
+{
+	USART_TypeDef* Instance;
+	volatile HAL_UART_StateTypeDef gState;
+} UART_HandleTypeDef;
+
+typedef struct
+{
+	TIM_TypeDef* Instance;
+} TIM_HandleTypeDef;
+
+typedef struct
+{
+	int unused;
+} I2C_HandleTypeDef, DMA_HandleTypeDef;
+
+#define UART_IT_IDLE 0x10
+#define __HAL_UART_ENABLE_IT(handle, it) ((void)(handle), (void)(it))
+
+/* SystemClock_Config() */
+typedef struct
+{
+	uint32_t PLLState, PLLSource, PLLMUL;
+} RCC_PLLInitTypeDef;
+
+typedef struct
+{
+	uint32_t OscillatorType, HSEState, HSEPredivValue, HSIState;
+	RCC_PLLInitTypeDef PLL;
+} RCC_OscInitTypeDef;
+
+typedef struct
+{
+	uint32_t ClockType, SYSCLKSource, AHBCLKDivider, APB1CLKDivider, APB2CLKDivider;
+} RCC_ClkInitTypeDef;
+
+#define RCC_OSCILLATORTYPE_HSE 0x1
+#define RCC_HSE_ON 0x1
+#define RCC_HSE_PREDIV_DIV1 0x0
+#define RCC_HSI_ON 0x1
+#define RCC_PLL_ON 0x2
+#define RCC_PLLSOURCE_HSE 0x1
+#define RCC_PLL_MUL9 0x7
+#define RCC_CLOCKTYPE_SYSCLK 0x1
+#define RCC_CLOCKTYPE_HCLK 0x2
+#define RCC_CLOCKTYPE_PCLK1 0x4
+#define RCC_CLOCKTYPE_PCLK2 0x8
+#define RCC_SYSCLKSOURCE_PLLCLK 0x2
+#define RCC_SYSCLK_DIV1 0x0
+#define RCC_HCLK_DIV1 0x0
+#define RCC_HCLK_DIV2 0x4
+#define FLASH_LATENCY_2 0x2
+
+HAL_StatusTypeDef HAL_Init(void);
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef* init);
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef* init, uint32_t latency);
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t delay);
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state);
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin);
+void HAL_GPIO_TogglePin(GPIO_TypeDef* port, uint16_t pin);
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size);
+
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef* hi2c, uint16_t address, uint8_t* data, uint16_t size,
+		uint32_t timeout);
+HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef* hi2c, uint16_t address, uint8_t* data, uint16_t size,
+		uint32_t timeout);
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef* htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef* htim);
+
+#endif /* STM32F1XX_HAL_H_ */
@@ -0,0 +1,1021 @@
+/*******************************************************************************
+ * Replay of a USART2 capture (see Inc/uart_capture.h) into the firmware.
+ *
+ * Src/main.c, the ESP8266 driver, the network wrapper and the MQTTPacket
+ * client run unchanged on the host over the stand-in HAL of replay/hal: the
+ * firmware main() initializes as on the board and enters MqttHandlerTask().
+ * The received chunks of the capture are put in rxBuffer/rx_len and handed
+ * to HAL_UART_IdleCpltCallback(), as the idle-line interrupt does, TIM2
+ * fires every 500 ms and what the firmware sends to USART2 is compared with
+ * what it sent when the capture was taken.
+ *
+ * A received chunk is due when the firmware has sent what was sent before
+ * it in the capture, as long after that as it came in the capture: the
+ * module answers commands, so the replay keeps the timing of the answers
+ * even if the firmware is faster or slower than on the board.
+ *
+ * Time is virtual by default: every HAL_GetTick() moves it by the poll
+ * interval and HAL_Delay() jumps to the next event, so a replay gives the
+ * same result on every run and machine, as fast as the host goes. With a
+ * speed, HAL_GetTick() follows the wall clock at that multiple of real time
+ * instead (1 is the original pace). The host scheduler then shifts the
+ * firmware timers against the answers, and sends TIM2 decides, such as the
+ * metrics publish every minute, can come in another order than captured.
+ *
+ * Sends are compared by what they mean to the module: AT commands in full
+ * (AT+CIPSEND only up to the length), the first segment of the data that
+ * follows by MQTT packet type and, for PUBLISH, flags and topic, the rest of
+ * the data not at all, as sensor values and metrics differ from the board.
+ * A send that does not match, or a stall when the firmware stops sending
+ * while the capture still has answers for it, is a divergence.
+ *
+ * Reported: the time spent in the receive path (ESP82_Receive and
+ * MQTTPacket_readnb), wrapped at link time, and in the AT command path,
+ * without the time of the simulated interrupts, plus the final firmware
+ * state. Exits 1 on divergence.
+ *
+ * With -m the firmware talks to the module of esp_model.c for that many
+ * seconds instead, and -o writes the session as a capture: a trace to
+ * replay without a board, which replays without divergence. The commands
+ * the model sends on "leds" and "mode", -c at a time, are timed from the
+ * end of their +IPD frame to the call of their topic handler, which sets
+ * the LED: the command latency, reported in percentiles of virtual time.
+ *
+ * The BH1750 measures, when told to, the lux given with -l, or with -l
+ * from,to one going from the first to the second over the replay (or over
+ * the seconds given third), geometrically as daylight does at dusk when
+ * both are above 0, and reads as the previous measurement until it is done.
+ * To replay a capture taken with a lux ramp, give the same ramp and length. Reported as well: the sensor reads and the
+ * bus time they took, the PUBLISH sends by topic and, when the lux crosses
+ * the auto mode threshold, how long the LED took to follow.
+ *
+ * usage: replay [-x speed] [-q poll_us] [-l lux[,to[,seconds]]] [-o capture] [-v] capture
+ *        replay -m seconds [-s seed] [-c burst] [-q poll_us] [-l lux[,to[,seconds]]] [-o capture] [-v]
+ *******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include "main.h"
+#include "usart.h"
+#include "MQTTPacket.h"
+#include "ESP8266Client.h"
+#include "fifo.h"
+#include "metrics.h"
+#include "uart_capture.h"
+#include "adaptive.h"
+#include "esp_model.h"
+#include "../bench/bench.h"
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TIM2_PERIOD_US 500000	/* 72 MHz / 7200 / 5000 */
+#define END_GRACE_US 100000	/* after the last record, for the firmware to act on it */
+#define STALL_US 60000000	/* without progress while the capture has more; above every AT timeout */
+#define SHOW_MAX 5	/* divergences shown in full */
+#define BH1750_LUX_SCALE 1.2
+#define BH1750_L_MODE_US 24000	/* one time L-resolution measurement, at most */
+#define I2C_CLOCK_HZ 100000	/* hi2c2.Init.ClockSpeed */
+#define PUB_TOPICS 3
+
+struct record
+{
+	uint8_t type;
+	uint16_t len;
+	uint64_t time;	/* us, unwrapped */
+	const unsigned char* data;
+	int sent;	/* RX: TX records before it */
+	int kind;	/* TX: see tx_kind() */
+};
+
+enum
+{
+	TX_COMMAND,
+	TX_DATA,	/* first segment after AT+CIPSEND */
+	TX_MORE	/* later segments */
+};
+
+struct timing
+{
+	const char* name;
+	unsigned long calls;
+	uint64_t ns;
+};
+
+static struct
+{
+	struct record* rx;
+	int nrx;
+	struct record* tx;
+	int ntx;
+	unsigned long rxbytes, lost;
+	unsigned char* file;
+} cap;
+
+static struct
+{
+	uint64_t vt;	/* virtual time, us */
+	double speed;	/* 0: virtual clock */
+	uint64_t start_ns;
+	unsigned poll_us;
+	double lux, lux_to;	/* -l: from, to */
+	uint64_t span;	/* of the lux ramp */
+	int verbose;
+	FILE* out;
+	uint64_t model_end;	/* with the module model: when to stop, else 0 */
+
+	int next_rx;
+	int sent;	/* USART2 sends of the firmware */
+	uint64_t* sent_at;	/* time of each send, the first ntx */
+	int kind;	/* of the last send */
+	uint64_t last_progress, end;
+	int tim2_started;
+	uint64_t next_tim2;
+	int in_poll;
+
+	unsigned long divergences, differing;
+	int stalled;
+	uint64_t harness_ns;	/* spent in the simulated interrupts and the checks */
+	jmp_buf done;
+
+	/* command latency, with the module model */
+	uint64_t* cmd_sent;	/* time each command frame was complete */
+	unsigned ncmd, cmd_size;
+	uint64_t* cmd_latency;	/* us, of the commands handled */
+	unsigned handled;
+
+	/* the BH1750: the last measurement, and the one in progress */
+	double bh_lux, bh_next;
+	uint64_t bh_done;	/* when it is in, 0 for none in progress */
+
+	/* sensor, publish and LED accounting */
+	unsigned long i2c_reads, i2c_transfers, i2c_bits;
+	unsigned long published[PUB_TOPICS + 1];	/* by topic, then the others */
+	int dark;	/* lux below the threshold at the last read */
+	uint64_t crossed;	/* when it went across, 0 when the LED follows */
+	unsigned long led_switches, crossings;
+	uint64_t lag_total, lag_max;
+} rp;
+
+static const char* pub_topics[PUB_TOPICS] = { "ledmode", "light", "ledh" };
+
+static struct timing t_receive = { "ESP82_Receive" };
+static struct timing t_readnb = { "MQTTPacket_readnb (with receive)" };
+static struct timing t_command = { "AT command path" };
+
+/* the firmware */
+extern uint8_t rxBuffer[RX_BUFFER_SIZE];
+extern int recv_end_flag, rx_len;
+extern struct fifo rxFifo;
+extern int ledMode, ledSwitch, ledStatus, lightSensorValue, MQTT_connected;
+extern UART_HandleTypeDef huart1, huart2;
+int firmware_main(void);
+
+GPIO_TypeDef replay_gpioa, replay_gpiod;
+USART_TypeDef replay_usart1 = { 1 }, replay_usart2 = { 2 };
+TIM_TypeDef replay_tim2 = { 2 };
+UART_HandleTypeDef huart1 = { USART1, HAL_UART_STATE_READY };
+UART_HandleTypeDef huart2 = { USART2, HAL_UART_STATE_READY };
+TIM_HandleTypeDef htim2 = { TIM2 };
+I2C_HandleTypeDef hi2c2;
+
+
+static unsigned get16(const unsigned char* p)
+{
+	return p[0] | p[1] << 8;
+}
+
+
+static uint32_t get32(const unsigned char* p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+/**
+ * What a send is, after a send of the given kind.
+ */
+static int tx_kind(const unsigned char* data, int len, int after)
+{
+	if (len >= 2 && memcmp(data, "AT", 2) == 0)
+		return TX_COMMAND;
+	return (after == TX_COMMAND) ? TX_DATA : TX_MORE;
+}
+
+
+/**
+ * Reads a capture from its first header to its end, or to the next header,
+ * where the device restarted.
+ * @return 0, or -1 if there is no capture in the file
+ */
+static int load(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	const unsigned char* p, *end;
+	uint64_t base = 0;
+	uint32_t last = 0;
+	long size;
+	int kind = TX_COMMAND;
+
+	if (!f)
+		return -1;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	cap.file = malloc(size ? size : 1);
+	if (fread(cap.file, 1, size, f) != (size_t)size)
+		size = 0;
+	fclose(f);
+	p = memmem(cap.file, size, UART_CAPTURE_MAGIC, UART_CAPTURE_MAGIC_SIZE);
+	if (!p)
+		return -1;
+	end = cap.file + size;
+	cap.rx = calloc(size / UART_CAPTURE_HEADER + 1, sizeof(*cap.rx));
+	cap.tx = calloc(size / UART_CAPTURE_HEADER + 1, sizeof(*cap.tx));
+	for (p += UART_CAPTURE_MAGIC_SIZE; end - p >= UART_CAPTURE_HEADER; p += UART_CAPTURE_HEADER + get16(p + 5))
+	{
+		struct record r;
+		uint32_t t = get32(p + 1);
+
+		if (end - p >= UART_CAPTURE_MAGIC_SIZE && memcmp(p, UART_CAPTURE_MAGIC, UART_CAPTURE_MAGIC_SIZE) == 0)
+		{
+			fprintf(stderr, "capture: device restarted, the rest is not replayed\n");
+			break;
+		}
+		if (t < last)
+			base += 1ull << 32;	/* 71 minutes */
+		last = t;
+		r.type = p[0];
+		r.time = base + t;
+		r.len = get16(p + 5);
+		r.data = p + UART_CAPTURE_HEADER;
+		r.sent = cap.ntx;
+		r.kind = 0;
+		if (end - r.data < r.len)
+		{
+			fprintf(stderr, "capture: truncated record at offset %ld\n", (long)(p - cap.file));
+			break;
+		}
+		if (r.type == UART_CAPTURE_RX)
+		{
+			if (r.len > RX_BUFFER_SIZE)
+				r.len = RX_BUFFER_SIZE;	/* no more fits the DMA buffer */
+			cap.rx[cap.nrx++] = r;
+			cap.rxbytes += r.len;
+		}
+		else if (r.type == UART_CAPTURE_TX)
+		{
+			r.kind = kind = tx_kind(r.data, r.len, kind);
+			cap.tx[cap.ntx++] = r;
+		}
+		else if (r.type == UART_CAPTURE_LOST && r.len >= 2)
+			cap.lost += get16(r.data);
+		else
+		{
+			fprintf(stderr, "capture: unknown record type 0x%02x at offset %ld\n", r.type, (long)(p - cap.file));
+			break;
+		}
+	}
+	rp.sent_at = calloc(cap.ntx + 1, sizeof(*rp.sent_at));
+	return 0;
+}
+
+
+static void write_record(uint8_t type, const unsigned char* data, int len)
+{
+	unsigned char h[UART_CAPTURE_HEADER];
+	uint32_t t = (uint32_t)rp.vt;
+
+	if (!rp.out)
+		return;
+	h[0] = type;
+	h[1] = t;
+	h[2] = t >> 8;
+	h[3] = t >> 16;
+	h[4] = t >> 24;
+	h[5] = len;
+	h[6] = len >> 8;
+	fwrite(h, 1, sizeof(h), rp.out);
+	fwrite(data, 1, len, rp.out);
+}
+
+
+static void show(const char* what, const unsigned char* data, int len)
+{
+	int i;
+
+	printf("%s \"", what);
+	for (i = 0; i < len && i < 60; ++i)
+	{
+		if (data[i] >= 0x20 && data[i] < 0x7f && data[i] != '"' && data[i] != '\\')
+			putchar(data[i]);
+		else if (data[i] == '\r')
+			printf("\\r");
+		else if (data[i] == '\n')
+			printf("\\n");
+		else
+			printf("\\x%02x", data[i]);
+	}
+	printf("%s\"", (len > 60) ? "..." : "");
+}
+
+
+/**
+ * The bytes of a send that have to match: the topic of a PUBLISH, after the
+ * fixed header, or the whole packet.
+ */
+static int publish_topic(const unsigned char* data, int len, const unsigned char** topic)
+{
+	int i = 1, tl;
+
+	if (len < 2 || (data[0] >> 4) != PUBLISH)
+		return -1;
+	while (i < len && i < 5 && (data[i] & 0x80))
+		++i;
+	if (++i + 2 > len)
+		return -1;
+	tl = data[i] << 8 | data[i + 1];
+	if (i + 2 + tl > len)
+		return -1;
+	*topic = data + i + 2;
+	return tl;
+}
+
+
+static int matches(const struct record* expect, int kind, const unsigned char* data, int len)
+{
+	const unsigned char* t1, *t2;
+	int l1, l2;
+
+	if (kind != expect->kind)
+		return 0;
+	if (kind == TX_MORE)
+		return 1;
+	if (kind == TX_COMMAND)
+	{
+		if (expect->len >= 11 && memcmp(expect->data, "AT+CIPSEND=", 11) == 0)
+			return len >= 11 && memcmp(data, "AT+CIPSEND=", 11) == 0;
+		return len == expect->len && memcmp(data, expect->data, len) == 0;
+	}
+	if ((l1 = publish_topic(expect->data, expect->len, &t1)) < 0)
+		return len == expect->len && memcmp(data, expect->data, len) == 0;
+	l2 = publish_topic(data, len, &t2);
+	return data[0] == expect->data[0] && l1 == l2 && memcmp(t1, t2, l1) == 0;
+}
+
+
+static void diverged(const char* why)
+{
+	if (++rp.divergences <= SHOW_MAX)
+		printf("divergence at %.6f s: %s\n", rp.vt / 1e6, why);
+}
+
+
+static void count_publish(const unsigned char* data, int len)
+{
+	const unsigned char* topic;
+	int tl = publish_topic(data, len, &topic), i;
+
+	if (tl < 0)
+		return;
+	for (i = 0; i < PUB_TOPICS; ++i)
+		if (tl == (int)strlen(pub_topics[i]) && memcmp(topic, pub_topics[i], tl) == 0)
+			break;
+	rp.published[i]++;
+}
+
+
+/**
+ * A send of the firmware to the module.
+ */
+static void on_send(const unsigned char* data, int len)
+{
+	int kind = tx_kind(data, len, rp.kind);
+
+	if (rp.verbose)
+	{
+		printf("%12.6f tx %4d ", rp.vt / 1e6, len);
+		show("", data, len);
+		putchar('\n');
+	}
+	write_record(UART_CAPTURE_TX, data, len);
+	if (kind == TX_DATA)
+		count_publish(data, len);
+	if (rp.model_end)
+		esp_model_send(rp.vt, data, len);
+	else if (rp.sent < cap.ntx)
+	{
+		const struct record* expect = &cap.tx[rp.sent];
+
+		rp.sent_at[rp.sent] = rp.vt;
+		if (!matches(expect, kind, data, len))
+		{
+			diverged("the firmware sent something else");
+			if (rp.divergences <= SHOW_MAX)
+			{
+				show("  expected", expect->data, expect->len);
+				show("\n  sent    ", data, len);
+				putchar('\n');
+			}
+		}
+		else if (len != expect->len || memcmp(data, expect->data, len) != 0)
+			rp.differing++;
+	}
+	rp.sent++;
+	rp.kind = kind;
+	rp.last_progress = rp.vt;
+}
+
+
+/**
+ * When the next received chunk is due, UINT64_MAX while the firmware has not
+ * sent what comes before it.
+ */
+static uint64_t rx_due(void)
+{
+	const struct record* r;
+	int k;
+
+	if (rp.model_end)
+		return esp_model_due(rp.vt);
+	if (rp.next_rx == cap.nrx)
+		return UINT64_MAX;
+	r = &cap.rx[rp.next_rx];
+	if (rp.sent < (k = r->sent))
+		return UINT64_MAX;
+	if (k == 0)
+		return r->time;
+	return rp.sent_at[k - 1] + (r->time - cap.tx[k - 1].time);
+}
+
+
+static void deliver(const unsigned char* data, int len)
+{
+	if (rp.verbose)
+	{
+		printf("%12.6f rx %4d ", rp.vt / 1e6, len);
+		show("", data, len);
+		putchar('\n');
+	}
+	write_record(UART_CAPTURE_RX, data, len);
+	/* what USART2_IRQHandler does on the idle line */
+	memcpy(rxBuffer, data, len);
+	rx_len = len;
+	recv_end_flag = 1;
+	HAL_UART_IdleCpltCallback(&huart2);
+	rp.last_progress = rp.vt;
+}
+
+
+static double lux_now(void);
+static void led_check(void);
+
+/* the lux going across the threshold, as often as TIM2 could see it */
+static void lux_check(void)
+{
+	int dark = lux_now() < ADAPTIVE_LUX_THRESHOLD;
+
+	if (dark != rp.dark)
+	{
+		rp.dark = dark;
+		rp.crossed = rp.crossed ? 0 : rp.vt;
+		led_check();
+	}
+}
+
+
+/**
+ * The interrupts due by now, and the end of the replay.
+ */
+static void poll(void)
+{
+	uint64_t start;
+
+	if (rp.in_poll)
+		return;
+	rp.in_poll = 1;
+	start = bench_now_ns();
+	while (rx_due() <= rp.vt)
+	{
+		if (rp.model_end)
+		{
+			unsigned char chunk[RX_BUFFER_SIZE];
+
+			deliver(chunk, esp_model_take(rp.vt, chunk, sizeof(chunk)));
+			while (rp.ncmd < esp_model_commands())
+			{
+				if (rp.ncmd == rp.cmd_size)
+				{
+					rp.cmd_size = rp.cmd_size ? 2 * rp.cmd_size : 256;
+					rp.cmd_sent = realloc(rp.cmd_sent, rp.cmd_size * sizeof(*rp.cmd_sent));
+					rp.cmd_latency = realloc(rp.cmd_latency, rp.cmd_size * sizeof(*rp.cmd_latency));
+				}
+				rp.cmd_sent[rp.ncmd++] = rp.vt;
+			}
+		}
+		else
+		{
+			deliver(cap.rx[rp.next_rx].data, cap.rx[rp.next_rx].len);
+			rp.next_rx++;
+		}
+	}
+	while (rp.tim2_started && rp.next_tim2 <= rp.vt)
+	{
+		rp.next_tim2 += TIM2_PERIOD_US;
+		lux_check();
+		HAL_TIM_PeriodElapsedCallback(&htim2);
+	}
+	rp.harness_ns += bench_now_ns() - start;
+	rp.in_poll = 0;
+
+	if (rp.model_end)
+	{
+		if (rp.vt >= rp.model_end)
+			longjmp(rp.done, 1);
+	}
+	else if (rp.next_rx == cap.nrx && rp.sent >= cap.ntx)
+	{
+		if (!rp.end)
+			rp.end = rp.vt + END_GRACE_US;
+		else if (rp.vt >= rp.end)
+			longjmp(rp.done, 1);
+	}
+	else if (rp.vt - rp.last_progress > STALL_US)
+	{
+		rp.stalled = 1;
+		rp.divergences++;
+		printf("divergence at %.6f s: stalled, %d of %d chunks delivered, %d of %d sends\n", rp.vt / 1e6,
+				rp.next_rx, cap.nrx, rp.sent, cap.ntx);
+		if (rp.sent < cap.ntx)
+		{
+			show("  waiting for", cap.tx[rp.sent].data, cap.tx[rp.sent].len);
+			putchar('\n');
+		}
+		longjmp(rp.done, 1);
+	}
+}
+
+
+static void wall_clock(void)
+{
+	uint64_t vt = (uint64_t)((bench_now_ns() - rp.start_ns) / 1000 * rp.speed);
+
+	if (vt > rp.vt)
+		rp.vt = vt;
+}
+
+
+uint32_t HAL_GetTick(void)
+{
+	if (rp.speed > 0)
+		wall_clock();
+	else
+		rp.vt += rp.poll_us;
+	poll();
+	return (uint32_t)(rp.vt / 1000);
+}
+
+
+void HAL_Delay(uint32_t delay)
+{
+	uint64_t until = rp.vt + delay * 1000ull;
+
+	if (rp.speed > 0)
+	{
+		usleep((useconds_t)(delay * 1000 / rp.speed));
+		wall_clock();
+		poll();
+		return;
+	}
+	while (rp.vt < until)
+	{
+		uint64_t next = rx_due();
+
+		if (rp.tim2_started && rp.next_tim2 < next)
+			next = rp.next_tim2;
+		rp.vt = (next < until && next > rp.vt) ? next : until;
+		poll();
+	}
+}
+
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+	uint64_t start = bench_now_ns();
+
+	if (huart == &huart2)
+		on_send(data, size);
+	rp.harness_ns += bench_now_ns() - start;
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size, uint32_t timeout)
+{
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef* huart, uint8_t* data, uint16_t size)
+{
+	return HAL_OK;
+}
+
+
+/* start, address and data bytes with their acknowledge, stop */
+static void i2c_transfer(uint16_t size)
+{
+	rp.i2c_transfers++;
+	rp.i2c_bits += 1 + 9 * (1 + size) + 1;
+}
+
+
+/* the measurement in progress, if it is done by now */
+static void bh_latch(void)
+{
+	if (rp.bh_done && rp.bh_done <= rp.vt)
+	{
+		rp.bh_lux = rp.bh_next;
+		rp.bh_done = 0;
+	}
+}
+
+
+/* a command starts a measurement of the lux of -l at the current time */
+HAL_StatusTypeDef HAL_I2C_Master_Transmit(I2C_HandleTypeDef* hi2c, uint16_t address, uint8_t* data, uint16_t size,
+		uint32_t timeout)
+{
+	i2c_transfer(size);
+	bh_latch();
+	rp.bh_next = lux_now();
+	rp.bh_done = rp.vt + BH1750_L_MODE_US;
+	return HAL_OK;
+}
+
+
+/* the lux of -l at the current time */
+static double lux_now(void)
+{
+	double f = rp.span ? (double)rp.vt / rp.span : 1;
+
+	if (rp.lux_to < 0 || f <= 0)
+		return rp.lux;
+	if (f > 1)
+		f = 1;
+	if (rp.lux > 0 && rp.lux_to > 0)
+		return rp.lux * pow(rp.lux_to / rp.lux, f);
+	return rp.lux + (rp.lux_to - rp.lux) * f;
+}
+
+
+/* the LED of auto mode is on (LED0 low) below the threshold */
+static void led_check(void)
+{
+	if (rp.crossed && (replay_gpioa.ODR & LED0_Pin) == (rp.dark ? 0 : LED0_Pin))
+	{
+		uint64_t lag = rp.vt - rp.crossed;
+
+		rp.lag_total += lag;
+		if (lag > rp.lag_max)
+			rp.lag_max = lag;
+		rp.crossings++;
+		rp.crossed = 0;
+	}
+}
+
+
+/* the last measurement the BH1750 has completed, one still in progress
+ * reads as the one before */
+HAL_StatusTypeDef HAL_I2C_Master_Receive(I2C_HandleTypeDef* hi2c, uint16_t address, uint8_t* data, uint16_t size,
+		uint32_t timeout)
+{
+	unsigned raw;
+
+	bh_latch();
+	raw = (unsigned)(rp.bh_lux * BH1750_LUX_SCALE);
+	i2c_transfer(size);
+	rp.i2c_reads++;
+	if (size >= 2)
+	{
+		data[0] = raw >> 8;
+		data[1] = raw;
+	}
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef* htim)
+{
+	rp.tim2_started = 1;
+	rp.next_tim2 = rp.vt + TIM2_PERIOD_US;
+	return HAL_OK;
+}
+
+
+void HAL_GPIO_WritePin(GPIO_TypeDef* port, uint16_t pin, GPIO_PinState state)
+{
+	uint32_t odr = port->ODR;
+
+	if (state == GPIO_PIN_SET)
+		port->ODR |= pin;
+	else
+		port->ODR &= ~pin;
+	if (port == LED0_GPIO_Port && ((odr ^ port->ODR) & LED0_Pin))
+	{
+		rp.led_switches++;
+		led_check();
+	}
+}
+
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef* port, uint16_t pin)
+{
+	return (port->ODR & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef* port, uint16_t pin)
+{
+	port->ODR ^= pin;
+}
+
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef* init)
+{
+	return HAL_OK;
+}
+
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef* init, uint32_t latency)
+{
+	return HAL_OK;
+}
+
+
+void MX_GPIO_Init(void) { }
+void MX_I2C2_Init(void) { }
+void MX_DMA_Init(void) { }
+void MX_USART1_UART_Init(void) { }
+void MX_USART2_UART_Init(void) { }
+void MX_TIM2_Init(void) { }
+
+
+/* Timing of the firmware entry points, linked with --wrap. */
+
+#define TIMED(t, call) \
+	uint64_t start = bench_now_ns(), harness = rp.harness_ns; \
+	ESP82_Result_t rc = (call); \
+	(t)->calls++; \
+	(t)->ns += bench_now_ns() - start - (rp.harness_ns - harness); \
+	return rc
+
+ESP82_Result_t __real_ESP82_Receive(char* const data, const uint8_t dataLengthMax);
+ESP82_Result_t __wrap_ESP82_Receive(char* const data, const uint8_t dataLengthMax)
+{
+	TIMED(&t_receive, __real_ESP82_Receive(data, dataLengthMax));
+}
+
+int __real_MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport* trp);
+int __wrap_MQTTPacket_readnb(unsigned char* buf, int buflen, MQTTTransport* trp)
+{
+	TIMED(&t_readnb, __real_MQTTPacket_readnb(buf, buflen, trp));
+}
+
+ESP82_Result_t __real_ESP82_ConnectWifi(const bool resetToDefault, const char* ssid, const char* pass);
+ESP82_Result_t __wrap_ESP82_ConnectWifi(const bool resetToDefault, const char* ssid, const char* pass)
+{
+	TIMED(&t_command, __real_ESP82_ConnectWifi(resetToDefault, ssid, pass));
+}
+
+ESP82_Result_t __real_ESP82_IsConnectedWifi(void);
+ESP82_Result_t __wrap_ESP82_IsConnectedWifi(void)
+{
+	TIMED(&t_command, __real_ESP82_IsConnectedWifi());
+}
+
+ESP82_Result_t __real_ESP82_StartTCP(const char* host, const uint16_t port, const uint16_t keepalive, const bool ssl);
+ESP82_Result_t __wrap_ESP82_StartTCP(const char* host, const uint16_t port, const uint16_t keepalive, const bool ssl)
+{
+	TIMED(&t_command, __real_ESP82_StartTCP(host, port, keepalive, ssl));
+}
+
+ESP82_Result_t __real_ESP82_SendV(const ESP82_Segment_t* const segments, const uint8_t count);
+ESP82_Result_t __wrap_ESP82_SendV(const ESP82_Segment_t* const segments, const uint8_t count)
+{
+	TIMED(&t_command, __real_ESP82_SendV(segments, count));
+}
+
+
+/* The command handlers, linked with --wrap: in order, the n-th call is the
+ * n-th command of the model. */
+
+static void handled(void)
+{
+	if (rp.handled < rp.ncmd)
+	{
+		rp.cmd_latency[rp.handled] = rp.vt - rp.cmd_sent[rp.handled];
+		rp.handled++;
+	}
+}
+
+void __real_onLedsTopic(const unsigned char* payload, int payloadlen);
+void __wrap_onLedsTopic(const unsigned char* payload, int payloadlen)
+{
+	__real_onLedsTopic(payload, payloadlen);
+	handled();
+}
+
+void __real_onModeTopic(const unsigned char* payload, int payloadlen);
+void __wrap_onModeTopic(const unsigned char* payload, int payloadlen)
+{
+	__real_onModeTopic(payload, payloadlen);
+	handled();
+}
+
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+	return (x > y) - (x < y);
+}
+
+
+static void report_commands(void)
+{
+	uint64_t* l = rp.cmd_latency;
+	unsigned n = rp.handled;
+
+	printf("commands: %u sent, %u handled", rp.ncmd, n);
+	if (n)
+	{
+		qsort(l, n, sizeof(*l), compare_u64);
+		printf(", latency p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms", l[n / 2] / 1e3, l[n * 9 / 10] / 1e3,
+				l[n * 99 / 100] / 1e3, l[n - 1] / 1e3);
+	}
+	putchar('\n');
+}
+
+
+static void report_device(void)
+{
+	int i;
+
+	printf("sensor: %lu reads, %lu transfers, %.3f ms of bus at %d kHz, %.1f reads/min\n", rp.i2c_reads,
+			rp.i2c_transfers, rp.i2c_bits * 1e3 / I2C_CLOCK_HZ, I2C_CLOCK_HZ / 1000,
+			rp.vt ? rp.i2c_reads * 60e6 / rp.vt : 0.0);
+	printf("publish:");
+	for (i = 0; i < PUB_TOPICS; ++i)
+		printf(" %s %lu,", pub_topics[i], rp.published[i]);
+	printf(" other %lu\n", rp.published[PUB_TOPICS]);
+	printf("led: %lu switches", rp.led_switches);
+	if (rp.crossings)
+		printf(", followed %lu threshold crossings, lag avg %.3f s max %.3f s", rp.crossings,
+				rp.lag_total / 1e6 / rp.crossings, rp.lag_max / 1e6);
+	if (rp.crossed)
+		printf(", not following the last crossing");
+	putchar('\n');
+}
+
+
+static void report_timing(const struct timing* t)
+{
+	printf("%-34s %9lu calls %12.3f ms %9.1f ns/call", t->name, t->calls, t->ns / 1e6,
+			t->calls ? (double)t->ns / t->calls : 0.0);
+	if (t != &t_command && cap.rxbytes)
+		printf(" %7.1f ns/byte", (double)t->ns / cap.rxbytes);
+	putchar('\n');
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: replay [-x speed] [-q poll_us] [-l lux[,to[,seconds]]] [-o capture] [-v] capture\n"
+			"       replay -m seconds [-s seed] [-c burst] [-q poll_us] [-l lux[,to[,seconds]]] [-o capture] [-v]\n");
+	exit(2);
+}
+
+
+int main(int argc, char** argv)
+{
+	uint64_t wall, span = 0;
+	unsigned seed = 1;
+	double ramp = 0;
+	int burst = 1, opt;
+
+	rp.poll_us = 20;
+	rp.lux = 100;
+	rp.lux_to = -1;
+	while ((opt = getopt(argc, argv, "x:q:l:o:m:s:c:v")) != -1)
+	{
+		switch (opt)
+		{
+		case 'x':
+			rp.speed = atof(optarg);
+			break;
+		case 'q':
+			rp.poll_us = atoi(optarg);
+			break;
+		case 'l':
+			if (sscanf(optarg, "%lf,%lf,%lf", &rp.lux, &rp.lux_to, &ramp) < 1 || rp.lux < 0)
+				usage();
+			break;
+		case 'o':
+			if (!(rp.out = fopen(optarg, "wb")))
+			{
+				perror(optarg);
+				return 2;
+			}
+			fwrite(UART_CAPTURE_MAGIC, 1, UART_CAPTURE_MAGIC_SIZE, rp.out);
+			break;
+		case 'm':
+			rp.model_end = (uint64_t)(atof(optarg) * 1e6);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'c':
+			burst = atoi(optarg);
+			break;
+		case 'v':
+			rp.verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - !rp.model_end || rp.poll_us == 0)
+		usage();
+	if (rp.model_end)
+	{
+		esp_model_init(seed, burst);
+		rp.speed = 0;
+	}
+	else if (load(argv[optind]) < 0)
+	{
+		fprintf(stderr, "%s: no capture\n", argv[optind]);
+		return 2;
+	}
+	if (cap.nrx)
+		span = cap.rx[cap.nrx - 1].time;
+	if (cap.ntx && cap.tx[cap.ntx - 1].time > span)
+		span = cap.tx[cap.ntx - 1].time;
+	rp.span = (ramp > 0) ? (uint64_t)(ramp * 1e6) : rp.model_end ? rp.model_end : span;
+	rp.dark = lux_now() < ADAPTIVE_LUX_THRESHOLD;
+	rp.bh_lux = lux_now();
+	if (rp.model_end)
+		printf("model: seed %u, %.3f s, commands %d at a time\n", seed, rp.model_end / 1e6, burst);
+	else
+	{
+		printf("capture: %d chunks, %lu bytes received, %d sends, %.3f s", cap.nrx, cap.rxbytes, cap.ntx, span / 1e6);
+		if (cap.lost)
+			printf(", %lu records lost on the device: expect divergence", cap.lost);
+		printf("\n");
+	}
+
+	rp.start_ns = bench_now_ns();
+	if (!setjmp(rp.done))
+		firmware_main();
+	wall = bench_now_ns() - rp.start_ns;
+
+	printf("replay: %d of %d chunks delivered, %d sends, %.3f s virtual in %.1f ms (%s)\n", rp.next_rx, cap.nrx,
+			rp.sent, rp.vt / 1e6, wall / 1e6, (rp.speed > 0) ? "wall clock" : "virtual clock");
+	report_timing(&t_receive);
+	report_timing(&t_readnb);
+	report_timing(&t_command);
+	if (rp.model_end)
+		report_commands();
+	report_device();
+	printf("state: mqtt %s, ledMode %d, ledSwitch %d, lux %d, fifo overflow %lu, resync %lu bytes, at errors",
+			MQTT_connected ? "connected" : "down", ledMode, ledSwitch, lightSensorValue,
+			(unsigned long)metrics.fifo_overflow, (unsigned long)metrics.rx_resync);
+	{
+		unsigned long errors = 0, timeouts = 0;
+		int i;
+
+		for (i = 0; i < METRICS_AT_MAX; ++i)
+		{
+			errors += metrics.at_error[i];
+			timeouts += metrics.at_timeout[i];
+		}
+		printf(" %lu, timeouts %lu\n", errors, timeouts);
+	}
+	if (rp.out)
+		fclose(rp.out);
+	if (rp.divergences)
+	{
+		printf("DIVERGED: %lu sends differ from the capture%s\n", rp.divergences, rp.stalled ? ", stalled" : "");
+		return 1;
+	}
+	printf("no divergence, %lu sends matched with other data\n", rp.differing);
+	return 0;
+}